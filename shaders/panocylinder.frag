@@ -5,9 +5,32 @@ varying vec2 vfTexCoord;
 uniform sampler2D texImage;
 uniform vec2 texOff;
 uniform float vEyeYaw;
+uniform float exposure; // Linear scale applied to HDR radiance
+uniform float hdrMode;  // 0: LDR texture, 1: HDR clamped, 2: HDR Reinhard tonemapped
+uniform float numStrips;   // Textures the eye is split across, texImage holding one of them
+uniform vec4 stripRange;   // u start, u end, then scale and offset from u into texImage
 
 void main()
 {
     float turn = vEyeYaw - floor(vEyeYaw);
-    gl_FragColor = texture2D(texImage, vfTexCoord + texOff + vec2(turn,0));
+    vec2 uv = vfTexCoord + texOff + vec2(turn,0);
+    if (numStrips > 1.5)
+    {
+        // Wrap u within half a turn of the strip's middle, keeping the jump far from
+        // the strip so neighbouring pixels' derivatives stay small
+        float middle = 0.5 * (stripRange.x + stripRange.y);
+        uv.x -= floor(uv.x - middle + 0.5);
+        if ((uv.x < stripRange.x) || (uv.x >= stripRange.y))
+            discard;
+        uv.x = uv.x * stripRange.z + stripRange.w;
+    }
+    vec4 texel = texture2D(texImage, uv);
+    if (hdrMode > 0.5)
+    {
+        vec3 c = exposure * texel.rgb;
+        if (hdrMode > 1.5)
+            c = c / (1.0 + c);
+        texel.rgb = pow(clamp(c, 0.0, 1.0), vec3(1.0/2.2));
+    }
+    gl_FragColor = texel;
 }
@@ -8,11 +8,15 @@ varying vec2 vfTexCoord;
 uniform float vMove;
 uniform mat4 mvmtx;
 uniform mat4 prmtx;
+uniform float coverage; // Fraction of the circle the mesh's columns spread over
 
 void main()
 {
     vfTexCoord = vTexCoord;
-    vec3 outPos = vPosition;
+    // Spread the full circle mesh's columns over the covered arc, the seam staying behind
+    float phase = 3.14159265 * (1.0 + coverage * (1.0 - 2.0 * vTexCoord.x));
+    float radius = length(vPosition.xz);
+    vec3 outPos = vec3(radius * sin(phase), vPosition.y, radius * cos(phase));
     outPos.y += vMove;
     gl_Position = prmtx * mvmtx * vec4(outPos, 1.0);
 }
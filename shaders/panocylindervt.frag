@@ -0,0 +1,54 @@
+// panocylindervt.frag
+// Virtual texture variant of panocylinder.frag: texels come from an atlas of tiles,
+// found through an indirection texture holding each level's tile grid side by side.
+
+varying vec2 vfTexCoord;
+
+uniform vec2 texOff;
+uniform float vEyeYaw;
+uniform float exposure; // Linear scale applied to HDR radiance
+uniform float hdrMode;  // 0: LDR texture, 1: HDR clamped, 2: HDR Reinhard tonemapped
+
+uniform sampler2D vtAtlas;
+uniform sampler2D vtIndirection; // Per tile: slot x, slot y, level of the tile in the slot
+uniform vec2 vtAtlasSize;
+uniform vec2 vtIndirectionSize;
+uniform float vtTileSize;
+uniform float vtBorder;
+uniform float vtMaxLevel;
+uniform vec2 vtLevelSize[16];    // Texels
+uniform float vtLevelOrigin[16]; // First column of each level's tiles in vtIndirection
+
+void main()
+{
+    float turn = vEyeYaw - floor(vEyeYaw);
+    vec2 uvRaw = vfTexCoord + texOff + vec2(turn,0);
+    vec2 uv = vec2(fract(uvRaw.x), clamp(uvRaw.y, 0.0, 1.0));
+
+    // The finest level with no more than two texels to a pixel
+    vec2 dx = dFdx(uvRaw) * vtLevelSize[0];
+    vec2 dy = dFdy(uvRaw) * vtLevelSize[0];
+    float lod = clamp(floor(0.5 * log2(max(max(dot(dx,dx), dot(dy,dy)), 1.0))), 0.0, vtMaxLevel);
+    int l = int(lod);
+
+    vec2 tile = min(floor(uv * vtLevelSize[l] / vtTileSize), ceil(vtLevelSize[l] / vtTileSize) - 1.0);
+    vec4 entry = texture2D(vtIndirection, (vec2(vtLevelOrigin[l], 0.0) + tile + 0.5) / vtIndirectionSize);
+    vec2 slot = floor(entry.rg * 255.0 + 0.5);
+    float resident = floor(entry.b * 255.0 + 0.5);
+    int r = int(resident);
+
+    // Fallbacks are the ancestor tile; its border covers any rounding of odd level sizes
+    vec2 ancestor = min(floor(tile / exp2(resident - lod)), ceil(vtLevelSize[r] / vtTileSize) - 1.0);
+    vec2 inTile = clamp(uv * vtLevelSize[r] - ancestor * vtTileSize, 0.5 - vtBorder, vtTileSize + vtBorder - 0.5);
+    vec2 atlasTexel = slot * (vtTileSize + 2.0 * vtBorder) + vtBorder + inTile;
+    vec4 texel = texture2D(vtAtlas, atlasTexel / vtAtlasSize);
+
+    if (hdrMode > 0.5)
+    {
+        vec3 c = exposure * texel.rgb;
+        if (hdrMode > 1.5)
+            c = c / (1.0 + c);
+        texel.rgb = pow(clamp(c, 0.0, 1.0), vec3(1.0/2.2));
+    }
+    gl_FragColor = texel;
+}
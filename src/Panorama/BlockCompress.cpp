@@ -0,0 +1,396 @@
+// BlockCompress.cpp
+
+#include "BlockCompress.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#  define BLOCKCOMPRESS_USE_SSE2 1
+#  include <emmintrin.h>
+#else
+#  define BLOCKCOMPRESS_USE_SSE2 0
+#endif
+
+namespace
+{
+    const int kMinBlocksPerThread = 1024;
+    const int kRefineIterations = 2;
+
+    ///@brief The 16 pixels of one block as float channels. Pixels past the image edge repeat
+    /// the edge and have a zero mask, so they shape the endpoints but count no error.
+    struct Block
+    {
+        float r[16];
+        float g[16];
+        float b[16];
+        float mask[16];
+    };
+
+    int Clamp(int x, int lo, int hi)
+    {
+        return std::min(hi, std::max(lo, x));
+    }
+
+    unsigned short Quantize565(const float* pRgb)
+    {
+        const int r = Clamp((int)(pRgb[0] * (31.0f / 255.0f) + 0.5f), 0, 31);
+        const int g = Clamp((int)(pRgb[1] * (63.0f / 255.0f) + 0.5f), 0, 63);
+        const int b = Clamp((int)(pRgb[2] * (31.0f / 255.0f) + 0.5f), 0, 31);
+        return (unsigned short)((r << 11) | (g << 5) | b);
+    }
+
+    void Expand565(unsigned short c, float* pRgb)
+    {
+        const int r = (c >> 11) & 31;
+        const int g = (c >> 5) & 63;
+        const int b = c & 31;
+        pRgb[0] = (float)((r << 3) | (r >> 2));
+        pRgb[1] = (float)((g << 2) | (g >> 4));
+        pRgb[2] = (float)((b << 3) | (b >> 2));
+    }
+
+    /// Indices 0-3 of the four color mode(c0 > c1), in the order BC1 codes them.
+    void MakePalette(unsigned short c0, unsigned short c1, float pal[4][3])
+    {
+        Expand565(c0, pal[0]);
+        Expand565(c1, pal[1]);
+        for (int k=0; k<3; ++k)
+        {
+            pal[2][k] = (2.0f * pal[0][k] + pal[1][k]) / 3.0f;
+            pal[3][k] = (pal[0][k] + 2.0f * pal[1][k]) / 3.0f;
+        }
+    }
+
+    /// Pick every pixel's nearest palette entry.
+    ///@return The squared error of the block's pixels within the image
+    float MatchPalette(const Block& blk, const float pal[4][3], unsigned char idx[16])
+    {
+#if BLOCKCOMPRESS_USE_SSE2
+        __m128 err = _mm_setzero_ps();
+        for (int q=0; q<16; q+=4)
+        {
+            const __m128 r = _mm_loadu_ps(blk.r + q);
+            const __m128 g = _mm_loadu_ps(blk.g + q);
+            const __m128 b = _mm_loadu_ps(blk.b + q);
+            __m128 best = _mm_setzero_ps();
+            __m128i bestIdx = _mm_setzero_si128();
+            for (int c=0; c<4; ++c)
+            {
+                const __m128 dr = _mm_sub_ps(r, _mm_set1_ps(pal[c][0]));
+                const __m128 dg = _mm_sub_ps(g, _mm_set1_ps(pal[c][1]));
+                const __m128 db = _mm_sub_ps(b, _mm_set1_ps(pal[c][2]));
+                const __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+                if (c == 0)
+                {
+                    best = d;
+                    continue;
+                }
+                const __m128i closer = _mm_castps_si128(_mm_cmplt_ps(d, best));
+                best = _mm_min_ps(d, best);
+                bestIdx = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(c)), _mm_andnot_si128(closer, bestIdx));
+            }
+            err = _mm_add_ps(err, _mm_mul_ps(best, _mm_loadu_ps(blk.mask + q)));
+
+            int bestIdx4[4];
+            _mm_storeu_si128((__m128i*)bestIdx4, bestIdx);
+            for (int i=0; i<4; ++i)
+            {
+                idx[q + i] = (unsigned char)bestIdx4[i];
+            }
+        }
+        float err4[4];
+        _mm_storeu_ps(err4, err);
+        return (err4[0] + err4[1]) + (err4[2] + err4[3]);
+#else
+        float err = 0.0f;
+        for (int i=0; i<16; ++i)
+        {
+            float best = 0.0f;
+            for (int c=0; c<4; ++c)
+            {
+                const float dr = blk.r[i] - pal[c][0];
+                const float dg = blk.g[i] - pal[c][1];
+                const float db = blk.b[i] - pal[c][2];
+                const float d = dr * dr + dg * dg + db * db;
+                if ((c == 0) || (d < best))
+                {
+                    best = d;
+                    idx[i] = (unsigned char)c;
+                }
+            }
+            err += best * blk.mask[i];
+        }
+        return err;
+#endif
+    }
+
+    /// Order the endpoints for the four color mode and match the block against them.
+    float Evaluate(const Block& blk, unsigned short& c0, unsigned short& c1, unsigned char idx[16])
+    {
+        if (c0 < c1)
+            std::swap(c0, c1);
+        float pal[4][3];
+        MakePalette(c0, c1, pal);
+        const float err = MatchPalette(blk, pal, idx);
+
+        /// Equal endpoints select the three color mode, where index 3 is black
+        if (c0 == c1)
+        {
+            memset(idx, 0, 16);
+        }
+        return err;
+    }
+
+    /// The endpoints at the extremes of the block along its principal axis.
+    void PrincipalEndpoints(const Block& blk, float e0[3], float e1[3])
+    {
+        float mean[3] = { 0.0f, 0.0f, 0.0f };
+        for (int i=0; i<16; ++i)
+        {
+            mean[0] += blk.r[i];
+            mean[1] += blk.g[i];
+            mean[2] += blk.b[i];
+        }
+        for (int k=0; k<3; ++k)
+        {
+            mean[k] /= 16.0f;
+        }
+
+        float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f }; ///< rr rg rb gg gb bb
+        for (int i=0; i<16; ++i)
+        {
+            const float r = blk.r[i] - mean[0];
+            const float g = blk.g[i] - mean[1];
+            const float b = blk.b[i] - mean[2];
+            cov[0] += r * r;
+            cov[1] += r * g;
+            cov[2] += r * b;
+            cov[3] += g * g;
+            cov[4] += g * b;
+            cov[5] += b * b;
+        }
+
+        /// Power iteration, starting from the row of the largest variance
+        float axis[3] = { cov[0], cov[1], cov[2] };
+        if ((cov[3] >= cov[0]) && (cov[3] >= cov[5]))
+        {
+            axis[0] = cov[1]; axis[1] = cov[3]; axis[2] = cov[4];
+        }
+        else if ((cov[5] >= cov[0]) && (cov[5] >= cov[3]))
+        {
+            axis[0] = cov[2]; axis[1] = cov[4]; axis[2] = cov[5];
+        }
+        for (int iter=0; iter<4; ++iter)
+        {
+            const float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+            const float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+            const float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+            const float len = std::max(fabsf(x), std::max(fabsf(y), fabsf(z)));
+            if (len < 1e-6f)
+                break;
+            axis[0] = x / len;
+            axis[1] = y / len;
+            axis[2] = z / len;
+        }
+        const float len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+        float tMin = 0.0f;
+        float tMax = 0.0f;
+        if (len2 > 1e-12f)
+        {
+            for (int i=0; i<16; ++i)
+            {
+                const float t = ((blk.r[i] - mean[0]) * axis[0] +
+                                 (blk.g[i] - mean[1]) * axis[1] +
+                                 (blk.b[i] - mean[2]) * axis[2]) / len2;
+                tMin = std::min(tMin, t);
+                tMax = std::max(tMax, t);
+            }
+        }
+        for (int k=0; k<3; ++k)
+        {
+            e0[k] = std::min(255.0f, std::max(0.0f, mean[k] + tMax * axis[k]));
+            e1[k] = std::min(255.0f, std::max(0.0f, mean[k] + tMin * axis[k]));
+        }
+    }
+
+    /// Least squares endpoints for the given indices.
+    ///@return false if the indices do not constrain both endpoints
+    bool RefineEndpoints(const Block& blk, const unsigned char idx[16], float e0[3], float e1[3])
+    {
+        static const float kWeight0[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+        float a = 0.0f;
+        float b = 0.0f;
+        float c = 0.0f;
+        float x0[3] = { 0.0f, 0.0f, 0.0f };
+        float x1[3] = { 0.0f, 0.0f, 0.0f };
+        for (int i=0; i<16; ++i)
+        {
+            const float w0 = kWeight0[idx[i]] * blk.mask[i];
+            const float w1 = (1.0f - kWeight0[idx[i]]) * blk.mask[i];
+            a += w0 * kWeight0[idx[i]];
+            b += w0 * (1.0f - kWeight0[idx[i]]);
+            c += w1 * (1.0f - kWeight0[idx[i]]);
+            x0[0] += w0 * blk.r[i]; x1[0] += w1 * blk.r[i];
+            x0[1] += w0 * blk.g[i]; x1[1] += w1 * blk.g[i];
+            x0[2] += w0 * blk.b[i]; x1[2] += w1 * blk.b[i];
+        }
+        const float det = a * c - b * b;
+        if (fabsf(det) < 1e-6f)
+            return false;
+        for (int k=0; k<3; ++k)
+        {
+            e0[k] = std::min(255.0f, std::max(0.0f, (c * x0[k] - b * x1[k]) / det));
+            e1[k] = std::min(255.0f, std::max(0.0f, (a * x1[k] - b * x0[k]) / det));
+        }
+        return true;
+    }
+
+    ///@return The squared error of the block
+    float CompressBlock(const Block& blk, BlockCompressQuality quality, unsigned char* pDst)
+    {
+        float e0[3];
+        float e1[3];
+        PrincipalEndpoints(blk, e0, e1);
+        unsigned short c0 = Quantize565(e0);
+        unsigned short c1 = Quantize565(e1);
+        unsigned char idx[16];
+        float err = Evaluate(blk, c0, c1, idx);
+
+        for (int iter=0; (quality == BlockCompressHigh) && (iter < kRefineIterations) && (err > 0.0f); ++iter)
+        {
+            if (!RefineEndpoints(blk, idx, e0, e1))
+                break;
+            unsigned short r0 = Quantize565(e0);
+            unsigned short r1 = Quantize565(e1);
+            unsigned char refinedIdx[16];
+            const float refinedErr = Evaluate(blk, r0, r1, refinedIdx);
+            if (refinedErr >= err)
+                break;
+            c0 = r0;
+            c1 = r1;
+            memcpy(idx, refinedIdx, sizeof(idx));
+            err = refinedErr;
+        }
+
+        unsigned int bits = 0;
+        for (int i=0; i<16; ++i)
+        {
+            bits |= (unsigned int)idx[i] << (2 * i);
+        }
+        pDst[0] = (unsigned char)(c0 & 0xff);
+        pDst[1] = (unsigned char)(c0 >> 8);
+        pDst[2] = (unsigned char)(c1 & 0xff);
+        pDst[3] = (unsigned char)(c1 >> 8);
+        pDst[4] = (unsigned char)(bits & 0xff);
+        pDst[5] = (unsigned char)((bits >> 8) & 0xff);
+        pDst[6] = (unsigned char)((bits >> 16) & 0xff);
+        pDst[7] = (unsigned char)(bits >> 24);
+        return err;
+    }
+
+    ///@brief Compresses a range of block rows of one image.
+    class Bc1Compressor
+    {
+    public:
+        Bc1Compressor(const unsigned char* pSrc, int width, int height,
+                      const BlockCompressParams& params, unsigned char* pDst)
+        : m_pSrc(pSrc)
+        , m_width(width)
+        , m_height(height)
+        , m_blocksX((width + 3) / 4)
+        , m_params(params)
+        , m_pDst(pDst)
+        {}
+
+        void CompressRows(int by0, int by1, double* pErr) const
+        {
+            double err = 0.0;
+            Block blk;
+            for (int by=by0; by<by1; ++by)
+            {
+                for (int bx=0; bx<m_blocksX; ++bx)
+                {
+                    for (int i=0; i<16; ++i)
+                    {
+                        const int x = bx * 4 + (i & 3);
+                        const int y = by * 4 + (i >> 2);
+                        const unsigned char* p = m_pSrc + 3 * ((size_t)std::min(y, m_height - 1) * m_width + std::min(x, m_width - 1));
+                        blk.r[i] = (float)p[0];
+                        blk.g[i] = (float)p[1];
+                        blk.b[i] = (float)p[2];
+                        blk.mask[i] = ((x < m_width) && (y < m_height)) ? 1.0f : 0.0f;
+                    }
+                    err += CompressBlock(blk, m_params.quality, m_pDst + kBc1BlockBytes * ((size_t)by * m_blocksX + bx));
+                }
+            }
+            *pErr = err;
+        }
+
+    protected:
+        const unsigned char* m_pSrc;
+        int m_width;
+        int m_height;
+        int m_blocksX;
+        BlockCompressParams m_params;
+        unsigned char* m_pDst;
+    };
+
+    void CompressRowsThread(const Bc1Compressor* pCompressor, int by0, int by1, double* pErr)
+    {
+        pCompressor->CompressRows(by0, by1, pErr);
+    }
+} // namespace
+
+size_t Bc1Size(int width, int height)
+{
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * kBc1BlockBytes;
+}
+
+double CompressBc1(const unsigned char* pSrc, int width, int height,
+                   const BlockCompressParams& params, unsigned char* pDst)
+{
+    if ((pSrc == NULL) || (pDst == NULL) || (width <= 0) || (height <= 0))
+        return 0.0;
+
+    int maxThreads = params.numThreads;
+    if (maxThreads <= 0)
+        maxThreads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    const int blocksX = (width + 3) / 4;
+    const int blocksY = (height + 3) / 4;
+    const int numThreads = std::max(1, std::min(std::min(maxThreads, blocksY), blocksX * blocksY / kMinBlocksPerThread));
+
+    const Bc1Compressor compressor(pSrc, width, height, params, pDst);
+    std::vector<double> errs(numThreads, 0.0);
+    std::thread* pThreads = (numThreads > 1) ? new std::thread[numThreads - 1] : NULL;
+    for (int i=1; i<numThreads; ++i)
+    {
+        pThreads[i - 1] = std::thread(CompressRowsThread, &compressor,
+            blocksY * i / numThreads, blocksY * (i + 1) / numThreads, &errs[i]);
+    }
+    compressor.CompressRows(0, blocksY / numThreads, &errs[0]);
+    for (int i=1; i<numThreads; ++i)
+    {
+        pThreads[i - 1].join();
+    }
+    delete [] pThreads;
+
+    double err = 0.0;
+    for (int i=0; i<numThreads; ++i)
+    {
+        err += errs[i];
+    }
+    return err;
+}
+
+double Psnr(double squaredError, size_t samples)
+{
+    if ((squaredError <= 0.0) || (samples == 0))
+        return 100.0;
+    return 10.0 * log10(255.0 * 255.0 * (double)samples / squaredError);
+}
@@ -0,0 +1,41 @@
+// BlockCompress.h
+
+#pragma once
+
+#include <stddef.h>
+
+enum BlockCompressQuality
+{
+    BlockCompressFast, ///< Endpoints from the extremes along each block's principal axis
+    BlockCompressHigh, ///< ...then refined by least squares against the chosen indices
+};
+
+///@brief Options for CompressBc1.
+struct BlockCompressParams
+{
+    BlockCompressParams()
+    : quality(BlockCompressFast)
+    , numThreads(0)
+    {}
+
+    BlockCompressQuality quality;
+    int numThreads; ///< 0 = one per hardware thread
+};
+
+const int kBc1BlockBytes = 8; ///< Per 4x4 block of pixels
+
+/// Bytes of the BC1 blocks covering a width x height image.
+size_t Bc1Size(int width, int height);
+
+/// Compress an 8-bit RGB image to BC1(DXT1, opaque) blocks in row major block order, as
+/// glCompressedTexImage2D takes them for GL_COMPRESSED_RGB_S3TC_DXT1_EXT. Blocks past the
+/// right and bottom edges repeat the edge pixels. Palette matching runs on SIMD float
+/// pixels, with block rows split across threads.
+///@param pDst Receives Bc1Size(width, height) bytes
+///@return The sum of squared errors over all pixels and channels, for Psnr
+double CompressBc1(const unsigned char* pSrc, int width, int height,
+                   const BlockCompressParams& params, unsigned char* pDst);
+
+/// Peak signal to noise ratio in dB of 8-bit samples with the given sum of squared errors,
+/// 100 for an exact match.
+double Psnr(double squaredError, size_t samples);
@@ -0,0 +1,182 @@
+// HdrConvert.cpp
+
+#include "HdrConvert.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#  define HDRCONVERT_USE_SSE2 1
+#  include <emmintrin.h>
+#else
+#  define HDRCONVERT_USE_SSE2 0
+#endif
+
+namespace
+{
+    const unsigned int kF32Infinity  = 255 << 23;
+    const unsigned int kF16Max       = (127 + 16) << 23;                  ///< Floats from here on round to infinity
+    const unsigned int kF32MinNormal = (127 - 14) << 23;                  ///< Smallest float with a normal half
+    const unsigned int kDenormMagic  = ((127 - 15) + (23 - 10) + 1) << 23; ///< Adding this rounds to a half denormal
+
+    const int   kRgb9e5MantBits = 9;
+    const int   kRgb9e5Bias     = 15;
+    const float kRgb9e5Max      = 65408.0f; ///< (2^9-1)/2^9 * 2^(31-15)
+
+    unsigned int FloatBits(float f)
+    {
+        unsigned int u;
+        memcpy(&u, &f, sizeof(u));
+        return u;
+    }
+
+    float BitsFloat(unsigned int u)
+    {
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+
+    unsigned short FloatToHalf1(float f)
+    {
+        unsigned int u = FloatBits(f);
+        const unsigned int sign = u & 0x80000000u;
+        u ^= sign;
+
+        unsigned int h;
+        if (u >= kF16Max)
+        {
+            h = (u > kF32Infinity) ? 0x7e00 : 0x7c00;
+        }
+        else if (u < kF32MinNormal)
+        {
+            h = FloatBits(BitsFloat(u) + BitsFloat(kDenormMagic)) - kDenormMagic;
+        }
+        else
+        {
+            const unsigned int mantOdd = (u >> 13) & 1;
+            h = (u + ((unsigned int)(15 - 127) << 23) + 0xfff + mantOdd) >> 13;
+        }
+        return (unsigned short)(h | (sign >> 16));
+    }
+
+    unsigned int RgbToRgb9e51(const float* pRgb)
+    {
+        float c[3];
+        for (int i=0; i<3; ++i)
+        {
+            // Written so NaNs fail both tests and become 0
+            c[i] = (pRgb[i] > 0.0f) ? pRgb[i] : 0.0f;
+            c[i] = (c[i] < kRgb9e5Max) ? c[i] : kRgb9e5Max;
+        }
+        const float maxc = (c[0] > c[1]) ? ((c[0] > c[2]) ? c[0] : c[2]) : ((c[1] > c[2]) ? c[1] : c[2]);
+
+        // floor(log2(maxc)) straight from the exponent bits, at least -B-1
+        int e = (int)(FloatBits(maxc) >> 23) - 127;
+        e = (e < -kRgb9e5Bias - 1) ? (-kRgb9e5Bias - 1) : e;
+        e += 1 + kRgb9e5Bias;
+
+        // Multiplying by 2^(B+N-e) scales the largest component to [256,512]
+        float scale = BitsFloat((unsigned int)(127 + kRgb9e5Bias + kRgb9e5MantBits - e) << 23);
+        if ((int)(maxc * scale + 0.5f) == (1 << kRgb9e5MantBits))
+        {
+            ++e;
+            scale *= 0.5f;
+        }
+
+        unsigned int packed = (unsigned int)e << 27;
+        for (int i=0; i<3; ++i)
+        {
+            packed |= (unsigned int)(int)(c[i] * scale + 0.5f) << (9 * i);
+        }
+        return packed;
+    }
+
+#if HDRCONVERT_USE_SSE2
+    /// FloatToHalf1 on 4 floats, results in the low 16 bits of each lane(sign extended)
+    __m128i FloatToHalf4(__m128 f)
+    {
+        const __m128i signMask = _mm_set1_epi32(0x80000000u);
+        const __m128 justSign  = _mm_and_ps(f, _mm_castsi128_ps(signMask));
+        const __m128 absf      = _mm_xor_ps(f, justSign);
+        const __m128i absi     = _mm_castps_si128(absf);
+
+        const __m128i isNan     = _mm_castps_si128(_mm_cmpunord_ps(absf, absf));
+        const __m128i isRegular = _mm_cmpgt_epi32(_mm_set1_epi32(kF16Max), absi);
+        const __m128i special   = _mm_or_si128(_mm_and_si128(isNan, _mm_set1_epi32(0x200)), _mm_set1_epi32(0x7c00));
+
+        const __m128i isDenorm = _mm_cmpgt_epi32(_mm_set1_epi32(kF32MinNormal), absi);
+        const __m128i magic    = _mm_set1_epi32(kDenormMagic);
+        const __m128i denorm   = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(absf, _mm_castsi128_ps(magic))), magic);
+
+        const __m128i mantOdd = _mm_srai_epi32(_mm_slli_epi32(absi, 31 - 13), 31); // -1 if odd
+        const __m128i bias    = _mm_set1_epi32(0xfff + ((unsigned int)(15 - 127) << 23));
+        const __m128i normal  = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(absi, bias), mantOdd), 13);
+
+        __m128i h = _mm_or_si128(_mm_and_si128(isDenorm, denorm), _mm_andnot_si128(isDenorm, normal));
+        h = _mm_or_si128(_mm_and_si128(isRegular, h), _mm_andnot_si128(isRegular, special));
+        return _mm_or_si128(h, _mm_srai_epi32(_mm_castps_si128(justSign), 16));
+    }
+#endif
+} // namespace
+
+void FloatToHalf(const float* pSrc, unsigned short* pDst, size_t count)
+{
+    size_t i = 0;
+#if HDRCONVERT_USE_SSE2
+    for (; i+8 <= count; i+=8)
+    {
+        const __m128i lo = FloatToHalf4(_mm_loadu_ps(pSrc + i));
+        const __m128i hi = FloatToHalf4(_mm_loadu_ps(pSrc + i + 4));
+        // Lanes are sign extended halves, so the signed saturating pack keeps all 16 bits
+        _mm_storeu_si128((__m128i*)(pDst + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i<count; ++i)
+    {
+        pDst[i] = FloatToHalf1(pSrc[i]);
+    }
+}
+
+void RgbFloatToRgb9e5(const float* pSrc, unsigned int* pDst, size_t pixelCount)
+{
+    size_t i = 0;
+#if HDRCONVERT_USE_SSE2
+    const __m128 zero   = _mm_setzero_ps();
+    const __m128 maxVal = _mm_set1_ps(kRgb9e5Max);
+    const __m128 half   = _mm_set1_ps(0.5f);
+    for (; i+4 <= pixelCount; i+=4)
+    {
+        const float* p = pSrc + i*3;
+        // max(x, 0) returns 0 for NaN x, the second operand
+        __m128 r = _mm_min_ps(_mm_max_ps(_mm_setr_ps(p[0], p[3], p[6], p[9]), zero), maxVal);
+        __m128 g = _mm_min_ps(_mm_max_ps(_mm_setr_ps(p[1], p[4], p[7], p[10]), zero), maxVal);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_setr_ps(p[2], p[5], p[8], p[11]), zero), maxVal);
+        const __m128 maxc = _mm_max_ps(r, _mm_max_ps(g, b));
+
+        __m128i e = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(maxc), 23), _mm_set1_epi32(127));
+        const __m128i minExp = _mm_set1_epi32(-kRgb9e5Bias - 1);
+        const __m128i tooSmall = _mm_cmpgt_epi32(minExp, e);
+        e = _mm_or_si128(_mm_and_si128(tooSmall, minExp), _mm_andnot_si128(tooSmall, e));
+        e = _mm_add_epi32(e, _mm_set1_epi32(1 + kRgb9e5Bias));
+
+        __m128i scaleBits = _mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(127 + kRgb9e5Bias + kRgb9e5MantBits), e), 23);
+        const __m128i maxs = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(maxc, _mm_castsi128_ps(scaleBits)), half));
+        const __m128i overflow = _mm_cmpeq_epi32(maxs, _mm_set1_epi32(1 << kRgb9e5MantBits)); // -1 where it rounded up to 512
+        e = _mm_sub_epi32(e, overflow);
+        scaleBits = _mm_add_epi32(scaleBits, _mm_slli_epi32(overflow, 23)); // halve the scale
+        const __m128 scale = _mm_castsi128_ps(scaleBits);
+
+        const __m128i rs = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(r, scale), half));
+        const __m128i gs = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(g, scale), half));
+        const __m128i bs = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, scale), half));
+        __m128i packed = _mm_or_si128(rs, _mm_slli_epi32(gs, 9));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(bs, 18));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(e, 27));
+        _mm_storeu_si128((__m128i*)(pDst + i), packed);
+    }
+#endif
+    for (; i<pixelCount; ++i)
+    {
+        pDst[i] = RgbToRgb9e51(pSrc + i*3);
+    }
+}
@@ -0,0 +1,14 @@
+// HdrConvert.h
+
+#pragma once
+
+#include <stddef.h>
+
+/// Pack floats to IEEE half floats(GL_HALF_FLOAT), rounding to nearest even.
+/// Values beyond the half range become infinity, NaNs stay NaN.
+void FloatToHalf(const float* pSrc, unsigned short* pDst, size_t count);
+
+/// Pack RGB float triples to shared exponent pixels(GL_RGB9_E5 / GL_UNSIGNED_INT_5_9_9_9_REV),
+/// following the EXT_texture_shared_exponent encoding. Negative values and NaNs become 0,
+/// values above 65408 are clamped.
+void RgbFloatToRgb9e5(const float* pSrc, unsigned int* pDst, size_t pixelCount);
@@ -0,0 +1,558 @@
+// ImageDecoder.cpp
+
+#include "ImageDecoder.h"
+#include "Logger.h"
+
+#include "jpgd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// stb_image's short internal names(uint8, e(), ...) stay below everything else.
+#include "stb_image.c"
+
+
+///@return The capabilities a decoder needs to produce req from an image of the given size directly
+unsigned int ImageDecodeRequest::RequiredCaps(int imageWidth, int imageHeight) const
+{
+    unsigned int caps = 0;
+    if ((roiX > 0) || (roiY > 0) ||
+        ((roiWidth > 0) && (roiWidth < imageWidth)) ||
+        ((roiHeight > 0) && (roiHeight < imageHeight)))
+    {
+        caps |= DecodeRegion;
+    }
+    if (((maxWidth > 0) && (imageWidth > maxWidth)) ||
+        ((maxHeight > 0) && (imageHeight > maxHeight)))
+    {
+        caps |= DecodeScaled;
+    }
+    if (planar)
+    {
+        caps |= DecodePlanar;
+    }
+    return caps;
+}
+
+
+namespace
+{
+    ///@brief Takes rows of reqComps-component pixels at the full source width, in order, and crops,
+    /// box filters and optionally deinterleaves them into the requested output image, or passes
+    /// its rows on to an ImageRowTarget. Only the output image(or row) and one row of sums are
+    /// held, so streaming decoders stay bounded.
+    class RowSink
+    {
+    public:
+        RowSink()
+        : m_pOut(NULL)
+        , m_pTarget(NULL)
+        , m_row()
+        , m_comps(0)
+        , m_planar(false)
+        , m_x0(0), m_y0(0), m_w(0), m_h(0)
+        , m_factor(1)
+        , m_outW(0), m_outH(0)
+        , m_outY(0)
+        , m_rowsSummed(0)
+        , m_sums()
+        {}
+
+        ~RowSink() { free(m_pOut); }
+
+        ///@param pTarget Where to send output rows, NULL to gather them into an image for Detach
+        bool Init(const ImageDecodeRequest& req, int srcWidth, int srcHeight, ImageRowTarget* pTarget=NULL)
+        {
+            m_comps = req.reqComps;
+            m_planar = req.planar;
+            m_x0 = std::min(std::max(req.roiX, 0), srcWidth);
+            m_y0 = std::min(std::max(req.roiY, 0), srcHeight);
+            m_w = (req.roiWidth > 0) ? std::min(req.roiWidth, srcWidth - m_x0) : (srcWidth - m_x0);
+            m_h = (req.roiHeight > 0) ? std::min(req.roiHeight, srcHeight - m_y0) : (srcHeight - m_y0);
+            if ((m_w <= 0) || (m_h <= 0))
+                return false;
+
+            m_factor = 1;
+            while (((req.maxWidth > 0) && ((m_w + m_factor - 1) / m_factor > req.maxWidth)) ||
+                   ((req.maxHeight > 0) && ((m_h + m_factor - 1) / m_factor > req.maxHeight)))
+            {
+                m_factor *= 2;
+            }
+            m_outW = (m_w + m_factor - 1) / m_factor;
+            m_outH = (m_h + m_factor - 1) / m_factor;
+
+            m_pTarget = pTarget;
+            if (m_pTarget != NULL)
+            {
+                if (m_planar || !m_pTarget->Begin(m_outW, m_outH, m_comps))
+                    return false;
+                m_row.resize((size_t)m_outW * m_comps);
+            }
+            else
+            {
+                m_pOut = (unsigned char*)malloc((size_t)m_outW * m_outH * m_comps);
+                if (m_pOut == NULL)
+                    return false;
+            }
+            if (m_factor > 1)
+            {
+                m_sums.assign((size_t)m_outW * m_comps, 0);
+            }
+            return true;
+        }
+
+        /// Rows before this one can be skipped
+        int FirstRow() const { return m_y0; }
+        /// Rows from this one on are not needed
+        int EndRow() const { return m_y0 + m_h; }
+
+        ///@param y Source row, between FirstRow() and EndRow()
+        void AddRow(int y, const unsigned char* pRow)
+        {
+            const unsigned char* pSrc = pRow + m_x0 * m_comps;
+            if (m_factor == 1)
+            {
+                _EmitRow(pSrc, NULL, 1);
+                return;
+            }
+
+            for (int ox=0; ox<m_outW; ++ox)
+            {
+                const int x0 = ox * m_factor;
+                const int x1 = std::min(x0 + m_factor, m_w);
+                unsigned int* pSum = &m_sums[ox * m_comps];
+                for (int x=x0; x<x1; ++x)
+                {
+                    for (int c=0; c<m_comps; ++c)
+                        pSum[c] += pSrc[x * m_comps + c];
+                }
+            }
+            ++m_rowsSummed;
+
+            if ((m_rowsSummed == m_factor) || (y + 1 == EndRow()))
+            {
+                _EmitRow(NULL, &m_sums[0], m_rowsSummed);
+                std::fill(m_sums.begin(), m_sums.end(), 0);
+                m_rowsSummed = 0;
+            }
+        }
+
+        unsigned char* Detach(int* pWidth, int* pHeight)
+        {
+            *pWidth = m_outW;
+            *pHeight = m_outH;
+            unsigned char* pOut = m_pOut;
+            m_pOut = NULL;
+            return pOut;
+        }
+
+    protected:
+        /// Write one output row, either straight from pSrc or from sums of rows x m_factor columns.
+        void _EmitRow(const unsigned char* pSrc, const unsigned int* pSums, int rows)
+        {
+            for (int ox=0; ox<m_outW; ++ox)
+            {
+                const int cols = std::min(m_factor, m_w - ox * m_factor);
+                const unsigned int count = rows * cols;
+                for (int c=0; c<m_comps; ++c)
+                {
+                    const int i = ox * m_comps + c;
+                    const unsigned char v = pSrc ? pSrc[i] : (unsigned char)((pSums[i] + count / 2) / count);
+                    if (m_pTarget != NULL)
+                        m_row[i] = v;
+                    else if (m_planar)
+                        m_pOut[((size_t)c * m_outH + m_outY) * m_outW + ox] = v;
+                    else
+                        m_pOut[((size_t)m_outY * m_outW + ox) * m_comps + c] = v;
+                }
+            }
+            if (m_pTarget != NULL)
+            {
+                m_pTarget->Row(m_outY, &m_row[0]);
+            }
+            ++m_outY;
+        }
+
+        unsigned char* m_pOut;
+        ImageRowTarget* m_pTarget;
+        std::vector<unsigned char> m_row;  ///< The row being passed on to m_pTarget
+        int m_comps;
+        bool m_planar;
+        int m_x0, m_y0, m_w, m_h;
+        int m_factor;
+        int m_outW, m_outH;
+        int m_outY;
+        int m_rowsSummed;
+        std::vector<unsigned int> m_sums;
+
+    private: // Disallow copy ctor and assignment operator
+        RowSink(const RowSink&);
+        RowSink& operator=(const RowSink&);
+    };
+
+
+    /// Convert a jpgd scanline(1 byte grey or 4 byte RGBA pixels) to reqComps components.
+    void ConvertJpgdRow(unsigned char* pDst, const unsigned char* pScan, int width, int srcComps, int reqComps)
+    {
+        if (srcComps == 1)
+        {
+            for (int x=0; x<width; ++x)
+            {
+                for (int c=0; c<std::min(reqComps, 3); ++c)
+                    *pDst++ = pScan[x];
+                if (reqComps == 4)
+                    *pDst++ = 255;
+            }
+        }
+        else if (reqComps == 1)
+        {
+            const int YR = 19595, YG = 38470, YB = 7471;
+            for (int x=0; x<width; ++x)
+            {
+                const unsigned char* p = pScan + x*4;
+                *pDst++ = (unsigned char)((p[0] * YR + p[1] * YG + p[2] * YB + 32768) >> 16);
+            }
+        }
+        else
+        {
+            for (int x=0; x<width; ++x)
+            {
+                for (int c=0; c<reqComps; ++c)
+                    *pDst++ = pScan[x*4 + c];
+            }
+        }
+    }
+
+    bool JpgdMatches(const unsigned char* pMagic, size_t len)
+    {
+        return (len >= 3) && (pMagic[0] == 0xFF) && (pMagic[1] == 0xD8) && (pMagic[2] == 0xFF);
+    }
+
+    /// Open src with whichever jpgd stream reads it.
+    jpgd::jpeg_decoder_stream* OpenJpgdStream(const ImageSource& src,
+        jpgd::jpeg_decoder_file_stream& fileStream, jpgd::jpeg_decoder_mem_stream& memStream)
+    {
+        if (src.pData != NULL)
+        {
+            memStream.open(src.pData, (jpgd::uint)src.len);
+            return &memStream;
+        }
+        if (!fileStream.open(src.pFilename))
+            return NULL;
+        return &fileStream;
+    }
+
+    bool JpgdGetInfo(const ImageSource& src, int* pWidth, int* pHeight)
+    {
+        jpgd::jpeg_decoder_file_stream fileStream;
+        jpgd::jpeg_decoder_mem_stream memStream;
+        jpgd::jpeg_decoder_stream* pStream = OpenJpgdStream(src, fileStream, memStream);
+        if (pStream == NULL)
+            return false;
+        jpgd::jpeg_decoder decoder(pStream);
+        if (decoder.get_error_code() != jpgd::JPGD_SUCCESS)
+            return false;
+        *pWidth = decoder.get_width();
+        *pHeight = decoder.get_height();
+        return true;
+    }
+
+    /// Decode scanline by scanline into a RowSink, stopping after the last row of the region.
+    bool JpgdDecodeToSink(const ImageSource& src, const ImageDecodeRequest& req, ImageRowTarget* pTarget, RowSink& sink)
+    {
+        jpgd::jpeg_decoder_file_stream fileStream;
+        jpgd::jpeg_decoder_mem_stream memStream;
+        jpgd::jpeg_decoder_stream* pStream = OpenJpgdStream(src, fileStream, memStream);
+        if (pStream == NULL)
+            return false;
+        jpgd::jpeg_decoder decoder(pStream);
+        if (decoder.get_error_code() != jpgd::JPGD_SUCCESS)
+            return false;
+
+        const int width = decoder.get_width();
+        if (!sink.Init(req, width, decoder.get_height(), pTarget))
+            return false;
+        if (decoder.begin_decoding() != jpgd::JPGD_SUCCESS)
+            return false;
+
+        std::vector<unsigned char> row((size_t)width * req.reqComps);
+        for (int y=0; y<sink.EndRow(); ++y)
+        {
+            const void* pScan = NULL;
+            unsigned int scanLen = 0;
+            if (decoder.decode(&pScan, &scanLen) != jpgd::JPGD_SUCCESS)
+                return false;
+            if (y < sink.FirstRow())
+                continue;
+            ConvertJpgdRow(&row[0], (const unsigned char*)pScan, width, decoder.get_num_components(), req.reqComps);
+            sink.AddRow(y, &row[0]);
+        }
+        return true;
+    }
+
+    unsigned char* JpgdDecode(const ImageSource& src, const ImageDecodeRequest& req, int* pWidth, int* pHeight)
+    {
+        RowSink sink;
+        if (!JpgdDecodeToSink(src, req, NULL, sink))
+            return NULL;
+        return sink.Detach(pWidth, pHeight);
+    }
+
+    bool JpgdDecodeRows(const ImageSource& src, const ImageDecodeRequest& req, ImageRowTarget& target)
+    {
+        RowSink sink;
+        return JpgdDecodeToSink(src, req, &target, sink);
+    }
+
+    bool StbGetInfo(const ImageSource& src, int* pWidth, int* pHeight)
+    {
+        int comps = 0;
+        if (src.pData != NULL)
+            return stbi_info_from_memory(src.pData, (int)src.len, pWidth, pHeight, &comps) != 0;
+        return stbi_info(src.pFilename, pWidth, pHeight, &comps) != 0;
+    }
+
+    /// stb_image only decodes whole images, so this ignores everything but req.reqComps.
+    unsigned char* StbDecode(const ImageSource& src, const ImageDecodeRequest& req, int* pWidth, int* pHeight)
+    {
+        int comps = 0;
+        if (src.pData != NULL)
+            return stbi_load_from_memory(src.pData, (int)src.len, pWidth, pHeight, &comps, req.reqComps);
+        return stbi_load(src.pFilename, pWidth, pHeight, &comps, req.reqComps);
+    }
+
+    float* StbDecodeFloat(const ImageSource& src, int* pWidth, int* pHeight)
+    {
+        int comps = 0;
+        if (src.pData != NULL)
+            return stbi_loadf_from_memory(src.pData, (int)src.len, pWidth, pHeight, &comps, 3);
+        return stbi_loadf(src.pFilename, pWidth, pHeight, &comps, 3);
+    }
+
+    bool StbPngMatches (const unsigned char* pMagic, size_t len) { return stbi_png_test_memory (pMagic, (int)len) != 0; }
+    bool StbJpegMatches(const unsigned char* pMagic, size_t len) { return stbi_jpeg_test_memory(pMagic, (int)len) != 0; }
+    bool StbTgaMatches (const unsigned char* pMagic, size_t len) { return stbi_tga_test_memory (pMagic, (int)len) != 0; }
+    bool StbBmpMatches (const unsigned char* pMagic, size_t len) { return stbi_bmp_test_memory (pMagic, (int)len) != 0; }
+    bool StbPsdMatches (const unsigned char* pMagic, size_t len) { return stbi_psd_test_memory (pMagic, (int)len) != 0; }
+    bool StbGifMatches (const unsigned char* pMagic, size_t len) { return stbi_gif_test_memory (pMagic, (int)len) != 0; }
+    bool StbHdrMatches (const unsigned char* pMagic, size_t len) { return stbi_hdr_test_memory (pMagic, (int)len) != 0; }
+    bool StbPicMatches (const unsigned char* pMagic, size_t len) { return stbi_pic_test_memory (pMagic, (int)len) != 0; }
+
+    /// The registry. TGA has no real magic bytes, so its header sanity check goes last.
+    const ImageDecoder g_imageDecoders[] =
+    {
+        { "jpgd",            DecodeScaled | DecodeRegion | DecodePlanar | DecodeStreaming, 0, JpgdMatches,    JpgdGetInfo, JpgdDecode, JpgdDecodeRows, NULL },
+        { "stb_image jpeg",  0,                                                            1, StbJpegMatches, StbGetInfo,  StbDecode,  NULL,           NULL },
+        { "stb_image png",   0,                                                            1, StbPngMatches,  StbGetInfo,  StbDecode,  NULL,           NULL },
+        { "stb_image bmp",   0,                                                            1, StbBmpMatches,  StbGetInfo,  StbDecode,  NULL,           NULL },
+        { "stb_image psd",   0,                                                            1, StbPsdMatches,  StbGetInfo,  StbDecode,  NULL,           NULL },
+        { "stb_image gif",   0,                                                            1, StbGifMatches,  StbGetInfo,  StbDecode,  NULL,           NULL },
+        { "stb_image hdr",   0,                                                            1, StbHdrMatches,  StbGetInfo,  StbDecode,  NULL,           StbDecodeFloat },
+        { "stb_image pic",   0,                                                            1, StbPicMatches,  StbGetInfo,  StbDecode,  NULL,           NULL },
+        { "stb_image tga",   0,                                                            2, StbTgaMatches,  StbGetInfo,  StbDecode,  NULL,           NULL },
+    };
+
+    /// Read the first kMagicBytes of an image into pMagic and return how many there were.
+    size_t ReadMagic(const ImageSource& src, unsigned char* pMagic)
+    {
+        if (src.pData != NULL)
+        {
+            const size_t len = std::min(src.len, kMagicBytes);
+            memcpy(pMagic, src.pData, len);
+            return len;
+        }
+        FILE* pFile = fopen(src.pFilename, "rb");
+        if (pFile == NULL)
+            return 0;
+        const size_t len = fread(pMagic, 1, kMagicBytes, pFile);
+        fclose(pFile);
+        return len;
+    }
+
+    bool FasterDecoder(const ImageDecoder* pA, const ImageDecoder* pB)
+    {
+        return pA->speedRank < pB->speedRank;
+    }
+
+    /// Gather the decoders that recognize src, fastest first, and read its size.
+    bool FindDecoders(const ImageSource& src, std::vector<const ImageDecoder*>& candidates, int* pWidth, int* pHeight)
+    {
+        unsigned char magic[kMagicBytes];
+        const size_t len = ReadMagic(src, magic);
+
+        int count = 0;
+        const ImageDecoder* pDecoders = GetImageDecoders(&count);
+        for (int i=0; i<count; ++i)
+        {
+            if (pDecoders[i].Matches(magic, len))
+                candidates.push_back(&pDecoders[i]);
+        }
+
+        bool haveInfo = false;
+        for (size_t i=0; (i<candidates.size()) && !haveInfo; ++i)
+        {
+            haveInfo = candidates[i]->GetInfo(src, pWidth, pHeight);
+        }
+        if (!haveInfo)
+        {
+            LOG_INFO("No decoder recognizes image %s", src.Name());
+            return false;
+        }
+        std::stable_sort(candidates.begin(), candidates.end(), FasterDecoder);
+        return true;
+    }
+} // namespace
+
+
+const ImageDecoder* GetImageDecoders(int* pCount)
+{
+    *pCount = sizeof(g_imageDecoders) / sizeof(g_imageDecoders[0]);
+    return g_imageDecoders;
+}
+
+bool IsSupportedImageFile(const char* pFilename)
+{
+    unsigned char magic[kMagicBytes];
+    const size_t len = ReadMagic(ImageSource(pFilename), magic);
+    int count = 0;
+    const ImageDecoder* pDecoders = GetImageDecoders(&count);
+    for (int i=0; i<count; ++i)
+    {
+        if (pDecoders[i].Matches(magic, len))
+            return true;
+    }
+    return false;
+}
+
+float* DecodeHdrImage(const ImageSource& src, int* pWidth, int* pHeight)
+{
+    unsigned char magic[kMagicBytes];
+    const size_t len = ReadMagic(src, magic);
+
+    int count = 0;
+    const ImageDecoder* pDecoders = GetImageDecoders(&count);
+    for (int i=0; i<count; ++i)
+    {
+        if ((pDecoders[i].DecodeFloat != NULL) && pDecoders[i].Matches(magic, len))
+        {
+            float* pData = pDecoders[i].DecodeFloat(src, pWidth, pHeight);
+            if (pData != NULL)
+                return pData;
+            LOG_INFO("Decoder %s failed on %s", pDecoders[i].pName, src.Name());
+        }
+    }
+    return NULL;
+}
+
+float* DecodeHdrImageFile(const char* pFilename, int* pWidth, int* pHeight)
+{
+    return DecodeHdrImage(ImageSource(pFilename), pWidth, pHeight);
+}
+
+unsigned char* DecodeImage(const ImageSource& src, const ImageDecodeRequest& req, int* pWidth, int* pHeight)
+{
+    std::vector<const ImageDecoder*> candidates;
+    int width = 0;
+    int height = 0;
+    if (!FindDecoders(src, candidates, &width, &height))
+        return NULL;
+    const unsigned int needed = req.RequiredCaps(width, height);
+
+    // First decoders that produce the request directly, then any decoder plus a RowSink pass.
+    for (int pass=0; pass<2; ++pass)
+    {
+        for (size_t i=0; i<candidates.size(); ++i)
+        {
+            const ImageDecoder& dec = *candidates[i];
+            const bool capable = (dec.caps & needed) == needed;
+            if (capable != (pass == 0))
+                continue;
+
+            unsigned char* pData = NULL;
+            if (capable)
+            {
+                pData = dec.Decode(src, req, pWidth, pHeight);
+            }
+            else
+            {
+                ImageDecodeRequest whole;
+                whole.reqComps = req.reqComps;
+                int w = 0;
+                int h = 0;
+                unsigned char* pWhole = dec.Decode(src, whole, &w, &h);
+                RowSink sink;
+                if ((pWhole != NULL) && sink.Init(req, w, h))
+                {
+                    for (int y=sink.FirstRow(); y<sink.EndRow(); ++y)
+                    {
+                        sink.AddRow(y, pWhole + (size_t)y * w * req.reqComps);
+                    }
+                    pData = sink.Detach(pWidth, pHeight);
+                }
+                free(pWhole);
+            }
+            if (pData != NULL)
+                return pData;
+            LOG_INFO("Decoder %s failed on %s", dec.pName, src.Name());
+        }
+    }
+    return NULL;
+}
+
+unsigned char* DecodeImageFile(const char* pFilename, const ImageDecodeRequest& req, int* pWidth, int* pHeight)
+{
+    return DecodeImage(ImageSource(pFilename), req, pWidth, pHeight);
+}
+
+bool DecodeImageRows(const ImageSource& src, const ImageDecodeRequest& req, ImageRowTarget& target)
+{
+    std::vector<const ImageDecoder*> candidates;
+    int width = 0;
+    int height = 0;
+    if (req.planar || !FindDecoders(src, candidates, &width, &height))
+        return false;
+    const unsigned int needed = req.RequiredCaps(width, height) | DecodeStreaming;
+
+    // First decoders that stream the request directly, then any decoder plus a RowSink pass.
+    for (int pass=0; pass<2; ++pass)
+    {
+        for (size_t i=0; i<candidates.size(); ++i)
+        {
+            const ImageDecoder& dec = *candidates[i];
+            const bool capable = ((dec.caps & needed) == needed) && (dec.DecodeRows != NULL);
+            if (capable != (pass == 0))
+                continue;
+
+            bool decoded = false;
+            if (capable)
+            {
+                decoded = dec.DecodeRows(src, req, target);
+            }
+            else
+            {
+                ImageDecodeRequest whole;
+                whole.reqComps = req.reqComps;
+                int w = 0;
+                int h = 0;
+                unsigned char* pWhole = dec.Decode(src, whole, &w, &h);
+                RowSink sink;
+                if ((pWhole != NULL) && sink.Init(req, w, h, &target))
+                {
+                    for (int y=sink.FirstRow(); y<sink.EndRow(); ++y)
+                    {
+                        sink.AddRow(y, pWhole + (size_t)y * w * req.reqComps);
+                    }
+                    decoded = true;
+                }
+                free(pWhole);
+            }
+            if (decoded)
+                return true;
+            LOG_INFO("Decoder %s failed on %s", dec.pName, src.Name());
+        }
+    }
+    return false;
+}
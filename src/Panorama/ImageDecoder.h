@@ -0,0 +1,130 @@
+// ImageDecoder.h
+
+#pragma once
+
+#include <stddef.h>
+
+///@brief Output modes an image decoder can produce directly, without decoding the whole image first.
+enum ImageDecoderCaps
+{
+    DecodeScaled    = 1 << 0, ///< Reduces the image by a power of two while decoding
+    DecodeRegion    = 1 << 1, ///< Decodes a sub-rectangle, stopping after its last row
+    DecodePlanar    = 1 << 2, ///< Writes one plane per component instead of interleaved pixels
+    DecodeStreaming = 1 << 3, ///< Produces rows one at a time, so only the output image is held in memory
+};
+
+///@brief What the caller wants out of a decode. Decoders lacking a requested capability still
+/// honor it, by cropping/scaling/deinterleaving the fully decoded image afterwards.
+struct ImageDecodeRequest
+{
+    ImageDecodeRequest()
+    : reqComps(3)
+    , maxWidth(0)
+    , maxHeight(0)
+    , roiX(0)
+    , roiY(0)
+    , roiWidth(0)
+    , roiHeight(0)
+    , planar(false)
+    {}
+
+    int reqComps;   ///< Components per pixel of the output: 1(grey), 3(RGB) or 4(RGBA)
+    int maxWidth;   ///< The region is halved until it fits, 0 for no limit
+    int maxHeight;
+    int roiX;       ///< Region of the image to return, 0 width/height for the rest of the image
+    int roiY;
+    int roiWidth;
+    int roiHeight;
+    bool planar;    ///< Return reqComps planes of width*height bytes instead of interleaved pixels
+
+    unsigned int RequiredCaps(int imageWidth, int imageHeight) const;
+};
+
+///@brief Where an image is decoded from: a file, or a whole file's bytes already in memory.
+struct ImageSource
+{
+    ImageSource(const char* pFilename_)
+    : pFilename(pFilename_)
+    , pData(NULL)
+    , len(0)
+    {}
+    ImageSource(const unsigned char* pData_, size_t len_)
+    : pFilename(NULL)
+    , pData(pData_)
+    , len(len_)
+    {}
+
+    const char* pFilename;
+    const unsigned char* pData; ///< Used instead of pFilename when not NULL
+    size_t len;
+
+    const char* Name() const { return (pData != NULL) ? "<memory>" : pFilename; }
+};
+
+///@brief Receives a decode's output rows as they are produced, instead of one malloc'd image,
+/// so the caller can put each row where it is going right away.
+class ImageRowTarget
+{
+public:
+    virtual ~ImageRowTarget() {}
+
+    /// Called with the output size before the first row. Called again should a decoder fail
+    /// part way and another start over.
+    ///@return false to abandon the decode
+    virtual bool Begin(int width, int height, int comps) = 0;
+
+    /// Output row y, of width x comps bytes, valid only during the call. Rows come in order.
+    virtual void Row(int y, const unsigned char* pRow) = 0;
+};
+
+///@brief One entry of the decoder registry.
+struct ImageDecoder
+{
+    const char* pName;
+    unsigned int caps;  ///< ImageDecoderCaps bits
+    int speedRank;      ///< Lower is faster; the loader tries capable decoders in this order
+
+    /// Returns true if the first bytes of a file(at most kMagicBytes) are this decoder's format.
+    bool (*Matches)(const unsigned char* pMagic, size_t len);
+
+    /// Reads the image size without decoding pixels.
+    bool (*GetInfo)(const ImageSource& src, int* pWidth, int* pHeight);
+
+    /// Decodes the image, honoring those parts of req that caps advertises. Returns a malloc'd buffer
+    /// of *pWidth x *pHeight pixels of req.reqComps components, or NULL.
+    unsigned char* (*Decode)(const ImageSource& src, const ImageDecodeRequest& req, int* pWidth, int* pHeight);
+
+    /// For decoders with DecodeStreaming, decodes into target row by row, holding no more than
+    /// the rows in flight; else NULL. Planar output is not supported.
+    bool (*DecodeRows)(const ImageSource& src, const ImageDecodeRequest& req, ImageRowTarget& target);
+
+    /// For high dynamic range formats, decodes the whole image to linear RGB floats(malloc'd), else NULL.
+    float* (*DecodeFloat)(const ImageSource& src, int* pWidth, int* pHeight);
+};
+
+/// Number of leading file bytes the decoders' Matches functions look at.
+const size_t kMagicBytes = 128;
+
+/// Returns the registered decoders.
+const ImageDecoder* GetImageDecoders(int* pCount);
+
+/// Returns true if some decoder recognizes the file's magic bytes.
+bool IsSupportedImageFile(const char* pFilename);
+
+/// Decode a high dynamic range image to linear RGB floats.
+///@return A malloc'd buffer of 3 floats per pixel to release with free(), or NULL if no
+/// registered decoder with float output recognizes the image
+float* DecodeHdrImage(const ImageSource& src, int* pWidth, int* pHeight);
+float* DecodeHdrImageFile(const char* pFilename, int* pWidth, int* pHeight);
+
+/// Decode an image with the fastest registered decoder that recognizes it and supports the
+/// request's output modes natively, falling back to slower or less capable decoders if that fails.
+///@return A malloc'd pixel buffer to release with free(), or NULL on failure
+unsigned char* DecodeImage(const ImageSource& src, const ImageDecodeRequest& req, int* pWidth, int* pHeight);
+unsigned char* DecodeImageFile(const char* pFilename, const ImageDecodeRequest& req, int* pWidth, int* pHeight);
+
+/// Decode an image into target row by row, preferring decoders that stream, so the output is
+/// never held whole. Other decoders decode the whole image first and feed its rows to target.
+/// req.planar is not supported.
+///@return false on failure
+bool DecodeImageRows(const ImageSource& src, const ImageDecodeRequest& req, ImageRowTarget& target);
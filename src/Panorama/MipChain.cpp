@@ -0,0 +1,294 @@
+// MipChain.cpp
+
+#include "MipChain.h"
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#  define MIPCHAIN_USE_SSE2 1
+#  include <emmintrin.h>
+#else
+#  define MIPCHAIN_USE_SSE2 0
+#endif
+
+namespace
+{
+    const double kKaiserWidth = 3.0;  ///< Support radius in destination pixels
+    const double kKaiserAlpha = 4.0;
+    const int kMinPixelsPerThread = 65536;
+
+    ///@brief The source samples and weights that make up each destination sample along one axis.
+    struct FilterTaps
+    {
+        std::vector<int>   first;   ///< Per destination sample, its first entry in index/weight
+        std::vector<int>   count;
+        std::vector<int>   index;
+        std::vector<float> weight;
+        int maxTaps;
+    };
+
+    /// Zeroth order modified Bessel function of the first kind.
+    double Bessel0(double x)
+    {
+        double sum = 1.0;
+        double term = 1.0;
+        for (int k=1; k<32; ++k)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+            if (term < sum * 1e-12)
+                break;
+        }
+        return sum;
+    }
+
+    double Kaiser(double x)
+    {
+        const double t = x / kKaiserWidth;
+        if (t * t >= 1.0)
+            return 0.0;
+        const double sinc = (fabs(x) < 1e-9) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        return sinc * Bessel0(kKaiserAlpha * sqrt(1.0 - t * t)) / Bessel0(kKaiserAlpha);
+    }
+
+    /// Destination sample i covers source [i*scale, (i+1)*scale), which for odd source sizes
+    /// straddles pixels - the box filter weights them by their overlap.
+    void ComputeTaps(int srcSize, int dstSize, MipFilter filter, bool wrap, FilterTaps& taps)
+    {
+        const double scale = (double)srcSize / (double)dstSize;
+        taps.maxTaps = 0;
+        for (int i=0; i<dstSize; ++i)
+        {
+            const int first = (int)taps.index.size();
+            double sum = 0.0;
+            if (filter == MipFilterBox)
+            {
+                const double lo = i * scale;
+                const double hi = (i + 1) * scale;
+                for (int j=(int)floor(lo); j<(int)ceil(hi); ++j)
+                {
+                    const double w = std::min(hi, j + 1.0) - std::max(lo, (double)j);
+                    if (w <= 1e-9)
+                        continue;
+                    taps.index.push_back(j);
+                    taps.weight.push_back((float)w);
+                    sum += w;
+                }
+            }
+            else
+            {
+                const double center = (i + 0.5) * scale;
+                const double radius = kKaiserWidth * scale;
+                for (int j=(int)floor(center - radius); j<=(int)ceil(center + radius); ++j)
+                {
+                    const double w = Kaiser((j + 0.5 - center) / scale);
+                    if (w == 0.0)
+                        continue;
+                    taps.index.push_back(j);
+                    taps.weight.push_back((float)w);
+                    sum += w;
+                }
+            }
+
+            const int count = (int)taps.index.size() - first;
+            for (int t=first; t<first+count; ++t)
+            {
+                int& j = taps.index[t];
+                if (wrap)
+                    j = ((j % srcSize) + srcSize) % srcSize;
+                else
+                    j = std::min(std::max(j, 0), srcSize - 1);
+                taps.weight[t] = (float)(taps.weight[t] / sum);
+            }
+            taps.first.push_back(first);
+            taps.count.push_back(count);
+            taps.maxTaps = std::max(taps.maxTaps, count);
+        }
+    }
+
+    ///@brief Filters one level into the next. Each thread keeps a ring of horizontally filtered
+    /// source rows as 4-float pixels, enough for one destination row's vertical taps.
+    class LevelBuilder
+    {
+    public:
+        LevelBuilder(const unsigned char* pSrc, int srcW, int srcH, int comps,
+                     unsigned char* pDst, int dstW, int dstH, const MipChainParams& params)
+        : m_pSrc(pSrc), m_srcW(srcW), m_srcH(srcH), m_comps(comps)
+        , m_pDst(pDst), m_dstW(dstW), m_dstH(dstH)
+        {
+            ComputeTaps(srcW, dstW, params.filter, params.wrapX, m_xTaps);
+            ComputeTaps(srcH, dstH, params.filter, false, m_yTaps);
+        }
+
+        void BuildRows(int y0, int y1) const
+        {
+            const int slots = m_yTaps.maxTaps;
+            std::vector<float> ring((size_t)slots * m_dstW * 4);
+            std::vector<int> ringRow(slots, -1);
+            std::vector<float> srcRow((size_t)m_srcW * 4 + 4);
+            std::vector<const float*> rows(slots);
+
+            for (int y=y0; y<y1; ++y)
+            {
+                const int first = m_yTaps.first[y];
+                const int count = m_yTaps.count[y];
+                for (int t=0; t<count; ++t)
+                {
+                    // The taps are a contiguous range of rows, so they never share a slot
+                    const int r = m_yTaps.index[first + t];
+                    float* pSlot = &ring[(size_t)(r % slots) * m_dstW * 4];
+                    if (ringRow[r % slots] != r)
+                    {
+                        _FilterRow(r, &srcRow[0], pSlot);
+                        ringRow[r % slots] = r;
+                    }
+                    rows[t] = pSlot;
+                }
+                _BlendRows(&rows[0], &m_yTaps.weight[first], count, m_pDst + (size_t)y * m_dstW * m_comps);
+            }
+        }
+
+    protected:
+        /// Expand source row r to 4-float pixels, then filter it horizontally into pOut.
+        void _FilterRow(int r, float* pSrcRow, float* pOut) const
+        {
+            const unsigned char* pIn = m_pSrc + (size_t)r * m_srcW * m_comps;
+            int x = 0;
+#if MIPCHAIN_USE_SSE2
+            if (m_comps >= 3)
+            {
+                // 4 byte loads, except for the last pixel which may end the buffer
+                const __m128i zero = _mm_setzero_si128();
+                for (; x<m_srcW-1; ++x)
+                {
+                    int v;
+                    memcpy(&v, pIn + x * m_comps, 4);
+                    const __m128i px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+                    _mm_storeu_ps(pSrcRow + x * 4, _mm_cvtepi32_ps(px));
+                }
+            }
+#endif
+            for (; x<m_srcW; ++x)
+            {
+                for (int c=0; c<4; ++c)
+                    pSrcRow[x * 4 + c] = (c < m_comps) ? pIn[x * m_comps + c] : 0.0f;
+            }
+
+            for (int ox=0; ox<m_dstW; ++ox)
+            {
+                const int first = m_xTaps.first[ox];
+                const int count = m_xTaps.count[ox];
+                const int* pIndex = &m_xTaps.index[first];
+                const float* pWeight = &m_xTaps.weight[first];
+#if MIPCHAIN_USE_SSE2
+                __m128 acc = _mm_setzero_ps();
+                for (int t=0; t<count; ++t)
+                    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(pSrcRow + pIndex[t] * 4), _mm_set1_ps(pWeight[t])));
+                _mm_storeu_ps(pOut + ox * 4, acc);
+#else
+                float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                for (int t=0; t<count; ++t)
+                    for (int c=0; c<4; ++c)
+                        acc[c] += pSrcRow[pIndex[t] * 4 + c] * pWeight[t];
+                memcpy(pOut + ox * 4, acc, sizeof(acc));
+#endif
+            }
+        }
+
+        /// Weighted sum of horizontally filtered rows, rounded and clamped to 8 bits.
+        void _BlendRows(const float* const* pRows, const float* pWeights, int count, unsigned char* pOut) const
+        {
+            for (int ox=0; ox<m_dstW; ++ox)
+            {
+                unsigned char px[4];
+#if MIPCHAIN_USE_SSE2
+                __m128 acc = _mm_setzero_ps();
+                for (int t=0; t<count; ++t)
+                    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(pRows[t] + ox * 4), _mm_set1_ps(pWeights[t])));
+                // Truncating x+0.5 rounds like the scalar path; anything it gets wrong below 0 clamps to 0
+                const __m128i i32 = _mm_cvttps_epi32(_mm_add_ps(acc, _mm_set1_ps(0.5f)));
+                const __m128i i16 = _mm_packs_epi32(i32, i32);
+                const int packed = _mm_cvtsi128_si32(_mm_packus_epi16(i16, i16));
+                memcpy(px, &packed, 4);
+#else
+                for (int c=0; c<m_comps; ++c)
+                {
+                    float acc = 0.0f;
+                    for (int t=0; t<count; ++t)
+                        acc += pRows[t][ox * 4 + c] * pWeights[t];
+                    const int v = (int)floor(acc + 0.5f);
+                    px[c] = (unsigned char)std::min(std::max(v, 0), 255);
+                }
+#endif
+                for (int c=0; c<m_comps; ++c)
+                    pOut[ox * m_comps + c] = px[c];
+            }
+        }
+
+        const unsigned char* m_pSrc;
+        int m_srcW, m_srcH, m_comps;
+        unsigned char* m_pDst;
+        int m_dstW, m_dstH;
+        FilterTaps m_xTaps;
+        FilterTaps m_yTaps;
+    };
+
+    void BuildRowsThread(const LevelBuilder* pBuilder, int y0, int y1)
+    {
+        pBuilder->BuildRows(y0, y1);
+    }
+} // namespace
+
+void BuildMipChain(const unsigned char* pSrc, int width, int height, int comps,
+                   const MipChainParams& params, std::vector<MipLevel>& levels)
+{
+    levels.clear();
+    if ((pSrc == NULL) || (width <= 0) || (height <= 0) || (comps < 1) || (comps > 4))
+        return;
+
+    int maxThreads = params.numThreads;
+    if (maxThreads <= 0)
+        maxThreads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    int numLevels = 0;
+    for (int s=std::max(width, height); s>1; s/=2)
+    {
+        ++numLevels;
+    }
+    levels.resize(numLevels);
+
+    const unsigned char* pLevelSrc = pSrc;
+    int w = width;
+    int h = height;
+    for (int l=0; l<numLevels; ++l)
+    {
+        MipLevel& dst = levels[l];
+        dst.width = std::max(1, w / 2);
+        dst.height = std::max(1, h / 2);
+        dst.pixels.resize((size_t)dst.width * dst.height * comps);
+
+        const LevelBuilder builder(pLevelSrc, w, h, comps, &dst.pixels[0], dst.width, dst.height, params);
+
+        const int numThreads = std::max(1, std::min(maxThreads, dst.width * dst.height / kMinPixelsPerThread));
+        std::thread* pThreads = (numThreads > 1) ? new std::thread[numThreads - 1] : NULL;
+        for (int i=1; i<numThreads; ++i)
+        {
+            pThreads[i - 1] = std::thread(BuildRowsThread, &builder,
+                dst.height * i / numThreads, dst.height * (i + 1) / numThreads);
+        }
+        builder.BuildRows(0, dst.height / numThreads);
+        for (int i=1; i<numThreads; ++i)
+        {
+            pThreads[i - 1].join();
+        }
+        delete [] pThreads;
+
+        pLevelSrc = &dst.pixels[0];
+        w = dst.width;
+        h = dst.height;
+    }
+}
@@ -0,0 +1,41 @@
+// MipChain.h
+
+#pragma once
+
+#include <vector>
+
+enum MipFilter
+{
+    MipFilterBox,    ///< Exact area average, also across odd(NPOT) sizes
+    MipFilterKaiser, ///< Kaiser windowed sinc, sharper at the cost of some ringing
+};
+
+///@brief One reduced level of a mip chain, tightly packed rows of 8-bit pixels.
+struct MipLevel
+{
+    int width;
+    int height;
+    std::vector<unsigned char> pixels;
+};
+
+///@brief Options for BuildMipChain.
+struct MipChainParams
+{
+    MipChainParams()
+    : filter(MipFilterBox)
+    , wrapX(true)
+    , numThreads(0)
+    {}
+
+    MipFilter filter;
+    bool wrapX;     ///< Filter across the left/right edges, for panoramas that wrap around
+    int numThreads; ///< 0 = one per hardware thread
+};
+
+/// Build levels 1..n of the mip chain of an 8-bit image with comps(1-4) components, without
+/// rounding it up to a power of two first: every level is max(1, size/2) of the one above,
+/// as GL expects of NPOT textures. Each level is filtered from the one above on SIMD
+/// float pixels, with its rows split across threads.
+///@param levels Receives the reduced levels, largest first(level 0 is the source itself)
+void BuildMipChain(const unsigned char* pSrc, int width, int height, int comps,
+                   const MipChainParams& params, std::vector<MipLevel>& levels);
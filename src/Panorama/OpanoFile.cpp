@@ -0,0 +1,261 @@
+// OpanoFile.cpp
+
+#ifdef _WIN32
+#  define WINDOWS_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+#include "OpanoFile.h"
+#include "Logger.h"
+
+#include "jpgd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+namespace
+{
+    const uint32_t kMaxOpanoLevels = 32;
+} // namespace
+
+
+OpanoFile::OpanoFile()
+: m_index()
+, m_pHeader(NULL)
+, m_pLevels(NULL)
+, m_pTiles(NULL)
+, m_numTiles(0)
+#ifdef _WIN32
+, m_hFile(INVALID_HANDLE_VALUE)
+#else
+, m_fd(-1)
+#endif
+{
+}
+
+OpanoFile::~OpanoFile()
+{
+    Close();
+}
+
+bool OpanoFile::IsOpanoFile(const char* pFilename)
+{
+    FILE* pFile = fopen(pFilename, "rb");
+    if (pFile == NULL)
+        return false;
+    char magic[4];
+    const bool isOpano = (fread(magic, 1, sizeof(magic), pFile) == sizeof(magic)) &&
+        (memcmp(magic, kOpanoMagic, sizeof(magic)) == 0);
+    fclose(pFile);
+    return isOpano;
+}
+
+/// Read the header, then map it with the level and tile tables.
+bool OpanoFile::Open(const char* pFilename)
+{
+    Close();
+
+    OpanoHeader header;
+#ifdef _WIN32
+    m_hFile = CreateFileA(pFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+    DWORD read = 0;
+    if (!ReadFile(m_hFile, &header, sizeof(header), &read, NULL) || (read != sizeof(header)))
+    {
+        Close();
+        return false;
+    }
+#else
+    m_fd = open(pFilename, O_RDONLY);
+    if (m_fd < 0)
+        return false;
+    if (pread(m_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        Close();
+        return false;
+    }
+#endif
+
+    if ((memcmp(header.magic, kOpanoMagic, sizeof(kOpanoMagic)) != 0) ||
+        (header.version != kOpanoVersion) ||
+        (header.numEyes < 1) || (header.numEyes > 2) ||
+        (header.numLevels < 1) || (header.numLevels > kMaxOpanoLevels) ||
+        (header.indexBytes < sizeof(header) + header.numEyes * header.numLevels * sizeof(OpanoLevel)) ||
+        !m_index.Open(pFilename, (size_t)header.indexBytes) ||
+        (m_index.Size() != header.indexBytes))
+    {
+        LOG_INFO("OpanoFile::Open: %s is not a valid .opano file.", pFilename);
+        Close();
+        return false;
+    }
+
+    m_pHeader = (const OpanoHeader*)m_index.Data();
+    m_pLevels = (const OpanoLevel*)(m_pHeader + 1);
+    m_pTiles = (const OpanoTile*)(m_pLevels + m_pHeader->numEyes * m_pHeader->numLevels);
+    m_numTiles = (header.indexBytes - ((const unsigned char*)m_pTiles - m_index.Data())) / sizeof(OpanoTile);
+    if (!_Validate())
+    {
+        LOG_INFO("OpanoFile::Open: %s has a corrupt index.", pFilename);
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void OpanoFile::Close()
+{
+    m_index.Close();
+    m_pHeader = NULL;
+    m_pLevels = NULL;
+    m_pTiles = NULL;
+    m_numTiles = 0;
+#ifdef _WIN32
+    if (m_hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+#else
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+#endif
+}
+
+/// Check every level's tiles lie in the table, so lookups need no checks of their own.
+/// Payloads are checked as they are read, leaving the tile table unpaged until then.
+bool OpanoFile::_Validate() const
+{
+    const OpanoHeader& h = *m_pHeader;
+    if ((h.tileSize == 0) || (h.tileSize % 4 != 0) || (h.border % 4 != 0) || (h.border > h.tileSize))
+        return false;
+
+    for (uint32_t i=0; i<h.numEyes * h.numLevels; ++i)
+    {
+        const OpanoLevel& level = m_pLevels[i];
+        if ((level.width < 1) || (level.height < 1) ||
+            (level.tilesX != (level.width + (int)h.tileSize - 1) / (int)h.tileSize) ||
+            (level.tilesY != (level.height + (int)h.tileSize - 1) / (int)h.tileSize) ||
+            (level.firstTile > m_numTiles) ||
+            ((uint64_t)level.tilesX * level.tilesY > m_numTiles - level.firstTile))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+const OpanoLevel& OpanoFile::Level(int eye, int level) const
+{
+    return m_pLevels[eye * m_pHeader->numLevels + level];
+}
+
+///@return NULL if there is no such tile
+const OpanoTile* OpanoFile::Tile(int eye, int level, int tileX, int tileY) const
+{
+    if ((eye < 0) || (eye >= (int)m_pHeader->numEyes) ||
+        (level < 0) || (level >= (int)m_pHeader->numLevels))
+    {
+        return NULL;
+    }
+    const OpanoLevel& lv = Level(eye, level);
+    if ((tileX < 0) || (tileX >= lv.tilesX) || (tileY < 0) || (tileY >= lv.tilesY))
+        return NULL;
+    return &m_pTiles[lv.firstTile + (uint64_t)tileY * lv.tilesX + tileX];
+}
+
+bool OpanoFile::ReadPayload(const OpanoTile& tile, unsigned char* pDst) const
+{
+    const OpanoHeader& h = *m_pHeader;
+    if ((tile.offset < h.indexBytes) || (tile.offset > h.fileSize) || (tile.size > h.fileSize - tile.offset))
+        return false;
+
+#ifdef _WIN32
+    OVERLAPPED at;
+    memset(&at, 0, sizeof(at));
+    at.Offset = (DWORD)(tile.offset & 0xffffffff);
+    at.OffsetHigh = (DWORD)(tile.offset >> 32);
+    DWORD read = 0;
+    return ReadFile(m_hFile, pDst, tile.size, &read, &at) && (read == tile.size);
+#else
+    return pread(m_fd, pDst, tile.size, (off_t)tile.offset) == (ssize_t)tile.size;
+#endif
+}
+
+
+OpanoTileSource::OpanoTileSource(const std::shared_ptr<OpanoFile>& pFile, int eye)
+: m_pFile(pFile)
+, m_eye(std::min(eye, (int)pFile->Header().numEyes - 1))
+, m_layout()
+, m_compressed()
+{
+    const OpanoHeader& h = m_pFile->Header();
+    if (h.payload == OpanoJpeg)
+    {
+        m_layout.internalFormat = GL_RGB8;
+        m_layout.format = GL_RGB;
+        m_layout.type = GL_UNSIGNED_BYTE;
+        m_layout.bytesPerPixel = 3;
+    }
+    else
+    {
+        m_layout.internalFormat = h.internalFormat;
+        m_layout.format = h.format;
+        m_layout.type = h.type;
+        m_layout.bytesPerPixel = h.bytesPerPixel;
+        m_layout.blockBytes = h.blockBytes;
+        m_layout.isHdr = (h.isHdr != 0);
+    }
+    m_layout.tileSize = h.tileSize;
+    m_layout.border = h.border;
+    for (uint32_t i=0; i<h.numLevels; ++i)
+    {
+        const OpanoLevel& lv = m_pFile->Level(m_eye, i);
+        TileLevel level;
+        level.width = lv.width;
+        level.height = lv.height;
+        level.tilesX = lv.tilesX;
+        level.tilesY = lv.tilesY;
+        m_layout.levels.push_back(level);
+    }
+}
+
+/// Raw and BC1 tiles are read straight into pDst; JPEG tiles go through m_compressed.
+bool OpanoTileSource::ReadTile(int level, int tileX, int tileY, unsigned char* pDst)
+{
+    const OpanoTile* pTile = m_pFile->Tile(m_eye, level, tileX, tileY);
+    if (pTile == NULL)
+        return false;
+
+    const size_t tileBytes = m_layout.TileBytes();
+    if (m_pFile->Header().payload != OpanoJpeg)
+    {
+        return (pTile->size == tileBytes) && m_pFile->ReadPayload(*pTile, pDst);
+    }
+
+    if ((pTile->size == 0) || (pTile->size > m_pFile->Header().fileSize))
+        return false;
+    m_compressed.resize(pTile->size);
+    if (!m_pFile->ReadPayload(*pTile, &m_compressed[0]))
+        return false;
+
+    int width = 0;
+    int height = 0;
+    int comps = 0;
+    unsigned char* pPixels = jpgd::decompress_jpeg_image_from_memory(
+        &m_compressed[0], (int)m_compressed.size(), &width, &height, &comps, 3);
+    if (pPixels == NULL)
+        return false;
+    const bool ok = (width == m_layout.SlotSize()) && (height == m_layout.SlotSize());
+    if (ok)
+    {
+        memcpy(pDst, pPixels, tileBytes);
+    }
+    free(pPixels);
+    return ok;
+}
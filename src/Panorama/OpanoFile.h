@@ -0,0 +1,75 @@
+// OpanoFile.h
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "OpanoFormat.h"
+#include "PanoDiskCache.h"
+#include "VirtualTexture.h"
+
+///@brief A read only .opano file. Opening reads the header and maps the index, whatever the
+/// size of the image, so it takes milliseconds; each tile is then one positional read
+/// at the offset its index entry gives. Reads may come from any number of threads.
+class OpanoFile
+{
+public:
+    OpanoFile();
+    virtual ~OpanoFile();
+
+    /// Whether the file starts with the .opano magic bytes.
+    static bool IsOpanoFile(const char* pFilename);
+
+    bool Open(const char* pFilename);
+    void Close();
+
+    bool IsOpen() const { return m_pHeader != NULL; }
+    const OpanoHeader& Header() const { return *m_pHeader; }
+    const OpanoLevel& Level(int eye, int level) const;
+    const OpanoTile* Tile(int eye, int level, int tileX, int tileY) const;
+
+    /// Read a tile's payload in one go.
+    ///@param pDst Receives Tile(...)->size bytes
+    bool ReadPayload(const OpanoTile& tile, unsigned char* pDst) const;
+
+protected:
+    bool _Validate() const;
+
+    MappedFile m_index;
+    const OpanoHeader* m_pHeader;
+    const OpanoLevel* m_pLevels;
+    const OpanoTile* m_pTiles;
+    uint64_t m_numTiles;
+#ifdef _WIN32
+    void* m_hFile;
+#else
+    int m_fd;
+#endif
+
+private: // Disallow copy ctor and assignment operator
+    OpanoFile(const OpanoFile&);
+    OpanoFile& operator=(const OpanoFile&);
+};
+
+///@brief The tiles of one eye of an .opano file, for a VirtualTexture.
+class OpanoTileSource : public TileSource
+{
+public:
+    ///@param eye 0 for left, 1 for right; a mono file shows its only eye to both
+    OpanoTileSource(const std::shared_ptr<OpanoFile>& pFile, int eye);
+
+    virtual const TileLayout& Layout() const { return m_layout; }
+    virtual bool ReadTile(int level, int tileX, int tileY, unsigned char* pDst);
+
+protected:
+    std::shared_ptr<OpanoFile> m_pFile;
+    int m_eye;
+    TileLayout m_layout;
+    std::vector<unsigned char> m_compressed; ///< Payload of a JPEG tile, before decoding
+
+private: // Disallow default, copy ctor and assignment operator
+    OpanoTileSource();
+    OpanoTileSource(const OpanoTileSource&);
+    OpanoTileSource& operator=(const OpanoTileSource&);
+};
@@ -0,0 +1,69 @@
+// OpanoFormat.h
+
+#pragma once
+
+#include <stdint.h>
+
+///@brief How the tiles of an .opano file are stored.
+enum OpanoPayload
+{
+    OpanoRaw  = 0, ///< Texels as TileLayout describes them, ready to upload
+    OpanoBc1  = 1, ///< BC1 blocks, ready to upload as GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+    OpanoJpeg = 2, ///< A baseline JPEG per tile, decoded to 8-bit RGB
+};
+
+///@brief Where and how to show the panorama, as PanoramaPatch takes it.
+struct OpanoProjection
+{
+    float cylHeight;  ///< Half height of the cylinder, of radius 8
+    float coverage;   ///< Fraction of the full circle the image spans
+    float pairTweak;  ///< Texture coordinate offset of the right eye
+    float reserved;
+};
+
+///@brief .opano file layout, shared by the viewer and the opanobuild tool. All values are little endian and every struct is 8-byte aligned:
+///   OpanoHeader
+///   OpanoLevel[numEyes * numLevels], each eye's levels finest first
+///   OpanoTile[] for every level's tiles in row order, from OpanoLevel::firstTile
+///   tile payloads, anywhere past the index
+/// Each tile payload holds its tile plus border texels on every side, wrapped around on x
+/// and clamped on y, so a tile fills a whole TileLayout::SlotSize() atlas slot.
+struct OpanoHeader
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t numEyes;
+    uint32_t numLevels;
+    uint32_t payload;        ///< OpanoPayload
+    uint32_t tileSize;
+    uint32_t border;
+    uint32_t isHdr;
+    int32_t  internalFormat; ///< Of the decoded tiles, as in PanoEyeImage; JPEG tiles are always 8-bit RGB
+    uint32_t format;
+    uint32_t type;
+    int32_t  bytesPerPixel;
+    int32_t  blockBytes;
+    uint32_t reserved;
+    OpanoProjection projection;
+    uint64_t indexBytes;     ///< The header, level and tile tables
+    uint64_t fileSize;
+};
+
+struct OpanoLevel
+{
+    int32_t  width;
+    int32_t  height;
+    int32_t  tilesX;
+    int32_t  tilesY;
+    uint64_t firstTile;
+};
+
+struct OpanoTile
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+const char     kOpanoMagic[4] = { 'O', 'P', 'A', 'N' };
+const uint32_t kOpanoVersion  = 1;
@@ -0,0 +1,67 @@
+// PanoCache.cpp
+
+#include "PanoCache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sstream>
+
+namespace
+{
+    const size_t kFileBytesBudget = 256 * 1024 * 1024;
+    const size_t kImageBudget     = 768 * 1024 * 1024;
+    const size_t kTextureBudget   = 384 * 1024 * 1024;
+}
+
+std::string MakeFileCacheKey(const char* pFilename)
+{
+    struct stat st;
+    if ((pFilename == NULL) || (stat(pFilename, &st) != 0))
+        return std::string();
+
+    std::ostringstream oss;
+    oss << pFilename << "|" << (long long)st.st_mtime << "|" << (long long)st.st_size;
+    return oss.str();
+}
+
+std::string MakePanoCacheKey(const char* pFileL, const char* pFileR)
+{
+    std::string key = MakeFileCacheKey(pFileL);
+    if (key.empty() || (pFileR == NULL))
+        return key;
+
+    const std::string keyR = MakeFileCacheKey(pFileR);
+    if (keyR.empty())
+        return keyR;
+    return key + "\n" + keyR;
+}
+
+PanoCache::PanoCache()
+: m_fileBytes(kFileBytesBudget)
+, m_images(kImageBudget)
+, m_textures(kTextureBudget)
+{
+}
+
+unsigned int PanoCache::GetResidency(const char* pFileL, const char* pFileR) const
+{
+    const std::string key = MakePanoCacheKey(pFileL, pFileR);
+    if (key.empty())
+        return 0;
+
+    unsigned int tiers = 0;
+    if (m_fileBytes.Contains(MakeFileCacheKey(pFileL)) &&
+        ((pFileR == NULL) || m_fileBytes.Contains(MakeFileCacheKey(pFileR))))
+    {
+        tiers |= PanoTierFileBytes;
+    }
+    if (m_images.Contains(key))
+    {
+        tiers |= PanoTierImage;
+    }
+    if (m_textures.Contains(key))
+    {
+        tiers |= PanoTierTexture;
+    }
+    return tiers;
+}
@@ -0,0 +1,226 @@
+// PanoCache.h
+
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+///@brief Counters of one cache, for reporting.
+struct CacheTierStats
+{
+    CacheTierStats()
+    : hits(0)
+    , misses(0)
+    , evictions(0)
+    , entries(0)
+    , bytes(0)
+    , budgetBytes(0)
+    {}
+
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int evictions;
+    size_t entries;
+    size_t bytes;
+    size_t budgetBytes;
+
+    float HitRate() const { return (hits + misses > 0) ? (float)hits / (float)(hits + misses) : 0.0f; }
+};
+
+///@brief Shared objects by key up to a byte budget. Eviction is cost aware LRU(GreedyDual-Size):
+/// an entry's priority is its cost to rebuild per byte on top of an "age" that rises to the
+/// priority of each evicted entry, so cheap, large and long unused entries go first.
+/// All members lock, so one tier can be filled on a loader thread and read on the render thread.
+template <typename T>
+class CacheTier
+{
+public:
+    explicit CacheTier(size_t budgetBytes)
+    : m_mutex()
+    , m_entries()
+    , m_age(0.0)
+    , m_bytes(0)
+    , m_budgetBytes(budgetBytes)
+    , m_stats()
+    {}
+
+    void SetBudget(size_t budgetBytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_budgetBytes = budgetBytes;
+        _EvictToFit(0, NULL);
+    }
+
+    /// Look a key up, counting a hit or a miss and marking it as used.
+    std::shared_ptr<T> Find(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        typename EntryMap::iterator it = m_entries.find(key);
+        if (it == m_entries.end())
+        {
+            ++m_stats.misses;
+            return std::shared_ptr<T>();
+        }
+        ++m_stats.hits;
+        it->second.priority = m_age + it->second.costPerByte;
+        return it->second.pValue;
+    }
+
+    /// Look a key up without touching the counters or its age.
+    bool Contains(const std::string& key) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_entries.find(key) != m_entries.end();
+    }
+
+    /// Add or replace an entry, evicting others until it fits the budget.
+    ///@param costMs What it took to make the entry, in milliseconds
+    ///@param pKeep Keys that must not be evicted to make room, or NULL
+    ///@return false if the entry does not fit, in which case nothing was evicted
+    bool Insert(const std::string& key, const std::shared_ptr<T>& pValue, size_t bytes, double costMs,
+                const std::set<std::string>* pKeep = NULL)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        _Erase(key);
+
+        /// Check first so a refused entry costs nothing
+        size_t evictable = 0;
+        for (typename EntryMap::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+        {
+            if ((pKeep == NULL) || (pKeep->count(it->first) == 0))
+                evictable += it->second.bytes;
+        }
+        if (m_bytes - evictable + bytes > m_budgetBytes)
+            return false;
+
+        _EvictToFit(bytes, pKeep);
+        Entry& e = m_entries[key];
+        e.pValue = pValue;
+        e.bytes = bytes;
+        e.costPerByte = costMs / (double)std::max(bytes, (size_t)1);
+        e.priority = m_age + e.costPerByte;
+        m_bytes += bytes;
+        return true;
+    }
+
+    void Erase(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        _Erase(key);
+    }
+
+    void Clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_entries.clear();
+        m_bytes = 0;
+    }
+
+    CacheTierStats GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        CacheTierStats stats = m_stats;
+        stats.entries = m_entries.size();
+        stats.bytes = m_bytes;
+        stats.budgetBytes = m_budgetBytes;
+        return stats;
+    }
+
+protected:
+    struct Entry
+    {
+        std::shared_ptr<T> pValue;
+        size_t bytes;
+        double costPerByte;
+        double priority;
+    };
+    typedef std::map<std::string, Entry> EntryMap;
+
+    void _Erase(const std::string& key)
+    {
+        typename EntryMap::iterator it = m_entries.find(key);
+        if (it == m_entries.end())
+            return;
+        m_bytes -= it->second.bytes;
+        m_entries.erase(it);
+    }
+
+    /// Evict the lowest priority entries not in pKeep until extraBytes more would fit.
+    void _EvictToFit(size_t extraBytes, const std::set<std::string>* pKeep)
+    {
+        while (m_bytes + extraBytes > m_budgetBytes)
+        {
+            typename EntryMap::iterator victim = m_entries.end();
+            for (typename EntryMap::iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+            {
+                if ((pKeep != NULL) && (pKeep->count(it->first) != 0))
+                    continue;
+                if ((victim == m_entries.end()) || (it->second.priority < victim->second.priority))
+                    victim = it;
+            }
+            if (victim == m_entries.end())
+                return;
+            m_age = victim->second.priority;
+            m_bytes -= victim->second.bytes;
+            m_entries.erase(victim);
+            ++m_stats.evictions;
+        }
+    }
+
+    mutable std::mutex m_mutex;
+    EntryMap m_entries;
+    double m_age;
+    size_t m_bytes;
+    size_t m_budgetBytes;
+    CacheTierStats m_stats;
+
+private: // Disallow copy ctor and assignment operator
+    CacheTier(const CacheTier&);
+    CacheTier& operator=(const CacheTier&);
+};
+
+
+struct PanoImageData;
+class PanoramaPatch;
+
+typedef std::vector<unsigned char> FileBytes;
+
+///@brief Tier bits returned by PanoCache::GetResidency.
+enum PanoCacheTier
+{
+    PanoTierFileBytes = 1 << 0,
+    PanoTierImage     = 1 << 1,
+    PanoTierTexture   = 1 << 2,
+};
+
+/// A file's cache key: its path, modification time and size, so edited files miss.
+///@return An empty key if the file does not exist
+std::string MakeFileCacheKey(const char* pFilename);
+
+/// A panorama's cache key, from the keys of its over/under file or pair(pFileR may be NULL).
+std::string MakePanoCacheKey(const char* pFileL, const char* pFileR);
+
+///@brief The panorama caches, one tier per stage of loading, all sharing the same keys.
+/// A miss in one tier is filled from the one below it.
+class PanoCache
+{
+public:
+    PanoCache();
+
+    /// Bitwise or of the PanoCacheTier tiers holding a panorama.
+    unsigned int GetResidency(const char* pFileL, const char* pFileR) const;
+
+public:
+    CacheTier<FileBytes>     m_fileBytes;  ///< Whole image files as read from disk, keyed per file
+    CacheTier<PanoImageData> m_images;     ///< Decoded panoramas with their mip chains
+    CacheTier<PanoramaPatch> m_textures;   ///< Uploaded panoramas; only use on the render thread
+
+private: // Disallow copy ctor and assignment operator
+    PanoCache(const PanoCache&);
+    PanoCache& operator=(const PanoCache&);
+};
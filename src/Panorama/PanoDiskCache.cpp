@@ -0,0 +1,455 @@
+// PanoDiskCache.cpp
+
+#ifdef _WIN32
+#  define WINDOWS_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#  include <direct.h>
+#  include <sys/utime.h>
+#  include "win/dirent.h"
+#else
+#  include <dirent.h>
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  include <utime.h>
+#endif
+
+#include "PanoDiskCache.h"
+#include "PanoLoader.h"
+#include "Logger.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+namespace
+{
+    const char     kMagic[4]   = { 'P', 'M', 'I', 'P' };
+    const uint32_t kVersion    = 2;
+    const uint32_t kMaxLevels  = 32;
+    const size_t   kPageSize   = 4096; ///< Level 0 starts on a page, for the mapping
+    const size_t   kLevelAlign = 64;
+    const char*    kExtension  = ".pmip";
+
+    struct DiskEye
+    {
+        int32_t  internalFormat;
+        uint32_t format;
+        uint32_t type;
+        int32_t  bytesPerPixel;
+        int32_t  blockBytes;
+        uint32_t gpuMipmaps;
+        uint32_t numLevels;
+        float    psnr;
+    };
+
+    struct DiskHeader
+    {
+        char     magic[4];
+        uint32_t version;
+        uint32_t keyLength;
+        uint32_t isHdr;
+        uint64_t fileSize;
+        DiskEye  eyes[2];
+    };
+
+    /// Followed by the key, then the level data
+    struct DiskLevel
+    {
+        int32_t  width;
+        int32_t  height;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    size_t AlignUp(size_t x, size_t align)
+    {
+        return (x + align - 1) / align * align;
+    }
+
+    /// 64-bit FNV-1a
+    uint64_t HashKey(const std::string& key)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i=0; i<key.size(); ++i)
+        {
+            h ^= (unsigned char)key[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    struct DiskEntry
+    {
+        std::string path;
+        size_t size;
+        time_t lastUse;
+
+        bool operator<(const DiskEntry& rhs) const { return lastUse < rhs.lastUse; }
+    };
+} // namespace
+
+
+MappedFile::MappedFile()
+: m_pData(NULL)
+, m_size(0)
+#ifdef _WIN32
+, m_hFile(INVALID_HANDLE_VALUE)
+, m_hMapping(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const char* pFilename, size_t maxBytes)
+{
+    Close();
+#ifdef _WIN32
+    m_hFile = CreateFileA(pFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_hFile, &size) || (size.QuadPart == 0))
+    {
+        Close();
+        return false;
+    }
+    m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_hMapping == NULL)
+    {
+        Close();
+        return false;
+    }
+    m_size = (size_t)size.QuadPart;
+    if ((maxBytes != 0) && (maxBytes < m_size))
+        m_size = maxBytes;
+    m_pData = (const unsigned char*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, m_size);
+#else
+    const int fd = open(pFilename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    if ((maxBytes != 0) && (maxBytes < size))
+        size = maxBytes;
+    void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    m_pData = (const unsigned char*)p;
+    m_size = size;
+#endif
+    if (m_pData == NULL)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+    if (m_pData != NULL)
+        UnmapViewOfFile(m_pData);
+    if (m_hMapping != NULL)
+        CloseHandle(m_hMapping);
+    if (m_hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hFile);
+    m_hMapping = NULL;
+    m_hFile = INVALID_HANDLE_VALUE;
+#else
+    if (m_pData != NULL)
+        munmap((void*)m_pData, m_size);
+#endif
+    m_pData = NULL;
+    m_size = 0;
+}
+
+
+///@param directory Where the entries go, created if need be; ends in a path separator
+PanoDiskCache::PanoDiskCache(const std::string& directory, size_t budgetBytes)
+: m_directory(directory)
+, m_budgetBytes(budgetBytes)
+, m_mutex()
+, m_stats()
+{
+#ifdef _WIN32
+    _mkdir(m_directory.c_str());
+#else
+    mkdir(m_directory.c_str(), 0755);
+#endif
+    _Trim();
+}
+
+PanoDiskCache::~PanoDiskCache()
+{
+}
+
+std::string PanoDiskCache::MakeKey(const std::string& panoKey, const PanoLoadParams& params)
+{
+    std::ostringstream oss;
+    oss << panoKey
+        << "|max " << params.maxTexSize
+        << "|strips " << params.maxStrips
+        << "|filter " << (int)params.mipFilter
+        << "|gpumips " << (int)params.gpuMipmaps
+        << "|half " << (int)params.hdrHalfFloat
+        << "|bc1 " << (params.compressBc1 ? (int)params.compressQuality + 1 : 0);
+    return oss.str();
+}
+
+std::string PanoDiskCache::_EntryPath(const std::string& key) const
+{
+    char name[32];
+    sprintf(name, "%016llx", (unsigned long long)HashKey(key));
+    return m_directory + name + kExtension;
+}
+
+std::shared_ptr<PanoImageData> PanoDiskCache::Load(const std::string& key)
+{
+    std::shared_ptr<PanoImageData> pImage;
+    const std::string path = _EntryPath(key);
+
+    std::shared_ptr<MappedFile> pMapping(new MappedFile());
+    if (pMapping->Open(path.c_str()))
+    {
+        /// Validate everything the levels are read through
+        const unsigned char* pData = pMapping->Data();
+        const size_t size = pMapping->Size();
+        DiskHeader header;
+        bool valid = (size >= sizeof(header));
+        if (valid)
+        {
+            memcpy(&header, pData, sizeof(header));
+            valid = (memcmp(header.magic, kMagic, sizeof(kMagic)) == 0) &&
+                    (header.version == kVersion) &&
+                    (header.fileSize == size) &&
+                    (header.eyes[0].numLevels <= kMaxLevels) &&
+                    (header.eyes[1].numLevels <= kMaxLevels);
+        }
+        const size_t numLevels = valid ? (header.eyes[0].numLevels + header.eyes[1].numLevels) : 0;
+        const size_t keyOffset = sizeof(header) + numLevels * sizeof(DiskLevel);
+        valid = valid &&
+                (keyOffset + header.keyLength <= size) &&
+                (key.compare(0, std::string::npos, (const char*)pData + keyOffset, header.keyLength) == 0);
+
+        if (valid)
+        {
+            pImage.reset(new PanoImageData());
+            pImage->isHdr = (header.isHdr != 0);
+            pImage->pMapping = pMapping;
+            const DiskLevel* pLevels = (const DiskLevel*)(pData + sizeof(header));
+            for (int e=0; (e<2) && valid; ++e)
+            {
+                const DiskEye& de = header.eyes[e];
+                PanoEyeImage& eye = pImage->eyes[e];
+                eye.internalFormat = de.internalFormat;
+                eye.format = de.format;
+                eye.type = de.type;
+                eye.bytesPerPixel = de.bytesPerPixel;
+                eye.blockBytes = de.blockBytes;
+                eye.psnr = de.psnr;
+                eye.gpuMipmaps = (de.gpuMipmaps != 0);
+                valid = (de.bytesPerPixel > 0) && (de.bytesPerPixel <= 16) &&
+                        (de.blockBytes >= 0) && (de.blockBytes <= 16);
+                eye.levels.resize(de.numLevels);
+                eye.mappedLevels.resize(de.numLevels);
+                for (uint32_t i=0; (i<de.numLevels) && valid; ++i)
+                {
+                    DiskLevel dl;
+                    memcpy(&dl, pLevels++, sizeof(dl));
+                    eye.levels[i].width = dl.width;
+                    eye.levels[i].height = dl.height;
+                    eye.mappedLevels[i] = pData + dl.offset;
+                    valid = (dl.width > 0) && (dl.height > 0) &&
+                            (dl.offset <= size) && (dl.size <= size - dl.offset) &&
+                            (dl.size == eye.LevelSize(i));
+                }
+            }
+            if (!valid)
+                pImage.reset();
+        }
+        if (!valid)
+        {
+            LOG_INFO("Removing invalid disk cache entry %s", path.c_str());
+            pMapping.reset();
+            remove(path.c_str());
+        }
+    }
+
+    if (pImage != NULL)
+    {
+        /// The modification time orders entries for eviction
+#ifdef _WIN32
+        _utime(path.c_str(), NULL);
+#else
+        utime(path.c_str(), NULL);
+#endif
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (pImage != NULL)
+        ++m_stats.hits;
+    else
+        ++m_stats.misses;
+    return pImage;
+}
+
+bool PanoDiskCache::Store(const std::string& key, const PanoImageData& image)
+{
+    DiskHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.keyLength = (uint32_t)key.size();
+    header.isHdr = image.isHdr ? 1 : 0;
+
+    std::vector<DiskLevel> levels;
+    for (int e=0; e<2; ++e)
+    {
+        const PanoEyeImage& eye = image.eyes[e];
+        DiskEye& de = header.eyes[e];
+        de.internalFormat = eye.internalFormat;
+        de.format = eye.format;
+        de.type = eye.type;
+        de.bytesPerPixel = eye.bytesPerPixel;
+        de.blockBytes = eye.blockBytes;
+        de.psnr = eye.psnr;
+        de.gpuMipmaps = eye.gpuMipmaps ? 1 : 0;
+        de.numLevels = (uint32_t)eye.levels.size();
+        if (de.numLevels > kMaxLevels)
+            return false;
+        for (size_t i=0; i<eye.levels.size(); ++i)
+        {
+            DiskLevel dl;
+            dl.width = eye.levels[i].width;
+            dl.height = eye.levels[i].height;
+            dl.offset = 0;
+            dl.size = eye.LevelSize(i);
+            levels.push_back(dl);
+        }
+    }
+
+    size_t offset = AlignUp(sizeof(header) + levels.size() * sizeof(DiskLevel) + key.size(), kPageSize);
+    for (size_t i=0; i<levels.size(); ++i)
+    {
+        levels[i].offset = offset;
+        offset = AlignUp(offset + (size_t)levels[i].size, kLevelAlign);
+    }
+    header.fileSize = offset;
+
+    /// Written under a temporary name, so a crash never leaves a truncated entry behind
+    const std::string path = _EntryPath(key);
+    const std::string tempPath = path + ".tmp";
+    FILE* pFile = fopen(tempPath.c_str(), "wb");
+    if (pFile == NULL)
+        return false;
+
+    bool ok = (fwrite(&header, sizeof(header), 1, pFile) == 1);
+    ok = ok && (levels.empty() || (fwrite(&levels[0], sizeof(DiskLevel), levels.size(), pFile) == levels.size()));
+    ok = ok && (fwrite(key.data(), 1, key.size(), pFile) == key.size());
+    size_t written = sizeof(header) + levels.size() * sizeof(DiskLevel) + key.size();
+
+    /// Sequential writes, zero padding up to each level's offset and the file size
+    const std::vector<unsigned char> zeros(kPageSize, 0);
+    size_t level = 0;
+    for (int e=0; (e<2) && ok; ++e)
+    {
+        const PanoEyeImage& eye = image.eyes[e];
+        for (size_t i=0; (i<eye.levels.size()) && ok; ++i, ++level)
+        {
+            const size_t pad = (size_t)levels[level].offset - written;
+            ok = (fwrite(&zeros[0], 1, pad, pFile) == pad) &&
+                 (fwrite(eye.LevelData(i), 1, (size_t)levels[level].size, pFile) == levels[level].size);
+            written += pad + (size_t)levels[level].size;
+        }
+    }
+    const size_t pad = (size_t)header.fileSize - written;
+    ok = ok && (fwrite(&zeros[0], 1, pad, pFile) == pad);
+    ok = (fclose(pFile) == 0) && ok;
+
+    if (ok)
+    {
+        remove(path.c_str());
+        ok = (rename(tempPath.c_str(), path.c_str()) == 0);
+    }
+    if (!ok)
+    {
+        LOG_INFO("Could not write disk cache entry %s", path.c_str());
+        remove(tempPath.c_str());
+        return false;
+    }
+
+    _Trim();
+    return true;
+}
+
+/// Delete the least recently used entries until the directory fits the budget.
+void PanoDiskCache::_Trim()
+{
+    std::vector<DiskEntry> entries;
+    size_t total = 0;
+
+    DIR* dir = opendir(m_directory.c_str());
+    if (dir != NULL)
+    {
+        const size_t extLen = strlen(kExtension);
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != NULL)
+        {
+            const std::string name(ent->d_name);
+            if ((name.size() <= extLen) || (name.compare(name.size() - extLen, extLen, kExtension) != 0))
+                continue;
+
+            DiskEntry entry;
+            entry.path = m_directory + name;
+            struct stat st;
+            if (stat(entry.path.c_str(), &st) != 0)
+                continue;
+            entry.size = (size_t)st.st_size;
+            entry.lastUse = st.st_mtime;
+            entries.push_back(entry);
+            total += entry.size;
+        }
+        closedir(dir);
+    }
+
+    std::sort(entries.begin(), entries.end());
+    unsigned int evictions = 0;
+    for (size_t i=0; (i<entries.size()) && (total > m_budgetBytes); ++i)
+    {
+        if (remove(entries[i].path.c_str()) == 0)
+        {
+            total -= entries[i].size;
+            ++evictions;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.evictions += evictions;
+    m_stats.entries = entries.size() - evictions;
+    m_stats.bytes = total;
+    m_stats.budgetBytes = m_budgetBytes;
+}
+
+CacheTierStats PanoDiskCache::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
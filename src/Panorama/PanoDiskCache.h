@@ -0,0 +1,78 @@
+// PanoDiskCache.h
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include "PanoCache.h"
+
+struct PanoImageData;
+struct PanoLoadParams;
+
+///@brief A read only memory mapping of a file, or of its first bytes.
+class MappedFile
+{
+public:
+    MappedFile();
+    virtual ~MappedFile();
+
+    ///@param maxBytes Map only the start of the file, if nonzero
+    bool Open(const char* pFilename, size_t maxBytes=0);
+    void Close();
+
+    const unsigned char* Data() const { return m_pData; }
+    size_t Size() const { return m_size; }
+
+protected:
+    const unsigned char* m_pData;
+    size_t m_size;
+#ifdef _WIN32
+    void* m_hFile;
+    void* m_hMapping;
+#endif
+
+private: // Disallow copy ctor and assignment operator
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
+///@brief Finished panoramas(every eye's mip chain, in whatever texture format it uploads as)
+/// kept on disk between runs, so a repeat load is a file mapping instead of a decode.
+/// Each entry is one file: a header with the format and per-level offsets, the full key,
+/// then the page aligned levels, which upload straight out of the mapping.
+/// Entries are named by a hash of their key; the key covers the source files' path, mtime and
+/// size plus the load settings, so a stale entry is simply never hit again. Once the directory
+/// outgrows its budget the least recently used entries are deleted.
+class PanoDiskCache
+{
+public:
+    PanoDiskCache(const std::string& directory, size_t budgetBytes);
+    virtual ~PanoDiskCache();
+
+    /// The key of a panorama(from MakePanoCacheKey) as loaded with the given settings.
+    static std::string MakeKey(const std::string& panoKey, const PanoLoadParams& params);
+
+    /// Map a stored panorama.
+    ///@return NULL if there is no valid entry for key
+    std::shared_ptr<PanoImageData> Load(const std::string& key);
+
+    /// Write a panorama's entry, then trim the directory to the budget.
+    bool Store(const std::string& key, const PanoImageData& image);
+
+    CacheTierStats GetStats() const;
+
+protected:
+    std::string _EntryPath(const std::string& key) const;
+    void _Trim();
+
+    std::string m_directory;
+    size_t m_budgetBytes;
+    mutable std::mutex m_mutex;  ///< Guards m_stats
+    CacheTierStats m_stats;
+
+private: // Disallow default, copy ctor and assignment operator
+    PanoDiskCache();
+    PanoDiskCache(const PanoDiskCache&);
+    PanoDiskCache& operator=(const PanoDiskCache&);
+};
@@ -0,0 +1,591 @@
+// PanoLoader.cpp
+
+#include "PanoLoader.h"
+#include "PanoDiskCache.h"
+#include "Logger.h"
+
+#include "ImageDecoder.h"
+#include "HdrConvert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+namespace
+{
+    const int kStripAlign = 64;         ///< Strip widths are multiples of this
+    const int kStripOverlap = 64;       ///< Level 0 columns a strip repeats from each neighbour
+    const int kStripLevels = 7;         ///< Keeps at least one overlap column at the coarsest level
+    const int kStripLevelsBlock = 5;    ///< Keeps the overlap whole 4x4 blocks
+
+    double MillisecondsSince(const std::chrono::steady_clock::time_point& start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /// Pack rows [y0, y0+h) of a float RGB image into one HDR eye.
+    void MakeHdrEye(const float* pData, int width, int y0, int h, bool halfFloat, PanoEyeImage& eye)
+    {
+        const float* pStart = pData + (size_t)3 * width * y0;
+        const size_t pixelCount = (size_t)width * h;
+
+        eye.format = GL_RGB;
+        eye.gpuMipmaps = false;
+        eye.levels.resize(1);
+        MipLevel& level = eye.levels[0];
+        level.width = width;
+        level.height = h;
+        if (halfFloat)
+        {
+            eye.internalFormat = GL_RGB16F;
+            eye.type = GL_HALF_FLOAT;
+            eye.bytesPerPixel = 3 * sizeof(unsigned short);
+            level.pixels.resize(pixelCount * eye.bytesPerPixel);
+            FloatToHalf(pStart, (unsigned short*)&level.pixels[0], pixelCount * 3);
+        }
+        else
+        {
+            eye.internalFormat = GL_RGB9_E5;
+            eye.type = GL_UNSIGNED_INT_5_9_9_9_REV;
+            eye.bytesPerPixel = sizeof(unsigned int);
+            level.pixels.resize(pixelCount * eye.bytesPerPixel);
+            RgbFloatToRgb9e5(pStart, (unsigned int*)&level.pixels[0], pixelCount);
+        }
+    }
+
+    /// Replace an RGB eye's levels by their BC1 blocks.
+    void CompressEye(BlockCompressQuality quality, PanoEyeImage& eye)
+    {
+        BlockCompressParams blockParams;
+        blockParams.quality = quality;
+        double err = 0.0;
+        size_t samples = 0;
+        for (size_t i=0; i<eye.levels.size(); ++i)
+        {
+            MipLevel& level = eye.levels[i];
+            std::vector<unsigned char> blocks(Bc1Size(level.width, level.height));
+            err += CompressBc1(&level.pixels[0], level.width, level.height, blockParams, &blocks[0]);
+            samples += (size_t)level.width * level.height * 3;
+            level.pixels.swap(blocks);
+        }
+        eye.internalFormat = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        eye.blockBytes = kBc1BlockBytes;
+        eye.psnr = (float)Psnr(err, samples);
+
+        LOG_INFO("BC1 compressed %dx%d eye to %.1f MB, PSNR %.2f dB",
+            eye.levels[0].width, eye.levels[0].height,
+            PanoImageData::EyeByteSize(eye) / 1048576.0, eye.psnr);
+    }
+
+    /// Build the mip chain of an 8-bit eye whose level 0 is filled in.
+    void FinishEye(int comps, const PanoLoadParams& params, PanoEyeImage& eye)
+    {
+        eye.internalFormat = comps;
+        eye.format = (comps == 3) ? GL_RGB : GL_LUMINANCE;
+        eye.type = GL_UNSIGNED_BYTE;
+        eye.bytesPerPixel = comps;
+        eye.gpuMipmaps = params.gpuMipmaps;
+
+        std::vector<MipLevel> reduced;
+        if (!params.gpuMipmaps)
+        {
+            MipChainParams mipParams;
+            mipParams.filter = params.mipFilter;
+            BuildMipChain(&eye.levels[0].pixels[0], eye.levels[0].width, eye.levels[0].height, comps, mipParams, reduced);
+        }
+
+        eye.levels.resize(1 + reduced.size());
+        for (size_t i=0; i<reduced.size(); ++i)
+        {
+            eye.levels[i + 1].width = reduced[i].width;
+            eye.levels[i + 1].height = reduced[i].height;
+            eye.levels[i + 1].pixels.swap(reduced[i].pixels);
+        }
+
+        if (params.compressBc1 && (comps == 3) && !params.gpuMipmaps)
+        {
+            CompressEye(params.compressQuality, eye);
+        }
+    }
+
+    ///@brief Writes decoded rows straight into level 0 of the eyes, the top half of an over/under
+    /// image into the left eye and the bottom half into the right, so the whole frame is never
+    /// held in one buffer. Each eye is finished as soon as its last row is in, which with BC1
+    /// compression shrinks it before the next eye's rows start to arrive.
+    class EyeRowTarget : public ImageRowTarget
+    {
+    public:
+        EyeRowTarget(bool overUnder, int eyeIndex, const PanoLoadParams& params, PanoImageData& image)
+        : m_overUnder(overUnder)
+        , m_eyeIndex(eyeIndex)
+        , m_params(params)
+        , m_image(image)
+        , m_width(0)
+        , m_eyeHeight(0)
+        , m_comps(0)
+        {}
+
+        virtual bool Begin(int width, int height, int comps)
+        {
+            m_width = width;
+            m_eyeHeight = m_overUnder ? height / 2 : height;
+            m_comps = comps;
+            for (int e=0; e<2; ++e)
+            {
+                if (m_overUnder || (e == m_eyeIndex))
+                    m_image.eyes[e] = PanoEyeImage();
+            }
+            return m_eyeHeight > 0;
+        }
+
+        virtual void Row(int y, const unsigned char* pRow)
+        {
+            /// The odd last row of an over/under image belongs to neither eye
+            const int e = m_overUnder ? y / m_eyeHeight : m_eyeIndex;
+            const int eyeY = m_overUnder ? y % m_eyeHeight : y;
+            if (e > 1)
+                return;
+
+            PanoEyeImage& eye = m_image.eyes[e];
+            const size_t rowBytes = (size_t)m_width * m_comps;
+            if (eyeY == 0)
+            {
+                eye.levels.resize(1);
+                eye.levels[0].width = m_width;
+                eye.levels[0].height = m_eyeHeight;
+                eye.levels[0].pixels.resize(rowBytes * m_eyeHeight);
+            }
+            memcpy(&eye.levels[0].pixels[eyeY * rowBytes], pRow, rowBytes);
+            if (eyeY + 1 == m_eyeHeight)
+            {
+                FinishEye(m_comps, m_params, eye);
+            }
+        }
+
+    protected:
+        bool m_overUnder;
+        int m_eyeIndex;
+        const PanoLoadParams& m_params;
+        PanoImageData& m_image;
+        int m_width;
+        int m_eyeHeight;
+        int m_comps;
+
+    private: // Disallow default, copy ctor and assignment operator
+        EyeRowTarget();
+        EyeRowTarget(const EyeRowTarget&);
+        EyeRowTarget& operator=(const EyeRowTarget&);
+    };
+
+    /// Load one eye of a pair, or both eyes of an over/under image.
+    bool LoadEyes(const ImageSource& src, bool overUnder, int eyeIndex, int comps,
+                  const PanoLoadParams& params, PanoImageData& image)
+    {
+        /// High dynamic range images keep their radiance, at full size
+        int width  = 0;
+        int height = 0;
+        float* pHdrData = DecodeHdrImage(src, &width, &height);
+        if (pHdrData != NULL)
+        {
+            if (overUnder)
+            {
+                MakeHdrEye(pHdrData, width, 0, height / 2, params.hdrHalfFloat, image.eyes[0]);
+                MakeHdrEye(pHdrData, width, height / 2, height / 2, params.hdrHalfFloat, image.eyes[1]);
+            }
+            else
+            {
+                MakeHdrEye(pHdrData, width, 0, height, params.hdrHalfFloat, image.eyes[eyeIndex]);
+            }
+            free(pHdrData);
+            image.isHdr = true;
+            return true;
+        }
+
+        ImageDecodeRequest req;
+        req.reqComps  = comps;
+        req.maxWidth  = PanoStripLayout::MaxWidth(params.maxTexSize, params.maxStrips);
+        req.maxHeight = overUnder ? 2 * params.maxTexSize : params.maxTexSize; ///< Each half becomes a texture
+
+        EyeRowTarget target(overUnder, eyeIndex, params, image);
+        return DecodeImageRows(src, req, target);
+    }
+} // namespace
+
+size_t PanoImageData::EyeByteSize(const PanoEyeImage& eye)
+{
+    size_t bytes = 0;
+    for (size_t i=0; i<eye.levels.size(); ++i)
+    {
+        bytes += eye.LevelSize(i);
+    }
+    return bytes;
+}
+
+size_t PanoImageData::ByteSize() const
+{
+    return EyeByteSize(eyes[0]) + EyeByteSize(eyes[1]);
+}
+
+PanoStripLayout PanoStripLayout::ForEye(const PanoEyeImage& eye, int maxTexSize)
+{
+    PanoStripLayout strips;
+    if (eye.levels.empty())
+        return strips;
+    strips.width = eye.levels[0].width;
+    strips.coreWidth = strips.width;
+    strips.texWidth = strips.width;
+    strips.numLevels = (int)eye.levels.size();
+    if (eye.gpuMipmaps)
+    {
+        /// The driver builds the rest of the chain, down to 1x1
+        for (int size = std::max(eye.levels[0].width, eye.levels[0].height); size > 1; size >>= 1)
+            ++strips.numLevels;
+    }
+
+    const int maxCore = (maxTexSize & ~(kStripAlign - 1)) - 2 * kStripOverlap;
+    if ((maxTexSize <= 0) || (strips.width <= maxTexSize) || (maxCore <= 0))
+        return strips;
+
+    strips.count = (strips.width + maxCore - 1) / maxCore;
+    const int core = (strips.width + strips.count - 1) / strips.count;
+    strips.coreWidth = (core + kStripAlign - 1) & ~(kStripAlign - 1);
+    strips.overlap = kStripOverlap;
+    strips.texWidth = strips.coreWidth + 2 * strips.overlap;
+    strips.numLevels = std::min(strips.numLevels, (eye.blockBytes != 0) ? kStripLevelsBlock : kStripLevels);
+    return strips;
+}
+
+int PanoStripLayout::MaxWidth(int maxTexSize, int maxStrips)
+{
+    const int maxCore = (maxTexSize & ~(kStripAlign - 1)) - 2 * kStripOverlap;
+    if ((maxTexSize <= 0) || (maxStrips <= 1) || (maxCore <= 0))
+        return maxTexSize;
+    return maxStrips * maxCore;
+}
+
+std::shared_ptr<PanoImageData> LoadPanoImage(const ImageSource& srcL, const ImageSource* pSrcR, const PanoLoadParams& params)
+{
+    std::shared_ptr<PanoImageData> pImage(new PanoImageData());
+    if (pSrcR == NULL)
+    {
+        if (!LoadEyes(srcL, true, 0, 3, params, *pImage))
+            pImage.reset();
+    }
+    else
+    {
+        /// Pairs are loaded as greyscale
+        if (!LoadEyes(srcL, false, 0, 1, params, *pImage) ||
+            !LoadEyes(*pSrcR, false, 1, 1, params, *pImage))
+            pImage.reset();
+    }
+    return pImage;
+}
+
+std::shared_ptr<PanoImageData> LoadPanoImage(const char* pFileL, const char* pFileR, const PanoLoadParams& params)
+{
+    if (pFileL == NULL)
+        return std::shared_ptr<PanoImageData>();
+
+    const ImageSource srcL(pFileL);
+    const ImageSource srcR(pFileR);
+    return LoadPanoImage(srcL, (pFileR != NULL) ? &srcR : NULL, params);
+}
+
+
+PanoLoader::PanoLoader(PanoCache& cache)
+: m_thread()
+, m_mutex()
+, m_wake()
+, m_quit(false)
+, m_params()
+, m_fileL()
+, m_fileR()
+, m_requestKey()
+, m_loadingKey()
+, m_requested(0)
+, m_started(0)
+, m_finished(0)
+, m_pResult()
+, m_prefetchFiles()
+, m_prefetchKeys()
+, m_prefetchFailed()
+, m_prefetchStalled(false)
+, m_cache(cache)
+, m_pDiskCache(NULL)
+{
+    m_thread = std::thread(&PanoLoader::_ThreadMain, this);
+}
+
+PanoLoader::~PanoLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+}
+
+void PanoLoader::SetParams(const PanoLoadParams& params)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_params = params;
+}
+
+void PanoLoader::SetDiskCache(PanoDiskCache* pDiskCache)
+{
+    m_pDiskCache = pDiskCache;
+}
+
+void PanoLoader::Request(const char* pFileL, const char* pFileR)
+{
+    if (pFileL == NULL)
+        return;
+    /// The key stats the files, so work it out before taking the lock the render thread waits on
+    const std::string key = MakePanoCacheKey(pFileL, pFileR);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fileL.assign(pFileL);
+        m_fileR.assign(pFileR != NULL ? pFileR : "");
+        m_requestKey = key;
+        ++m_requested;
+        m_pResult.reset();
+        m_prefetchStalled = false;
+
+        if (m_requestKey.empty())
+        {
+            LOG_INFO("Could not find %s %s", pFileL, (pFileR != NULL) ? pFileR : "");
+            m_started = m_finished = m_requested;
+            return;
+        }
+
+        /// Served from the cache, or by the load already under way
+        std::shared_ptr<PanoImageData> pCached = m_cache.m_images.Find(m_requestKey);
+        if (pCached != NULL)
+        {
+            m_started = m_finished = m_requested;
+            m_pResult = pCached;
+            return;
+        }
+        if (m_loadingKey == m_requestKey)
+        {
+            m_started = m_requested;
+            return;
+        }
+    }
+    m_wake.notify_one();
+}
+
+void PanoLoader::Cancel()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_requestKey.clear();
+    ++m_requested;
+    m_started = m_finished = m_requested;
+    m_pResult.reset();
+}
+
+void PanoLoader::SetPrefetchList(const std::vector<std::string>& files)
+{
+    std::vector<std::string> keys(files.size());
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        keys[i] = MakePanoCacheKey(files[i].c_str(), NULL);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_prefetchFiles = files;
+        m_prefetchKeys.swap(keys);
+        m_prefetchFailed.clear();
+        m_prefetchStalled = false;
+    }
+    m_wake.notify_one();
+}
+
+std::shared_ptr<PanoImageData> PanoLoader::TakeResult()
+{
+    std::shared_ptr<PanoImageData> pResult;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_finished == m_requested)
+        pResult.swap(m_pResult);
+    return pResult;
+}
+
+bool PanoLoader::IsBusy() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return (m_finished != m_requested) || (m_pResult != NULL);
+}
+
+/// The first file of the prefetch list that is neither cached nor known to fail, with its key.
+bool PanoLoader::_NextPrefetch(std::string& file, std::string& key) const
+{
+    if (m_prefetchStalled)
+        return false;
+    for (size_t i=0; i<m_prefetchFiles.size(); ++i)
+    {
+        const std::string& f = m_prefetchFiles[i];
+        const std::string& k = m_prefetchKeys[i];
+        if (m_prefetchFailed.count(f) != 0)
+            continue;
+        if (!k.empty() && (k != m_requestKey) && (k != m_loadingKey) && !m_cache.m_images.Contains(k))
+        {
+            file = f;
+            key = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Read a whole file through the file bytes tier.
+std::shared_ptr<FileBytes> PanoLoader::_ReadFile(const char* pFilename)
+{
+    const std::string key = MakeFileCacheKey(pFilename);
+    if (key.empty())
+        return std::shared_ptr<FileBytes>();
+    std::shared_ptr<FileBytes> pBytes = m_cache.m_fileBytes.Find(key);
+    if (pBytes != NULL)
+        return pBytes;
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    FILE* pFile = fopen(pFilename, "rb");
+    if (pFile == NULL)
+        return pBytes;
+    fseek(pFile, 0, SEEK_END);
+    const long len = ftell(pFile);
+    fseek(pFile, 0, SEEK_SET);
+    if (len > 0)
+    {
+        pBytes.reset(new FileBytes((size_t)len));
+        if (fread(&(*pBytes)[0], 1, (size_t)len, pFile) != (size_t)len)
+            pBytes.reset();
+    }
+    fclose(pFile);
+
+    if (pBytes != NULL)
+    {
+        m_cache.m_fileBytes.Insert(key, pBytes, pBytes->size(), MillisecondsSince(start));
+    }
+    return pBytes;
+}
+
+/// Map a panorama from the disk cache, or else load it from the file bytes tier(from disk
+/// filling that in) and store it in the disk cache.
+///@param pCostMs Receives the time spent mapping, or decoding and building mip chains
+std::shared_ptr<PanoImageData> PanoLoader::_Load(const std::string& fileL, const std::string& fileR, const std::string& key,
+                                                 const PanoLoadParams& params, double* pCostMs)
+{
+    const std::string diskKey = (m_pDiskCache != NULL) ? PanoDiskCache::MakeKey(key, params) : std::string();
+    if (m_pDiskCache != NULL)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::shared_ptr<PanoImageData> pImage = m_pDiskCache->Load(diskKey);
+        if (pImage != NULL)
+        {
+            *pCostMs = MillisecondsSince(start);
+            return pImage;
+        }
+    }
+
+    std::shared_ptr<PanoImageData> pImage;
+    const std::shared_ptr<FileBytes> pBytesL = _ReadFile(fileL.c_str());
+    if ((pBytesL == NULL) || pBytesL->empty())
+        return pImage;
+    std::shared_ptr<FileBytes> pBytesR;
+    if (!fileR.empty())
+    {
+        pBytesR = _ReadFile(fileR.c_str());
+        if ((pBytesR == NULL) || pBytesR->empty())
+            return pImage;
+    }
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const ImageSource srcL(&(*pBytesL)[0], pBytesL->size());
+    if (pBytesR != NULL)
+    {
+        const ImageSource srcR(&(*pBytesR)[0], pBytesR->size());
+        pImage = LoadPanoImage(srcL, &srcR, params);
+    }
+    else
+    {
+        pImage = LoadPanoImage(srcL, NULL, params);
+    }
+    *pCostMs = MillisecondsSince(start);
+
+    if ((pImage != NULL) && (m_pDiskCache != NULL))
+    {
+        m_pDiskCache->Store(diskKey, *pImage);
+    }
+    return pImage;
+}
+
+void PanoLoader::_ThreadMain()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        std::string prefetchFile;
+        std::string prefetchKey;
+        while (!m_quit && (m_started == m_requested) && !_NextPrefetch(prefetchFile, prefetchKey))
+        {
+            m_wake.wait(lock);
+        }
+        if (m_quit)
+            return;
+
+        /// Requests come before prefetching
+        const bool isRequest = (m_started != m_requested);
+        std::string fileL = prefetchFile;
+        std::string fileR;
+        if (isRequest)
+        {
+            fileL = m_fileL;
+            fileR = m_fileR;
+            m_started = m_requested;
+        }
+        const std::string key = isRequest ? m_requestKey : prefetchKey;
+        const PanoLoadParams params = m_params;
+        m_loadingKey = key;
+
+        lock.unlock();
+        LOG_INFO("%s %s %s", isRequest ? "Loading" : "Prefetching", fileL.c_str(), fileR.c_str());
+        double costMs = 0.0;
+        std::shared_ptr<PanoImageData> pImage = _Load(fileL, fileR, key, params, &costMs);
+        if (pImage == NULL)
+        {
+            LOG_INFO("Could not load %s %s", fileL.c_str(), fileR.c_str());
+        }
+        lock.lock();
+        m_loadingKey.clear();
+
+        if (pImage != NULL)
+        {
+            /// Prefetched files may only displace what is less likely to be needed
+            std::set<std::string> keep;
+            keep.insert(m_requestKey);
+            for (size_t i=0; i<m_prefetchFiles.size() && (m_prefetchFiles[i] != fileL); ++i)
+            {
+                keep.insert(m_prefetchKeys[i]);
+            }
+            const bool isWanted = (key == m_requestKey);
+            if (!m_cache.m_images.Insert(key, pImage, pImage->ByteSize(), costMs, isWanted ? NULL : &keep) && !isWanted)
+            {
+                m_prefetchStalled = true;
+            }
+        }
+        else if (!isRequest)
+        {
+            m_prefetchFailed.insert(fileL);
+        }
+
+        /// Superseded loads stay in the cache; a prefetch may be the one asked for meanwhile
+        if ((key == m_requestKey) && (m_finished != m_requested) && (m_started == m_requested))
+        {
+            m_finished = m_requested;
+            m_pResult = pImage;
+        }
+    }
+}
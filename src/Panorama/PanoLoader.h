@@ -0,0 +1,201 @@
+// PanoLoader.h
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <GL/glew.h>
+#include "MipChain.h"
+#include "BlockCompress.h"
+#include "PanoCache.h"
+#include "ImageDecoder.h"
+
+class MappedFile;
+class PanoDiskCache;
+
+///@brief One eye's texture, decoded and with its mip levels built, ready to upload.
+struct PanoEyeImage
+{
+    PanoEyeImage()
+    : internalFormat(0)
+    , format(0)
+    , type(0)
+    , bytesPerPixel(0)
+    , blockBytes(0)
+    , gpuMipmaps(false)
+    , psnr(0.0f)
+    , levels()
+    , mappedLevels()
+    {}
+
+    GLint  internalFormat;
+    GLenum format;
+    GLenum type;
+    int bytesPerPixel;
+    int blockBytes;                ///< Per 4x4 block of a compressed internalFormat, else 0
+    bool gpuMipmaps;               ///< levels holds level 0 only, glGenerateMipmap builds the rest
+    float psnr;                    ///< Of compressed levels against their source, in dB; 0 if uncompressed
+    std::vector<MipLevel> levels;  ///< Level 0 first, rows(or rows of blocks) tightly packed
+
+    /// Set instead of the levels' pixels when they were mapped from the disk cache
+    std::vector<const unsigned char*> mappedLevels;
+
+    const unsigned char* LevelData(size_t i) const { return mappedLevels.empty() ? &levels[i].pixels[0] : mappedLevels[i]; }
+    size_t LevelSize(size_t i) const
+    {
+        return (blockBytes != 0) ?
+            (size_t)((levels[i].width + 3) / 4) * ((levels[i].height + 3) / 4) * blockBytes :
+            (size_t)levels[i].width * levels[i].height * bytesPerPixel;
+    }
+};
+
+///@brief Both eyes of a panorama in CPU memory. Building one makes no GL calls, so it can
+/// happen on any thread; only the upload needs the render thread.
+struct PanoImageData
+{
+    PanoImageData()
+    : isHdr(false)
+    , pMapping()
+    {}
+
+    PanoEyeImage eyes[2];  ///< Left, right
+    bool isHdr;
+    std::shared_ptr<MappedFile> pMapping;  ///< Keeps mappedLevels valid
+
+    size_t ByteSize() const;
+    static size_t EyeByteSize(const PanoEyeImage& eye);
+};
+
+///@brief How an eye wider than GL_MAX_TEXTURE_SIZE splits into vertical strips, each its own
+/// texture showing its own stretch of the cylinder. Every strip repeats overlap columns of its
+/// neighbours on both sides, so filtering and mip sampling at a seam read real texels.
+struct PanoStripLayout
+{
+    PanoStripLayout()
+    : width(0)
+    , count(1)
+    , coreWidth(0)
+    , overlap(0)
+    , texWidth(0)
+    , numLevels(0)
+    {}
+
+    int width;      ///< Of the eye's level 0
+    int count;      ///< 1 if the eye fits in one texture
+    int coreWidth;  ///< Level 0 columns each strip shows; the last strip may show fewer
+    int overlap;    ///< Level 0 columns repeated from each neighbour
+    int texWidth;   ///< coreWidth + 2 * overlap
+    int numLevels;  ///< Mip levels the strips keep; the overlap halves with each
+
+    /// Level 0 column of the eye a strip's texture starts at, wrapping around on x.
+    int TexStart(int strip) const { return strip * coreWidth - overlap; }
+
+    /// Split an eye into as few, equally wide, strips as fit in maxTexSize.
+    static PanoStripLayout ForEye(const PanoEyeImage& eye, int maxTexSize);
+
+    /// Widest eye maxStrips strips of at most maxTexSize can show, 0 for no limit.
+    static int MaxWidth(int maxTexSize, int maxStrips);
+};
+
+///@brief Options for LoadPanoImage, mirroring the PanoramaCylinder members of the same names.
+struct PanoLoadParams
+{
+    PanoLoadParams()
+    : maxTexSize(0)
+    , mipFilter(MipFilterBox)
+    , gpuMipmaps(false)
+    , hdrHalfFloat(false)
+    , compressBc1(false)
+    , compressQuality(BlockCompressFast)
+    , maxStrips(4)
+    {}
+
+    int maxTexSize;  ///< GL_MAX_TEXTURE_SIZE, queried on the render thread; 0 for no limit
+    MipFilter mipFilter;
+    bool gpuMipmaps;
+    bool hdrHalfFloat;
+    bool compressBc1;  ///< Only where EXT_texture_compression_s3tc is supported
+    BlockCompressQuality compressQuality;
+    int maxStrips;     ///< Wider eyes than maxTexSize split into up to this many textures before being reduced
+};
+
+/// Decode a panorama and build its mip chains. Makes no GL calls.
+///@param pSrcR NULL if srcL is in over/under format, else the right image of a pair
+///@return NULL if an image could not be decoded
+std::shared_ptr<PanoImageData> LoadPanoImage(const ImageSource& srcL, const ImageSource* pSrcR, const PanoLoadParams& params);
+std::shared_ptr<PanoImageData> LoadPanoImage(const char* pFileL, const char* pFileR, const PanoLoadParams& params);
+
+///@brief Loads panoramas on a background thread, so reading, decoding and mip building never
+/// stall the render thread. Only the most recent request matters: one that has not started
+/// yet is replaced by the next. Files are read through the cache's file bytes tier and loaded
+/// panoramas go into its image tier; while there is no request to serve the thread prefetches
+/// the files of a prefetch list into them.
+class PanoLoader
+{
+public:
+    PanoLoader(PanoCache& cache);
+    virtual ~PanoLoader();
+
+    void SetParams(const PanoLoadParams& params);
+
+    /// Look finished panoramas up in pDiskCache before decoding, and store them there after.
+    /// Set it before the first request; it must outlive the loader.
+    void SetDiskCache(PanoDiskCache* pDiskCache);
+
+    /// Queue a panorama to load, pFileR NULL for an over/under image. Returns immediately;
+    /// a cached panorama is ready to take right away.
+    void Request(const char* pFileL, const char* pFileR);
+
+    /// Over/under files to prefetch once the request is served, most likely to be needed first.
+    /// Files later in the list never evict earlier ones, nor the requested panorama.
+    void SetPrefetchList(const std::vector<std::string>& files);
+
+    /// Drop the outstanding request, e.g. when its textures turned out to be resident.
+    void Cancel();
+
+    /// Returns the requested panorama once it has loaded and not been taken yet, else NULL.
+    /// Never blocks on a load in progress.
+    std::shared_ptr<PanoImageData> TakeResult();
+
+    /// True from a Request until its result is taken or has failed.
+    bool IsBusy() const;
+
+protected:
+    void _ThreadMain();
+    bool _NextPrefetch(std::string& file, std::string& key) const;
+    std::shared_ptr<FileBytes> _ReadFile(const char* pFilename);
+    std::shared_ptr<PanoImageData> _Load(const std::string& fileL, const std::string& fileR, const std::string& key,
+                                         const PanoLoadParams& params, double* pCostMs);
+
+    std::thread m_thread;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_quit;
+
+    PanoLoadParams m_params;
+    std::string m_fileL;
+    std::string m_fileR;
+    std::string m_requestKey;    ///< Cache key of the requested panorama
+    std::string m_loadingKey;    ///< Key the thread is loading now, or empty
+    unsigned int m_requested;    ///< Serial of the newest request
+    unsigned int m_started;      ///< Serial of the request the thread last picked up
+    unsigned int m_finished;     ///< Serial of the request m_pResult belongs to
+    std::shared_ptr<PanoImageData> m_pResult;
+
+    std::vector<std::string> m_prefetchFiles;
+    std::vector<std::string> m_prefetchKeys;  ///< Cache key of each prefetch file, empty if it was missing
+    std::set<std::string> m_prefetchFailed;  ///< Not retried until the list changes
+    bool m_prefetchStalled;                  ///< The cache has no room for the next file
+
+    PanoCache& m_cache;
+    PanoDiskCache* m_pDiskCache;
+
+private: // Disallow default, copy ctor and assignment operator
+    PanoLoader();
+    PanoLoader(const PanoLoader&);
+    PanoLoader& operator=(const PanoLoader&);
+};
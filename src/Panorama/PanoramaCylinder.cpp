@@ -14,16 +14,98 @@
 #include "GL/ShaderFunctions.h"
 #include "VectorMath.h"
 
-#include "jpgd.h"
-
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
 #include <vector>
 #include <GL/glew.h>
 
+namespace
+{
+    const size_t kStripStagingBytes = 4 * 1024 * 1024;  ///< Largest band of strip rows gathered at once
+
+    void DeleteTextures(std::vector<GLuint>& texs)
+    {
+        if (!texs.empty())
+            glDeleteTextures((GLsizei)texs.size(), &texs[0]);
+        texs.clear();
+    }
+
+    /// Bytes in one row(or row of blocks) of a level of the given width
+    size_t RowUnitBytes(const PanoEyeImage& eye, int width)
+    {
+        return (eye.blockBytes != 0) ?
+            (size_t)((width + 3) / 4) * eye.blockBytes :
+            (size_t)width * eye.bytesPerPixel;
+    }
+
+    /// Copy rows(or rows of blocks) [unit0, unit0+units) of a level of one strip out of
+    /// the eye's level, wrapping around on x.
+    void CopyStripRows(const PanoEyeImage& eye, const PanoStripLayout& strips, int strip, int level,
+                       int unit0, int units, unsigned char* pDst)
+    {
+        const int unitCols = (eye.blockBytes != 0) ? 4 : 1;
+        const size_t colBytes = (eye.blockBytes != 0) ? eye.blockBytes : eye.bytesPerPixel;
+        const int srcCols = (eye.levels[level].width + unitCols - 1) / unitCols;
+        const int dstCols = ((strips.texWidth >> level) + unitCols - 1) / unitCols;
+        const size_t srcRowBytes = srcCols * colBytes;
+
+        /// Strip starts are whole blocks at every level the strips keep
+        const int start = strips.TexStart(strip) / (1 << level) / unitCols;
+        const int x0 = ((start % srcCols) + srcCols) % srcCols;
+        for (int r=0; r<units; ++r)
+        {
+            const unsigned char* pRow = eye.LevelData(level) + (size_t)(unit0 + r) * srcRowBytes;
+            unsigned char* pOut = pDst + (size_t)r * dstCols * colBytes;
+            int x = x0;
+            for (int done=0; done<dstCols; )
+            {
+                const int run = std::min(dstCols - done, srcCols - x);
+                memcpy(pOut + done * colBytes, pRow + x * colBytes, run * colBytes);
+                done += run;
+                x = 0;
+            }
+        }
+    }
+
+    /// Bit per clip plane p lies outside of
+    int ClipOutcode(const float* pMvp, const float3& p)
+    {
+        float clip[4];
+        for (int i=0; i<4; ++i)
+        {
+            clip[i] = pMvp[i] * p.x + pMvp[4 + i] * p.y + pMvp[8 + i] * p.z + pMvp[12 + i];
+        }
+        const float w = clip[3];
+        return ((clip[0] < -w) ? 1 : 0) | ((clip[0] > w) ?  2 : 0) |
+               ((clip[1] < -w) ? 4 : 0) | ((clip[1] > w) ?  8 : 0) |
+               ((clip[2] < -w) ? 16 : 0) | ((clip[2] > w) ? 32 : 0);
+    }
+
+    /// Angle about y panocylinder.vert puts a column of the cylinder with texture coordinate u at
+    float CoveredPhase(float u, float coverage)
+    {
+        return (float)M_PI * (1.0f + coverage * (1.0f - 2.0f * u));
+    }
+
+    /// Whether [lo, hi) overlaps [start, end) once either is shifted by whole turns
+    bool OverlapsWrapped(float lo, float hi, float start, float end)
+    {
+        for (int n=-2; n<=2; ++n)
+        {
+            if ((lo + n < end) && (hi + n > start))
+                return true;
+        }
+        return false;
+    }
+} // namespace
+
 
 ///@param pFilename Filename of the image to load(in over/under format)
 PanoramaCylinder::PanoramaCylinder(const char* pFilename)
-: m_panoTexL(0)
-, m_panoTexR(0)
+: m_panoTexL()
+, m_panoTexR()
 , m_progPanoCylinder(0)
 , m_cylV(0)
 , m_cylT(0)
@@ -34,15 +116,39 @@ PanoramaCylinder::PanoramaCylinder(const char* pFilename)
 , m_numSlices(64)
 , m_cylHeight(5.0f)
 , m_cylRadius(8.0f)
+, m_cylCoverage(1.0f)
 , m_pairTweak(0.016f)
 , m_rollTweak(0.0f)
 , m_manualTexToggle(false)
+, m_isHdr(false)
+, m_hdrHalfFloat(false)
+, m_exposureStops(0.0f)
+, m_tonemap(true)
+, m_mipFilter(MipFilterBox)
+, m_gpuMipmaps(false)
+, m_compressBc1(false)
+, m_compressQuality(BlockCompressFast)
+, m_maxStrips(4)
+, m_textureBytes(0)
 , m_cylinderVerts()
 , m_cylinderTexs()
 , m_cylinderIdxs()
 , m_capVerts()
 , m_capTexs()
 , m_capIdxs()
+, m_pUploadImage()
+, m_uploadEye(2)
+, m_uploadStrip(0)
+, m_uploadLevel(0)
+, m_uploadRow(0)
+, m_uploadStaging()
+, m_coveredVerts()
+, m_coveredVertsCoverage(0.0f)
+, m_cylinderSliceVisible()
+, m_capSliceVisible()
+, m_pVirtualL()
+, m_pVirtualR()
+, m_virtualUploadsPerFrame(0)
 {
     LoadColorTextureFromOverUnderJpeg(pFilename);
 
@@ -56,8 +162,8 @@ PanoramaCylinder::PanoramaCylinder(const char* pFilename)
 ///@param pFileL Filename of the left image to load
 ///@param pFileR Filename of the right image to load
 PanoramaCylinder::PanoramaCylinder(const char* pFileL, const char* pFileR)
-: m_panoTexL(0)
-, m_panoTexR(0)
+: m_panoTexL()
+, m_panoTexR()
 , m_progPanoCylinder(0)
 , m_cylV(0)
 , m_cylT(0)
@@ -68,15 +174,39 @@ PanoramaCylinder::PanoramaCylinder(const char* pFileL, const char* pFileR)
 , m_numSlices(16)
 , m_cylHeight(5.0f)
 , m_cylRadius(8.0f)
+, m_cylCoverage(1.0f)
 , m_pairTweak(0.016f)
 , m_rollTweak(0.0f)
 , m_manualTexToggle(false)
+, m_isHdr(false)
+, m_hdrHalfFloat(false)
+, m_exposureStops(0.0f)
+, m_tonemap(true)
+, m_mipFilter(MipFilterBox)
+, m_gpuMipmaps(false)
+, m_compressBc1(false)
+, m_compressQuality(BlockCompressFast)
+, m_maxStrips(4)
+, m_textureBytes(0)
 , m_cylinderVerts()
 , m_cylinderTexs()
 , m_cylinderIdxs()
 , m_capVerts()
 , m_capTexs()
 , m_capIdxs()
+, m_pUploadImage()
+, m_uploadEye(2)
+, m_uploadStrip(0)
+, m_uploadLevel(0)
+, m_uploadRow(0)
+, m_uploadStaging()
+, m_coveredVerts()
+, m_coveredVertsCoverage(0.0f)
+, m_cylinderSliceVisible()
+, m_capSliceVisible()
+, m_pVirtualL()
+, m_pVirtualR()
+, m_virtualUploadsPerFrame(0)
 {
     LoadColorTextureFromJpegPair(pFileL, pFileR);
 
@@ -86,10 +216,136 @@ PanoramaCylinder::PanoramaCylinder(const char* pFileL, const char* pFileR)
     _InitVBOs();
 }
 
+///@param pImage Decoded panorama, e.g. from a PanoLoader. Its upload is left to ContinueUpload,
+/// to be spread over as many frames as the caller likes.
+///@param pVirtual NULL to upload pImage into textures per eye, else the settings to stream
+/// its tiles from with UpdateView instead
+PanoramaCylinder::PanoramaCylinder(const std::shared_ptr<PanoImageData>& pImage, const VirtualTextureParams* pVirtual)
+: m_panoTexL()
+, m_panoTexR()
+, m_progPanoCylinder(0)
+, m_cylV(0)
+, m_cylT(0)
+, m_cylI(0)
+, m_capV(0)
+, m_capT(0)
+, m_capI(0)
+, m_numSlices(64)
+, m_cylHeight(5.0f)
+, m_cylRadius(8.0f)
+, m_cylCoverage(1.0f)
+, m_pairTweak(0.016f)
+, m_rollTweak(0.0f)
+, m_manualTexToggle(false)
+, m_isHdr(false)
+, m_hdrHalfFloat(false)
+, m_exposureStops(0.0f)
+, m_tonemap(true)
+, m_mipFilter(MipFilterBox)
+, m_gpuMipmaps(false)
+, m_compressBc1(false)
+, m_compressQuality(BlockCompressFast)
+, m_maxStrips(4)
+, m_textureBytes(0)
+, m_cylinderVerts()
+, m_cylinderTexs()
+, m_cylinderIdxs()
+, m_capVerts()
+, m_capTexs()
+, m_capIdxs()
+, m_pUploadImage()
+, m_uploadEye(2)
+, m_uploadStrip(0)
+, m_uploadLevel(0)
+, m_uploadRow(0)
+, m_uploadStaging()
+, m_coveredVerts()
+, m_coveredVertsCoverage(0.0f)
+, m_cylinderSliceVisible()
+, m_capSliceVisible()
+, m_pVirtualL()
+, m_pVirtualR()
+, m_virtualUploadsPerFrame(0)
+{
+    if ((pImage != NULL) && (pVirtual != NULL))
+    {
+        _BeginVirtual(std::make_shared<PanoEyeTileSource>(pImage, 0, pVirtual->tileSize, pVirtual->border),
+                      std::make_shared<PanoEyeTileSource>(pImage, 1, pVirtual->tileSize, pVirtual->border),
+                      *pVirtual);
+    }
+    else if (pImage != NULL)
+    {
+        _BeginUpload(pImage);
+    }
+
+    m_progPanoCylinder = makeShaderByName(IsVirtual() ? "panocylindervt" : "panocylinder");
+    _ConstructCylinderGeometry();
+    _ConstructCapGeometry();
+    _InitVBOs();
+}
+
+///@param pSourceL Tiles of the left eye, e.g. from an .opano file, streamed by UpdateView
+///@param pSourceR Tiles of the right eye
+PanoramaCylinder::PanoramaCylinder(const std::shared_ptr<TileSource>& pSourceL, const std::shared_ptr<TileSource>& pSourceR,
+                                   const VirtualTextureParams& params)
+: m_panoTexL()
+, m_panoTexR()
+, m_progPanoCylinder(0)
+, m_cylV(0)
+, m_cylT(0)
+, m_cylI(0)
+, m_capV(0)
+, m_capT(0)
+, m_capI(0)
+, m_numSlices(64)
+, m_cylHeight(5.0f)
+, m_cylRadius(8.0f)
+, m_cylCoverage(1.0f)
+, m_pairTweak(0.016f)
+, m_rollTweak(0.0f)
+, m_manualTexToggle(false)
+, m_isHdr(false)
+, m_hdrHalfFloat(false)
+, m_exposureStops(0.0f)
+, m_tonemap(true)
+, m_mipFilter(MipFilterBox)
+, m_gpuMipmaps(false)
+, m_compressBc1(false)
+, m_compressQuality(BlockCompressFast)
+, m_maxStrips(4)
+, m_textureBytes(0)
+, m_cylinderVerts()
+, m_cylinderTexs()
+, m_cylinderIdxs()
+, m_capVerts()
+, m_capTexs()
+, m_capIdxs()
+, m_pUploadImage()
+, m_uploadEye(2)
+, m_uploadStrip(0)
+, m_uploadLevel(0)
+, m_uploadRow(0)
+, m_uploadStaging()
+, m_coveredVerts()
+, m_coveredVertsCoverage(0.0f)
+, m_cylinderSliceVisible()
+, m_capSliceVisible()
+, m_pVirtualL()
+, m_pVirtualR()
+, m_virtualUploadsPerFrame(0)
+{
+    _BeginVirtual(pSourceL, pSourceR, params);
+
+    m_progPanoCylinder = makeShaderByName("panocylindervt");
+    _ConstructCylinderGeometry();
+    _ConstructCapGeometry();
+    _InitVBOs();
+}
+
 PanoramaCylinder::~PanoramaCylinder()
 {
-    glDeleteTextures(1, &m_panoTexL);
-    glDeleteTextures(1, &m_panoTexR);
+    DeleteTextures(m_panoTexL);
+    DeleteTextures(m_panoTexR);
     glDeleteProgram(m_progPanoCylinder);
     glDeleteBuffers(1, &m_cylV);
     glDeleteBuffers(1, &m_cylT);
@@ -99,125 +355,412 @@ PanoramaCylinder::~PanoramaCylinder()
     glDeleteBuffers(1, &m_capI);
 }
 
-/// Call gluBuild2DMipmaps to create a texture from half the data buffer(over/under format)
-void UploadBoundTex(int width, int height, int comps, unsigned char* pData, bool isLeft, bool isOverUnder)
+PanoLoadParams PanoramaCylinder::_GetLoadParams() const
+{
+    GLint maxTexSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
+
+    PanoLoadParams params;
+    params.maxTexSize   = maxTexSize;
+    params.mipFilter    = m_mipFilter;
+    params.gpuMipmaps   = m_gpuMipmaps;
+    params.hdrHalfFloat = m_hdrHalfFloat;
+    params.compressBc1  = m_compressBc1 && GLEW_EXT_texture_compression_s3tc;
+    params.compressQuality = m_compressQuality;
+    params.maxStrips    = m_maxStrips;
+    return params;
+}
+
+/// Replace the textures with empty ones sized for pImage, whose levels ContinueUpload then fills in.
+/// An eye wider than GL_MAX_TEXTURE_SIZE gets a texture per strip, clamped on x instead of wrapping.
+void PanoramaCylinder::_BeginUpload(const std::shared_ptr<PanoImageData>& pImage)
+{
+    GLint maxTexSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
+
+    m_textureBytes = 0;
+    for (int e=0; e<2; ++e)
+    {
+        const PanoEyeImage& eye = pImage->eyes[e];
+        const PanoStripLayout strips = PanoStripLayout::ForEye(eye, maxTexSize);
+        const bool split = (strips.count > 1);
+        const bool mipmapped = (strips.numLevels > 1);
+        const int numLevels = std::min(strips.numLevels, (int)eye.levels.size());
+        m_strips[e] = strips;
+
+        std::vector<GLuint>& texs = (e == 0) ? m_panoTexL : m_panoTexR;
+        DeleteTextures(texs);
+        texs.resize(strips.count);
+        glGenTextures(strips.count, &texs[0]);
+        for (int s=0; s<strips.count; ++s)
+        {
+            glBindTexture(GL_TEXTURE_2D, texs[s]);
+            if (split)
+            {
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            }
+            glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+            glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+            if (split || (!eye.gpuMipmaps && !eye.levels.empty()))
+            {
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, std::max(strips.numLevels - 1, 0));
+            }
+
+            /// Allocate every level now; ContinueUpload only fills them in
+            for (int i=0; i<numLevels; ++i)
+            {
+                const int width = split ? (strips.texWidth >> i) : eye.levels[i].width;
+                const int height = eye.levels[i].height;
+                const size_t bytes = RowUnitBytes(eye, width) *
+                    ((eye.blockBytes != 0) ? (height + 3) / 4 : height);
+                if (eye.blockBytes != 0)
+                {
+                    glCompressedTexImage2D(GL_TEXTURE_2D, i, eye.internalFormat,
+                        width, height, 0, (GLsizei)bytes, NULL);
+                }
+                else
+                {
+                    glTexImage2D(GL_TEXTURE_2D, i, eye.internalFormat,
+                        width, height, 0, eye.format, eye.type, NULL);
+                }
+                /// Levels glGenerateMipmap builds add a third to level 0
+                m_textureBytes += eye.gpuMipmaps ? bytes + bytes / 3 : bytes;
+            }
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    m_isHdr = pImage->isHdr;
+    m_pUploadImage = pImage;
+    m_uploadEye = 0;
+    m_uploadStrip = 0;
+    m_uploadLevel = 0;
+    m_uploadRow = 0;
+}
+
+/// Build a virtual texture for each eye, with an atlas to cover the viewport.
+void PanoramaCylinder::_BeginVirtual(const std::shared_ptr<TileSource>& pSourceL, const std::shared_ptr<TileSource>& pSourceR,
+                                     const VirtualTextureParams& params)
 {
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-    GLint numChannels = 1;
-    GLenum format = GL_LUMINANCE;
-    if (comps == 3)
+    GLint maxTexSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
+
+    m_textureBytes = 0;
+    for (int e=0; e<2; ++e)
     {
-        numChannels = 3;
-        format = GL_RGB;
+        const std::shared_ptr<TileSource>& pSource = (e == 0) ? pSourceL : pSourceR;
+        const int slots = VirtualTexture::SlotsForViewport(params.viewportWidth, params.viewportHeight,
+            pSource->Layout(), maxTexSize);
+        std::shared_ptr<VirtualTexture>& pVirtual = (e == 0) ? m_pVirtualL : m_pVirtualR;
+        pVirtual.reset(new VirtualTexture(pSource, slots));
+        m_textureBytes += pVirtual->ByteSize();
     }
+    m_isHdr = pSourceL->Layout().isHdr;
+    m_virtualUploadsPerFrame = params.uploadsPerFrame;
+}
 
-    const unsigned char* pDataStart = pData;
-    if (isOverUnder && !isLeft)
+/// Request the tiles of the faces of a mesh that fall in the view, each at the level
+/// that puts one to two texels on a pixel along its edges.
+///@param pMvp Projection times modelview, column major
+///@param uOffset Added to the texture coordinates, as in the shader
+void PanoramaCylinder::_RequestVisibleTiles(VirtualTexture& vt, const float* pMvp, int viewportWidth, int viewportHeight,
+                                            float uOffset, const std::vector<float3>& verts, const std::vector<float2>& texs,
+                                            const std::vector<unsigned int>& idxs, int vertsPerFace) const
+{
+    const TileLevel& level0 = vt.Layout().levels[0];
+    for (size_t f=0; f+vertsPerFace<=idxs.size(); f+=vertsPerFace)
     {
-        pDataStart += numChannels * width * height / 2;
+        float clip[4][4];
+        int outside[6] = { 0, 0, 0, 0, 0, 0 };
+        float u0 =  1e9f;
+        float u1 = -1e9f;
+        float v0 =  1e9f;
+        float v1 = -1e9f;
+        for (int k=0; k<vertsPerFace; ++k)
+        {
+            const float3& p = verts[idxs[f + k]];
+            for (int i=0; i<4; ++i)
+            {
+                clip[k][i] = pMvp[i] * p.x + pMvp[4 + i] * p.y + pMvp[8 + i] * p.z + pMvp[12 + i];
+            }
+            const float w = clip[k][3];
+            outside[0] += (clip[k][0] < -w);
+            outside[1] += (clip[k][0] >  w);
+            outside[2] += (clip[k][1] < -w);
+            outside[3] += (clip[k][1] >  w);
+            outside[4] += (clip[k][2] < -w);
+            outside[5] += (clip[k][2] >  w);
+
+            const float2& t = texs[idxs[f + k]];
+            u0 = std::min(u0, t.x);
+            u1 = std::max(u1, t.x);
+            v0 = std::min(v0, t.y);
+            v1 = std::max(v1, t.y);
+        }
+        bool culled = false;
+        for (int i=0; i<6; ++i)
+        {
+            culled = culled || (outside[i] == vertsPerFace);
+        }
+        if (culled)
+            continue;
+
+        /// Texels per pixel along each edge in front of the eye
+        float density = 0.0f;
+        for (int k=0; k<vertsPerFace; ++k)
+        {
+            const int n = (k + 1) % vertsPerFace;
+            if ((clip[k][3] <= 1e-4f) || (clip[n][3] <= 1e-4f))
+                continue;
+            const float dx = 0.5f * viewportWidth  * (clip[n][0] / clip[n][3] - clip[k][0] / clip[k][3]);
+            const float dy = 0.5f * viewportHeight * (clip[n][1] / clip[n][3] - clip[k][1] / clip[k][3]);
+            const float pixels = sqrt(dx * dx + dy * dy);
+            const float2& tk = texs[idxs[f + k]];
+            const float2& tn = texs[idxs[f + n]];
+            const float tu = (tn.x - tk.x) * level0.width;
+            const float tv = (tn.y - tk.y) * level0.height;
+            if (pixels > 1e-3f)
+                density = std::max(density, sqrt(tu * tu + tv * tv) / pixels);
+        }
+        if (density <= 0.0f)
+            continue;
+
+        const int level = (int)floor(log(std::max(density, 1.0f)) / log(2.0f));
+        vt.RequestTiles(level, u0 + uOffset, v0, u1 + uOffset, v1);
     }
+}
 
-    GLsizei h = height;
-    if (isOverUnder)
+/// Mark the slices of a mesh with a vertex inside the view frustum, or at least not all
+/// of them beyond the same one of its planes.
+void PanoramaCylinder::_CullSlices(const float* pMvp, const std::vector<float3>& verts,
+                                   const std::vector<unsigned int>& idxs, std::vector<char>& visible) const
+{
+    const size_t slices = m_numSlices;
+    visible.assign(slices, 1);
+    const size_t idxsPerSlice = idxs.size() / slices;
+    for (size_t i=0; i<slices; ++i)
     {
-        h /= 2;
+        int outside = ~0;
+        for (size_t k=i*idxsPerSlice; k<(i + 1)*idxsPerSlice; ++k)
+        {
+            outside &= ClipOutcode(pMvp, verts[idxs[k]]);
+        }
+        visible[i] = (idxsPerSlice == 0) || (outside == 0);
     }
-    gluBuild2DMipmaps(
-        GL_TEXTURE_2D,
-        numChannels,
-        width,
-        h,
-        format,
-        GL_UNSIGNED_BYTE,
-        pDataStart);
 }
 
-/// Load image data from a Jpeg into texture.
-///@param pFilename Filename of the image to load(in over/under Jpeg format)
-void PanoramaCylinder::LoadColorTextureFromOverUnderJpeg(const char* pFilename)
+/// Note which slices the view of one eye takes in, so drawing skips the rest, and in virtual
+/// texture mode work out the tiles it needs and stream missing ones into its atlas.
+/// Call once per eye and frame, before drawing it, with the same view and eye yaw.
+///@param pMvp Projection times modelview, column major as glUniformMatrix4fv takes it
+void PanoramaCylinder::UpdateView(const float* pMvp, int viewportWidth, int viewportHeight,
+                                  bool isLeft, float vEyeYaw)
 {
-    if (pFilename == NULL)
+    _UpdateCoveredVerts();
+    _CullSlices(pMvp, m_coveredVerts, m_cylinderIdxs, m_cylinderSliceVisible);
+    _CullSlices(pMvp, m_capVerts, m_capIdxs, m_capSliceVisible);
+    if (!IsVirtual())
         return;
 
-    int width  = 0;
-    int height = 0;
-    int comps  = 3;
-    unsigned char* pData = jpgd::decompress_jpeg_image_from_file(
-        pFilename,
-        &width,
-        &height,
-        &comps,
-        comps);
+    bool left = isLeft;
+    if (m_manualTexToggle)
+        left = !left;
+    VirtualTexture& vt = left ? *m_pVirtualL : *m_pVirtualR;
 
-    glDeleteTextures(1, &m_panoTexL);
-    glDeleteTextures(1, &m_panoTexR);
+    const float turn = vEyeYaw - floor(vEyeYaw);
+    const float uOffset = turn + (left ? 0.0f : m_pairTweak);
 
-    glGenTextures(1, &m_panoTexL);
-    glBindTexture(GL_TEXTURE_2D, m_panoTexL);
-    UploadBoundTex(width, height, comps, pData, true, true);
+    vt.BeginFrame();
+    _RequestVisibleTiles(vt, pMvp, viewportWidth, viewportHeight, uOffset,
+        m_coveredVerts, m_cylinderTexs, m_cylinderIdxs, 4);
+    _RequestVisibleTiles(vt, pMvp, viewportWidth, viewportHeight, uOffset,
+        m_capVerts, m_capTexs, m_capIdxs, 3);
+    vt.Update(m_virtualUploadsPerFrame);
+}
+
+/// Upload the next rows of the pending image, level by level, strip by strip and eye by eye,
+/// in bands of rows with glTexSubImage2D(or of block rows with glCompressedTexSubImage2D). Through a PboUploadRing each band is copied into the ring's
+/// next buffer and the texture filled from there without stalling; when every buffer is
+/// still in flight the upload simply resumes on the next call. The rows of a strip are
+/// gathered out of the image's wider ones on the way.
+///@param maxBytes Pixel bytes to upload in this call(at least one row), 0 for no limit
+///@param maxMs Start no more bands after this many milliseconds, 0 for no limit
+///@param pRing Buffers to stream through, NULL to upload straight from the image. Even with
+/// no limits a call through a ring returns early once all of its buffers are in flight.
+///@return true once the whole image is uploaded and the textures are ready to draw
+bool PanoramaCylinder::ContinueUpload(size_t maxBytes, double maxMs, PboUploadRing* pRing)
+{
+    if (m_pUploadImage == NULL)
+        return true;
 
-    glGenTextures(1, &m_panoTexR);
-    glBindTexture(GL_TEXTURE_2D, m_panoTexR);
-    UploadBoundTex(width, height, comps, pData, false, true);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    /// Rows of odd-width levels are not 4-byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    size_t sent = 0;
+    while (m_uploadEye < 2)
+    {
+        const PanoEyeImage& eye = m_pUploadImage->eyes[m_uploadEye];
+        const PanoStripLayout& strips = m_strips[m_uploadEye];
+        if (m_uploadStrip >= strips.count)
+        {
+            ++m_uploadEye;
+            m_uploadStrip = 0;
+            m_uploadLevel = 0;
+            m_uploadRow = 0;
+            continue;
+        }
+        glBindTexture(GL_TEXTURE_2D, ((m_uploadEye == 0) ? m_panoTexL : m_panoTexR)[m_uploadStrip]);
+
+        if (m_uploadLevel >= std::min(strips.numLevels, (int)eye.levels.size()))
+        {
+            if (eye.gpuMipmaps && !eye.levels.empty())
+            {
+                glGenerateMipmap(GL_TEXTURE_2D);
+            }
+            ++m_uploadStrip;
+            m_uploadLevel = 0;
+            m_uploadRow = 0;
+            continue;
+        }
+
+        /// Compressed levels go in whole rows of blocks
+        const bool split = (strips.count > 1);
+        const MipLevel& level = eye.levels[m_uploadLevel];
+        const int width = split ? (strips.texWidth >> m_uploadLevel) : level.width;
+        const int unitRows = (eye.blockBytes != 0) ? 4 : 1;
+        const size_t unitBytes = RowUnitBytes(eye, width);
+        const int unit0 = m_uploadRow / unitRows;
+        int units = (level.height - m_uploadRow + unitRows - 1) / unitRows;
+        if (maxBytes != 0)
+        {
+            const size_t budgetUnits = (maxBytes > sent) ? (maxBytes - sent) / unitBytes : 0;
+            units = std::max(1, (int)std::min(budgetUnits, (size_t)units));
+        }
+
+        const unsigned char* pSrc = split ? NULL : eye.LevelData(m_uploadLevel) + unit0 * unitBytes;
+        const bool streamed = (pRing != NULL) && (unitBytes <= pRing->BufferBytes());
+        if (streamed)
+        {
+            units = std::min(units, (int)(pRing->BufferBytes() / unitBytes));
+            unsigned char* pDst = pRing->MapNext(units * unitBytes);
+            if (pDst == NULL)
+                break;
+            if (split)
+                CopyStripRows(eye, strips, m_uploadStrip, m_uploadLevel, unit0, units, pDst);
+            else
+                memcpy(pDst, pSrc, units * unitBytes);
+            if (!pRing->Unmap())
+            {
+                pRing->Submit();
+                break;
+            }
+        }
+        else if (split)
+        {
+            units = std::max(1, std::min(units, (int)(kStripStagingBytes / unitBytes)));
+            m_uploadStaging.resize(units * unitBytes);
+            CopyStripRows(eye, strips, m_uploadStrip, m_uploadLevel, unit0, units, &m_uploadStaging[0]);
+            pSrc = &m_uploadStaging[0];
+        }
+        const unsigned char* pUnpack = streamed ? NULL : pSrc;  ///< Offset 0 in the bound buffer
+
+        const int rows = std::min(units * unitRows, level.height - m_uploadRow);
+        if (eye.blockBytes != 0)
+        {
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, m_uploadLevel, 0, m_uploadRow, width, rows,
+                eye.internalFormat, (GLsizei)(units * unitBytes), pUnpack);
+        }
+        else
+        {
+            glTexSubImage2D(GL_TEXTURE_2D, m_uploadLevel, 0, m_uploadRow, width, rows,
+                eye.format, eye.type, pUnpack);
+        }
+        if (streamed)
+        {
+            pRing->Submit();
+        }
+        sent += units * unitBytes;
 
+        m_uploadRow += rows;
+        if (m_uploadRow >= level.height)
+        {
+            ++m_uploadLevel;
+            m_uploadRow = 0;
+        }
+        if ((maxBytes != 0) && (sent >= maxBytes))
+            break;
+        if ((maxMs > 0.0) && (std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() >= maxMs))
+            break;
+    }
     glBindTexture(GL_TEXTURE_2D, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-    delete [] pData;
+    if (m_uploadEye < 2)
+        return false;
+    m_pUploadImage.reset();
+    std::vector<unsigned char>().swap(m_uploadStaging);
+    return true;
 }
 
-void PanoramaCylinder::LoadColorTextureFromJpegPair(const char* pFileL, const char* pFileR)
+/// Load image data from any format in the decoder registry into texture.
+/// Images wider than the GL texture size limit are split into up to m_maxStrips textures per eye,
+/// and reduced while decoding beyond that.
+///@param pFilename Filename of the image to load(in over/under format)
+void PanoramaCylinder::LoadColorTextureFromOverUnderJpeg(const char* pFilename)
 {
-    if (pFileL == NULL)
+    const std::shared_ptr<PanoImageData> pImage = LoadPanoImage(pFilename, NULL, _GetLoadParams());
+    if (pImage == NULL)
         return;
+
+    _BeginUpload(pImage);
+    ContinueUpload(0);
+}
+
+void PanoramaCylinder::LoadColorTextureFromJpegPair(const char* pFileL, const char* pFileR)
+{
     if (pFileR == NULL)
         return;
 
-    {
-        int width  = 0;
-        int height = 0;
-        int comps  = 1;
-        unsigned char* pData = jpgd::decompress_jpeg_image_from_file(
-            pFileL,
-            &width,
-            &height,
-            &comps,
-            comps);
-
-        glDeleteTextures(1, &m_panoTexL);
-
-        glGenTextures(1, &m_panoTexL);
-        glBindTexture(GL_TEXTURE_2D, m_panoTexL);
-        UploadBoundTex(width, height, comps, pData, true, false);
-        delete [] pData;
-    }
+    const std::shared_ptr<PanoImageData> pImage = LoadPanoImage(pFileL, pFileR, _GetLoadParams());
+    if (pImage == NULL)
+        return;
 
+    _BeginUpload(pImage);
+    ContinueUpload(0);
+}
+
+/// Bring m_coveredVerts up to date with the mesh and m_cylCoverage, for work on the CPU that
+/// needs the cylinder where it is drawn: a sin and cos per column of the mesh.
+void PanoramaCylinder::_UpdateCoveredVerts()
+{
+    if ((m_coveredVerts.size() == m_cylinderVerts.size()) && (m_coveredVertsCoverage == m_cylCoverage))
+        return;
+
+    const size_t rows = m_cylinderVerts.size() / (m_numSlices + 1);
+    m_coveredVerts.resize(m_cylinderVerts.size());
+    for (size_t i=0; i<m_cylinderVerts.size(); i+=rows)
     {
-        int width  = 0;
-        int height = 0;
-        int comps  = 1;
-        unsigned char* pData = jpgd::decompress_jpeg_image_from_file(
-            pFileR,
-            &width,
-            &height,
-            &comps,
-            comps);
-
-        glDeleteTextures(1, &m_panoTexR);
-        glGenTextures(1, &m_panoTexR);
-        glBindTexture(GL_TEXTURE_2D, m_panoTexR);
-        UploadBoundTex(width, height, comps, pData, false, false);
-        delete [] pData;
+        const float phase = CoveredPhase(m_cylinderTexs[i].x, m_cylCoverage);
+        const float s = sin(phase);
+        const float c = cos(phase);
+        for (size_t j=0; j<rows; ++j)
+        {
+            /// Every column has the radii of the first
+            const float3& p = m_cylinderVerts[j];
+            const float radius = sqrt(p.x * p.x + p.z * p.z);
+            const float3 q = { radius * s, m_cylinderVerts[i + j].y, radius * c };
+            m_coveredVerts[i + j] = q;
+        }
     }
-
-    glBindTexture(GL_TEXTURE_2D, 0);
+    m_coveredVertsCoverage = m_cylCoverage;
 }
 
-/// Form a cylindrical strip of quads, 4 verts per face.
-void PanoramaCylinder::_ConstructCylinderGeometry(float coverage)
+/// Form a cylindrical strip of quads, 4 verts per face, around the full circle. The vertex
+/// shader spreads its columns over the m_cylCoverage part of the circle instead, so changing
+/// that needs no new mesh.
+void PanoramaCylinder::_ConstructCylinderGeometry()
 {
     std::vector<float3>&       verts = m_cylinderVerts;
     std::vector<float2>&       cols  = m_cylinderTexs;
@@ -227,13 +770,12 @@ void PanoramaCylinder::_ConstructCylinderGeometry(float coverage)
     const int stacks = 32;
     const float height = m_cylHeight;
     const float radius = m_cylRadius;
+    m_coveredVerts.clear();
 
     for (int i=0; i<=slices; ++i)
     {
-        float phase = coverage * 2.0f * (float)M_PI * (float)i / (float)slices;
-        /// Align seam directly to the back
-        phase -= 0.5f * coverage * 2.0f * (float)M_PI;
-        phase += (float)M_PI;
+        /// Seam directly to the back
+        const float phase = 2.0f * (float)M_PI * (float)i / (float)slices;
 
         /// y is up, center at origin
         float3 xzvec = {
@@ -338,6 +880,64 @@ void PanoramaCylinder::_ConstructCapGeometry()
     }
 }
 
+/// Draw a mesh strip by strip, each strip's texture on the slices that show some of it, in
+/// runs of consecutive slices. Slices UpdateView found outside the view are skipped, and so
+/// are strips none of whose slices are left. The mesh's slices follow one another from u = 1
+/// down to u = 0, with the same number of indices each.
+///@param uOffset Added to the texture coordinates, as in the shader
+void PanoramaCylinder::_DrawStrips(GLenum mode, const std::vector<unsigned int>& idxs, const std::vector<char>& visible,
+                                   bool left, float uOffset) const
+{
+    const int slices = m_numSlices;
+    const size_t idxsPerSlice = idxs.size() / slices;
+    if (idxsPerSlice == 0)
+        return;
+    const bool culled = (visible.size() == (size_t)slices);
+
+    const PanoStripLayout& strips = m_strips[left ? 0 : 1];
+    const std::vector<GLuint>& texs = left ? m_panoTexL : m_panoTexR;
+    const int numStrips = IsVirtual() ? 1 : std::max(1, (int)texs.size());
+    for (int s=0; s<numStrips; ++s)
+    {
+        float uStart = 0.0f;
+        float uEnd = 1.0f;
+        if (!IsVirtual())
+        {
+            if (strips.count > 1)
+            {
+                uStart = (float)(s * strips.coreWidth) / strips.width;
+                uEnd = std::min(1.0f, (float)((s + 1) * strips.coreWidth) / strips.width);
+                glUniform4f(getUniLoc(m_progPanoCylinder, "stripRange"), uStart, uEnd,
+                    (float)strips.width / strips.texWidth, -(float)strips.TexStart(s) / strips.texWidth);
+            }
+            glUniform1f(getUniLoc(m_progPanoCylinder, "numStrips"), (float)strips.count);
+            glBindTexture(GL_TEXTURE_2D, texs.empty() ? 0 : texs[s]);
+        }
+
+        int runStart = -1;
+        for (int i=0; i<=slices; ++i)
+        {
+            bool drawn = false;
+            if (i < slices)
+            {
+                const float u0 = 1.0f - (float)(i + 1) / slices + uOffset;
+                const float u1 = 1.0f - (float)i / slices + uOffset;
+                drawn = (!culled || visible[i]) && OverlapsWrapped(u0, u1, uStart, uEnd);
+            }
+            if (drawn && (runStart < 0))
+            {
+                runStart = i;
+            }
+            else if (!drawn && (runStart >= 0))
+            {
+                glDrawElements(mode, (GLsizei)((i - runStart) * idxsPerSlice), GL_UNSIGNED_INT,
+                               &idxs[runStart * idxsPerSlice]);
+                runStart = -1;
+            }
+        }
+    }
+}
+
 ///@param isLeft Set to true if rendering for left eye, false for right eye
 void PanoramaCylinder::DrawPanoramaGeometry(bool isLeft, float vMove, float vEyeYaw) const
 {
@@ -359,9 +959,15 @@ void PanoramaCylinder::DrawPanoramaGeometry(bool isLeft, float vMove, float vEye
     if (m_manualTexToggle)
         left = !left;
 
-    glActiveTexture(0);
-    glBindTexture(GL_TEXTURE_2D, left ? m_panoTexL : m_panoTexR);
-    glUniform1i(getUniLoc(m_progPanoCylinder, "texImage"), 0);
+    if (IsVirtual())
+    {
+        (left ? m_pVirtualL : m_pVirtualR)->Bind(m_progPanoCylinder, 0, 1);
+    }
+    else
+    {
+        glActiveTexture(0);
+        glUniform1i(getUniLoc(m_progPanoCylinder, "texImage"), 0);
+    }
 
     glUniform2f(getUniLoc(m_progPanoCylinder, "texOff"),
         left? 0 : m_pairTweak,
@@ -375,11 +981,17 @@ void PanoramaCylinder::DrawPanoramaGeometry(bool isLeft, float vMove, float vEye
 
     glUniform1f(getUniLoc(m_progPanoCylinder, "vEyeYaw"), vEyeYaw );
 
+    /// LDR textures are displayed as they are
+    glUniform1f(getUniLoc(m_progPanoCylinder, "exposure"), pow(2.0f, m_exposureStops) );
+    glUniform1f(getUniLoc(m_progPanoCylinder, "hdrMode"),
+        !m_isHdr ? 0.0f : (m_tonemap ? 2.0f : 1.0f) );
+
+    const float turn = vEyeYaw - floor(vEyeYaw);
+    const float uOffset = turn + (left ? 0.0f : m_pairTweak);
+
+    glUniform1f(getUniLoc(m_progPanoCylinder, "coverage"), m_cylCoverage);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glDrawElements(GL_QUADS,
-                   m_cylinderIdxs.size(),
-                   GL_UNSIGNED_INT,
-                   &m_cylinderIdxs[0]);
+    _DrawStrips(GL_QUADS, m_cylinderIdxs, m_cylinderSliceVisible, left, uOffset);
 
     if (!m_capVerts.empty())
     {
@@ -387,12 +999,18 @@ void PanoramaCylinder::DrawPanoramaGeometry(bool isLeft, float vMove, float vEye
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
         glBindBuffer(GL_ARRAY_BUFFER, m_capT);
         glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
-        glDrawElements(GL_TRIANGLES,
-                       m_capIdxs.size(),
-                       GL_UNSIGNED_INT,
-                       &m_capIdxs[0]);
+        /// The caps always span the full circle
+        glUniform1f(getUniLoc(m_progPanoCylinder, "coverage"), 1.0f);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        _DrawStrips(GL_TRIANGLES, m_capIdxs, m_capSliceVisible, left, uOffset);
     }
 
+    if (IsVirtual())
+    {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glActiveTexture(GL_TEXTURE0);
+    }
     glBindTexture(GL_TEXTURE_2D, 0);
     glDisableVertexAttribArray(0);
     glDisableVertexAttribArray(1);
@@ -6,6 +6,10 @@
 #include <vector>
 #include <GL/glew.h>
 #include "vectortypes.h"
+#include "MipChain.h"
+#include "PanoLoader.h"
+#include "PboUploadRing.h"
+#include "VirtualTexture.h"
 
 ///@brief Constructs and draws a textured cylinder along the y axis centered on the origin.
 /// Texture coordinates wrap on x and vary from [0,0.5] along y.
@@ -16,15 +20,24 @@ class PanoramaCylinder
 public:
     PanoramaCylinder(const char* pFilename);
     PanoramaCylinder(const char* pFileL, const char* pFileR);
+    PanoramaCylinder(const std::shared_ptr<PanoImageData>& pImage, const VirtualTextureParams* pVirtual=NULL);
+    PanoramaCylinder(const std::shared_ptr<TileSource>& pSourceL, const std::shared_ptr<TileSource>& pSourceR,
+                     const VirtualTextureParams& params);
     virtual ~PanoramaCylinder();
     
     virtual void LoadColorTextureFromOverUnderJpeg(const char* pFilename);
     virtual void LoadColorTextureFromJpegPair(const char* pFileL, const char* pFileR);
+    virtual bool ContinueUpload(size_t maxBytes, double maxMs=0.0, PboUploadRing* pRing=NULL);
+    bool IsUploaded() const { return m_pUploadImage == NULL; }
+    bool IsVirtual() const { return m_pVirtualL != NULL; }
+    virtual void UpdateView(const float* pMvp, int viewportWidth, int viewportHeight,
+                            bool isLeft=true, float vEyeYaw=0.0f);
     virtual void DrawPanoramaGeometry(bool isLeft=true, float vMove=0.0f, float vEyeYaw=0.0f) const;
 
 public:
-    GLuint m_panoTexL;
-    GLuint m_panoTexR;
+    std::vector<GLuint> m_panoTexL;  ///< One per strip, a single texture unless the eye is wider than GL_MAX_TEXTURE_SIZE
+    std::vector<GLuint> m_panoTexR;
+    PanoStripLayout m_strips[2];     ///< Of the left and right eye
     GLuint m_progPanoCylinder;
     GLuint m_cylV;
     GLuint m_cylT;
@@ -36,9 +49,20 @@ public:
     unsigned int m_numSlices;
     float m_cylHeight;
     float m_cylRadius;
+    float m_cylCoverage;    ///< Fraction of the circle the image spans, applied by the vertex shader
     float m_pairTweak;
     float m_rollTweak;
     bool  m_manualTexToggle;
+    bool  m_isHdr;          ///< Textures hold linear radiance, exposed and tonemapped in the shader
+    bool  m_hdrHalfFloat;   ///< Upload HDR images as GL_RGB16F(6 bytes/pixel) instead of GL_RGB9_E5(4 bytes/pixel)
+    float m_exposureStops;
+    bool  m_tonemap;
+    MipFilter m_mipFilter;  ///< Filter for the CPU built mip levels of 8-bit images
+    bool  m_gpuMipmaps;     ///< Let glGenerateMipmap build the mip levels instead
+    bool  m_compressBc1;    ///< Compress 8-bit RGB levels to BC1 blocks on the CPU, 4 bits/pixel
+    BlockCompressQuality m_compressQuality;
+    int   m_maxStrips;      ///< Split eyes wider than GL_MAX_TEXTURE_SIZE into up to this many textures before reducing them
+    size_t m_textureBytes;  ///< GPU memory taken by both eyes' textures
 
     std::vector<float3>       m_cylinderVerts;
     std::vector<float2>       m_cylinderTexs;
@@ -49,11 +73,40 @@ public:
     std::vector<unsigned int> m_capIdxs;
 
 protected:
-    void _ConstructCylinderGeometry(float coverage = 1.0f);
+    PanoLoadParams _GetLoadParams() const;
+    void _BeginUpload(const std::shared_ptr<PanoImageData>& pImage);
+    void _BeginVirtual(const std::shared_ptr<TileSource>& pSourceL, const std::shared_ptr<TileSource>& pSourceR,
+                       const VirtualTextureParams& params);
+    void _RequestVisibleTiles(VirtualTexture& vt, const float* pMvp, int viewportWidth, int viewportHeight,
+                              float uOffset, const std::vector<float3>& verts, const std::vector<float2>& texs,
+                              const std::vector<unsigned int>& idxs, int vertsPerFace) const;
+    void _CullSlices(const float* pMvp, const std::vector<float3>& verts, const std::vector<unsigned int>& idxs,
+                     std::vector<char>& visible) const;
+    void _DrawStrips(GLenum mode, const std::vector<unsigned int>& idxs, const std::vector<char>& visible,
+                     bool left, float uOffset) const;
+    void _UpdateCoveredVerts();
+    void _ConstructCylinderGeometry();
     void _ConstructCapGeometry();
     void _InitVBOs();
     void _UpdateVBOs();
 
+    std::shared_ptr<PanoImageData> m_pUploadImage; ///< Held until all of it is uploaded
+    int m_uploadEye;
+    int m_uploadStrip;
+    int m_uploadLevel;
+    int m_uploadRow;
+    std::vector<unsigned char> m_uploadStaging;  ///< Rows of a strip, gathered when there is no ring to gather them in
+
+    std::vector<float3> m_coveredVerts;  ///< m_cylinderVerts where the vertex shader puts them at m_coveredVertsCoverage
+    float m_coveredVertsCoverage;
+
+    std::vector<char> m_cylinderSliceVisible;  ///< Per slice, as of the last UpdateView; empty to draw them all
+    std::vector<char> m_capSliceVisible;
+
+    std::shared_ptr<VirtualTexture> m_pVirtualL; ///< Set in virtual texture mode, in place of m_panoTexL/R
+    std::shared_ptr<VirtualTexture> m_pVirtualR;
+    int m_virtualUploadsPerFrame;
+
 private: // Disallow default, copy ctor and assignment operator
     PanoramaCylinder();
     PanoramaCylinder(const PanoramaCylinder&);
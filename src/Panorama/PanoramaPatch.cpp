@@ -5,16 +5,27 @@
 ///@param pFilename Filename of the image to load(in over/under format)
 PanoramaPatch::PanoramaPatch(const char* pFilename)
  : PanoramaCylinder(pFilename)
- , m_cylCoverage(1.0f)
 {
-    _ConstructPatchGeometry();
 }
 
 PanoramaPatch::PanoramaPatch(const char* pFileL, const char* pFileR)
  : PanoramaCylinder(pFileL, pFileR)
- , m_cylCoverage(1.0f)
 {
-    _ConstructPatchGeometry();
+}
+
+///@param pImage Decoded panorama, uploaded by ContinueUpload
+///@param pVirtual Settings to stream pImage as a virtual texture instead, or NULL
+PanoramaPatch::PanoramaPatch(const std::shared_ptr<PanoImageData>& pImage, const VirtualTextureParams* pVirtual)
+ : PanoramaCylinder(pImage, pVirtual)
+{
+}
+
+///@param pSourceL Tiles of the left eye, streamed by UpdateView
+///@param pSourceR Tiles of the right eye
+PanoramaPatch::PanoramaPatch(const std::shared_ptr<TileSource>& pSourceL, const std::shared_ptr<TileSource>& pSourceR,
+                             const VirtualTextureParams& params)
+ : PanoramaCylinder(pSourceL, pSourceR, params)
+{
 }
 
 PanoramaPatch::~PanoramaPatch()
@@ -27,26 +38,42 @@ void PanoramaPatch::DrawPanoramaGeometry(bool isLeft, float vMove, float vEyeYaw
     PanoramaCylinder::DrawPanoramaGeometry(isLeft, vMove, vEyeYaw);
 }
 
+/// Rebuild the meshes, e.g. for a new cylinder height.
 void PanoramaPatch::_ConstructPatchGeometry()
 {
     m_cylinderVerts.clear();
     m_cylinderTexs.clear();
     m_cylinderIdxs.clear();
+    m_capVerts.clear();
+    m_capTexs.clear();
+    m_capIdxs.clear();
 
-    _ConstructCylinderGeometry(m_cylCoverage);
+    _ConstructCylinderGeometry();
+    _ConstructCapGeometry();
     _UpdateVBOs();
 }
 
+/// Coverage is a vertex shader uniform, so changing it costs no rebuild or upload.
 void PanoramaPatch::IncreaseCoverage()
 {
     m_cylCoverage *= 1.1f;
     m_cylCoverage = std::min(m_cylCoverage, 1.0f);
-    _ConstructPatchGeometry();
 }
 
 void PanoramaPatch::DecreaseCoverage()
 {
     m_cylCoverage /= 1.1f;
     m_cylCoverage = std::max(m_cylCoverage, 0.125f);
+}
+
+/// Show the image as its file describes, e.g. from the projection of an .opano file.
+///@param cylHeight Half height of the cylinder
+///@param coverage Fraction of the full circle the image spans
+///@param pairTweak Texture coordinate offset of the right eye
+void PanoramaPatch::SetProjection(float cylHeight, float coverage, float pairTweak)
+{
+    m_cylHeight = cylHeight;
+    m_cylCoverage = std::min(std::max(coverage, 0.125f), 1.0f);
+    m_pairTweak = pairTweak;
     _ConstructPatchGeometry();
 }
@@ -13,18 +13,20 @@ class PanoramaPatch : public PanoramaCylinder
 public:
     PanoramaPatch(const char* pFilename);
     PanoramaPatch(const char* pFileL, const char* pFileR);
+    PanoramaPatch(const std::shared_ptr<PanoImageData>& pImage, const VirtualTextureParams* pVirtual=NULL);
+    PanoramaPatch(const std::shared_ptr<TileSource>& pSourceL, const std::shared_ptr<TileSource>& pSourceR,
+                  const VirtualTextureParams& params);
     virtual ~PanoramaPatch();
     
     virtual void DrawPanoramaGeometry(bool isLeft=true, float vMove=0.0f, float vEyeYaw=0.0f) const;
 
     virtual void IncreaseCoverage();
     virtual void DecreaseCoverage();
+    virtual void SetProjection(float cylHeight, float coverage, float pairTweak);
 
 protected:
     void _ConstructPatchGeometry();
 
-    float m_cylCoverage;
-
 private: // Disallow default, copy ctor and assignment operator
     PanoramaPatch();
     PanoramaPatch(const PanoramaPatch&);
@@ -0,0 +1,95 @@
+// PboUploadRing.cpp
+
+#ifdef _WIN32
+#  define WINDOWS_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#endif
+
+#include "PboUploadRing.h"
+
+///@param numBuffers Chunks that may be in flight at once
+///@param bufferBytes Largest chunk
+PboUploadRing::PboUploadRing(int numBuffers, size_t bufferBytes)
+: m_numBuffers(numBuffers)
+, m_bufferBytes(bufferBytes)
+, m_buffers()
+, m_fences()
+, m_next(0)
+{
+    _Init();
+}
+
+PboUploadRing::~PboUploadRing()
+{
+    for (size_t i=0; i<m_fences.size(); ++i)
+    {
+        if (m_fences[i] != NULL)
+            glDeleteSync(m_fences[i]);
+    }
+    if (!m_buffers.empty())
+    {
+        glDeleteBuffers((GLsizei)m_buffers.size(), &m_buffers[0]);
+    }
+}
+
+bool PboUploadRing::IsSupported()
+{
+    return (GLEW_VERSION_2_1 || GLEW_ARB_pixel_buffer_object) &&
+           (GLEW_VERSION_3_0 || GLEW_ARB_map_buffer_range) &&
+           (GLEW_VERSION_3_2 || GLEW_ARB_sync);
+}
+
+void PboUploadRing::_Init()
+{
+    if (!IsSupported() || (m_numBuffers < 1))
+        return;
+
+    m_buffers.resize(m_numBuffers, 0);
+    m_fences.resize(m_numBuffers, NULL);
+    glGenBuffers(m_numBuffers, &m_buffers[0]);
+    for (int i=0; i<m_numBuffers; ++i)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffers[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, m_bufferBytes, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+unsigned char* PboUploadRing::MapNext(size_t bytes)
+{
+    if (m_buffers.empty() || (bytes == 0) || (bytes > m_bufferBytes))
+        return NULL;
+
+    GLsync& fence = m_fences[m_next];
+    if (fence != NULL)
+    {
+        const GLenum status = glClientWaitSync(fence, 0, 0);
+        if ((status != GL_ALREADY_SIGNALED) && (status != GL_CONDITION_SATISFIED))
+            return NULL;
+        glDeleteSync(fence);
+        fence = NULL;
+    }
+
+    /// The fence says the GPU is done with it, so no implicit sync either
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffers[m_next]);
+    void* p = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (p == NULL)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    return (unsigned char*)p;
+}
+
+bool PboUploadRing::Unmap()
+{
+    return glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+}
+
+void PboUploadRing::Submit()
+{
+    m_fences[m_next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    m_next = (m_next + 1) % m_numBuffers;
+}
@@ -0,0 +1,49 @@
+// PboUploadRing.h
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include <GL/glew.h>
+
+///@brief A ring of pixel unpack buffers to stream texture uploads through. Each chunk is copied
+/// into the next buffer and read by glTexSubImage2D from there, so the driver copies it to the
+/// texture asynchronously instead of blocking the frame. A fence after each chunk tells when
+/// its buffer may be written again; a buffer still in flight is never waited for.
+/// Create and destroy it with a current context.
+class PboUploadRing
+{
+public:
+    PboUploadRing(int numBuffers, size_t bufferBytes);
+    virtual ~PboUploadRing();
+
+    /// True if the context has pixel buffer objects, mapped ranges and fences.
+    static bool IsSupported();
+
+    size_t BufferBytes() const { return m_bufferBytes; }
+
+    /// Bind the next buffer to GL_PIXEL_UNPACK_BUFFER and map its first bytes for writing.
+    ///@return NULL if that buffer is still being read, in which case nothing is bound
+    unsigned char* MapNext(size_t bytes);
+
+    /// Unmap the buffer from MapNext, leaving it bound for the uploads that read it(at offset 0).
+    ///@return false if its contents were lost and must be written again
+    bool Unmap();
+
+    /// Fence the uploads issued since Unmap, unbind the buffer and move on to the next one.
+    void Submit();
+
+protected:
+    void _Init();
+
+    int m_numBuffers;
+    size_t m_bufferBytes;
+    std::vector<GLuint> m_buffers;
+    std::vector<GLsync> m_fences;  ///< Set while a buffer's uploads may still read it
+    int m_next;
+
+private: // Disallow default, copy ctor and assignment operator
+    PboUploadRing();
+    PboUploadRing(const PboUploadRing&);
+    PboUploadRing& operator=(const PboUploadRing&);
+};
@@ -0,0 +1,420 @@
+// VirtualTexture.cpp
+
+#ifdef _WIN32
+#  define WINDOWS_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#endif
+
+#include "VirtualTexture.h"
+#include "PanoLoader.h"
+#include "GL/ShaderFunctions.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+namespace
+{
+    const int kMaxLevels = 16; ///< Size of the level arrays in panocylindervt.frag
+
+    int WrapIndex(int i, int n)
+    {
+        return ((i % n) + n) % n;
+    }
+} // namespace
+
+size_t TileLayout::TileBytes() const
+{
+    const int unit = (blockBytes != 0) ? 4 : 1;
+    const size_t units = (size_t)(SlotSize() / unit);
+    return units * units * ((blockBytes != 0) ? blockBytes : bytesPerPixel);
+}
+
+
+///@param eye 0 for left, 1 for right
+PanoEyeTileSource::PanoEyeTileSource(const std::shared_ptr<PanoImageData>& pImage, int eye, int tileSize, int border)
+: m_pImage(pImage)
+, m_eye(eye)
+, m_layout()
+{
+    const PanoEyeImage& src = m_pImage->eyes[m_eye];
+    m_layout.internalFormat = src.internalFormat;
+    m_layout.format = src.format;
+    m_layout.type = src.type;
+    m_layout.bytesPerPixel = src.bytesPerPixel;
+    m_layout.blockBytes = src.blockBytes;
+    m_layout.isHdr = m_pImage->isHdr;
+    m_layout.tileSize = tileSize;
+    m_layout.border = border;
+    for (size_t i=0; i<src.levels.size(); ++i)
+    {
+        TileLevel level;
+        level.width = src.levels[i].width;
+        level.height = src.levels[i].height;
+        level.tilesX = (level.width + tileSize - 1) / tileSize;
+        level.tilesY = (level.height + tileSize - 1) / tileSize;
+        m_layout.levels.push_back(level);
+    }
+}
+
+/// Copy the tile and its border out of the level, in whole blocks for compressed levels.
+bool PanoEyeTileSource::ReadTile(int level, int tileX, int tileY, unsigned char* pDst)
+{
+    const PanoEyeImage& src = m_pImage->eyes[m_eye];
+    if ((level < 0) || (level >= (int)src.levels.size()))
+        return false;
+
+    const int unit = (m_layout.blockBytes != 0) ? 4 : 1;
+    const size_t unitBytes = (m_layout.blockBytes != 0) ? m_layout.blockBytes : m_layout.bytesPerPixel;
+    const int levelUnitsX = (src.levels[level].width + unit - 1) / unit;
+    const int levelUnitsY = (src.levels[level].height + unit - 1) / unit;
+    const int slotUnits = m_layout.SlotSize() / unit;
+    const int x0 = (tileX * m_layout.tileSize - m_layout.border) / unit;
+    const int y0 = (tileY * m_layout.tileSize - m_layout.border) / unit;
+    const unsigned char* pLevel = src.LevelData(level);
+
+    for (int uy=0; uy<slotUnits; ++uy)
+    {
+        const int sy = std::min(levelUnitsY - 1, std::max(0, y0 + uy));
+        const unsigned char* pRow = pLevel + (size_t)sy * levelUnitsX * unitBytes;
+        unsigned char* pDstRow = pDst + (size_t)uy * slotUnits * unitBytes;
+
+        /// Runs up to the right edge, which wraps around to the left
+        int ux = 0;
+        while (ux < slotUnits)
+        {
+            const int sx = WrapIndex(x0 + ux, levelUnitsX);
+            const int run = std::min(slotUnits - ux, levelUnitsX - sx);
+            memcpy(pDstRow + ux * unitBytes, pRow + sx * unitBytes, run * unitBytes);
+            ux += run;
+        }
+    }
+    return true;
+}
+
+
+VirtualTexture::VirtualTexture(const std::shared_ptr<TileSource>& pSource, int slotsPerSide)
+: m_pSource(pSource)
+, m_slotsPerSide(std::min(255, std::max(1, slotsPerSide)))
+, m_maxLevel(0)
+, m_atlasTex(0)
+, m_indirectionTex(0)
+, m_indirectionWidth(0)
+, m_indirectionHeight(0)
+, m_levelOrigins()
+, m_indirection()
+, m_indirectionDirty(false)
+, m_slots()
+, m_resident()
+, m_missing()
+, m_staging()
+, m_frame(0)
+{
+    const TileLayout& layout = Layout();
+    if (layout.levels.empty())
+        return;
+
+    m_maxLevel = std::min((int)layout.levels.size(), kMaxLevels) - 1;
+    for (int l=0; l<=m_maxLevel; ++l)
+    {
+        if ((layout.levels[l].tilesX == 1) && (layout.levels[l].tilesY == 1))
+        {
+            m_maxLevel = l;
+            break;
+        }
+    }
+    for (int l=0; l<=m_maxLevel; ++l)
+    {
+        m_levelOrigins.push_back(m_indirectionWidth);
+        m_indirectionWidth += layout.levels[l].tilesX;
+    }
+    m_indirectionHeight = layout.levels[0].tilesY;
+    m_indirection.assign((size_t)m_indirectionWidth * m_indirectionHeight * 4, 0);
+
+    Slot empty;
+    empty.key = 0;
+    empty.used = false;
+    empty.pinned = false;
+    empty.lastUsed = 0;
+    m_slots.assign(m_slotsPerSide * m_slotsPerSide, empty);
+    m_staging.resize(layout.TileBytes());
+
+    const int atlasSize = m_slotsPerSide * layout.SlotSize();
+    glGenTextures(1, &m_atlasTex);
+    glBindTexture(GL_TEXTURE_2D, m_atlasTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    if (layout.blockBytes != 0)
+    {
+        glCompressedTexImage2D(GL_TEXTURE_2D, 0, layout.internalFormat, atlasSize, atlasSize, 0,
+            (GLsizei)((size_t)(atlasSize / 4) * (atlasSize / 4) * layout.blockBytes), NULL);
+    }
+    else
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, layout.internalFormat, atlasSize, atlasSize, 0,
+            layout.format, layout.type, NULL);
+    }
+
+    glGenTextures(1, &m_indirectionTex);
+    glBindTexture(GL_TEXTURE_2D, m_indirectionTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_indirectionWidth, m_indirectionHeight, 0,
+        GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    /// The coarsest level is the fallback for everything else
+    const TileLevel& top = layout.levels[m_maxLevel];
+    int slot = 0;
+    for (int ty=0; ty<top.tilesY; ++ty)
+    {
+        for (int tx=0; (tx<top.tilesX) && (slot < (int)m_slots.size()); ++tx, ++slot)
+        {
+            const TileKey key = _MakeKey(m_maxLevel, tx, ty);
+            if (_UploadTile(key, slot))
+            {
+                m_slots[slot].key = key;
+                m_slots[slot].used = true;
+                m_slots[slot].pinned = true;
+                m_resident[key] = slot;
+            }
+        }
+    }
+    _UpdateIndirection();
+}
+
+VirtualTexture::~VirtualTexture()
+{
+    glDeleteTextures(1, &m_atlasTex);
+    glDeleteTextures(1, &m_indirectionTex);
+}
+
+int VirtualTexture::SlotsForViewport(int viewportWidth, int viewportHeight, const TileLayout& layout, int maxTexSize)
+{
+    /// A screenful of tiles straddling tile edges, twice over for neighbouring levels and fallbacks
+    const int across = viewportWidth / layout.tileSize + 2;
+    const int down = viewportHeight / layout.tileSize + 2;
+    int slots = (int)ceil(sqrt(2.0 * across * down));
+    if (maxTexSize > 0)
+        slots = std::min(slots, maxTexSize / layout.SlotSize());
+    return std::min(255, std::max(1, slots));
+}
+
+size_t VirtualTexture::ByteSize() const
+{
+    const TileLayout& layout = Layout();
+    const size_t atlasSize = (size_t)m_slotsPerSide * layout.SlotSize();
+    const size_t atlasBytes = (layout.blockBytes != 0) ?
+        (atlasSize / 4) * (atlasSize / 4) * layout.blockBytes :
+        atlasSize * atlasSize * layout.bytesPerPixel;
+    return atlasBytes + m_indirection.size();
+}
+
+VirtualTexture::TileKey VirtualTexture::_MakeKey(int level, int tileX, int tileY)
+{
+    return ((TileKey)level << 48) | ((TileKey)tileY << 24) | (TileKey)tileX;
+}
+
+void VirtualTexture::BeginFrame()
+{
+    ++m_frame;
+    m_missing.clear();
+}
+
+void VirtualTexture::RequestTiles(int level, float u0, float v0, float u1, float v1)
+{
+    if (m_slots.empty())
+        return;
+    const TileLayout& layout = Layout();
+    level = std::min(m_maxLevel, std::max(0, level));
+    const TileLevel& lv = layout.levels[level];
+    const float tile = (float)layout.tileSize;
+
+    int tx0 = (int)floor(u0 * lv.width / tile);
+    int tx1 = (int)floor(u1 * lv.width / tile);
+    if (tx1 - tx0 >= lv.tilesX)
+    {
+        tx0 = 0;
+        tx1 = lv.tilesX - 1;
+    }
+    const int ty0 = std::min(lv.tilesY - 1, std::max(0, (int)floor(v0 * lv.height / tile)));
+    const int ty1 = std::min(lv.tilesY - 1, std::max(0, (int)floor(v1 * lv.height / tile)));
+
+    for (int ty=ty0; ty<=ty1; ++ty)
+    {
+        for (int t=tx0; t<=tx1; ++t)
+        {
+            int tx = WrapIndex(t, lv.tilesX);
+            int ly = ty;
+            std::map<TileKey, int>::const_iterator it = m_resident.find(_MakeKey(level, tx, ty));
+            if (it == m_resident.end())
+            {
+                m_missing.insert(_MakeKey(level, tx, ty));
+
+                /// Keep what is shown meanwhile
+                for (int l=level+1; (l<=m_maxLevel) && (it == m_resident.end()); ++l)
+                {
+                    tx = std::min(layout.levels[l].tilesX - 1, tx / 2);
+                    ly = std::min(layout.levels[l].tilesY - 1, ly / 2);
+                    it = m_resident.find(_MakeKey(l, tx, ly));
+                }
+            }
+            if (it != m_resident.end())
+            {
+                m_slots[it->second].lastUsed = m_frame;
+            }
+        }
+    }
+}
+
+int VirtualTexture::Update(int maxUploads)
+{
+    /// Keys sort by level, so the coarsest tiles come last; those fill in the most screen
+    int uploaded = 0;
+    for (std::set<TileKey>::reverse_iterator it = m_missing.rbegin();
+         (it != m_missing.rend()) && (uploaded < maxUploads); ++it)
+    {
+        int slot = -1;
+        for (int i=0; i<(int)m_slots.size(); ++i)
+        {
+            const Slot& s = m_slots[i];
+            if (!s.used)
+            {
+                slot = i;
+                break;
+            }
+            if (!s.pinned && (s.lastUsed != m_frame) &&
+                ((slot < 0) || (s.lastUsed < m_slots[slot].lastUsed)))
+            {
+                slot = i;
+            }
+        }
+        if (slot < 0)
+            break;
+
+        if (m_slots[slot].used)
+        {
+            m_resident.erase(m_slots[slot].key);
+            m_slots[slot].used = false;
+            m_indirectionDirty = true;
+        }
+        if (!_UploadTile(*it, slot))
+            continue;
+        m_slots[slot].key = *it;
+        m_slots[slot].used = true;
+        m_slots[slot].lastUsed = m_frame;
+        m_resident[*it] = slot;
+        m_indirectionDirty = true;
+        ++uploaded;
+    }
+
+    if (m_indirectionDirty)
+    {
+        _UpdateIndirection();
+    }
+    return uploaded;
+}
+
+bool VirtualTexture::_UploadTile(TileKey key, int slot)
+{
+    const int level = (int)(key >> 48);
+    const int tileY = (int)((key >> 24) & 0xffffff);
+    const int tileX = (int)(key & 0xffffff);
+    if (!m_pSource->ReadTile(level, tileX, tileY, &m_staging[0]))
+        return false;
+
+    const TileLayout& layout = Layout();
+    const int size = layout.SlotSize();
+    const int x = (slot % m_slotsPerSide) * size;
+    const int y = (slot / m_slotsPerSide) * size;
+
+    glBindTexture(GL_TEXTURE_2D, m_atlasTex);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (layout.blockBytes != 0)
+    {
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, x, y, size, size, layout.internalFormat,
+            (GLsizei)m_staging.size(), &m_staging[0]);
+    }
+    else
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, size, size, layout.format, layout.type, &m_staging[0]);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return true;
+}
+
+/// Point every tile at its slot, or at the slot of its nearest resident ancestor.
+void VirtualTexture::_UpdateIndirection()
+{
+    const TileLayout& layout = Layout();
+    for (int l=m_maxLevel; l>=0; --l)
+    {
+        const TileLevel& lv = layout.levels[l];
+        for (int ty=0; ty<lv.tilesY; ++ty)
+        {
+            for (int tx=0; tx<lv.tilesX; ++tx)
+            {
+                unsigned char* pEntry = &m_indirection[4 * ((size_t)ty * m_indirectionWidth + m_levelOrigins[l] + tx)];
+                std::map<TileKey, int>::const_iterator it = m_resident.find(_MakeKey(l, tx, ty));
+                if (it != m_resident.end())
+                {
+                    pEntry[0] = (unsigned char)(it->second % m_slotsPerSide);
+                    pEntry[1] = (unsigned char)(it->second / m_slotsPerSide);
+                    pEntry[2] = (unsigned char)l;
+                    pEntry[3] = 255;
+                }
+                else if (l < m_maxLevel)
+                {
+                    const TileLevel& parent = layout.levels[l + 1];
+                    const int px = std::min(parent.tilesX - 1, tx / 2);
+                    const int py = std::min(parent.tilesY - 1, ty / 2);
+                    memcpy(pEntry, &m_indirection[4 * ((size_t)py * m_indirectionWidth + m_levelOrigins[l + 1] + px)], 4);
+                }
+            }
+        }
+    }
+
+    glBindTexture(GL_TEXTURE_2D, m_indirectionTex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_indirectionWidth, m_indirectionHeight,
+        GL_RGBA, GL_UNSIGNED_BYTE, &m_indirection[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    m_indirectionDirty = false;
+}
+
+void VirtualTexture::Bind(GLuint prog, int atlasUnit, int indirectionUnit) const
+{
+    if (m_slots.empty())
+        return;
+
+    const TileLayout& layout = Layout();
+    glActiveTexture(GL_TEXTURE0 + indirectionUnit);
+    glBindTexture(GL_TEXTURE_2D, m_indirectionTex);
+    glActiveTexture(GL_TEXTURE0 + atlasUnit);
+    glBindTexture(GL_TEXTURE_2D, m_atlasTex);
+
+    glUniform1i(getUniLoc(prog, "vtAtlas"), atlasUnit);
+    glUniform1i(getUniLoc(prog, "vtIndirection"), indirectionUnit);
+    const float atlasSize = (float)(m_slotsPerSide * layout.SlotSize());
+    glUniform2f(getUniLoc(prog, "vtAtlasSize"), atlasSize, atlasSize);
+    glUniform2f(getUniLoc(prog, "vtIndirectionSize"), (float)m_indirectionWidth, (float)m_indirectionHeight);
+    glUniform1f(getUniLoc(prog, "vtTileSize"), (float)layout.tileSize);
+    glUniform1f(getUniLoc(prog, "vtBorder"), (float)layout.border);
+    glUniform1f(getUniLoc(prog, "vtMaxLevel"), (float)m_maxLevel);
+
+    float levelSizes[2 * kMaxLevels];
+    float levelOrigins[kMaxLevels];
+    for (int l=0; l<=m_maxLevel; ++l)
+    {
+        levelSizes[2 * l]     = (float)layout.levels[l].width;
+        levelSizes[2 * l + 1] = (float)layout.levels[l].height;
+        levelOrigins[l]       = (float)m_levelOrigins[l];
+    }
+    glUniform2fv(getUniLoc(prog, "vtLevelSize"), m_maxLevel + 1, levelSizes);
+    glUniform1fv(getUniLoc(prog, "vtLevelOrigin"), m_maxLevel + 1, levelOrigins);
+}
@@ -0,0 +1,172 @@
+// VirtualTexture.h
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+#include <GL/glew.h>
+
+struct PanoImageData;
+
+///@brief Size of one level of a tile pyramid.
+struct TileLevel
+{
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+};
+
+///@brief How a TileSource's tiles are laid out, in the terms of PanoEyeImage.
+struct TileLayout
+{
+    TileLayout()
+    : internalFormat(0)
+    , format(0)
+    , type(0)
+    , bytesPerPixel(0)
+    , blockBytes(0)
+    , isHdr(false)
+    , tileSize(128)
+    , border(4)
+    , levels()
+    {}
+
+    GLint  internalFormat;
+    GLenum format;
+    GLenum type;
+    int bytesPerPixel;
+    int blockBytes;   ///< Per 4x4 block of a compressed internalFormat, else 0
+    bool isHdr;       ///< Texels hold linear radiance
+    int tileSize;     ///< Texels per tile side, a multiple of 4
+    int border;       ///< Texels of the neighbouring tiles repeated around each tile, a multiple of 4
+    std::vector<TileLevel> levels;  ///< Level 0 first, each max(1, size/2) of the one above
+
+    int SlotSize() const { return tileSize + 2 * border; }
+    /// Bytes of a tile with its border
+    size_t TileBytes() const;
+};
+
+///@brief Supplies the tiles of a pyramid, each with its border: wrapped around on x, clamped on y.
+class TileSource
+{
+public:
+    virtual ~TileSource() {}
+
+    virtual const TileLayout& Layout() const = 0;
+
+    /// Fill pDst with Layout().TileBytes() of the tile, rows(or rows of blocks) tightly packed.
+    virtual bool ReadTile(int level, int tileX, int tileY, unsigned char* pDst) = 0;
+};
+
+///@brief Tiles cut on demand from one eye of a panorama held in CPU memory.
+class PanoEyeTileSource : public TileSource
+{
+public:
+    PanoEyeTileSource(const std::shared_ptr<PanoImageData>& pImage, int eye, int tileSize, int border);
+
+    virtual const TileLayout& Layout() const { return m_layout; }
+    virtual bool ReadTile(int level, int tileX, int tileY, unsigned char* pDst);
+
+protected:
+    std::shared_ptr<PanoImageData> m_pImage;
+    int m_eye;
+    TileLayout m_layout;
+
+private: // Disallow default, copy ctor and assignment operator
+    PanoEyeTileSource();
+    PanoEyeTileSource(const PanoEyeTileSource&);
+    PanoEyeTileSource& operator=(const PanoEyeTileSource&);
+};
+
+///@brief Options for the virtual texture mode of PanoramaCylinder.
+struct VirtualTextureParams
+{
+    VirtualTextureParams()
+    : tileSize(128)
+    , border(4)
+    , viewportWidth(1280)
+    , viewportHeight(800)
+    , uploadsPerFrame(8)
+    {}
+
+    int tileSize;
+    int border;
+    int viewportWidth;   ///< Per eye; the atlas is sized to cover it
+    int viewportHeight;
+    int uploadsPerFrame; ///< Tiles streamed into each eye's atlas per frame
+};
+
+///@brief A texture of any size drawn from a fixed atlas of tiles. The levels of the source
+/// are cut into tiles; each frame the caller requests the tiles it will sample, the missing
+/// ones stream into the atlas slots least recently used and an indirection texture tells
+/// the panocylindervt shader which slot holds each tile, or else its nearest resident
+/// ancestor. The coarsest level always stays resident, so every texel has something to show.
+/// GPU memory depends on the atlas size alone, not on the size of the source.
+class VirtualTexture
+{
+public:
+    ///@param slotsPerSide The atlas holds slotsPerSide^2 tiles
+    VirtualTexture(const std::shared_ptr<TileSource>& pSource, int slotsPerSide);
+    virtual ~VirtualTexture();
+
+    /// Atlas slots per side to cover a viewport with tiles at every level, within maxTexSize.
+    static int SlotsForViewport(int viewportWidth, int viewportHeight, const TileLayout& layout, int maxTexSize);
+
+    const TileLayout& Layout() const { return m_pSource->Layout(); }
+    int MaxLevel() const { return m_maxLevel; }
+    size_t ByteSize() const;
+
+    /// Start a frame's requests; tiles requested in the previous frame may now be evicted.
+    void BeginFrame();
+
+    /// Request the tiles of a level covering texture coordinates [u0,u1]x[v0,v1], u wrapping.
+    void RequestTiles(int level, float u0, float v0, float u1, float v1);
+
+    /// Stream up to maxUploads missing tiles into the atlas, coarsest first.
+    ///@return The number of tiles uploaded
+    int Update(int maxUploads);
+
+    /// Bind the atlas and indirection textures and set the panocylindervt uniforms of prog.
+    void Bind(GLuint prog, int atlasUnit, int indirectionUnit) const;
+
+protected:
+    typedef unsigned long long TileKey;
+
+    ///@brief An atlas slot and the tile in it.
+    struct Slot
+    {
+        TileKey key;
+        bool used;
+        bool pinned;
+        unsigned int lastUsed;
+    };
+
+    static TileKey _MakeKey(int level, int tileX, int tileY);
+    bool _UploadTile(TileKey key, int slot);
+    void _UpdateIndirection();
+
+    std::shared_ptr<TileSource> m_pSource;
+    int m_slotsPerSide;
+    int m_maxLevel;                        ///< Coarsest level used: the first with a single tile
+    GLuint m_atlasTex;
+    GLuint m_indirectionTex;
+    int m_indirectionWidth;
+    int m_indirectionHeight;
+    std::vector<int> m_levelOrigins;       ///< Each level's first column in the indirection texture
+    std::vector<unsigned char> m_indirection;  ///< RGBA per tile: slot x, slot y, level, 255
+    bool m_indirectionDirty;
+
+    std::vector<Slot> m_slots;
+    std::map<TileKey, int> m_resident;     ///< Tile to slot
+    std::set<TileKey> m_missing;           ///< Requested this frame and not resident
+    std::vector<unsigned char> m_staging;
+    unsigned int m_frame;
+
+private: // Disallow default, copy ctor and assignment operator
+    VirtualTexture();
+    VirtualTexture(const VirtualTexture&);
+    VirtualTexture& operator=(const VirtualTexture&);
+};
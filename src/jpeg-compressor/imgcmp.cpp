@@ -0,0 +1,454 @@
+// imgcmp.cpp - Image comparison metrics, see imgcmp.h.
+// Each thread takes a band of 4 line row groups: the rows of both images are first unpacked to planar 8-bit channels,
+// then the absolute/squared error sums and the 4x4 block sums used by SSIM are computed on the planes, 16 pixels at a time.
+
+#include "imgcmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+  #define IMGCMP_USE_SSE2 1
+  #include <emmintrin.h>
+#else
+  #define IMGCMP_USE_SSE2 0
+#endif
+
+#define IMGCMP_MAX(a,b) (((a)>(b))?(a):(b))
+#define IMGCMP_MIN(a,b) (((a)<(b))?(a):(b))
+
+namespace imgcmp {
+
+typedef unsigned long long uint64;
+
+static inline void *imgcmp_malloc(size_t nSize) { return malloc(nSize); }
+static inline void imgcmp_free(void *p) { free(p); }
+
+enum { cBlockSize = 4, cMaxChannels = 4, cMinPixelsPerThread = 65536 };
+
+// Sums over one 4x4 block of one channel: a, b, a^2 + b^2 and a * b. Four blocks make an 8x8 SSIM window.
+struct block_sums
+{
+  int m_a, m_b, m_ss, m_ab;
+};
+
+// Totals of one thread's band, merged once all threads are done.
+struct band_totals
+{
+  int m_max_err[cMaxChannels];
+  uint64 m_sum_err[cMaxChannels];
+  uint64 m_sum_sq_err[cMaxChannels];
+  double m_ssim_sum[cMaxChannels];
+  uint64 m_num_windows;
+  uint64 m_image_sums[cMaxChannels][4]; // block_sums of the whole image, only when it is smaller than one window
+  bool m_failed;
+};
+
+struct compare_job
+{
+  image m_a, m_b;
+  int m_num_channels;
+  bool m_luma_only;
+  bool m_compute_ssim;
+  bool m_single_window;
+  int m_num_block_cols, m_num_block_rows;
+  int m_num_groups;
+};
+
+#if IMGCMP_USE_SSE2
+// Transposes interleaved bytes to planar: every round interleaves register k with register k + num_regs / 2. 5 rounds
+// split 6 registers of RGB pixels into 2 registers per channel, 4 rounds split 4 registers of RGBA pixels into 1 per channel.
+template<int num_regs, int num_rounds> static inline void deinterleave(__m128i *pRegs)
+{
+  for (int r = 0; r < num_rounds; r++)
+  {
+    __m128i next[num_regs];
+    for (int k = 0; k < num_regs / 2; k++)
+    {
+      next[k * 2] = _mm_unpacklo_epi8(pRegs[k], pRegs[k + num_regs / 2]);
+      next[k * 2 + 1] = _mm_unpackhi_epi8(pRegs[k], pRegs[k + num_regs / 2]);
+    }
+    for (int k = 0; k < num_regs; k++)
+      pRegs[k] = next[k];
+  }
+}
+#endif
+
+// Splits a row of RGB or RGBA pixels into planes. pA may be NULL.
+template<int comps> static void split_row(uint8 *pR, uint8 *pG, uint8 *pB, uint8 *pA, const uint8 *pSrc, int width)
+{
+  int x = 0;
+#if IMGCMP_USE_SSE2
+  if (comps == 3)
+  {
+    for ( ; x + 32 <= width; x += 32)
+    {
+      __m128i regs[6];
+      for (int i = 0; i < 6; i++)
+        regs[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + x * 3 + i * 16));
+      deinterleave<6, 5>(regs);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pR + x), regs[0]); _mm_storeu_si128(reinterpret_cast<__m128i*>(pR + x + 16), regs[1]);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pG + x), regs[2]); _mm_storeu_si128(reinterpret_cast<__m128i*>(pG + x + 16), regs[3]);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pB + x), regs[4]); _mm_storeu_si128(reinterpret_cast<__m128i*>(pB + x + 16), regs[5]);
+    }
+  }
+  else
+  {
+    for ( ; x + 16 <= width; x += 16)
+    {
+      __m128i regs[4];
+      for (int i = 0; i < 4; i++)
+        regs[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + x * 4 + i * 16));
+      deinterleave<4, 4>(regs);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pR + x), regs[0]);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pG + x), regs[1]);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pB + x), regs[2]);
+      if (pA)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pA + x), regs[3]);
+    }
+  }
+#endif
+
+  for (pSrc += x * comps; x < width; x++, pSrc += comps)
+  {
+    pR[x] = pSrc[0];
+    pG[x] = pSrc[1];
+    pB[x] = pSrc[2];
+    if ((comps == 4) && (pA))
+      pA[x] = pSrc[3];
+  }
+}
+
+// Unpacks one row to num_channels planes (plane_size bytes apart). Grey reads as R=G=B, a missing alpha channel as 255.
+static void unpack_row(uint8 *pDst, int plane_size, const uint8 *pSrc, int width, int comps, int num_channels, bool luma_only)
+{
+  if (luma_only)
+  {
+    if (comps == 1)
+      memcpy(pDst, pSrc, width);
+    else
+    {
+      const int YR = 19595, YG = 38470, YB = 7471;
+      for (int x = 0; x < width; x++, pSrc += comps)
+        pDst[x] = static_cast<uint8>((pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) >> 16);
+    }
+    return;
+  }
+
+  uint8 *pR = pDst, *pG = pDst + plane_size, *pB = pDst + plane_size * 2, *pA = (num_channels == 4) ? (pDst + plane_size * 3) : NULL;
+  if (comps == 1)
+  {
+    memcpy(pR, pSrc, width);
+    memcpy(pG, pSrc, width);
+    memcpy(pB, pSrc, width);
+  }
+  else if (comps == 3)
+    split_row<3>(pR, pG, pB, pA, pSrc, width);
+  else
+    split_row<4>(pR, pG, pB, pA, pSrc, width);
+
+  if ((pA) && (comps != 4))
+    memset(pA, 255, width);
+}
+
+// Accumulates the maximum, sum and sum of squares of |a - b| over n pixels.
+static void accum_errors(const uint8 *pA, const uint8 *pB, int n, int &max_err, uint64 &sum_err, uint64 &sum_sq_err)
+{
+  int x = 0;
+#if IMGCMP_USE_SSE2
+  if (n >= 16)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vmax = zero, vsum = zero, vsum_sq = zero;
+    while (x + 16 <= n)
+    {
+      // Squares are summed in 32-bit lanes, and widened every 4096 pixels so they can't overflow.
+      const int end = IMGCMP_MIN(n & ~15, x + 4096);
+      __m128i vsq = zero;
+      for ( ; x < end; x += 16)
+      {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pA + x));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pB + x));
+        const __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+        vmax = _mm_max_epu8(vmax, d);
+        vsum = _mm_add_epi64(vsum, _mm_sad_epu8(d, zero));
+        const __m128i d_lo = _mm_unpacklo_epi8(d, zero), d_hi = _mm_unpackhi_epi8(d, zero);
+        vsq = _mm_add_epi32(vsq, _mm_add_epi32(_mm_madd_epi16(d_lo, d_lo), _mm_madd_epi16(d_hi, d_hi)));
+      }
+      vsum_sq = _mm_add_epi64(vsum_sq, _mm_add_epi64(_mm_unpacklo_epi32(vsq, zero), _mm_unpackhi_epi32(vsq, zero)));
+    }
+
+    uint8 maxes[16];
+    uint64 sums[2], sums_sq[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(maxes), vmax);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(sums), vsum);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(sums_sq), vsum_sq);
+    for (int i = 0; i < 16; i++)
+      max_err = IMGCMP_MAX(max_err, maxes[i]);
+    sum_err += sums[0] + sums[1];
+    sum_sq_err += sums_sq[0] + sums_sq[1];
+  }
+#endif
+
+  for ( ; x < n; x++)
+  {
+    const int d = abs(pA[x] - pB[x]);
+    max_err = IMGCMP_MAX(max_err, d);
+    sum_err += d;
+    sum_sq_err += d * d;
+  }
+}
+
+#if IMGCMP_USE_SSE2
+// Adds each odd 32-bit lane to its even neighbour, so lanes 0 and 2 hold the sums of 4 columns.
+static inline __m128i add_lane_pairs(__m128i v) { return _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1))); }
+
+static inline void store_block_pair(block_sums *pDst, __m128i a, __m128i b, __m128i ss, __m128i ab)
+{
+  pDst[0].m_a = _mm_cvtsi128_si32(a); pDst[1].m_a = _mm_cvtsi128_si32(_mm_srli_si128(a, 8));
+  pDst[0].m_b = _mm_cvtsi128_si32(b); pDst[1].m_b = _mm_cvtsi128_si32(_mm_srli_si128(b, 8));
+  pDst[0].m_ss = _mm_cvtsi128_si32(ss); pDst[1].m_ss = _mm_cvtsi128_si32(_mm_srli_si128(ss, 8));
+  pDst[0].m_ab = _mm_cvtsi128_si32(ab); pDst[1].m_ab = _mm_cvtsi128_si32(_mm_srli_si128(ab, 8));
+}
+#endif
+
+// Computes the sums of num_blocks 4x4 blocks from 4 rows of one channel's planes (stride bytes apart).
+static void compute_block_sums(block_sums *pDst, const uint8 *pA, const uint8 *pB, int stride, int num_blocks)
+{
+  int bx = 0;
+#if IMGCMP_USE_SSE2
+  const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+  for ( ; bx + 4 <= num_blocks; bx += 4)
+  {
+    __m128i sa_lo = zero, sa_hi = zero, sb_lo = zero, sb_hi = zero, ss_lo = zero, ss_hi = zero, sab_lo = zero, sab_hi = zero;
+    for (int r = 0; r < cBlockSize; r++)
+    {
+      const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pA + r * stride + bx * cBlockSize));
+      const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pB + r * stride + bx * cBlockSize));
+      const __m128i a_lo = _mm_unpacklo_epi8(a, zero), a_hi = _mm_unpackhi_epi8(a, zero);
+      const __m128i b_lo = _mm_unpacklo_epi8(b, zero), b_hi = _mm_unpackhi_epi8(b, zero);
+      sa_lo = _mm_add_epi16(sa_lo, a_lo); sa_hi = _mm_add_epi16(sa_hi, a_hi);
+      sb_lo = _mm_add_epi16(sb_lo, b_lo); sb_hi = _mm_add_epi16(sb_hi, b_hi);
+      ss_lo = _mm_add_epi32(ss_lo, _mm_add_epi32(_mm_madd_epi16(a_lo, a_lo), _mm_madd_epi16(b_lo, b_lo)));
+      ss_hi = _mm_add_epi32(ss_hi, _mm_add_epi32(_mm_madd_epi16(a_hi, a_hi), _mm_madd_epi16(b_hi, b_hi)));
+      sab_lo = _mm_add_epi32(sab_lo, _mm_madd_epi16(a_lo, b_lo));
+      sab_hi = _mm_add_epi32(sab_hi, _mm_madd_epi16(a_hi, b_hi));
+    }
+    store_block_pair(pDst + bx, add_lane_pairs(_mm_madd_epi16(sa_lo, ones)), add_lane_pairs(_mm_madd_epi16(sb_lo, ones)), add_lane_pairs(ss_lo), add_lane_pairs(sab_lo));
+    store_block_pair(pDst + bx + 2, add_lane_pairs(_mm_madd_epi16(sa_hi, ones)), add_lane_pairs(_mm_madd_epi16(sb_hi, ones)), add_lane_pairs(ss_hi), add_lane_pairs(sab_hi));
+  }
+#endif
+
+  for ( ; bx < num_blocks; bx++)
+  {
+    block_sums &sums = pDst[bx];
+    sums.m_a = sums.m_b = sums.m_ss = sums.m_ab = 0;
+    for (int r = 0; r < cBlockSize; r++)
+    {
+      for (int x = bx * cBlockSize; x < (bx + 1) * cBlockSize; x++)
+      {
+        const int a = pA[r * stride + x], b = pB[r * stride + x];
+        sums.m_a += a; sums.m_b += b; sums.m_ss += a * a + b * b; sums.m_ab += a * b;
+      }
+    }
+  }
+}
+
+// SSIM of a window of n pixels, given its sums.
+static inline double ssim_window(double n, double s_a, double s_b, double ss, double s_ab)
+{
+  const double C1 = (0.01 * 255.0) * (0.01 * 255.0), C2 = (0.03 * 255.0) * (0.03 * 255.0);
+  const double mu_a = s_a / n, mu_b = s_b / n;
+  const double var_sum = ss / n - mu_a * mu_a - mu_b * mu_b;
+  const double covar = s_ab / n - mu_a * mu_b;
+  return ((2.0 * mu_a * mu_b + C1) * (2.0 * covar + C2)) / ((mu_a * mu_a + mu_b * mu_b + C1) * (var_sum + C2));
+}
+
+// Compares the row groups [first_group, end_group). For SSIM the band also reads the block row below it, so every
+// window whose top block row lies in the band is computed exactly once.
+static void compare_band(const compare_job *pJob, int first_group, int end_group, band_totals *pTotals)
+{
+  const int width = pJob->m_a.m_width, height = pJob->m_a.m_height;
+  const int num_channels = pJob->m_num_channels;
+  const int stride = (width + 15) & ~15;
+  const int plane_size = stride * cBlockSize;
+  const int num_block_cols = pJob->m_num_block_cols;
+  const bool windows = (pJob->m_compute_ssim) && (!pJob->m_single_window);
+
+  uint8 *pPlanes = static_cast<uint8*>(imgcmp_malloc(plane_size * num_channels * 2));
+  block_sums *pBlocks = windows ? static_cast<block_sums*>(imgcmp_malloc(sizeof(block_sums) * num_block_cols * num_channels * 2)) : NULL;
+  if ((!pPlanes) || ((windows) && (!pBlocks)))
+  {
+    imgcmp_free(pPlanes);
+    imgcmp_free(pBlocks);
+    pTotals->m_failed = true;
+    return;
+  }
+  uint8 *pPlanes_a = pPlanes, *pPlanes_b = pPlanes + plane_size * num_channels;
+  block_sums *pPrev_blocks = pBlocks, *pCur_blocks = pBlocks ? (pBlocks + num_block_cols * num_channels) : NULL;
+
+  const int last_group = windows ? IMGCMP_MAX(end_group - 1, IMGCMP_MIN(end_group, pJob->m_num_block_rows - 1)) : (end_group - 1);
+  for (int g = first_group; g <= last_group; g++)
+  {
+    const int num_rows = IMGCMP_MIN(cBlockSize, height - g * cBlockSize);
+    for (int r = 0; r < num_rows; r++)
+    {
+      const int y = g * cBlockSize + r;
+      unpack_row(pPlanes_a + r * stride, plane_size, pJob->m_a.m_pPixels + static_cast<size_t>(y) * pJob->m_a.get_stride(), width, pJob->m_a.m_comps, num_channels, pJob->m_luma_only);
+      unpack_row(pPlanes_b + r * stride, plane_size, pJob->m_b.m_pPixels + static_cast<size_t>(y) * pJob->m_b.get_stride(), width, pJob->m_b.m_comps, num_channels, pJob->m_luma_only);
+    }
+
+    for (int c = 0; c < num_channels; c++)
+    {
+      const uint8 *pA = pPlanes_a + c * plane_size, *pB = pPlanes_b + c * plane_size;
+
+      if (g < end_group)
+      {
+        for (int r = 0; r < num_rows; r++)
+          accum_errors(pA + r * stride, pB + r * stride, width, pTotals->m_max_err[c], pTotals->m_sum_err[c], pTotals->m_sum_sq_err[c]);
+
+        if ((pJob->m_compute_ssim) && (pJob->m_single_window))
+        {
+          uint64 *pSums = pTotals->m_image_sums[c];
+          for (int r = 0; r < num_rows; r++)
+          {
+            for (int x = 0; x < width; x++)
+            {
+              const int a = pA[r * stride + x], b = pB[r * stride + x];
+              pSums[0] += a; pSums[1] += b; pSums[2] += a * a + b * b; pSums[3] += a * b;
+            }
+          }
+        }
+      }
+
+      if ((windows) && (g < pJob->m_num_block_rows))
+      {
+        compute_block_sums(pCur_blocks + c * num_block_cols, pA, pB, stride, num_block_cols);
+        if (g > first_group)
+        {
+          const block_sums *pT = pPrev_blocks + c * num_block_cols, *pU = pCur_blocks + c * num_block_cols;
+          double ssim_sum = 0.0;
+          for (int bx = 0; bx < num_block_cols - 1; bx++)
+          {
+            ssim_sum += ssim_window(64.0,
+              pT[bx].m_a + pT[bx + 1].m_a + pU[bx].m_a + pU[bx + 1].m_a,
+              pT[bx].m_b + pT[bx + 1].m_b + pU[bx].m_b + pU[bx + 1].m_b,
+              pT[bx].m_ss + pT[bx + 1].m_ss + pU[bx].m_ss + pU[bx + 1].m_ss,
+              pT[bx].m_ab + pT[bx + 1].m_ab + pU[bx].m_ab + pU[bx + 1].m_ab);
+          }
+          pTotals->m_ssim_sum[c] += ssim_sum;
+        }
+      }
+    }
+
+    if ((windows) && (g > first_group) && (g < pJob->m_num_block_rows))
+      pTotals->m_num_windows += num_block_cols - 1;
+
+    block_sums *pTemp = pPrev_blocks; pPrev_blocks = pCur_blocks; pCur_blocks = pTemp;
+  }
+
+  imgcmp_free(pPlanes);
+  imgcmp_free(pBlocks);
+}
+
+static void compute_channel_results(channel_results &res, double num_values, int max_err, uint64 sum_err, uint64 sum_sq_err)
+{
+  res.m_max_err = max_err;
+  res.m_mean = sum_err / num_values;
+  res.m_mean_squared = sum_sq_err / num_values;
+  res.m_root_mean_squared = sqrt(res.m_mean_squared);
+  res.m_peak_snr = res.m_root_mean_squared ? (log10(255.0 / res.m_root_mean_squared) * 20.0) : 1e+10;
+}
+
+static bool is_valid(const image &img)
+{
+  if ((!img.m_pPixels) || (img.m_width < 1) || (img.m_height < 1)) return false;
+  if ((img.m_comps != 1) && (img.m_comps != 3) && (img.m_comps != 4)) return false;
+  return img.get_stride() >= img.m_width * img.m_comps;
+}
+
+bool compare_images(results &res, const image &a, const image &b, const params &comp_params)
+{
+  memset(&res, 0, sizeof(res));
+  if ((!is_valid(a)) || (!is_valid(b)) || (a.m_width != b.m_width) || (a.m_height != b.m_height))
+    return false;
+
+  compare_job job;
+  job.m_a = a;
+  job.m_b = b;
+  job.m_num_channels = comp_params.m_luma_only ? 1 : (comp_params.m_compare_alpha ? 4 : 3);
+  job.m_luma_only = comp_params.m_luma_only;
+  job.m_compute_ssim = comp_params.m_compute_ssim;
+  job.m_num_block_cols = a.m_width / cBlockSize;
+  job.m_num_block_rows = a.m_height / cBlockSize;
+  job.m_single_window = (job.m_num_block_cols < 2) || (job.m_num_block_rows < 2);
+  job.m_num_groups = (a.m_height + cBlockSize - 1) / cBlockSize;
+
+  int num_threads = comp_params.m_num_threads ? comp_params.m_num_threads : static_cast<int>(std::thread::hardware_concurrency());
+  const int max_threads = static_cast<int>((static_cast<uint64>(a.m_width) * a.m_height) / cMinPixelsPerThread);
+  num_threads = IMGCMP_MIN(IMGCMP_MIN(num_threads, max_threads), job.m_num_groups);
+  if ((num_threads < 1) || (job.m_single_window))
+    num_threads = 1;
+
+  band_totals *pTotals = new band_totals[num_threads];
+  memset(pTotals, 0, sizeof(band_totals) * num_threads);
+
+  std::thread *pThreads = new std::thread[num_threads - 1];
+  for (int i = 1; i < num_threads; i++)
+    pThreads[i - 1] = std::thread(compare_band, &job, (job.m_num_groups * i) / num_threads, (job.m_num_groups * (i + 1)) / num_threads, &pTotals[i]);
+  compare_band(&job, 0, job.m_num_groups / num_threads, &pTotals[0]);
+  for (int i = 1; i < num_threads; i++)
+    pThreads[i - 1].join();
+  delete[] pThreads;
+
+  // Merge the bands in order, so the results only depend on the number of threads through SSIM rounding.
+  bool status = true;
+  int total_max_err = 0;
+  uint64 total_sum_err = 0, total_sum_sq_err = 0, num_windows = 0;
+  double ssim_sum = 0.0;
+  const double num_pixels = static_cast<double>(a.m_width) * a.m_height;
+  res.m_num_channels = job.m_num_channels;
+  for (int c = 0; c < job.m_num_channels; c++)
+  {
+    int max_err = 0;
+    uint64 sum_err = 0, sum_sq_err = 0, image_sums[4] = { 0, 0, 0, 0 };
+    double channel_ssim_sum = 0.0;
+    num_windows = 0;
+    for (int i = 0; i < num_threads; i++)
+    {
+      const band_totals &totals = pTotals[i];
+      if (totals.m_failed)
+        status = false;
+      max_err = IMGCMP_MAX(max_err, totals.m_max_err[c]);
+      sum_err += totals.m_sum_err[c];
+      sum_sq_err += totals.m_sum_sq_err[c];
+      channel_ssim_sum += totals.m_ssim_sum[c];
+      num_windows += totals.m_num_windows;
+      for (int s = 0; s < 4; s++)
+        image_sums[s] += totals.m_image_sums[c][s];
+    }
+
+    channel_results &channel = res.m_channels[c];
+    compute_channel_results(channel, num_pixels, max_err, sum_err, sum_sq_err);
+    if (job.m_compute_ssim)
+      channel.m_ssim = job.m_single_window ? ssim_window(num_pixels, (double)image_sums[0], (double)image_sums[1], (double)image_sums[2], (double)image_sums[3]) : (channel_ssim_sum / num_windows);
+
+    total_max_err = IMGCMP_MAX(total_max_err, max_err);
+    total_sum_err += sum_err;
+    total_sum_sq_err += sum_sq_err;
+    ssim_sum += channel.m_ssim;
+  }
+  delete[] pTotals;
+
+  compute_channel_results(res.m_total, num_pixels * job.m_num_channels, total_max_err, total_sum_err, total_sum_sq_err);
+  res.m_total.m_ssim = ssim_sum / job.m_num_channels;
+
+  if (!status)
+    memset(&res, 0, sizeof(res));
+  return status;
+}
+
+} // namespace imgcmp
@@ -0,0 +1,72 @@
+// imgcmp.h - Image comparison metrics (max/mean error, RMSE, PSNR and SSIM), per channel and in total.
+// Works on strided 8-bit grey, RGB or RGBA buffers, so a sub-rectangle (e.g. one half of an over/under panorama) can be
+// compared in place. The error sums are vectorized with SSE2 where available, and rows are split over several threads.
+#ifndef IMAGE_COMPARE_H
+#define IMAGE_COMPARE_H
+
+#include <stddef.h>
+
+namespace imgcmp
+{
+  typedef unsigned char  uint8;
+  typedef unsigned int   uint;
+
+  // Describes an image in memory. m_comps is 1 (grey), 3 (RGB) or 4 (RGBA), m_stride is the distance between rows in
+  // bytes (0 = m_width * m_comps).
+  struct image
+  {
+    inline image() : m_pPixels(0), m_width(0), m_height(0), m_comps(0), m_stride(0) { }
+    inline image(const void *pPixels, int width, int height, int comps, int stride = 0) : m_pPixels(static_cast<const uint8*>(pPixels)), m_width(width), m_height(height), m_comps(comps), m_stride(stride) { }
+
+    inline int get_stride() const { return m_stride ? m_stride : (m_width * m_comps); }
+
+    // Returns the rectangle at (x, y) of this image, sharing its pixels.
+    inline image get_rect(int x, int y, int width, int height) const { return image(m_pPixels + static_cast<size_t>(y) * get_stride() + x * m_comps, width, height, m_comps, get_stride()); }
+
+    const uint8 *m_pPixels;
+    int m_width, m_height, m_comps, m_stride;
+  };
+
+  // Comparison parameters.
+  struct params
+  {
+    inline params() : m_luma_only(false), m_compare_alpha(false), m_compute_ssim(true), m_num_threads(0) { }
+
+    // Compares only the luma (Y) of both images, computed like jpge's RGB to YCbCr conversion. Otherwise the R, G and B
+    // channels are compared; grey images read as R=G=B.
+    bool m_luma_only;
+
+    // Also compares the alpha channel (4th result channel). Images without alpha read as opaque.
+    bool m_compare_alpha;
+
+    // SSIM is computed over 8x8 windows, stepped by 4 pixels. Images smaller than 8x8 use a single window.
+    bool m_compute_ssim;
+
+    // Number of threads (0 = one per hardware thread). Small images always use one thread.
+    int m_num_threads;
+  };
+
+  // Error metrics of one channel, or of all channels together.
+  struct channel_results
+  {
+    double m_max_err;
+    double m_mean;                 // Mean absolute error
+    double m_mean_squared;
+    double m_root_mean_squared;
+    double m_peak_snr;             // In dB, 1e+10 if the images are identical
+    double m_ssim;                 // 1.0 if the images are identical, 0.0 if not computed
+  };
+
+  struct results
+  {
+    int m_num_channels;            // 1 with m_luma_only, 4 with m_compare_alpha, 3 otherwise
+    channel_results m_channels[4];
+    channel_results m_total;       // Over all samples of all channels; m_ssim is the channels' average
+  };
+
+  // Compares two images of the same size. Returns false (and clears results) if their sizes differ or a description is invalid.
+  bool compare_images(results &res, const image &a, const image &b, const params &comp_params = params());
+
+} // namespace imgcmp
+
+#endif // IMAGE_COMPARE_H
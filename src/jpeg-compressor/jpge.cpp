@@ -14,6 +14,9 @@
 #include <string.h>
 #include <malloc.h>
 
+#include <thread>
+#include <atomic>
+
 #define JPGE_MAX(a,b) (((a)>(b))?(a):(b))
 #define JPGE_MIN(a,b) (((a)<(b))?(a):(b))
 
@@ -23,7 +26,7 @@ static inline void *jpge_malloc(size_t nSize) { return malloc(nSize); }
 static inline void jpge_free(void *p) { free(p); }
 
 // Various JPEG enums and tables.
-enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_APP0 = 0xE0 };
+enum { M_SOF0 = 0xC0, M_SOF2 = 0xC2, M_DHT = 0xC4, M_RST0 = 0xD0, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_APP0 = 0xE0 };
 enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
 
 static uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
@@ -288,7 +291,7 @@ void jpeg_encoder::emit_dqt()
 // Emit start of frame marker
 void jpeg_encoder::emit_sof()
 {
-  emit_marker(M_SOF0);                           /* baseline */
+  emit_marker(m_params.m_progressive_flag ? M_SOF2 : M_SOF0); /* progressive or baseline */
   emit_word(3 * m_num_components + 2 + 5 + 1);
   emit_byte(8);                                  /* precision */
   emit_word(m_image_y);
@@ -352,6 +355,31 @@ void jpeg_encoder::emit_sos()
   emit_byte(0);
 }
 
+// Emit start of scan for a progressive scan. comp < 0 selects all components (interleaved DC scans).
+void jpeg_encoder::emit_progressive_sos(int comp, int ss, int se, int ah, int al)
+{
+  const int first_comp = (comp < 0) ? 0 : comp, num_comps = (comp < 0) ? m_num_components : 1;
+  emit_marker(M_SOS);
+  emit_word(2 * num_comps + 2 + 1 + 3);
+  emit_byte(static_cast<uint8>(num_comps));
+  for (int i = first_comp; i < first_comp + num_comps; i++)
+  {
+    emit_byte(static_cast<uint8>(i + 1));
+    emit_byte(static_cast<uint8>((i > 0) ? ((1 << 4) + 1) : 0));
+  }
+  emit_byte(static_cast<uint8>(ss));
+  emit_byte(static_cast<uint8>(se));
+  emit_byte(static_cast<uint8>((ah << 4) + al));
+}
+
+// Emit define restart interval marker
+void jpeg_encoder::emit_dri()
+{
+  emit_marker(M_DRI);
+  emit_word(4);
+  emit_word(m_restart_mcu_rows * m_mcus_per_row);
+}
+
 // Emit all markers at beginning of image file.
 void jpeg_encoder::emit_markers()
 {
@@ -360,6 +388,8 @@ void jpeg_encoder::emit_markers()
   emit_dqt();
   emit_sof();
   emit_dhts();
+  if (m_restart_mcu_rows)
+    emit_dri();
   emit_sos();
 }
 
@@ -412,12 +442,86 @@ void jpeg_encoder::compute_quant_table(int32 *pDst, int16 *pSrc)
   }
 }
 
+// Chunked buffer of quantized coefficients, lets the second pass run without the source image (m_single_feed_flag).
+// Each block is stored as a header byte (component << 6 | number of nonzero AC coefficients), the 16-bit DC coefficient,
+// then a zig-zag index byte and 16-bit value for each nonzero AC coefficient.
+class coeff_buffer
+{
+  coeff_buffer(const coeff_buffer &);
+  coeff_buffer &operator= (const coeff_buffer &);
+
+  enum { CHUNK_SIZE = 256 * 1024, MAX_BLOCK_SIZE = 1 + 2 + 63 * 3 };
+  struct chunk { chunk *m_pNext; uint m_size; uint8 m_data[CHUNK_SIZE]; };
+  chunk *m_pHead, *m_pTail, *m_pRead;
+  uint m_read_ofs;
+
+public:
+  coeff_buffer() : m_pHead(NULL), m_pTail(NULL), m_pRead(NULL), m_read_ofs(0) { }
+  ~coeff_buffer() { clear(); }
+
+  void clear()
+  {
+    while (m_pHead) { chunk *pNext = m_pHead->m_pNext; jpge_free(m_pHead); m_pHead = pNext; }
+    m_pTail = m_pRead = NULL; m_read_ofs = 0;
+  }
+
+  bool empty() const { return m_pHead == NULL; }
+
+  bool put_block(int component_num, const int16 *pSrc)
+  {
+    if ((!m_pTail) || (m_pTail->m_size + MAX_BLOCK_SIZE > CHUNK_SIZE))
+    {
+      chunk *pChunk = static_cast<chunk*>(jpge_malloc(sizeof(chunk)));
+      if (!pChunk) return false;
+      pChunk->m_pNext = NULL; pChunk->m_size = 0;
+      if (m_pTail) m_pTail->m_pNext = pChunk; else m_pHead = m_pRead = pChunk;
+      m_pTail = pChunk;
+    }
+    uint8 *pHeader = m_pTail->m_data + m_pTail->m_size, *pDst = pHeader + 1;
+    *pDst++ = static_cast<uint8>(pSrc[0]); *pDst++ = static_cast<uint8>(pSrc[0] >> 8);
+    uint num_ac = 0;
+    for (int i = 1; i < 64; i++)
+    {
+      if (!pSrc[i]) continue;
+      *pDst++ = static_cast<uint8>(i); *pDst++ = static_cast<uint8>(pSrc[i]); *pDst++ = static_cast<uint8>(pSrc[i] >> 8);
+      num_ac++;
+    }
+    *pHeader = static_cast<uint8>((component_num << 6) | num_ac);
+    m_pTail->m_size = static_cast<uint>(pDst - m_pTail->m_data);
+    return true;
+  }
+
+  // Returns the block's component number, or -1 once all blocks have been read.
+  int get_block(int16 *pDst)
+  {
+    if ((m_pRead) && (m_read_ofs == m_pRead->m_size)) { m_pRead = m_pRead->m_pNext; m_read_ofs = 0; }
+    if (!m_pRead) return -1;
+    const uint8 *pSrc = m_pRead->m_data + m_read_ofs;
+    const uint header = *pSrc++;
+    memset(pDst, 0, 64 * sizeof(int16));
+    pDst[0] = static_cast<int16>(pSrc[0] | (pSrc[1] << 8)); pSrc += 2;
+    for (uint i = header & 63; i; i--, pSrc += 3)
+      pDst[pSrc[0]] = static_cast<int16>(pSrc[1] | (pSrc[2] << 8));
+    m_read_ofs = static_cast<uint>(pSrc - m_pRead->m_data);
+    return header >> 6;
+  }
+};
+
 // Higher-level methods.
+void jpeg_encoder::set_default_huffman_tables()
+{
+  memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val [0+0], s_dc_lum_val, DC_LUM_CODES);
+  memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val [2+0], s_ac_lum_val, AC_LUM_CODES);
+  memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val [0+1], s_dc_chroma_val, DC_CHROMA_CODES);
+  memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val [2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+}
+
 void jpeg_encoder::first_pass_init()
 {
   m_bit_buffer = 0; m_bits_in = 0;
   memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
   m_mcu_y_ofs = 0;
+  m_mcu_rows_done = 0;
   m_pass_num = 1;
 }
 
@@ -436,7 +540,7 @@ bool jpeg_encoder::second_pass_init()
   return true;
 }
 
-bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
+bool jpeg_encoder::jpg_alloc(int p_x_res, int p_y_res, int src_channels)
 {
   m_num_components = 3;
   switch (m_params.m_subsampling)
@@ -486,23 +590,50 @@ bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
   for (int i = 1; i < m_mcu_y; i++)
     m_mcu_lines[i] = m_mcu_lines[i-1] + m_image_bpl_mcu;
 
-  compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-  compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+  set_quality(m_params.m_quality);
 
-  m_out_buf_left = JPGE_OUT_BUF_SIZE;
+  m_out_buf_size = m_params.m_out_buf_size ? JPGE_MAX((uint)m_params.m_out_buf_size, (uint)JPGE_MIN_OUT_BUF_SIZE) : (uint)JPGE_DEFAULT_OUT_BUF_SIZE;
+  if ((m_out_buf = static_cast<uint8*>(jpge_malloc(m_out_buf_size))) == NULL) return false;
+  m_out_buf_left = m_out_buf_size;
   m_pOut_buf = m_out_buf;
+  return true;
+}
 
-  if (m_params.m_two_pass_flag)
+bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
+{
+  if (!jpg_alloc(p_x_res, p_y_res, src_channels)) return false;
+
+  // The restart interval is given in MCU rows, but the DRI marker counts MCUs in 16 bits.
+  m_restart_mcu_rows = m_params.m_progressive_flag ? 0 : m_params.m_restart_interval;
+  if ((!m_restart_mcu_rows) && (m_params.m_num_threads != 1) && (!m_params.m_progressive_flag) && (!m_params.m_target_size))
+    m_restart_mcu_rows = 1;
+  m_restart_mcu_rows = JPGE_MIN(m_restart_mcu_rows, JPGE_MAX(0xFFFF / m_mcus_per_row, 1));
+  if (m_restart_mcu_rows * m_mcus_per_row > 0xFFFF)
+    m_restart_mcu_rows = 0;
+
+  if ((m_params.m_progressive_flag) || (m_params.m_target_size))
+  {
+    // One plane of coefficient blocks per component, covering every MCU. Progressive mode stores quantized zig-zag
+    // ordered blocks, target size mode the unquantized DCT output in natural order.
+    const int total_mcu_rows = m_image_y_mcu / m_mcu_y;
+    for (int c = 0; c < m_num_components; c++)
+    {
+      m_comp_blocks_x[c] = m_mcus_per_row * m_comp_h_samp[c];
+      const size_t num_blocks = static_cast<size_t>(m_comp_blocks_x[c]) * total_mcu_rows * m_comp_v_samp[c];
+      if ((m_pComp_coeffs[c] = static_cast<int16*>(jpge_malloc(num_blocks * 64 * sizeof(int16)))) == NULL) return false;
+    }
+    first_pass_init();
+  }
+  else if (m_params.m_two_pass_flag)
   {
     clear_obj(m_huff_count);
+    if (m_params.m_single_feed_flag)
+      m_pCoeffs = new coeff_buffer;
     first_pass_init();
   }
   else
   {
-    memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val [0+0], s_dc_lum_val, DC_LUM_CODES);
-    memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val [2+0], s_ac_lum_val, AC_LUM_CODES);
-    memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val [0+1], s_dc_chroma_val, DC_CHROMA_CODES);
-    memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val [2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+    set_default_huffman_tables();
     if (!second_pass_init()) return false;   // in effect, skip over the first pass
   }
   return m_all_stream_writes_succeeded;
@@ -568,13 +699,12 @@ void jpeg_encoder::load_block_16_8_8(int x, int c)
   }
 }
 
-void jpeg_encoder::load_quantized_coefficients(int component_num)
+// Quantizes a natural order block of DCT coefficients into zig-zag order.
+template<class T> static inline void quantize_block(int16 *pDst, const T *pSrc, const int32 *q)
 {
-  int32 *q = m_quantization_tables[component_num > 0];
-  int16 *pDst = m_coefficient_array;
   for (int i = 0; i < 64; i++)
   {
-    sample_array_t j = m_sample_array[s_zag[i]];
+    int32 j = pSrc[s_zag[i]];
     if (j < 0)
     {
       if ((j = -j + (*q >> 1)) < *q)
@@ -593,26 +723,84 @@ void jpeg_encoder::load_quantized_coefficients(int component_num)
   }
 }
 
+void jpeg_encoder::load_quantized_coefficients(int component_num)
+{
+  quantize_block(m_coefficient_array, m_sample_array, m_quantization_tables[component_num > 0]);
+}
+
+// Byte align the entropy coded data, write an RSTn marker and reset the DC predictions.
+void jpeg_encoder::emit_restart()
+{
+  if (m_pass_num == 2)
+  {
+    flush_bits();
+    if (m_out_buf_left < 2) flush_output_buffer();
+    m_pOut_buf[0] = 0xFF;
+    m_pOut_buf[1] = static_cast<uint8>(M_RST0 + ((m_mcu_rows_done / m_restart_mcu_rows - 1) & 7));
+    m_pOut_buf += 2; m_out_buf_left -= 2;
+  }
+  memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+}
+
 void jpeg_encoder::flush_output_buffer()
 {
-  if (m_out_buf_left != JPGE_OUT_BUF_SIZE)
-    m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, JPGE_OUT_BUF_SIZE - m_out_buf_left);
+  if (m_out_buf_left != m_out_buf_size)
+    m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, m_out_buf_size - m_out_buf_left);
   m_pOut_buf = m_out_buf;
-  m_out_buf_left = JPGE_OUT_BUF_SIZE;
+  m_out_buf_left = m_out_buf_size;
 }
 
+// bits must fit in len (<= 16) bits. They're shifted into the low end of a 64-bit accumulator, which is written out
+// a 32-bit word at a time, so most calls are a shift, an or and a compare.
 void jpeg_encoder::put_bits(uint bits, uint len)
 {
-  m_bit_buffer |= ((uint32)bits << (24 - (m_bits_in += len)));
+  m_bit_buffer = (m_bit_buffer << len) | bits;
+  if ((m_bits_in += len) >= 32)
+  {
+    m_bits_in -= 32;
+    put_word(static_cast<uint32>(m_bit_buffer >> m_bits_in));
+  }
+}
+
+// Writes 4 bytes of entropy coded data, big endian. A word without any 0xFF bytes (found with the "has a zero byte" trick
+// on its complement) is stored directly, otherwise each 0xFF byte is followed by a stuffed 0.
+void jpeg_encoder::put_word(uint32 c)
+{
+  if (m_out_buf_left < 8) flush_output_buffer();
+  uint8 *pDst = m_pOut_buf;
+  const uint32 n = ~c;
+  if (((n - 0x01010101U) & ~n & 0x80808080U) == 0)
+  {
+    pDst[0] = static_cast<uint8>(c >> 24); pDst[1] = static_cast<uint8>(c >> 16); pDst[2] = static_cast<uint8>(c >> 8); pDst[3] = static_cast<uint8>(c);
+    pDst += 4;
+  }
+  else
+  {
+    for (int shift = 24; shift >= 0; shift -= 8)
+      if ((*pDst++ = static_cast<uint8>(c >> shift)) == 0xFF) *pDst++ = 0;
+  }
+  m_out_buf_left -= static_cast<uint>(pDst - m_pOut_buf);
+  m_pOut_buf = pDst;
+}
+
+void jpeg_encoder::put_byte(uint8 c)
+{
+  if (m_out_buf_left < 2) flush_output_buffer();
+  *m_pOut_buf++ = c;
+  m_out_buf_left--;
+  if (c == 0xFF) { *m_pOut_buf++ = 0; m_out_buf_left--; }
+}
+
+// Pads the entropy coded data to a byte boundary with 1 bits and writes out all pending bytes.
+void jpeg_encoder::flush_bits()
+{
+  put_bits(0x7F, 7);
   while (m_bits_in >= 8)
   {
-    uint8 c;
-    #define JPGE_PUT_BYTE(c) { *m_pOut_buf++ = (c); if (--m_out_buf_left == 0) flush_output_buffer(); }
-    JPGE_PUT_BYTE(c = (uint8)((m_bit_buffer >> 16) & 0xFF));
-    if (c == 0xFF) JPGE_PUT_BYTE(0);
-    m_bit_buffer <<= 8;
     m_bits_in -= 8;
+    put_byte(static_cast<uint8>(m_bit_buffer >> m_bits_in));
   }
+  m_bit_buffer = 0; m_bits_in = 0;
 }
 
 void jpeg_encoder::code_coefficients_pass_one(int component_num)
@@ -721,15 +909,46 @@ void jpeg_encoder::code_coefficients_pass_two(int component_num)
 void jpeg_encoder::code_block(int component_num)
 {
   DCT2D(m_sample_array);
+  if (m_params.m_target_size)
+  {
+    // The quality isn't known yet, keep the unquantized block (it fits in 16 bits).
+    for (int i = 0; i < 64; i++)
+      m_coefficient_array[i] = static_cast<int16>(m_sample_array[i]);
+    store_block(component_num);
+    return;
+  }
   load_quantized_coefficients(component_num);
-  if (m_pass_num == 1)
+  if (m_params.m_progressive_flag)
+    store_block(component_num);
+  else if (m_pass_num == 1)
+  {
     code_coefficients_pass_one(component_num);
+    if ((m_pCoeffs) && (!m_pCoeffs->put_block(component_num, m_coefficient_array)))
+      m_all_stream_writes_succeeded = false;
+  }
   else
     code_coefficients_pass_two(component_num);
 }
 
+// Codes num_mcu_rows MCU rows of buffered coefficients with the second pass Huffman tables.
+void jpeg_encoder::replay_coefficients(int num_mcu_rows)
+{
+  const int blocks_per_mcu = (m_num_components == 1) ? 1 : (m_comp_h_samp[0] * m_comp_v_samp[0] + 2);
+  for (int y = 0; y < num_mcu_rows; y++)
+  {
+    for (int i = m_mcus_per_row * blocks_per_mcu; i; i--)
+    {
+      int component_num = m_pCoeffs->get_block(m_coefficient_array);
+      if (component_num < 0) return;
+      code_coefficients_pass_two(component_num);
+    }
+    end_mcu_row();
+  }
+}
+
 void jpeg_encoder::process_mcu_row()
 {
+  m_comp_block_ofs[0] = m_comp_block_ofs[1] = m_comp_block_ofs[2] = 0;
   if (m_num_components == 1)
   {
     for (int i = 0; i < m_mcus_per_row; i++)
@@ -775,14 +994,383 @@ bool jpeg_encoder::terminate_pass_one()
 
 bool jpeg_encoder::terminate_pass_two()
 {
-  put_bits(0x7F, 7);
+  flush_bits();
   flush_output_buffer();
   emit_marker(M_EOI);
   m_pass_num++; // purposely bump up m_pass_num, for debugging
   return true;
 }
 
-bool jpeg_encoder::process_end_of_image()
+// Progressive encoding, see sections G.1.2.1-G.1.2.3 of the JPEG spec (and libjpeg's jcphuff.c).
+// A scan is coded twice: once to count the symbols for its optimized Huffman tables, then for real.
+struct progressive_scan { int m_comp, m_ss, m_se, m_ah, m_al; };
+
+// DC first, then the low AC coefficients of each component, then the refinement of all bits (libjpeg's jpeg_simple_progression()).
+static const progressive_scan s_ycc_scans[] = { { -1, 0, 0, 0, 1 }, { 0, 1, 5, 0, 2 }, { 2, 1, 63, 0, 1 }, { 1, 1, 63, 0, 1 }, { 0, 6, 63, 0, 2 },
+                                                { 0, 1, 63, 2, 1 }, { -1, 0, 0, 1, 0 }, { 2, 1, 63, 1, 0 }, { 1, 1, 63, 1, 0 }, { 0, 1, 63, 1, 0 } };
+static const progressive_scan s_y_scans[] = { { 0, 0, 0, 0, 1 }, { 0, 1, 5, 0, 2 }, { 0, 6, 63, 0, 2 }, { 0, 1, 63, 2, 1 }, { 0, 0, 0, 1, 0 }, { 0, 1, 63, 1, 0 } };
+
+// Copies the quantized block of the current MCU row into its component's coefficient plane.
+void jpeg_encoder::store_block(int component_num)
+{
+  const int h = m_comp_h_samp[component_num], v = m_comp_v_samp[component_num];
+  const int n = m_comp_block_ofs[component_num]++;
+  const int block_x = (n / (h * v)) * h + (n % h), block_y = m_mcu_rows_done * v + (n % (h * v)) / h;
+  memcpy(m_pComp_coeffs[component_num] + (static_cast<size_t>(block_y) * m_comp_blocks_x[component_num] + block_x) * 64, m_coefficient_array, 64 * sizeof(int16));
+}
+
+void jpeg_encoder::put_symbol(int table_num, uint sym)
+{
+  if (m_count_only)
+    m_huff_count[table_num][sym]++;
+  else
+    put_bits(m_huff_codes[table_num][sym], m_huff_code_sizes[table_num][sym]);
+}
+
+void jpeg_encoder::put_value_bits(uint bits, uint len)
+{
+  if (!m_count_only)
+    put_bits(bits & ((1U << len) - 1), len);
+}
+
+void jpeg_encoder::put_correction_bits(const uint8 *pBits, uint num_bits)
+{
+  if (!m_count_only)
+    for (uint i = 0; i < num_bits; i++)
+      put_bits(pBits[i], 1);
+}
+
+// Codes the pending run of end-of-bands, followed by the correction bits that belong to them.
+void jpeg_encoder::flush_eob_run()
+{
+  if (!m_eob_run) return;
+  uint nbits = 0;
+  for (uint temp = m_eob_run; temp >>= 1; ) nbits++;
+  put_symbol(m_ac_table, nbits << 4);
+  if (nbits) put_value_bits(m_eob_run, nbits);
+  m_eob_run = 0;
+  put_correction_bits(m_corr_bits, m_num_corr_bits);
+  m_num_corr_bits = 0;
+}
+
+void jpeg_encoder::code_dc_first(const int16 *pSrc, int component_num, int al)
+{
+  int temp1 = pSrc[0] >> al, temp2 = temp1 - m_last_dc_val[component_num];
+  m_last_dc_val[component_num] = temp1;
+  temp1 = temp2;
+  if (temp1 < 0)
+  {
+    temp1 = -temp1; temp2--;
+  }
+  uint nbits = 0;
+  while (temp1)
+  {
+    nbits++; temp1 >>= 1;
+  }
+  put_symbol(component_num ? 1 : 0, nbits);
+  if (nbits) put_value_bits(temp2, nbits);
+}
+
+void jpeg_encoder::code_ac_first(const int16 *pSrc, int ss, int se, int al)
+{
+  int run_len = 0;
+  for (int k = ss; k <= se; k++)
+  {
+    int temp1 = pSrc[k], temp2;
+    if (temp1 < 0)
+    {
+      temp1 = (-temp1) >> al; temp2 = ~temp1;
+    }
+    else
+    {
+      temp1 >>= al; temp2 = temp1;
+    }
+    if (!temp1)
+    {
+      run_len++;
+      continue;
+    }
+    flush_eob_run();
+    while (run_len >= 16)
+    {
+      put_symbol(m_ac_table, 0xF0);
+      run_len -= 16;
+    }
+    uint nbits = 1;
+    while (temp1 >>= 1) nbits++;
+    put_symbol(m_ac_table, (run_len << 4) + nbits);
+    put_value_bits(temp2, nbits);
+    run_len = 0;
+  }
+  if ((run_len) && (++m_eob_run == 0x7FFF))
+    flush_eob_run();
+}
+
+// Successive approximation refinement of the AC coefficients (section G.1.2.3). Coefficients that became nonzero in an
+// earlier scan only send a correction bit, buffered until the next symbol (or end-of-band run) that the decoder sees first.
+void jpeg_encoder::code_ac_refine(const int16 *pSrc, int ss, int se, int al)
+{
+  int abs_values[64], eob = 0;
+  for (int k = ss; k <= se; k++)
+  {
+    int temp = pSrc[k];
+    abs_values[k] = ((temp < 0) ? -temp : temp) >> al;
+    if (abs_values[k] == 1) eob = k; // index of the last newly nonzero coefficient
+  }
+
+  int run_len = 0;
+  uint num_new_corr_bits = 0;
+  uint8 *pCorr_bits = m_corr_bits + m_num_corr_bits;
+  for (int k = ss; k <= se; k++)
+  {
+    const int temp = abs_values[k];
+    if (!temp)
+    {
+      run_len++;
+      continue;
+    }
+    // Emit any required ZRLs, but not if they can be folded into the end-of-band.
+    while ((run_len >= 16) && (k <= eob))
+    {
+      flush_eob_run();
+      put_symbol(m_ac_table, 0xF0);
+      run_len -= 16;
+      put_correction_bits(pCorr_bits, num_new_corr_bits);
+      pCorr_bits = m_corr_bits; num_new_corr_bits = 0;
+    }
+    if (temp > 1)
+    {
+      pCorr_bits[num_new_corr_bits++] = static_cast<uint8>(temp & 1);
+      continue;
+    }
+    flush_eob_run();
+    put_symbol(m_ac_table, (run_len << 4) + 1);
+    put_value_bits((pSrc[k] < 0) ? 0 : 1, 1);
+    put_correction_bits(pCorr_bits, num_new_corr_bits);
+    pCorr_bits = m_corr_bits; num_new_corr_bits = 0;
+    run_len = 0;
+  }
+  if ((run_len) || (num_new_corr_bits))
+  {
+    m_eob_run++;
+    m_num_corr_bits += num_new_corr_bits;
+    // Don't let the end-of-band run or the correction bit buffer overflow while coding the next block.
+    if ((m_eob_run == 0x7FFF) || (m_num_corr_bits > JPGE_MAX_CORR_BITS - 64 + 1))
+      flush_eob_run();
+  }
+}
+
+void jpeg_encoder::code_progressive_scan(int comp, int ss, int se, int ah, int al)
+{
+  m_bit_buffer = 0; m_bits_in = 0;
+  memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+  m_eob_run = 0; m_num_corr_bits = 0;
+
+  if ((comp < 0) && (m_num_components > 1))
+  {
+    // Interleaved DC scan, in MCU order.
+    const int total_mcu_rows = m_image_y_mcu / m_mcu_y;
+    for (int mcu_y = 0; mcu_y < total_mcu_rows; mcu_y++)
+      for (int mcu_x = 0; mcu_x < m_mcus_per_row; mcu_x++)
+        for (int c = 0; c < m_num_components; c++)
+          for (int v = 0; v < m_comp_v_samp[c]; v++)
+            for (int h = 0; h < m_comp_h_samp[c]; h++)
+            {
+              const int16 *pSrc = m_pComp_coeffs[c] + (static_cast<size_t>(mcu_y * m_comp_v_samp[c] + v) * m_comp_blocks_x[c] + mcu_x * m_comp_h_samp[c] + h) * 64;
+              if (ah)
+                put_value_bits(pSrc[0] >> al, 1);
+              else
+                code_dc_first(pSrc, c, al);
+            }
+  }
+  else
+  {
+    // Non-interleaved scans only cover the blocks inside the component's own dimensions, not the MCU padding.
+    const int c = (comp < 0) ? 0 : comp;
+    const int comp_x = (m_image_x * m_comp_h_samp[c] + m_comp_h_samp[0] - 1) / m_comp_h_samp[0];
+    const int comp_y = (m_image_y * m_comp_v_samp[c] + m_comp_v_samp[0] - 1) / m_comp_v_samp[0];
+    m_ac_table = 2 + (c > 0);
+    for (int block_y = 0; block_y < (comp_y + 7) / 8; block_y++)
+      for (int block_x = 0; block_x < (comp_x + 7) / 8; block_x++)
+      {
+        const int16 *pSrc = m_pComp_coeffs[c] + (static_cast<size_t>(block_y) * m_comp_blocks_x[c] + block_x) * 64;
+        if (!ss)
+        {
+          if (ah)
+            put_value_bits(pSrc[0] >> al, 1);
+          else
+            code_dc_first(pSrc, c, al);
+        }
+        else if (ah)
+          code_ac_refine(pSrc, ss, se, al);
+        else
+          code_ac_first(pSrc, ss, se, al);
+      }
+  }
+  flush_eob_run();
+}
+
+// Writes the headers and every scan of the progressive script, then the EOI marker.
+bool jpeg_encoder::terminate_progressive()
+{
+  emit_marker(M_SOI);
+  emit_jfif_app0();
+  emit_dqt();
+  emit_sof();
+
+  const progressive_scan *pScans = (m_num_components == 1) ? s_y_scans : s_ycc_scans;
+  const int num_scans = (m_num_components == 1) ? (sizeof(s_y_scans) / sizeof(s_y_scans[0])) : (sizeof(s_ycc_scans) / sizeof(s_ycc_scans[0]));
+  for (int i = 0; i < num_scans; i++)
+  {
+    const progressive_scan &scan = pScans[i];
+
+    // DC refinement scans are raw bits; every other scan gets its own optimized tables.
+    if ((scan.m_ss) || (!scan.m_ah))
+    {
+      clear_obj(m_huff_count);
+      m_count_only = true;
+      code_progressive_scan(scan.m_comp, scan.m_ss, scan.m_se, scan.m_ah, scan.m_al);
+      m_count_only = false;
+
+      for (int t = 0; t < 4; t++)
+      {
+        uint32 total = 0;
+        for (int s = 0; s < 256; s++)
+          total += m_huff_count[t][s];
+        if (!total) continue;
+        optimize_huffman_table(t, (t < 2) ? DC_LUM_CODES : AC_LUM_CODES);
+        compute_huffman_table(&m_huff_codes[t][0], &m_huff_code_sizes[t][0], m_huff_bits[t], m_huff_val[t]);
+        emit_dht(m_huff_bits[t], m_huff_val[t], t & 1, t >= 2);
+      }
+    }
+
+    emit_progressive_sos(scan.m_comp, scan.m_ss, scan.m_se, scan.m_ah, scan.m_al);
+    code_progressive_scan(scan.m_comp, scan.m_ss, scan.m_se, scan.m_ah, scan.m_al);
+    flush_bits();
+    flush_output_buffer();
+  }
+
+  emit_marker(M_EOI);
+  m_pass_num = 3;
+  return m_all_stream_writes_succeeded;
+}
+
+// Target size mode (see params::m_target_size): the stored DCT blocks are requantized for every quality tried.
+void jpeg_encoder::set_quality(int quality)
+{
+  m_params.m_quality = quality;
+  compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
+  compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+}
+
+// Quantizes the stored DCT blocks with the current tables and codes them in MCU order: counting symbols in pass 1,
+// writing them (and any restart markers) in pass 2.
+void jpeg_encoder::code_dct_blocks()
+{
+  const int total_mcu_rows = m_image_y_mcu / m_mcu_y;
+  for (int mcu_y = 0; mcu_y < total_mcu_rows; mcu_y++)
+  {
+    for (int mcu_x = 0; mcu_x < m_mcus_per_row; mcu_x++)
+      for (int c = 0; c < m_num_components; c++)
+        for (int v = 0; v < m_comp_v_samp[c]; v++)
+          for (int h = 0; h < m_comp_h_samp[c]; h++)
+          {
+            const int16 *pSrc = m_pComp_coeffs[c] + (static_cast<size_t>(mcu_y * m_comp_v_samp[c] + v) * m_comp_blocks_x[c] + mcu_x * m_comp_h_samp[c] + h) * 64;
+            quantize_block(m_coefficient_array, pSrc, m_quantization_tables[c > 0]);
+            if (m_pass_num == 1)
+              code_coefficients_pass_one(c);
+            else
+              code_coefficients_pass_two(c);
+          }
+    end_mcu_row();
+  }
+}
+
+// Counts the bytes written to it.
+class counting_stream : public output_stream
+{
+public:
+  uint m_size;
+
+  counting_stream() : m_size(0) { }
+
+  virtual bool put_buf(const void* pBuf, int len)
+  {
+    (void)pBuf;
+    m_size += len;
+    return true;
+  }
+};
+
+// Returns the estimated file size at the given quality, from the symbol counts of the requantized blocks.
+// Leaves the Huffman tables for that quality in m_huff_bits/m_huff_val.
+uint64 jpeg_encoder::estimate_size(int quality)
+{
+  set_quality(quality);
+  clear_obj(m_huff_count);
+  first_pass_init();
+  code_dct_blocks();
+
+  if (m_params.m_two_pass_flag)
+  {
+    optimize_huffman_table(0+0, DC_LUM_CODES); optimize_huffman_table(2+0, AC_LUM_CODES);
+    if (m_num_components > 1)
+    {
+      optimize_huffman_table(0+1, DC_CHROMA_CODES); optimize_huffman_table(2+1, AC_CHROMA_CODES);
+    }
+  }
+  else
+    set_default_huffman_tables();
+
+  // Each DC symbol is followed by that many bits, each AC symbol by its low nibble.
+  uint64 total_bits = 0;
+  for (int t = 0; t < 4; t++)
+  {
+    if ((t & 1) && (m_num_components == 1)) continue;
+    compute_huffman_table(&m_huff_codes[t][0], &m_huff_code_sizes[t][0], m_huff_bits[t], m_huff_val[t]);
+    for (int sym = 0; sym < 256; sym++)
+      if (m_huff_count[t][sym])
+        total_bits += static_cast<uint64>(m_huff_count[t][sym]) * (m_huff_code_sizes[t][sym] + ((t < 2) ? sym : (sym & 15)));
+  }
+
+  counting_stream headers;
+  output_stream *pStream = m_pStream;
+  m_pStream = &headers;
+  emit_markers();
+  m_pStream = pStream;
+
+  // On average one byte in 256 is an 0xFF that gets a stuffed 0. Every restart costs up to 7 bits of padding and a 2 byte
+  // RSTn marker, the EOI marker another 2 bytes.
+  const uint64 data_bytes = (total_bits + 7) / 8;
+  const int total_mcu_rows = m_image_y_mcu / m_mcu_y;
+  const uint64 num_restarts = m_restart_mcu_rows ? (total_mcu_rows - 1) / m_restart_mcu_rows : 0;
+  return headers.m_size + data_bytes + data_bytes / 256 + num_restarts * 3 + 2;
+}
+
+bool jpeg_encoder::terminate_target_size()
+{
+  // The size grows with the quality, binary search for the highest quality that fits.
+  int lo = 1, hi = 100, best = 1;
+  while (lo <= hi)
+  {
+    const int quality = (lo + hi) >> 1;
+    if (estimate_size(quality) <= static_cast<uint64>(m_params.m_target_size))
+    {
+      best = quality; lo = quality + 1;
+    }
+    else
+      hi = quality - 1;
+  }
+
+  // Recount at the chosen quality for its Huffman tables, then write the file once.
+  estimate_size(best);
+  if (!second_pass_init()) return false;
+  code_dct_blocks();
+  return terminate_pass_two();
+}
+
+// Duplicates the last scanline into the rest of the MCU row and codes it.
+void jpeg_encoder::process_partial_mcu_row()
 {
   if (m_mcu_y_ofs)
   {
@@ -793,10 +1381,28 @@ bool jpeg_encoder::process_end_of_image()
     }
 
     process_mcu_row();
+    m_mcu_y_ofs = 0;
   }
+}
+
+bool jpeg_encoder::process_end_of_image()
+{
+  process_partial_mcu_row();
+
+  if (m_params.m_progressive_flag)
+    return terminate_progressive();
+
+  if (m_params.m_target_size)
+    return terminate_target_size();
 
   if (m_pass_num == 1)
-    return terminate_pass_one();
+  {
+    if (!terminate_pass_one()) return false;
+    if (!m_pCoeffs) return true;
+    replay_coefficients(m_image_y_mcu / m_mcu_y);
+    m_pCoeffs->clear();
+    return terminate_pass_two();
+  }
   else
     return terminate_pass_two();
 }
@@ -843,14 +1449,29 @@ void jpeg_encoder::load_mcu(const void *pSrc)
   {
     process_mcu_row();
     m_mcu_y_ofs = 0;
+    end_mcu_row();
   }
 }
 
+// Counts a completed MCU row, and writes a restart marker if it ends a restart interval (but never after the final row).
+void jpeg_encoder::end_mcu_row()
+{
+  m_mcu_rows_done++;
+  if ((m_restart_mcu_rows) && ((m_mcu_rows_done % m_restart_mcu_rows) == 0) && (m_mcu_rows_done * m_mcu_y < m_image_y))
+    emit_restart();
+}
+
 void jpeg_encoder::clear()
 {
   m_mcu_lines[0] = NULL;
+  m_out_buf = NULL;
   m_pass_num = 0;
   m_all_stream_writes_succeeded = true;
+  m_restart_mcu_rows = 0;
+  m_mcu_rows_done = 0;
+  m_pCoeffs = NULL;
+  m_pComp_coeffs[0] = m_pComp_coeffs[1] = m_pComp_coeffs[2] = NULL;
+  m_count_only = false;
 }
 
 jpeg_encoder::jpeg_encoder()
@@ -875,6 +1496,10 @@ bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_c
 void jpeg_encoder::deinit()
 {
   jpge_free(m_mcu_lines[0]);
+  jpge_free(m_out_buf);
+  delete m_pCoeffs;
+  for (int c = 0; c < 3; c++)
+    jpge_free(m_pComp_coeffs[c]);
   clear();
 }
 
@@ -895,6 +1520,201 @@ bool jpeg_encoder::process_scanline(const void* pScanline)
   return m_all_stream_writes_succeeded;
 }
 
+// Growable memory stream, holds the entropy coded data of one restart segment.
+class segment_stream : public output_stream
+{
+  segment_stream(const segment_stream &);
+  segment_stream &operator= (const segment_stream &);
+
+public:
+  uint8 *m_pBuf;
+  uint m_size, m_capacity;
+
+  segment_stream() : m_pBuf(NULL), m_size(0), m_capacity(0) { }
+
+  virtual ~segment_stream() { jpge_free(m_pBuf); }
+
+  virtual bool put_buf(const void* pBuf, int len)
+  {
+    if (m_size + len > m_capacity)
+    {
+      uint new_capacity = JPGE_MAX(m_capacity * 2, JPGE_MAX(m_size + len, 4096U));
+      uint8 *pNew_buf = static_cast<uint8*>(realloc(m_pBuf, new_capacity));
+      if (!pNew_buf) return false;
+      m_pBuf = pNew_buf; m_capacity = new_capacity;
+    }
+    memcpy(m_pBuf + m_size, pBuf, len);
+    m_size += len;
+    return true;
+  }
+};
+
+// Sets up this encoder to code restart segments with the parent's layout, quantization and Huffman tables.
+// Segment encoders never write markers, and accumulate symbol statistics in pass 1.
+bool jpeg_encoder::init_segment_encoder(const jpeg_encoder &parent)
+{
+  deinit();
+  m_params = parent.m_params;
+  if (!jpg_alloc(parent.m_image_x, parent.m_image_y, parent.m_image_bpp)) return false;
+  first_pass_init();
+  if (parent.m_pass_num == 1)
+    clear_obj(m_huff_count);
+  else
+  {
+    memcpy(m_huff_codes, parent.m_huff_codes, sizeof(m_huff_codes));
+    memcpy(m_huff_code_sizes, parent.m_huff_code_sizes, sizeof(m_huff_code_sizes));
+    m_pass_num = 2;
+  }
+  return true;
+}
+
+void jpeg_encoder::begin_segment()
+{
+  m_bit_buffer = 0; m_bits_in = 0;
+  memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+  m_mcu_y_ofs = 0;
+  m_pOut_buf = m_out_buf;
+  m_out_buf_left = m_out_buf_size;
+}
+
+// Codes scanlines [first_line, last_line) as one restart segment. In pass 2 the byte aligned entropy coded data
+// (without the RSTn marker) goes to pStream. If pCoeffs is not NULL pass 1 fills it, and pass 2 codes from it.
+bool jpeg_encoder::encode_segment(const uint8 *pImage, int first_line, int last_line, output_stream *pStream, coeff_buffer *pCoeffs)
+{
+  m_pStream = pStream;
+  m_pCoeffs = pCoeffs;
+  begin_segment();
+  if ((m_pass_num == 2) && (pCoeffs))
+    replay_coefficients((last_line - first_line + m_mcu_y - 1) / m_mcu_y);
+  else
+  {
+    for (int y = first_line; y < last_line; y++)
+      load_mcu(pImage + y * m_image_bpl);
+    process_partial_mcu_row();
+  }
+  m_pCoeffs = NULL;
+  if (m_pass_num == 2)
+  {
+    flush_bits();
+    flush_output_buffer();
+  }
+  return m_all_stream_writes_succeeded;
+}
+
+struct segment_job
+{
+  const uint8 *m_pImage;
+  int m_lines_per_segment, m_num_lines;
+  int m_num_segments;
+  segment_stream *m_pSegments;
+  coeff_buffer *m_pSegment_coeffs;
+  std::atomic<int> m_next_segment;
+  std::atomic<bool> m_failed;
+};
+
+void jpeg_encoder::segment_worker(segment_job *pJob, jpeg_encoder *pEncoder)
+{
+  for ( ; ; )
+  {
+    const int segment_index = pJob->m_next_segment++;
+    if ((segment_index >= pJob->m_num_segments) || (pJob->m_failed)) break;
+    const int first_line = segment_index * pJob->m_lines_per_segment;
+    const int last_line = JPGE_MIN(first_line + pJob->m_lines_per_segment, pJob->m_num_lines);
+    coeff_buffer *pCoeffs = pJob->m_pSegment_coeffs ? &pJob->m_pSegment_coeffs[segment_index] : NULL;
+    if (!pEncoder->encode_segment(pJob->m_pImage, first_line, last_line, &pJob->m_pSegments[segment_index], pCoeffs))
+      pJob->m_failed = true;
+  }
+}
+
+int jpeg_encoder::get_num_segments() const
+{
+  return (m_image_y_mcu / m_mcu_y + m_restart_mcu_rows - 1) / m_restart_mcu_rows;
+}
+
+// Runs the current pass over all restart segments on m_num_threads threads, then writes (pass 2) or merges (pass 1) the results.
+// pSegment_coeffs is NULL, or an array of get_num_segments() buffers that carry the quantized coefficients from pass 1 to pass 2.
+bool jpeg_encoder::process_segments(const uint8 *pImage, coeff_buffer *pSegment_coeffs)
+{
+  const int num_segments = get_num_segments();
+  int num_threads = m_params.m_num_threads ? m_params.m_num_threads : static_cast<int>(std::thread::hardware_concurrency());
+  num_threads = JPGE_MIN(JPGE_MAX(num_threads, 1), num_segments);
+
+  jpeg_encoder *pEncoders = new jpeg_encoder[num_threads];
+  segment_job job;
+  job.m_pImage = pImage;
+  job.m_lines_per_segment = m_restart_mcu_rows * m_mcu_y;
+  job.m_num_lines = m_image_y;
+  job.m_num_segments = num_segments;
+  job.m_pSegments = new segment_stream[num_segments];
+  job.m_pSegment_coeffs = pSegment_coeffs;
+  job.m_next_segment = 0;
+  job.m_failed = false;
+
+  for (int i = 0; i < num_threads; i++)
+    if (!pEncoders[i].init_segment_encoder(*this)) job.m_failed = true;
+
+  if (!job.m_failed)
+  {
+    std::thread *pThreads = new std::thread[num_threads - 1];
+    for (int i = 1; i < num_threads; i++)
+      pThreads[i - 1] = std::thread(segment_worker, &job, &pEncoders[i]);
+    segment_worker(&job, &pEncoders[0]);
+    for (int i = 1; i < num_threads; i++)
+      pThreads[i - 1].join();
+    delete[] pThreads;
+  }
+
+  bool status = !job.m_failed;
+  if (status)
+  {
+    if (m_pass_num == 1)
+    {
+      for (int i = 0; i < num_threads; i++)
+        for (int t = 0; t < 4; t++)
+          for (int s = 0; s < 256; s++)
+            m_huff_count[t][s] += pEncoders[i].m_huff_count[t][s];
+    }
+    else
+    {
+      for (int i = 0; i < num_segments; i++)
+      {
+        m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(job.m_pSegments[i].m_pBuf, job.m_pSegments[i].m_size);
+        if (i < (num_segments - 1))
+          emit_marker(M_RST0 + (i & 7));
+      }
+    }
+    status = ((m_pass_num == 1) ? terminate_pass_one() : terminate_pass_two()) && m_all_stream_writes_succeeded;
+  }
+
+  delete[] job.m_pSegments;
+  delete[] pEncoders;
+  return status;
+}
+
+bool jpeg_encoder::process_image(const void* pImage)
+{
+  const uint8 *pSrc = static_cast<const uint8*>(pImage);
+  if ((m_pass_num < 1) || (m_pass_num > 2)) return false;
+
+  if ((!m_restart_mcu_rows) || (m_params.m_num_threads == 1) || (m_params.m_target_size) || (get_num_segments() < 2))
+  {
+    for (uint pass_index = 0; pass_index < get_total_passes(); pass_index++)
+    {
+      for (int i = 0; i < m_image_y; i++)
+        if (!process_scanline(pSrc + i * m_image_bpl)) return false;
+      if (!process_scanline(NULL)) return false;
+    }
+    return true;
+  }
+
+  coeff_buffer *pSegment_coeffs = m_pCoeffs ? new coeff_buffer[get_num_segments()] : NULL;
+  bool status = true;
+  while ((status) && (m_pass_num <= 2))
+    status = process_segments(pSrc, pSegment_coeffs);
+  delete[] pSegment_coeffs;
+  return status;
+}
+
 // Higher level wrappers/examples (optional).
 #include <stdio.h>
 
@@ -958,17 +1778,8 @@ bool compress_image_to_jpeg_file(const char *pFilename, int width, int height, i
   if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
     return false;
 
-  for (uint pass_index = 0; pass_index < dst_image.get_total_passes(); pass_index++)
-  {
-    for (int i = 0; i < height; i++)
-    {
-       const uint8* pBuf = pImage_data + i * width * num_channels;
-       if (!dst_image.process_scanline(pBuf))
-          return false;
-    }
-    if (!dst_image.process_scanline(NULL))
-       return false;
-  }
+  if (!dst_image.process_image(pImage_data))
+    return false;
 
   dst_image.deinit();
 
@@ -1013,26 +1824,111 @@ bool compress_image_to_jpeg_file_in_memory(void *pDstBuf, int &buf_size, int wid
 
    buf_size = 0;
 
-   jpge::jpeg_encoder dst_image;
-   if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
+   if (!compress_image_to_stream(dst_stream, width, height, num_channels, pImage_data, comp_params))
       return false;
 
-   for (uint pass_index = 0; pass_index < dst_image.get_total_passes(); pass_index++)
+   buf_size = dst_stream.get_size();
+   return true;
+}
+
+chunked_output_stream::chunked_output_stream(uint min_chunk_size) : m_pHead(NULL), m_pTail(NULL), m_total_size(0), m_num_chunks(0)
+{
+   m_min_chunk_size = JPGE_MIN(JPGE_MAX(min_chunk_size, (uint)JPGE_MIN_CHUNK_SIZE), (uint)JPGE_MAX_CHUNK_SIZE);
+}
+
+chunked_output_stream::~chunked_output_stream()
+{
+   clear();
+}
+
+void chunked_output_stream::clear()
+{
+   free_chunks(m_pHead);
+   m_pHead = m_pTail = NULL;
+   m_total_size = 0; m_num_chunks = 0;
+}
+
+bool chunked_output_stream::put_buf(const void* pBuf, int len)
+{
+   if (len < 0) return false;
+   const uint8 *pSrc = static_cast<const uint8*>(pBuf);
+   uint n = len;
+   while (n)
    {
-     for (int i = 0; i < height; i++)
-     {
-        const uint8* pScanline = pImage_data + i * width * num_channels;
-        if (!dst_image.process_scanline(pScanline))
-           return false;
-     }
-     if (!dst_image.process_scanline(NULL))
-        return false;
+      if ((!m_pTail) || (m_pTail->m_size == m_pTail->m_capacity))
+      {
+         // Grow by about half the output so far: the unused tail of the last chunk stays a fraction of the compressed size.
+         uint capacity = JPGE_MIN(JPGE_MAX(m_total_size / 2, m_min_chunk_size), (uint)JPGE_MAX_CHUNK_SIZE);
+         chunk *pChunk = static_cast<chunk*>(jpge_malloc(sizeof(chunk) + capacity));
+         if (!pChunk) return false;
+         pChunk->m_pNext = NULL; pChunk->m_size = 0; pChunk->m_capacity = capacity;
+         if (m_pTail) m_pTail->m_pNext = pChunk; else m_pHead = pChunk;
+         m_pTail = pChunk;
+         m_num_chunks++;
+      }
+      uint n_copy = JPGE_MIN(n, m_pTail->m_capacity - m_pTail->m_size);
+      memcpy(m_pTail->get_data() + m_pTail->m_size, pSrc, n_copy);
+      m_pTail->m_size += n_copy; m_total_size += n_copy;
+      pSrc += n_copy; n -= n_copy;
    }
+   return true;
+}
+
+bool chunked_output_stream::copy_to(void *pDst, uint dst_size) const
+{
+   if ((!pDst) || (dst_size < m_total_size)) return false;
+   uint8 *pDst_bytes = static_cast<uint8*>(pDst);
+   for (const chunk *pChunk = m_pHead; pChunk; pChunk = pChunk->m_pNext)
+   {
+      memcpy(pDst_bytes, pChunk->get_data(), pChunk->m_size);
+      pDst_bytes += pChunk->m_size;
+   }
+   return true;
+}
+
+chunked_output_stream::chunk *chunked_output_stream::release_chunks()
+{
+   chunk *pHead = m_pHead;
+   m_pHead = m_pTail = NULL;
+   m_total_size = 0; m_num_chunks = 0;
+   return pHead;
+}
+
+void chunked_output_stream::free_chunks(chunk *pChunk)
+{
+   while (pChunk) { chunk *pNext = pChunk->m_pNext; jpge_free(pChunk); pChunk = pNext; }
+}
+
+bool compress_image_to_stream(output_stream &dst_stream, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
+{
+   jpge::jpeg_encoder dst_image;
+   if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
+      return false;
+
+   if (!dst_image.process_image(pImage_data))
+      return false;
 
    dst_image.deinit();
+   return true;
+}
 
-   buf_size = dst_stream.get_size();
+bool compress_image_to_jpeg_chunks(chunked_output_stream &dst_stream, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
+{
+   dst_stream.clear();
+   if (!compress_image_to_stream(dst_stream, width, height, num_channels, pImage_data, comp_params))
+   {
+      dst_stream.clear();
+      return false;
+   }
    return true;
 }
 
+bool compress_image_to_jpeg_callback(put_buf_func_ptr pPut_buf_func, void *pUser_data, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
+{
+   if (!pPut_buf_func)
+      return false;
+   callback_output_stream dst_stream(pPut_buf_func, pUser_data);
+   return compress_image_to_stream(dst_stream, width, height, num_channels, pImage_data, comp_params);
+}
+
 } // namespace jpge
@@ -11,6 +11,7 @@ namespace jpge
   typedef signed int     int32;
   typedef unsigned short uint16;
   typedef unsigned int   uint32;
+  typedef unsigned long long uint64;
   typedef unsigned int   uint;
   
   // JPEG chroma subsampling factors. Y_ONLY (grayscale images) and H2V2 (color images) are the most common.
@@ -19,12 +20,14 @@ namespace jpge
   // JPEG compression parameters structure.
   struct params
   {
-    inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false) { }
+    inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false), m_single_feed_flag(false), m_progressive_flag(false), m_restart_interval(0), m_num_threads(1), m_out_buf_size(0), m_target_size(0) { }
 
     inline bool check() const
     {
       if ((m_quality < 1) || (m_quality > 100)) return false;
       if ((uint)m_subsampling > (uint)H2V2) return false;
+      if ((m_restart_interval < 0) || (m_num_threads < 0) || (m_out_buf_size < 0) || (m_target_size < 0)) return false;
+      if ((m_target_size) && (m_progressive_flag)) return false;
       return true;
     }
 
@@ -42,7 +45,39 @@ namespace jpge
     // If true, the Y quantization table is also used for the CbCr channels.
     bool m_no_chroma_discrim_flag;
 
+    // Enables optimized Huffman tables (smaller files). Both passes need every scanline, see get_total_passes().
     bool m_two_pass_flag;
+
+    // With m_two_pass_flag, keeps the quantized coefficients of the first pass in a compact buffer and codes the
+    // second pass from it, so the scanlines only have to be supplied once and aren't colour converted/DCT'd twice.
+    bool m_single_feed_flag;
+
+    // Writes a progressive JPEG (spectral selection and successive approximation scans, each with optimized Huffman tables)
+    // so a low frequency version of the whole image can be shown after the first few percent of the file.
+    // The scanlines are supplied once; the quantized coefficients of the whole image are kept in memory (2 bytes each).
+    // Restart markers and m_num_threads are ignored in this mode.
+    bool m_progressive_flag;
+
+    // Restart interval, in MCU rows (0 = no restart markers). Writes a DRI marker and an RSTn marker after every
+    // m_restart_interval MCU rows. Clamped so the interval fits in the 16-bit DRI field.
+    int m_restart_interval;
+
+    // Number of threads used by jpeg_encoder::process_image() (0 = one per hardware thread). Values other than 1 encode
+    // the restart segments concurrently, so restart markers are enabled at one MCU row per segment if m_restart_interval is 0.
+    // The output is identical to a single threaded encode with the same restart interval.
+    int m_num_threads;
+
+    // Size in bytes of the buffer the entropy coded data is gathered in before it's handed to the output stream
+    // (0 = 64KB, minimum 1KB). Larger buffers mean fewer, bigger output_stream::put_buf() calls.
+    int m_out_buf_size;
+
+    // Target size of the whole file in bytes (0 = off), m_quality is then picked by the encoder. The scanlines are
+    // supplied once and their DCT blocks kept in memory (2 bytes per coefficient). At the end of the image the highest
+    // quality whose estimated size fits is found by requantizing the blocks and counting symbols only, then the file is
+    // written once at that quality (get_params().m_quality reports it). 0xFF stuffing is estimated, so the size can be a
+    // fraction of a percent off. If even quality 1 doesn't fit, quality 1 is used.
+    // Not supported with m_progressive_flag. m_num_threads is ignored.
+    int m_target_size;
   };
   
   // Writes JPEG image to a file. 
@@ -55,7 +90,7 @@ namespace jpge
   bool compress_image_to_jpeg_file_in_memory(void *pBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params());
     
   // Output stream abstract class - used by the jpeg_encoder class to write to the output stream. 
-  // put_buf() is generally called with len==JPGE_OUT_BUF_SIZE bytes, but for headers it'll be called with smaller amounts.
+  // put_buf() is generally called with len close to params::m_out_buf_size bytes, but for headers it'll be called with smaller amounts.
   class output_stream
   {
   public:
@@ -63,7 +98,89 @@ namespace jpge
     virtual bool put_buf(const void* Pbuf, int len) = 0;
     template<class T> inline bool put_obj(const T& obj) { return put_buf(&obj, sizeof(T)); }
   };
+
+  // Output stream that appends to a list of heap allocated chunks, so memory use tracks the compressed size instead of a
+  // guessed worst case. Chunks grow with the amount written so far (min_chunk_size up to JPGE_MAX_CHUNK_SIZE bytes), and
+  // are handed out as-is: walk them with get_first_chunk(), or take ownership with release_chunks().
+  class chunked_output_stream : public output_stream
+  {
+    chunked_output_stream(const chunked_output_stream &);
+    chunked_output_stream &operator= (const chunked_output_stream &);
+
+  public:
+    enum { JPGE_MIN_CHUNK_SIZE = 4096, JPGE_MAX_CHUNK_SIZE = 4 * 1024 * 1024 };
+
+    // A chunk's data immediately follows its header in the same allocation.
+    struct chunk
+    {
+      chunk *m_pNext;
+      uint m_size, m_capacity;
+
+      inline uint8 *get_data() { return reinterpret_cast<uint8*>(this + 1); }
+      inline const uint8 *get_data() const { return reinterpret_cast<const uint8*>(this + 1); }
+    };
+
+    explicit chunked_output_stream(uint min_chunk_size = 64 * 1024);
+    virtual ~chunked_output_stream();
+
+    virtual bool put_buf(const void* pBuf, int len);
+
+    // Frees all chunks.
+    void clear();
+
+    // Total number of bytes written.
+    uint get_size() const { return m_total_size; }
+    uint get_num_chunks() const { return m_num_chunks; }
+    const chunk *get_first_chunk() const { return m_pHead; }
+
+    // Copies the chunks to a contiguous buffer, which must hold at least get_size() bytes.
+    bool copy_to(void *pDst, uint dst_size) const;
+
+    // Returns the chunk list and empties the stream. The caller must free it with free_chunks().
+    chunk *release_chunks();
+    static void free_chunks(chunk *pChunk);
+
+  private:
+    chunk *m_pHead, *m_pTail;
+    uint m_total_size, m_num_chunks, m_min_chunk_size;
+  };
+
+  // Writer callback used by callback_output_stream. Returns false to abort compression.
+  typedef bool (*put_buf_func_ptr)(const void* pBuf, int len, void *pUser_data);
+
+  // Output stream that forwards every write to a caller supplied function (socket, file handle, custom allocator, etc.)
+  class callback_output_stream : public output_stream
+  {
+  public:
+    callback_output_stream(put_buf_func_ptr pPut_buf_func, void *pUser_data) : m_pPut_buf_func(pPut_buf_func), m_pUser_data(pUser_data), m_size(0) { }
+
+    virtual bool put_buf(const void* pBuf, int len)
+    {
+      if ((!m_pPut_buf_func) || (!(*m_pPut_buf_func)(pBuf, len, m_pUser_data))) return false;
+      m_size += len;
+      return true;
+    }
+
+    uint get_size() const { return m_size; }
+
+  private:
+    put_buf_func_ptr m_pPut_buf_func;
+    void *m_pUser_data;
+    uint m_size;
+  };
+
+  // Writes JPEG image to any output stream, e.g. a chunked_output_stream or callback_output_stream.
+  bool compress_image_to_stream(output_stream &dst_stream, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params());
+
+  // Writes JPEG image to a chunked, growable memory buffer (dst_stream is cleared first).
+  bool compress_image_to_jpeg_chunks(chunked_output_stream &dst_stream, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params());
+
+  // Writes JPEG image through a writer callback.
+  bool compress_image_to_jpeg_callback(put_buf_func_ptr pPut_buf_func, void *pUser_data, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params());
     
+  struct segment_job;
+  class coeff_buffer;
+
   // Lower level jpeg_encoder class - useful if more control is needed than the above helper functions.
   class jpeg_encoder
   {
@@ -84,7 +201,7 @@ namespace jpge
     // Deinitializes the compressor, freeing any allocated memory. May be called at any time.
     void deinit();
 
-    uint get_total_passes() const { return m_params.m_two_pass_flag ? 2 : 1; }
+    uint get_total_passes() const { return (m_params.m_two_pass_flag && !m_params.m_single_feed_flag && !m_params.m_progressive_flag && !m_params.m_target_size) ? 2 : 1; }
     inline uint get_cur_pass() { return m_pass_num; }
 
     // Call this method with each source scanline.
@@ -92,6 +209,11 @@ namespace jpge
     // You must call with NULL after all scanlines are processed to finish compression.
     // Returns false on out of memory or if a stream write fails.
     bool process_scanline(const void* pScanline);
+
+    // Compresses a whole image in memory, running all passes (don't call process_scanline() when using this method).
+    // width * src_channels bytes per scanline is expected. Restart segments are encoded on m_num_threads threads.
+    // Returns false on out of memory or if a stream write fails.
+    bool process_image(const void* pImage);
         
   private:
     jpeg_encoder(const jpeg_encoder &);
@@ -119,14 +241,26 @@ namespace jpge
     uint8 m_huff_val[4][256];
     uint32 m_huff_count[4][256];
     int m_last_dc_val[3];
-    enum { JPGE_OUT_BUF_SIZE = 2048 };
-    uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
+    enum { JPGE_DEFAULT_OUT_BUF_SIZE = 64 * 1024, JPGE_MIN_OUT_BUF_SIZE = 1024 };
+    uint8 *m_out_buf;
+    uint m_out_buf_size;
     uint8 *m_pOut_buf;
     uint m_out_buf_left;
-    uint32 m_bit_buffer;
+    uint64 m_bit_buffer;
     uint m_bits_in;
     uint8 m_pass_num;
     bool m_all_stream_writes_succeeded;
+    int m_restart_mcu_rows;
+    int m_mcu_rows_done;
+    coeff_buffer *m_pCoeffs;
+    int16 *m_pComp_coeffs[3];
+    int m_comp_blocks_x[3], m_comp_block_ofs[3];
+    bool m_count_only;
+    int m_ac_table;
+    uint m_eob_run;
+    enum { JPGE_MAX_CORR_BITS = 1000 };
+    uint m_num_corr_bits;
+    uint8 m_corr_bits[JPGE_MAX_CORR_BITS];
         
     void optimize_huffman_table(int table_num, int table_len);
     void emit_byte(uint8 i);
@@ -135,6 +269,7 @@ namespace jpge
     void emit_jfif_app0();
     void emit_dqt();
     void emit_sof();
+    void emit_progressive_sos(int comp, int ss, int se, int ah, int al);
     void emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag);
     void emit_dhts();
     void emit_sos();
@@ -142,9 +277,21 @@ namespace jpge
     void compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *bits, uint8 *val);
     void compute_quant_table(int32 *dst, int16 *src);
     void adjust_quant_table(int32 *dst, int32 *src);
+    void set_default_huffman_tables();
     void first_pass_init();
     bool second_pass_init();
+    bool jpg_alloc(int p_x_res, int p_y_res, int src_channels);
     bool jpg_open(int p_x_res, int p_y_res, int src_channels);
+    bool init_segment_encoder(const jpeg_encoder &parent);
+    void begin_segment();
+    bool encode_segment(const uint8 *pImage, int first_line, int last_line, output_stream *pStream, coeff_buffer *pCoeffs);
+    int get_num_segments() const;
+    bool process_segments(const uint8 *pImage, coeff_buffer *pSegment_coeffs);
+    static void segment_worker(segment_job *pJob, jpeg_encoder *pEncoder);
+    void emit_dri();
+    void emit_restart();
+    void end_mcu_row();
+    void replay_coefficients(int num_mcu_rows);
     void load_block_8_8_grey(int x);
     void load_block_8_8(int x, int y, int c);
     void load_block_16_8(int x, int c);
@@ -152,10 +299,28 @@ namespace jpge
     void load_quantized_coefficients(int component_num);
     void flush_output_buffer();
     void put_bits(uint bits, uint len);
+    void put_word(uint32 c);
+    void put_byte(uint8 c);
+    void flush_bits();
     void code_coefficients_pass_one(int component_num);
     void code_coefficients_pass_two(int component_num);
     void code_block(int component_num);
+    void store_block(int component_num);
+    void put_symbol(int table_num, uint sym);
+    void put_value_bits(uint bits, uint len);
+    void put_correction_bits(const uint8 *pBits, uint num_bits);
+    void flush_eob_run();
+    void code_dc_first(const int16 *pSrc, int component_num, int al);
+    void code_ac_first(const int16 *pSrc, int ss, int se, int al);
+    void code_ac_refine(const int16 *pSrc, int ss, int se, int al);
+    void code_progressive_scan(int comp, int ss, int se, int ah, int al);
+    bool terminate_progressive();
+    void set_quality(int quality);
+    void code_dct_blocks();
+    uint64 estimate_size(int quality);
+    bool terminate_target_size();
     void process_mcu_row();
+    void process_partial_mcu_row();
     bool terminate_pass_one();
     bool terminate_pass_two();
     bool process_end_of_image();
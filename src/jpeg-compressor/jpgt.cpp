@@ -0,0 +1,391 @@
+// jpgt.cpp - Streaming JPEG to JPEG transcoder, see jpgt.h.
+// The pipeline is: jpeg_decoder::decode() -> [resampler] -> [line_ring, crossing to the encoding thread] -> encoder_sink.
+
+#include "jpgt.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define JPGT_MAX(a,b) (((a)>(b))?(a):(b))
+#define JPGT_MIN(a,b) (((a)<(b))?(a):(b))
+
+namespace jpgt {
+
+static inline void *jpgt_malloc(size_t nSize) { return malloc(nSize); }
+static inline void jpgt_free(void *p) { free(p); }
+
+// A stage of the pipeline, receives the image one line at a time, top to bottom.
+class line_sink
+{
+public:
+  virtual ~line_sink() { }
+  virtual bool put_line(const uint8 *pLine) = 0;
+};
+
+// Last stage: feeds the lines to the encoder, or to two encoders with the top and bottom halves of the image.
+class encoder_sink : public line_sink
+{
+  encoder_sink(const encoder_sink &);
+  encoder_sink &operator= (const encoder_sink &);
+
+  jpge::jpeg_encoder m_encoders[2];
+  int m_num_encoders, m_split_y, m_y;
+
+public:
+  encoder_sink() : m_num_encoders(0), m_split_y(0), m_y(0) { }
+
+  bool init(jpge::output_stream *pDst, jpge::output_stream *pDst_bottom, int width, int height, int num_channels, const params &trans_params)
+  {
+    // Every line is only supplied once.
+    jpge::params comp_params(trans_params.m_comp_params);
+    if (comp_params.m_two_pass_flag)
+      comp_params.m_single_feed_flag = true;
+    comp_params.m_num_threads = 1;
+
+    m_y = 0;
+    m_num_encoders = trans_params.m_split_over_under ? 2 : 1;
+    m_split_y = trans_params.m_split_over_under ? (height / 2) : height;
+    if (!m_encoders[0].init(pDst, width, m_split_y, num_channels, comp_params)) return false;
+    if (m_num_encoders == 2)
+      return m_encoders[1].init(pDst_bottom, width, height - m_split_y, num_channels, comp_params);
+    return true;
+  }
+
+  virtual bool put_line(const uint8 *pLine)
+  {
+    return m_encoders[(m_y++ < m_split_y) ? 0 : 1].process_scanline(pLine);
+  }
+
+  bool finish()
+  {
+    for (int i = 0; i < m_num_encoders; i++)
+      if (!m_encoders[i].process_scanline(NULL)) return false;
+    return true;
+  }
+};
+
+// Tent filter taps of one axis: for every destination pixel, the source pixels (clamped to the edges) and their weights.
+// The tent is widened to the scale factor when downsampling, so it averages every source pixel instead of skipping some.
+class filter_axis
+{
+  filter_axis(const filter_axis &);
+  filter_axis &operator= (const filter_axis &);
+
+public:
+  int *m_pOfs;  // taps of destination pixel i are [m_pOfs[i], m_pOfs[i + 1])
+  int *m_pSrc;
+  float *m_pWeight;
+
+  filter_axis() : m_pOfs(NULL), m_pSrc(NULL), m_pWeight(NULL) { }
+  ~filter_axis() { jpgt_free(m_pOfs); jpgt_free(m_pSrc); jpgt_free(m_pWeight); }
+
+  bool init(int src_size, int dst_size)
+  {
+    const double scale = static_cast<double>(src_size) / dst_size;
+    const double radius = JPGT_MAX(scale, 1.0);
+    const int max_taps = static_cast<int>(ceil(radius * 2.0)) + 1;
+    m_pOfs = static_cast<int*>(jpgt_malloc((dst_size + 1) * sizeof(int)));
+    m_pSrc = static_cast<int*>(jpgt_malloc(dst_size * max_taps * sizeof(int)));
+    m_pWeight = static_cast<float*>(jpgt_malloc(dst_size * max_taps * sizeof(float)));
+    if ((!m_pOfs) || (!m_pSrc) || (!m_pWeight)) return false;
+
+    int n = 0;
+    for (int i = 0; i < dst_size; i++)
+    {
+      m_pOfs[i] = n;
+      const double center = (i + 0.5) * scale - 0.5;
+      const int first = static_cast<int>(ceil(center - radius)), last = static_cast<int>(floor(center + radius));
+      double total = 0.0;
+      for (int j = first; j <= last; j++)
+      {
+        const double w = 1.0 - fabs(j - center) / radius;
+        if (w <= 0.0) continue;
+        m_pSrc[n] = JPGT_MIN(JPGT_MAX(j, 0), src_size - 1);
+        m_pWeight[n++] = static_cast<float>(w);
+        total += w;
+      }
+      for (int k = m_pOfs[i]; k < n; k++)
+        m_pWeight[k] = static_cast<float>(m_pWeight[k] / total);
+    }
+    m_pOfs[dst_size] = n;
+    return true;
+  }
+};
+
+// Resampling stage. Each source line is filtered horizontally into a small window of float lines, which holds just
+// enough lines for the vertical filter of the next destination line.
+class resampler : public line_sink
+{
+  resampler(const resampler &);
+  resampler &operator= (const resampler &);
+
+  filter_axis m_x, m_y;
+  int m_num_channels, m_dst_width, m_dst_height;
+  int m_window_lines, m_src_y, m_dst_y;
+  float *m_pWindow, *m_pAccum;
+  uint8 *m_pDst_line;
+  line_sink *m_pNext;
+
+public:
+  resampler() : m_num_channels(0), m_dst_width(0), m_dst_height(0), m_window_lines(0), m_src_y(0), m_dst_y(0), m_pWindow(NULL), m_pAccum(NULL), m_pDst_line(NULL), m_pNext(NULL) { }
+  ~resampler() { jpgt_free(m_pWindow); jpgt_free(m_pAccum); jpgt_free(m_pDst_line); }
+
+  bool init(int src_width, int src_height, int dst_width, int dst_height, int num_channels, line_sink *pNext)
+  {
+    if ((!m_x.init(src_width, dst_width)) || (!m_y.init(src_height, dst_height))) return false;
+    m_num_channels = num_channels;
+    m_dst_width = dst_width; m_dst_height = dst_height;
+    m_src_y = 0; m_dst_y = 0;
+    m_pNext = pNext;
+
+    // The taps of a line are sorted, so its span is last - first + 1.
+    m_window_lines = 1;
+    for (int y = 0; y < dst_height; y++)
+      m_window_lines = JPGT_MAX(m_window_lines, m_y.m_pSrc[m_y.m_pOfs[y + 1] - 1] - m_y.m_pSrc[m_y.m_pOfs[y]] + 1);
+
+    const size_t line_floats = static_cast<size_t>(dst_width) * num_channels;
+    m_pWindow = static_cast<float*>(jpgt_malloc(m_window_lines * line_floats * sizeof(float)));
+    m_pAccum = static_cast<float*>(jpgt_malloc(line_floats * sizeof(float)));
+    m_pDst_line = static_cast<uint8*>(jpgt_malloc(line_floats));
+    return (m_pWindow) && (m_pAccum) && (m_pDst_line);
+  }
+
+  virtual bool put_line(const uint8 *pLine)
+  {
+    const int n = m_dst_width * m_num_channels;
+
+    float *pDst = m_pWindow + static_cast<size_t>(m_src_y % m_window_lines) * n;
+    for (int x = 0; x < m_dst_width; x++, pDst += m_num_channels)
+    {
+      for (int c = 0; c < m_num_channels; c++)
+        pDst[c] = 0.0f;
+      for (int t = m_x.m_pOfs[x]; t < m_x.m_pOfs[x + 1]; t++)
+      {
+        const uint8 *pSrc = pLine + m_x.m_pSrc[t] * m_num_channels;
+        const float w = m_x.m_pWeight[t];
+        for (int c = 0; c < m_num_channels; c++)
+          pDst[c] += w * pSrc[c];
+      }
+    }
+
+    // Emit every destination line whose last source line just arrived.
+    while ((m_dst_y < m_dst_height) && (m_y.m_pSrc[m_y.m_pOfs[m_dst_y + 1] - 1] <= m_src_y))
+    {
+      memset(m_pAccum, 0, n * sizeof(float));
+      for (int t = m_y.m_pOfs[m_dst_y]; t < m_y.m_pOfs[m_dst_y + 1]; t++)
+      {
+        const float *pSrc = m_pWindow + static_cast<size_t>(m_y.m_pSrc[t] % m_window_lines) * n;
+        const float w = m_y.m_pWeight[t];
+        for (int i = 0; i < n; i++)
+          m_pAccum[i] += w * pSrc[i];
+      }
+      for (int i = 0; i < n; i++)
+        m_pDst_line[i] = static_cast<uint8>(JPGT_MIN(JPGT_MAX(m_pAccum[i] + 0.5f, 0.0f), 255.0f));
+      if (!m_pNext->put_line(m_pDst_line)) return false;
+      m_dst_y++;
+    }
+    m_src_y++;
+    return true;
+  }
+};
+
+// Hands lines from the decoding thread to the encoding thread through a fixed ring of line buffers. Both sides copy
+// or consume their line outside the lock; a slot is only reused after the encoder is done with it.
+class line_ring : public line_sink
+{
+  line_ring(const line_ring &);
+  line_ring &operator= (const line_ring &);
+
+  uint8 *m_pLines;
+  size_t m_line_size;
+  int m_num_lines, m_num_put, m_num_taken;
+  bool m_closed, m_failed;
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+
+public:
+  line_ring() : m_pLines(NULL), m_line_size(0), m_num_lines(0), m_num_put(0), m_num_taken(0), m_closed(false), m_failed(false) { }
+  ~line_ring() { jpgt_free(m_pLines); }
+
+  bool init(size_t line_size, int num_lines)
+  {
+    m_line_size = line_size;
+    m_num_lines = num_lines;
+    m_pLines = static_cast<uint8*>(jpgt_malloc(line_size * num_lines));
+    return m_pLines != NULL;
+  }
+
+  virtual bool put_line(const uint8 *pLine)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while ((m_num_put - m_num_taken == m_num_lines) && (!m_failed))
+      m_cond.wait(lock);
+    if (m_failed) return false;
+    lock.unlock();
+
+    memcpy(m_pLines + (m_num_put % m_num_lines) * m_line_size, pLine, m_line_size);
+
+    lock.lock();
+    m_num_put++;
+    m_cond.notify_all();
+    return true;
+  }
+
+  // No more lines will be put.
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_cond.notify_all();
+  }
+
+  // Stops both sides.
+  void abort()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_failed = true;
+    m_cond.notify_all();
+  }
+
+  bool failed()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failed;
+  }
+
+  // Runs on the encoding thread: passes the lines on to pNext until the ring is closed and empty, or a stage fails.
+  void drain(line_sink *pNext)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for ( ; ; )
+    {
+      while ((m_num_taken == m_num_put) && (!m_closed) && (!m_failed))
+        m_cond.wait(lock);
+      if ((m_failed) || (m_num_taken == m_num_put))
+        return;
+
+      const uint8 *pLine = m_pLines + (m_num_taken % m_num_lines) * m_line_size;
+      lock.unlock();
+      const bool status = pNext->put_line(pLine);
+      lock.lock();
+
+      if (status)
+        m_num_taken++;
+      else
+        m_failed = true;
+      m_cond.notify_all();
+    }
+  }
+};
+
+static void drain_ring(line_ring *pRing, line_sink *pNext)
+{
+  pRing->drain(pNext);
+}
+
+bool transcode(jpgd::jpeg_decoder_stream *pSrc, jpge::output_stream *pDst, const params &trans_params, jpge::output_stream *pDst_bottom)
+{
+  if ((!pSrc) || (!pDst) || (!trans_params.check()) || ((trans_params.m_split_over_under) && (!pDst_bottom)))
+    return false;
+
+  jpgd::jpeg_decoder decoder(pSrc);
+  if ((decoder.get_error_code() != jpgd::JPGD_SUCCESS) || (decoder.begin_decoding() != jpgd::JPGD_SUCCESS))
+    return false;
+
+  // jpgd returns either 8-bit grey or 32-bit RGBA lines, jpge takes both as is (ignoring alpha).
+  const int src_width = decoder.get_width(), src_height = decoder.get_height();
+  const int num_channels = decoder.get_bytes_per_pixel();
+  const int dst_width = trans_params.m_dst_width ? trans_params.m_dst_width : src_width;
+  const int dst_height = trans_params.m_dst_height ? trans_params.m_dst_height : src_height;
+
+  encoder_sink encoder;
+  if (!encoder.init(pDst, pDst_bottom, dst_width, dst_height, num_channels, trans_params))
+    return false;
+
+  line_ring ring;
+  line_sink *pEncode_stage = &encoder;
+  if (trans_params.m_threaded)
+  {
+    if (!ring.init(static_cast<size_t>(dst_width) * num_channels, trans_params.m_ring_mcu_rows * 16)) return false;
+    pEncode_stage = &ring;
+  }
+
+  resampler resample;
+  line_sink *pFirst_stage = pEncode_stage;
+  if ((dst_width != src_width) || (dst_height != src_height))
+  {
+    if (!resample.init(src_width, src_height, dst_width, dst_height, num_channels, pEncode_stage)) return false;
+    pFirst_stage = &resample;
+  }
+
+  std::thread encode_thread;
+  if (trans_params.m_threaded)
+    encode_thread = std::thread(drain_ring, &ring, &encoder);
+
+  bool status = true;
+  for ( ; ; )
+  {
+    const void *pLine;
+    uint line_len;
+    const int result = decoder.decode(&pLine, &line_len);
+    if (result == jpgd::JPGD_DONE)
+      break;
+    if ((result != jpgd::JPGD_SUCCESS) || (!pFirst_stage->put_line(static_cast<const uint8*>(pLine))))
+    {
+      status = false;
+      break;
+    }
+  }
+
+  if (trans_params.m_threaded)
+  {
+    if (status)
+      ring.close();
+    else
+      ring.abort();
+    encode_thread.join();
+    status = status && (!ring.failed());
+  }
+
+  return status && encoder.finish();
+}
+
+static bool file_put_buf(const void* pBuf, int len, void *pUser_data)
+{
+  return (!len) || (fwrite(pBuf, len, 1, static_cast<FILE*>(pUser_data)) == 1);
+}
+
+bool transcode_file(const char *pSrc_filename, const char *pDst_filename, const params &trans_params, const char *pDst_bottom_filename)
+{
+  if ((!pSrc_filename) || (!pDst_filename) || ((trans_params.m_split_over_under) && (!pDst_bottom_filename)))
+    return false;
+
+  jpgd::jpeg_decoder_file_stream src_stream;
+  if (!src_stream.open(pSrc_filename))
+    return false;
+
+  FILE *pFiles[2] = { NULL, NULL };
+  pFiles[0] = fopen(pDst_filename, "wb");
+  if (trans_params.m_split_over_under)
+    pFiles[1] = fopen(pDst_bottom_filename, "wb");
+
+  bool status = (pFiles[0] != NULL) && ((!trans_params.m_split_over_under) || (pFiles[1] != NULL));
+  if (status)
+  {
+    jpge::callback_output_stream dst_stream(file_put_buf, pFiles[0]), dst_bottom_stream(file_put_buf, pFiles[1]);
+    status = transcode(&src_stream, &dst_stream, trans_params, trans_params.m_split_over_under ? &dst_bottom_stream : NULL);
+  }
+
+  for (int i = 0; i < 2; i++)
+    if ((pFiles[i]) && (fclose(pFiles[i]) == EOF))
+      status = false;
+  return status;
+}
+
+} // namespace jpgt
@@ -0,0 +1,57 @@
+// jpgt.h - Streaming JPEG to JPEG transcoder, built on jpgd and jpge.
+// Decoded scanlines go straight to jpeg_encoder::process_scanline() through a small ring of lines, with optional
+// resampling and over/under splitting stages in between, so the whole image is never held in memory.
+#ifndef JPEG_TRANSCODER_H
+#define JPEG_TRANSCODER_H
+
+#include "jpgd.h"
+#include "jpge.h"
+
+namespace jpgt
+{
+  typedef unsigned char  uint8;
+  typedef unsigned int   uint;
+
+  // Transcoding parameters.
+  struct params
+  {
+    inline params() : m_dst_width(0), m_dst_height(0), m_split_over_under(false), m_ring_mcu_rows(4), m_threaded(true) { }
+
+    inline bool check() const
+    {
+      if ((m_dst_width < 0) || (m_dst_height < 0) || (m_ring_mcu_rows < 1)) return false;
+      return m_comp_params.check();
+    }
+
+    // Compression parameters of the output image(s). m_two_pass_flag implies m_single_feed_flag (the source is only decoded
+    // once), which buffers the quantized coefficients in a compact form (roughly 2-4x the compressed size).
+    // Progressive output and m_target_size keep every coefficient of the image. m_num_threads is ignored.
+    jpge::params m_comp_params;
+
+    // Size of the whole output image, before any splitting (0 = source width/height). The image is resampled with a
+    // separable tent filter, widened when downsampling so every source pixel contributes.
+    int m_dst_width, m_dst_height;
+
+    // Writes the top half of the image to the first output stream and the bottom half to the second, e.g. to split an
+    // over/under stereo panorama into one file per eye.
+    bool m_split_over_under;
+
+    // Size of the ring of lines between the decoder and the encoder, in 16-line MCU rows.
+    int m_ring_mcu_rows;
+
+    // Decodes (and resamples) on the calling thread while a second thread encodes.
+    bool m_threaded;
+  };
+
+  // Transcodes the JPEG image read from pSrc. pDst_bottom is only used (and required) with m_split_over_under.
+  // Peak memory is the ring, a few resampled lines and the decoder's/encoders' MCU row buffers - a few MB for panoramas
+  // up to jpgd's 16384 pixel limit. Progressive source images are an exception: jpgd buffers their coefficients.
+  // Returns false if the source can't be decoded or an output stream write fails.
+  bool transcode(jpgd::jpeg_decoder_stream *pSrc, jpge::output_stream *pDst, const params &trans_params = params(), jpge::output_stream *pDst_bottom = NULL);
+
+  // File to file version of the above. pDst_bottom_filename is only used (and required) with m_split_over_under.
+  bool transcode_file(const char *pSrc_filename, const char *pDst_filename, const params &trans_params = params(), const char *pDst_bottom_filename = NULL);
+
+} // namespace jpgt
+
+#endif // JPEG_TRANSCODER_H
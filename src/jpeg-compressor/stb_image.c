@@ -7,7 +7,7 @@
           avoid problematic images and only need the trivial interface
 
       JPEG baseline (no JPEG progressive)
-      PNG 8-bit only
+      PNG 8-bit and 16-bit (16-bit samples are reduced to 8 bits)
 
       TGA (not sure what subset, if a subset)
       BMP non-1bpp, non-RLE
@@ -80,7 +80,7 @@
 //
 // Limitations:
 //    - no jpeg progressive support
-//    - non-HDR formats support 8-bit samples only (jpeg, png)
+//    - non-HDR formats support 8-bit samples only (jpeg); png 16-bit samples are reduced to 8 bits
 //    - no delayed line count (jpeg) -- IJG doesn't support either
 //    - no 1-bit BMP
 //    - GIF always returns *comp=4
@@ -442,10 +442,22 @@ typedef   signed short  int16;
 typedef unsigned int   uint32;
 typedef   signed int    int32;
 typedef unsigned int   uint;
+typedef unsigned long long uint64;
 
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
 
+// SSE2 PNG unfiltering; define STBI_NO_SSE2 to use the plain C code
+#if !defined(STBI_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBI_SSE2
+#include <emmintrin.h>
+#endif
+
+// little-endian targets can refill the zlib bit buffer with a single unaligned 8-byte read
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define STBI_LITTLE_ENDIAN
+#endif
+
 #if defined(STBI_NO_STDIO) && !defined(STBI_NO_WRITE)
 #define STBI_NO_WRITE
 #endif
@@ -2121,17 +2133,19 @@ extern int      stbi_jpeg_info_from_memory(stbi_uc const *buffer, int len, int *
 //      - all input must be provided in an upfront buffer
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
-//      - fast huffman
+//      - fast huffman, resolving codes of up to 11 bits with one lookup
+//      - 64-bit bit buffer, refilled a word at a time
+//      - matches copied 8 bytes at a time (or with memcpy/memset)
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define ZFAST_BITS  9 // accelerate all cases in default tables
+#define ZFAST_BITS  11 // accelerate all cases in default tables, and most codes of dynamic ones
 #define ZFAST_MASK  ((1 << ZFAST_BITS) - 1)
 
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   uint16 fast[1 << ZFAST_BITS];
+   uint16 fast[1 << ZFAST_BITS]; // (code size << 9) | symbol, or 0 if the code is longer than ZFAST_BITS
    uint16 firstcode[16];
    int maxcode[17];
    uint16 firstsymbol[16];
@@ -2163,7 +2177,7 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
 
    // DEFLATE spec for generating codes
    memset(sizes, 0, sizeof(sizes));
-   memset(z->fast, 255, sizeof(z->fast));
+   memset(z->fast, 0, sizeof(z->fast));
    for (i=0; i < num; ++i)
       ++sizes[sizelist[i]];
    sizes[0] = 0;
@@ -2191,7 +2205,7 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
          if (s <= ZFAST_BITS) {
             int k = bit_reverse(next_code[s],s);
             while (k < (1 << ZFAST_BITS)) {
-               z->fast[k] = (uint16) c;
+               z->fast[k] = (uint16) ((s << 9) | i);
                k += (1 << s);
             }
          }
@@ -2211,7 +2225,7 @@ typedef struct
 {
    uint8 *zbuffer, *zbuffer_end;
    int num_bits;
-   uint32 code_buffer;
+   uint64 code_buffer; // bits above num_bits may hold the next input bytes
 
    char *zout;
    char *zout_start;
@@ -2227,40 +2241,43 @@ __forceinline static int zget8(zbuf *z)
    return *z->zbuffer++;
 }
 
+// tops the bit buffer up to at least 56 bits
 static void fill_bits(zbuf *z)
 {
+#ifdef STBI_LITTLE_ENDIAN
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      // load 8 bytes but only consume the whole bytes that fit; any bits loaded above num_bits are
+      // the following input bytes, at the positions the next refill will put them again
+      uint64 bits;
+      memcpy(&bits, z->zbuffer, 8);
+      z->code_buffer |= bits << z->num_bits;
+      z->zbuffer += (63 - z->num_bits) >> 3;
+      z->num_bits |= 56;
+      return;
+   }
+#endif
    do {
-      assert(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= zget8(z) << z->num_bits;
+      z->code_buffer |= (uint64) zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
 }
 
 __forceinline static unsigned int zreceive(zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
 }
 
-__forceinline static int zhuffman_decode(zbuf *a, zhuffman *z)
+static int zhuffman_decode_slowpath(zbuf *a, zhuffman *z)
 {
    int b,s,k;
-   if (a->num_bits < 16) fill_bits(a);
-   b = z->fast[a->code_buffer & ZFAST_MASK];
-   if (b < 0xffff) {
-      s = z->size[b];
-      a->code_buffer >>= s;
-      a->num_bits -= s;
-      return z->value[b];
-   }
-
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = bit_reverse(a->code_buffer, 16);
+   k = bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -2273,6 +2290,20 @@ __forceinline static int zhuffman_decode(zbuf *a, zhuffman *z)
    return z->value[b];
 }
 
+__forceinline static int zhuffman_decode(zbuf *a, zhuffman *z)
+{
+   int b,s;
+   if (a->num_bits < 16) fill_bits(a);
+   b = z->fast[a->code_buffer & ZFAST_MASK];
+   if (b) {
+      s = b >> 9;
+      a->code_buffer >>= s;
+      a->num_bits -= s;
+      return b & 511;
+   }
+   return zhuffman_decode_slowpath(a, z);
+}
+
 static int expand(zbuf *z, int n)  // need to make room for n bytes
 {
    char *q;
@@ -2306,16 +2337,24 @@ static int dist_extra[32] =
 
 static int parse_huffman_block(zbuf *a)
 {
+   char *zout = a->zout; // kept in a local, written back around expand() and on exit
    for(;;) {
       int z = zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
-         *a->zout++ = (char) z;
+         if (zout >= a->zout_end) {
+            a->zout = zout;
+            if (!expand(a, 1)) return 0;
+            zout = a->zout;
+         }
+         *zout++ = (char) z;
       } else {
-         uint8 *p;
+         char *p;
          int len,dist;
-         if (z == 256) return 1;
+         if (z == 256) {
+            a->zout = zout;
+            return 1;
+         }
          z -= 257;
          len = length_base[z];
          if (length_extra[z]) len += zreceive(a, length_extra[z]);
@@ -2323,11 +2362,32 @@ static int parse_huffman_block(zbuf *a)
          if (z < 0) return e("bad huffman code","Corrupt PNG");
          dist = dist_base[z];
          if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
-         if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
-         if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
-         p = (uint8 *) (a->zout - dist);
-         while (len--)
-            *a->zout++ = *p++;
+         if (zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
+         if (zout + len > a->zout_end) {
+            a->zout = zout;
+            if (!expand(a, len)) return 0;
+            zout = a->zout;
+         }
+         p = zout - dist;
+         if (dist >= len) {
+            memcpy(zout, p, len); // no overlap
+         } else if (dist == 1) {
+            memset(zout, *p, len); // run of one byte
+         } else if (dist >= 8 && zout + len + 8 <= a->zout_end) {
+            // overlapping, but every 8-byte chunk reads bytes written before it; may write up to 7 bytes past len
+            char *q = zout, *end = zout + len;
+            do {
+               memcpy(q, p, 8);
+               q += 8;
+               p += 8;
+            } while (q < end);
+         } else {
+            char *q = zout;
+            int n = len;
+            while (n--)
+               *q++ = *p++;
+         }
+         zout += len;
       }
    }
 }
@@ -2386,21 +2446,29 @@ static int parse_uncompressed_block(zbuf *a)
       zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (uint8) (a->code_buffer & 255); // wtf this warns?
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
-   assert(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
       header[k++] = (uint8) zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return e("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!expand(a, len)) return 0;
+   // the bit buffer can still hold the first few bytes of the block
+   while (a->num_bits > 0 && len > 0) {
+      *a->zout++ = (char) (a->code_buffer & 255);
+      a->code_buffer >>= 8;
+      a->num_bits -= 8;
+      --len;
+   }
+   if (a->num_bits == 0)
+      a->code_buffer = 0; // drop any lookahead bytes, the input is read directly from here on
+   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
    memcpy(a->zout, a->zbuffer, len);
    a->zbuffer += len;
    a->zout += len;
@@ -2552,7 +2620,7 @@ int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffe
 
 // public domain "baseline" PNG decoder   v0.10  Sean Barrett 2006-11-18
 //    simple implementation
-//      - only 8-bit samples
+//      - 8-bit and 16-bit samples, 16-bit reduced to 8-bit
 //      - no CRC checking
 //      - allocates lots of intermediate memory
 //        - avoids problem of streaming data between subsystems
@@ -2590,6 +2658,8 @@ typedef struct
 {
    stbi s;
    uint8 *idata, *expanded, *out;
+   int has_trans16;           // 16-bit images match the tRNS color key before they're reduced to 8 bits
+   uint16 tc16[3];
 } png;
 
 
@@ -2614,31 +2684,122 @@ static int paeth(int a, int b, int c)
    return c;
 }
 
-// create the png data from post-deflated data
-static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y)
+#ifdef STBI_SSE2
+// one pixel of 3, 4, 6 or 8 bytes in the low bytes of a register, moved directly rather than through memory
+// so the loads can forward from the previous pixel's store
+__forceinline static __m128i load_pixel_sse2(uint8 const *p, int bpp)
+{
+   uint32 v;
+   uint16 w;
+   switch (bpp) {
+      case 3:  return _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16));
+      case 4:  memcpy(&v, p, 4); return _mm_cvtsi32_si128(v);
+      case 6:  memcpy(&v, p, 4); memcpy(&w, p+4, 2); return _mm_insert_epi16(_mm_cvtsi32_si128(v), w, 2);
+      default: return _mm_loadl_epi64((__m128i const *) p);
+   }
+}
+
+__forceinline static void store_pixel_sse2(uint8 *p, __m128i v, int bpp)
+{
+   uint32 t = _mm_cvtsi128_si32(v);
+   uint16 w;
+   switch (bpp) {
+      case 3:  p[0] = (uint8) t; p[1] = (uint8) (t >> 8); p[2] = (uint8) (t >> 16); break;
+      case 4:  memcpy(p, &t, 4); break;
+      case 6:  w = (uint16) _mm_extract_epi16(v, 2); memcpy(p, &t, 4); memcpy(p+4, &w, 2); break;
+      default: _mm_storel_epi64((__m128i *) p, v); break;
+   }
+}
+
+// floor((a+b)/2) per byte; _mm_avg_epu8 rounds up
+__forceinline static __m128i avg_floor_sse2(__m128i a, __m128i b)
+{
+   return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+// paeth() on 8 bytes at once, in 16-bit lanes
+__forceinline static __m128i paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a16 = _mm_unpacklo_epi8(a, zero), b16 = _mm_unpacklo_epi8(b, zero), c16 = _mm_unpacklo_epi8(c, zero);
+   __m128i pa = _mm_sub_epi16(b16, c16);   // p-a
+   __m128i pb = _mm_sub_epi16(a16, c16);   // p-b
+   __m128i pc = _mm_add_epi16(pa, pb);     // p-c
+   __m128i smallest, use_a, use_b, r;
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+   // ties favor a over b over c
+   use_a = _mm_cmpeq_epi16(smallest, pa);
+   use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb));
+   r = _mm_or_si128(_mm_and_si128(use_a, a16), _mm_andnot_si128(use_a, c16));
+   r = _mm_or_si128(_mm_and_si128(use_b, b16), _mm_andnot_si128(use_b, r));
+   return _mm_packus_epi16(r, r);
+}
+
+// unfilters pixels 1..x-1 of a row of bpp (3..8) bytes per pixel; pixel 0 is done already and cur, prior
+// and raw point at pixel 1. Each pixel depends on the one to its left, so this works a pixel at a time.
+__forceinline static void unfilter_row_sse2(int filter, uint8 *cur, uint8 const *prior, uint8 const *raw, uint32 x, int bpp)
+{
+   __m128i a = load_pixel_sse2(cur - bpp, bpp), b, c;
+   uint32 i;
+   switch (filter) {
+      case F_sub: case F_paeth_first:
+         for (i=1; i < x; ++i, cur+=bpp, raw+=bpp) {
+            a = _mm_add_epi8(load_pixel_sse2(raw, bpp), a);
+            store_pixel_sse2(cur, a, bpp);
+         }
+         break;
+      case F_avg: case F_avg_first:
+         for (i=1; i < x; ++i, cur+=bpp, prior+=bpp, raw+=bpp) {
+            b = (filter == F_avg) ? load_pixel_sse2(prior, bpp) : _mm_setzero_si128();
+            a = _mm_add_epi8(load_pixel_sse2(raw, bpp), avg_floor_sse2(a, b));
+            store_pixel_sse2(cur, a, bpp);
+         }
+         break;
+      case F_paeth:
+         c = load_pixel_sse2(prior - bpp, bpp); // the first row has no prior row, so only read it here
+         for (i=1; i < x; ++i, cur+=bpp, prior+=bpp, raw+=bpp) {
+            b = load_pixel_sse2(prior, bpp);
+            a = _mm_add_epi8(load_pixel_sse2(raw, bpp), paeth_sse2(a, b, c));
+            c = b;
+            store_pixel_sse2(cur, a, bpp);
+         }
+         break;
+   }
+}
+#endif
+
+// unfilter the rows of bytes, img_n bytes per pixel, into out with out_n bytes per pixel (img_n or img_n+1,
+// with the extra byte set to 255)
+static int unfilter_png_rows(uint8 *out, uint8 *raw, int img_n, int out_n, uint32 x, uint32 y)
 {
-   stbi *s = &a->s;
    uint32 i,j,stride = x*out_n;
    int k;
-   int img_n = s->img_n; // copy it into a local for later
-   assert(out_n == s->img_n || out_n == s->img_n+1);
-   if (stbi_png_partial) y = 1;
-   a->out = (uint8 *) malloc(x * y * out_n);
-   if (!a->out) return e("outofmem", "Out of memory");
-   if (!stbi_png_partial) {
-      if (s->img_x == x && s->img_y == y) {
-         if (raw_len != (img_n * x + 1) * y) return e("not enough pixels","Corrupt PNG");
-      } else { // interlaced:
-         if (raw_len < (img_n * x + 1) * y) return e("not enough pixels","Corrupt PNG");
-      }
-   }
    for (j=0; j < y; ++j) {
-      uint8 *cur = a->out + stride*j;
+      uint8 *cur = out + stride*j;
       uint8 *prior = cur - stride;
       int filter = *raw++;
       if (filter > 4) return e("invalid filter","Corrupt PNG");
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
+      #ifdef STBI_SSE2
+      if (img_n == out_n && (filter == F_none || filter == F_up)) {
+         // no dependency between pixels, do the whole row 16 bytes at a time
+         uint32 n = x*img_n;
+         if (filter == F_none)
+            memcpy(cur, raw, n);
+         else {
+            for (i=0; i+16 <= n; i += 16)
+               _mm_storeu_si128((__m128i *) (cur+i), _mm_add_epi8(_mm_loadu_si128((__m128i const *) (raw+i)), _mm_loadu_si128((__m128i const *) (prior+i))));
+            for (; i < n; ++i)
+               cur[i] = raw[i] + prior[i];
+         }
+         raw += n;
+         continue;
+      }
+      #endif
       // handle first pixel explicitly
       for (k=0; k < img_n; ++k) {
          switch (filter) {
@@ -2655,6 +2816,19 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
       raw += img_n;
       cur += out_n;
       prior += out_n;
+      #ifdef STBI_SSE2
+      if (img_n == out_n && img_n >= 3) {
+         // constant bpp, so the pixel loads and stores inline to plain moves
+         switch (img_n) {
+            case 3: unfilter_row_sse2(filter, cur, prior, raw, x, 3); break;
+            case 4: unfilter_row_sse2(filter, cur, prior, raw, x, 4); break;
+            case 6: unfilter_row_sse2(filter, cur, prior, raw, x, 6); break;
+            case 8: unfilter_row_sse2(filter, cur, prior, raw, x, 8); break;
+         }
+         raw += (x-1)*img_n;
+         continue;
+      }
+      #endif
       // this is a little gross, so that we don't switch per-pixel or per-component
       if (img_n == out_n) {
          #define CASE(f) \
@@ -2692,13 +2866,55 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
    return 1;
 }
 
-static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced)
+// create the png data from post-deflated data
+// 16-bit images are unfiltered as pairs of bytes, then reduced to their most significant bytes
+static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y, int depth)
+{
+   stbi *s = &a->s;
+   int img_n = s->img_n; // copy it into a local for later
+   int bytes = depth / 8;
+   assert(out_n == s->img_n || out_n == s->img_n+1);
+   if (stbi_png_partial) y = 1;
+   a->out = (uint8 *) malloc(x * y * out_n);
+   if (!a->out) return e("outofmem", "Out of memory");
+   if (!stbi_png_partial) {
+      if (s->img_x == x && s->img_y == y) {
+         if (raw_len != (img_n * bytes * x + 1) * y) return e("not enough pixels","Corrupt PNG");
+      } else { // interlaced:
+         if (raw_len < (img_n * bytes * x + 1) * y) return e("not enough pixels","Corrupt PNG");
+      }
+   }
+   if (bytes == 1)
+      return unfilter_png_rows(a->out, raw, img_n, out_n, x, y);
+   else {
+      uint8 *wide = (uint8 *) malloc(x * y * img_n * 2), *p, *q = a->out;
+      uint32 i, n = x * y;
+      int k;
+      if (!wide) return e("outofmem", "Out of memory");
+      if (!unfilter_png_rows(wide, raw, img_n * 2, img_n * 2, x, y)) {
+         free(wide);
+         return 0;
+      }
+      for (i=0, p=wide; i < n; ++i, q += out_n) {
+         int keyed = a->has_trans16;
+         for (k=0; k < img_n; ++k, p += 2) {
+            q[k] = p[0]; // big endian samples
+            keyed &= ((p[0] << 8) + p[1] == a->tc16[k]);
+         }
+         if (img_n != out_n) q[img_n] = keyed ? 0 : 255;
+      }
+      free(wide);
+      return 1;
+   }
+}
+
+static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced, int depth)
 {
    uint8 *final;
    int p;
    int save;
    if (!interlaced)
-      return create_png_image_raw(a, raw, raw_len, out_n, a->s.img_x, a->s.img_y);
+      return create_png_image_raw(a, raw, raw_len, out_n, a->s.img_x, a->s.img_y, depth);
    save = stbi_png_partial;
    stbi_png_partial = 0;
 
@@ -2714,7 +2930,7 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
       x = (a->s.img_x - xorig[p] + xspc[p]-1) / xspc[p];
       y = (a->s.img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
-         if (!create_png_image_raw(a, raw, raw_len, out_n, x, y)) {
+         if (!create_png_image_raw(a, raw, raw_len, out_n, x, y, depth)) {
             free(final);
             return 0;
          }
@@ -2723,8 +2939,8 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
                memcpy(final + (j*yspc[p]+yorig[p])*a->s.img_x*out_n + (i*xspc[p]+xorig[p])*out_n,
                       a->out + (j*x+i)*out_n, out_n);
          free(a->out);
-         raw += (x*out_n+1)*y;
-         raw_len -= (x*out_n+1)*y;
+         raw += (x*a->s.img_n*(depth/8)+1)*y;
+         raw_len -= (x*a->s.img_n*(depth/8)+1)*y;
       }
    }
    a->out = final;
@@ -2854,9 +3070,10 @@ static int parse_png_file(png *z, int scan, int req_comp)
    uint8 palette[1024], pal_img_n=0;
    uint8 has_trans=0, tc[3];
    uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, iphone=0;
+   int first=1,k,interlace=0, iphone=0, depth=8;
    stbi *s = &z->s;
 
+   z->has_trans16 = 0;
    if (!check_png_header(s)) return 0;
 
    if (scan == SCAN_type) return 1;
@@ -2869,22 +3086,23 @@ static int parse_png_file(png *z, int scan, int req_comp)
             skip(s, c.length);
             break;
          case PNG_TYPE('I','H','D','R'): {
-            int depth,color,comp,filter;
+            int color,comp,filter;
             if (!first) return e("multiple IHDR","Corrupt PNG");
             first = 0;
             if (c.length != 13) return e("bad IHDR len","Corrupt PNG");
             s->img_x = get32(s); if (s->img_x > (1 << 24)) return e("too large","Very large image (corrupt?)");
             s->img_y = get32(s); if (s->img_y > (1 << 24)) return e("too large","Very large image (corrupt?)");
-            depth = get8(s);  if (depth != 8)        return e("8bit only","PNG not supported: 8-bit only");
+            depth = get8(s);  if (depth != 8 && depth != 16) return e("8/16bit only","PNG not supported: 8-bit and 16-bit only");
             color = get8(s);  if (color > 6)         return e("bad ctype","Corrupt PNG");
             if (color == 3) pal_img_n = 3; else if (color & 1) return e("bad ctype","Corrupt PNG");
+            if (color == 3 && depth != 8) return e("bad ctype","Corrupt PNG");
             comp  = get8(s);  if (comp) return e("bad comp method","Corrupt PNG");
             filter= get8(s);  if (filter) return e("bad filter method","Corrupt PNG");
             interlace = get8(s); if (interlace>1) return e("bad interlace method","Corrupt PNG");
             if (!s->img_x || !s->img_y) return e("0-pixel image","Corrupt PNG");
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
-               if ((1 << 30) / s->img_x / s->img_n < s->img_y) return e("too large", "Image too large to decode");
+               if ((1 << 30) / s->img_x / s->img_n / (depth/8) < s->img_y) return e("too large", "Image too large to decode");
                if (scan == SCAN_header) return 1;
             } else {
                // if paletted, then pal_n is our final components, and
@@ -2924,8 +3142,9 @@ static int parse_png_file(png *z, int scan, int req_comp)
                if (!(s->img_n & 1)) return e("tRNS with alpha","Corrupt PNG");
                if (c.length != (uint32) s->img_n*2) return e("bad tRNS len","Corrupt PNG");
                has_trans = 1;
+               z->has_trans16 = (depth == 16);
                for (k=0; k < s->img_n; ++k)
-                  tc[k] = (uint8) get16(s); // non 8-bit images will be larger
+                  tc[k] = (uint8) (z->tc16[k] = (uint16) get16(s));
             }
             break;
          }
@@ -2948,19 +3167,21 @@ static int parse_png_file(png *z, int scan, int req_comp)
          }
 
          case PNG_TYPE('I','E','N','D'): {
-            uint32 raw_len;
+            uint32 raw_len, guess_len;
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (scan != SCAN_load) return 1;
             if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, 16384, (int *) &raw_len, !iphone);
+            // start with the exact size of a non-interlaced image, plus room for the 8-byte match copies
+            guess_len = (s->img_x * s->img_n * (depth/8) + 1) * s->img_y + (interlace ? s->img_y * 2 : 0) + 8;
+            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, guess_len, (int *) &raw_len, !iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
             free(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace)) return 0;
-            if (has_trans)
+            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace, depth)) return 0;
+            if (has_trans && !z->has_trans16)
                if (!compute_transparency(z, tc, s->img_out_n)) return 0;
             if (iphone && s->img_out_n > 2)
                stbi_de_iphone(z);
@@ -5,14 +5,31 @@
 // Note: jpge.cpp/h and jpgd.cpp/h are completely standalone, i.e. they do not have any dependencies to each other.
 #include "jpge.h"
 #include "jpgd.h"
+#include "jpgt.h"
+#include "imgcmp.h"
 #include "stb_image.c"
 #include "timer.h"
 #include <ctype.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
 #if defined(_MSC_VER)
   #define strcasecmp _stricmp
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <windows.h>
+  #include <direct.h>
+  #define make_dir(d) _mkdir(d)
 #else
   #define strcpy_s(d, c, s) strcpy(d, s)
+  #include <sys/stat.h>
+  #include <dirent.h>
+  #include <glob.h>
+  #define make_dir(d) mkdir(d, 0777)
 #endif
 
 static int print_usage()
@@ -23,21 +40,36 @@ static int print_usage()
   printf("dest_file: Destination JPEG file.\n");
   printf("quality_factor: 1-100, higher=better (only needed in compression mode)\n");
   printf("\nDefault mode compresses source_file to dest_file. Alternate modes:\n");
-  printf("-x: Exhaustive compression test (only needs source_file)\n");
+  printf("-x: Exhaustive compression test (only needs source_file, or several sources with -j)\n");
+  printf("-jN: Batch mode, spreads the work over N threads (0=all cores). Sources can be files, directories or wildcards.\n");
+  printf("     Converts the sources to dest_dir/<name>.jpg: jpge -jN [options] <dest_dir> <quality_factor> <source>...\n");
+  printf("     Sources sharing a name keep their extension (<name>.<ext>.jpg); the same file name in two directories is an error.\n");
+  printf("     With -x, runs the exhaustive test on every source: jpge -x -jN <source>...\n");
   printf("-d: Test jpgd.h. source_file must be JPEG, and dest_file must be .TGA\n");
+  printf("-kreference.png: With -d, check the decompressed image (and each over/under half) against a known good decode\n");
+  printf("-c: Transcode with bounded memory (jpgt.h). source_file must be JPEG, compression options apply\n");
   printf("\nOptions supported in all modes:\n");
   printf("-glogfilename.txt: Append output to log file\n");
+  printf("-ereport.csv/.json: With -x or -j, write size, PSNR, SSIM and encode/decode MP/s of every configuration to a CSV or JSON file\n");
   printf("\nOptions supported in compression mode (the default):\n");
   printf("-o: Enable optimized Huffman tables (slower, but smaller files)\n");
+  printf("-f: With -o, buffer the coefficients so the image is only color converted/DCT'd once\n");
   printf("-luma: Output Y-only image\n");
+  printf("-p: Write a progressive JPEG (always uses optimized Huffman tables, can't be read by -s)\n");
   printf("-h1v1, -h2v1, -h2v2: Chroma subsampling (default is either Y-only or H2V2)\n");
   printf("-m: Test mem to mem compression (instead of mem to file)\n");
+  printf("-rN: Write a restart marker every N MCU rows\n");
+  printf("-tN: Compress using N threads (0=all cores), implies restart markers\n");
+  printf("-bN: Pick the quality so the file is about N bytes (quality_factor is ignored, not with -p)\n");
   printf("-wfilename.tga: Write decompressed image to filename.tga\n");
   printf("-s: Use stb_image.c to decompress JPEG image, instead of jpgd.cpp\n");
+  printf("-vWIDTHxHEIGHT: With -c, resample to WIDTH x HEIGHT\n");
+  printf("-ufilename.jpg: With -c, split an over/under image: top half to dest_file, bottom half to filename.jpg\n");
   printf("\nExample usages:\n");
   printf("Test compression: jpge orig.png comp.jpg 90\n");
   printf("Test decompression: jpge -d comp.jpg uncomp.tga\n");
   printf("Exhaustively test compressor: jpge -x orig.png\n");
+  printf("Batch compression: jpge -j0 -ereport.csv out_dir 90 panos/ extra/*.png\n");
   
   return EXIT_FAILURE;
 }
@@ -77,83 +109,154 @@ static uint get_file_size(const char *pFilename)
   return file_size;
 }
 
-struct image_compare_results
+// One compress/decompress round trip, as reported by the exhaustive test and batch mode.
+struct report_row
 {
-  image_compare_results() { memset(this, 0, sizeof(*this)); }
-
-  double max_err;
-  double mean;
-  double mean_squared;
-  double root_mean_squared;
-  double peak_snr;
+  report_row() : m_pFilename(""), m_quality(0), m_subsampling(0), m_optimize_huffman_tables(false), m_width(0), m_height(0), m_comp_size(0), m_encode_mps(0), m_decode_mps(0), m_succeeded(false) { }
+
+  const char *m_pFilename;
+  int m_quality, m_subsampling;
+  bool m_optimize_huffman_tables;
+  int m_width, m_height;
+  uint m_comp_size;
+  double m_encode_mps, m_decode_mps;
+  imgcmp::results m_results;
+  bool m_succeeded;
 };
 
-static void get_pixel(int* pDst, const uint8 *pSrc, bool luma_only, int num_comps)
+// Compresses the image to memory, decompresses it again and fills in the row's size, error and speed columns.
+// If pDst_filename isn't NULL the JPEG file is written there as well. The images are compared on compare_threads threads.
+static bool round_trip(report_row &row, const uint8 *pImage_data, int width, int height, int req_comps, int actual_comps, const jpge::params &params, bool use_jpgd, const char *pDst_filename, int compare_threads)
 {
-  int r, g, b;
-  if (num_comps == 1)
+  row.m_quality = params.m_quality;
+  row.m_subsampling = params.m_subsampling;
+  row.m_optimize_huffman_tables = params.m_two_pass_flag;
+  row.m_width = width;
+  row.m_height = height;
+  row.m_succeeded = false;
+  const double megapixels = (static_cast<double>(width) * height) / 1000000.0;
+
+  jpge::chunked_output_stream comp_stream;
+  timer tm;
+  tm.start();
+  if (!jpge::compress_image_to_jpeg_chunks(comp_stream, width, height, req_comps, pImage_data, params))
+    return false;
+  tm.stop();
+  row.m_encode_mps = megapixels / std::max(tm.get_elapsed_secs(), 1e-6);
+  row.m_comp_size = comp_stream.get_size();
+
+  uint8 *pComp_data = static_cast<uint8*>(malloc(row.m_comp_size));
+  if ((!pComp_data) || (!comp_stream.copy_to(pComp_data, row.m_comp_size)))
   {
-    r = g = b = pSrc[0];
+    free(pComp_data);
+    return false;
   }
-  else if (luma_only)
+  comp_stream.clear();
+
+  if (pDst_filename)
   {
-    const int YR = 19595, YG = 38470, YB = 7471;
-    r = g = b = (pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) / 65536;
+    FILE *pFile = fopen(pDst_filename, "wb");
+    bool written = (pFile != NULL) && (fwrite(pComp_data, row.m_comp_size, 1, pFile) == 1);
+    if ((pFile) && (fclose(pFile) == EOF))
+      written = false;
+    if (!written)
+    {
+      free(pComp_data);
+      return false;
+    }
   }
+
+  int uncomp_width = 0, uncomp_height = 0, uncomp_actual_comps = 0, uncomp_req_comps = 3;
+  tm.start();
+  uint8 *pUncomp_image_data;
+  if (use_jpgd)
+    pUncomp_image_data = jpgd::decompress_jpeg_image_from_memory(pComp_data, row.m_comp_size, &uncomp_width, &uncomp_height, &uncomp_actual_comps, uncomp_req_comps);
   else
-  {
-    r = pSrc[0]; g = pSrc[1]; b = pSrc[2];
-  }
-  pDst[0] = r; pDst[1] = g; pDst[2] = b;
+    pUncomp_image_data = stbi_load_from_memory(pComp_data, row.m_comp_size, &uncomp_width, &uncomp_height, &uncomp_actual_comps, uncomp_req_comps);
+  tm.stop();
+  free(pComp_data);
+  if (!pUncomp_image_data)
+    return false;
+  row.m_decode_mps = megapixels / std::max(tm.get_elapsed_secs(), 1e-6);
+
+  imgcmp::params comp_params;
+  comp_params.m_luma_only = (params.m_subsampling == jpge::Y_ONLY) || (actual_comps == 1) || (uncomp_actual_comps == 1);
+  comp_params.m_num_threads = compare_threads;
+  row.m_succeeded = imgcmp::compare_images(row.m_results, imgcmp::image(pImage_data, width, height, req_comps), imgcmp::image(pUncomp_image_data, uncomp_width, uncomp_height, uncomp_req_comps), comp_params);
+  free(pUncomp_image_data);
+  return row.m_succeeded;
 }
 
-// Compute image error metrics.
-static void image_compare(image_compare_results &results, int width, int height, const uint8 *pComp_image, int comp_image_comps, const uint8 *pUncomp_image_data, int uncomp_comps, bool luma_only)
+// Simple thread pool: calls pJob_func(i, pData) for every i in [0, num_jobs) on num_threads threads (0 = one per core).
+typedef void (*job_func_ptr)(int index, void *pData);
+
+struct job_list
 {
-  double hist[256];
-  memset(hist, 0, sizeof(hist));
+  job_func_ptr m_pJob_func;
+  void *m_pData;
+  int m_num_jobs;
+  std::atomic<int> m_next_job;
+};
 
-  const uint first_channel = 0, num_channels = 3;
-  for (int y = 0; y < height; y++)
+static void job_worker(job_list *pList)
+{
+  for ( ; ; )
   {
-    for (int x = 0; x < width; x++)
-    {
-      int a[3]; get_pixel(a, pComp_image + (y * width + x) * comp_image_comps, luma_only, comp_image_comps);
-      int b[3]; get_pixel(b, pUncomp_image_data + (y * width + x) * uncomp_comps, luma_only, uncomp_comps);
-      for (uint c = 0; c < num_channels; c++)
-        hist[labs(a[first_channel + c] - b[first_channel + c])]++;
-    }
+    const int index = pList->m_next_job++;
+    if (index >= pList->m_num_jobs)
+      break;
+    pList->m_pJob_func(index, pList->m_pData);
   }
+}
 
-  results.max_err = 0;
-  double sum = 0.0f, sum2 = 0.0f;
-  for (uint i = 0; i < 256; i++)
-  {
-    if (!hist[i])
-      continue;
-    if (i > results.max_err)
-      results.max_err = i;
-    double x = i * hist[i];
-    sum += x;
-    sum2 += i * x;
-  }
+static void run_jobs(int num_jobs, int num_threads, job_func_ptr pJob_func, void *pData)
+{
+  if (num_threads <= 0)
+    num_threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+  num_threads = std::min(num_threads, num_jobs);
+
+  job_list list;
+  list.m_pJob_func = pJob_func;
+  list.m_pData = pData;
+  list.m_num_jobs = num_jobs;
+  list.m_next_job = 0;
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++)
+    threads.push_back(std::thread(job_worker, &list));
+  job_worker(&list);
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+}
 
-  // See http://bmrc.berkeley.edu/courseware/cs294/fall97/assignment/psnr.html
-  double total_values = width * height;
+// Exhaustive test configurations: quality 1-100, every subsampling, with and without optimized Huffman tables.
+enum { cNumSubsamplings = jpge::H2V2 + 1, cNumExhaustiveConfigs = 100 * cNumSubsamplings * 2 };
 
-  results.mean = sum / total_values;
-  results.mean_squared = sum2 / total_values;
+struct exhaustive_jobs
+{
+  const uint8 *m_pImage_data;
+  int m_width, m_height, m_req_comps, m_actual_comps;
+  bool m_use_jpgd;
+  int m_compare_threads;
+  report_row *m_pRows;
+};
 
-  results.root_mean_squared = sqrt(results.mean_squared);
+static void exhaustive_job(int index, void *pData)
+{
+  const exhaustive_jobs *pJobs = static_cast<const exhaustive_jobs*>(pData);
 
-  if (!results.root_mean_squared)
-    results.peak_snr = 1e+10f;
-  else
-    results.peak_snr = log10(255.0f / results.root_mean_squared) * 20.0f;
+  // Fill in the compression parameter structure.
+  jpge::params params;
+  params.m_quality = 1 + index / (cNumSubsamplings * 2);
+  params.m_subsampling = static_cast<jpge::subsampling_t>((index / 2) % cNumSubsamplings);
+  params.m_two_pass_flag = (index & 1) != 0;
+
+  round_trip(pJobs->m_pRows[index], pJobs->m_pImage_data, pJobs->m_width, pJobs->m_height, pJobs->m_req_comps, pJobs->m_actual_comps, params, pJobs->m_use_jpgd, NULL, pJobs->m_compare_threads);
 }
 
 // Simple exhaustive test. Tries compressing/decompressing image using all supported quality, subsampling, and Huffman optimization settings.
-static int exhausive_compression_test(const char *pSrc_filename, bool use_jpgd)
+// Runs every configuration on num_threads threads, then checks the results in order. The rows are appended to report.
+static int exhausive_compression_test(const char *pSrc_filename, bool use_jpgd, int num_threads, std::vector<report_row> &report)
 {
   int status = EXIT_SUCCESS;
 
@@ -169,106 +272,348 @@ static int exhausive_compression_test(const char *pSrc_filename, bool use_jpgd)
 
   log_printf("Source file: \"%s\" Image resolution: %ix%i Actual comps: %i\n", pSrc_filename, width, height, actual_comps);
 
-  int orig_buf_size = width * height * 3; // allocate a buffer that's hopefully big enough (this is way overkill for jpeg)
-  if (orig_buf_size < 1024) orig_buf_size = 1024;
-  void *pBuf = malloc(orig_buf_size);
-
-  uint8 *pUncomp_image_data = NULL;
+  const size_t first_row = report.size();
+  report.resize(first_row + cNumExhaustiveConfigs);
+  report_row *pRows = &report[first_row];
+  for (int i = 0; i < cNumExhaustiveConfigs; i++)
+    pRows[i].m_pFilename = pSrc_filename;
+
+  exhaustive_jobs jobs;
+  jobs.m_pImage_data = pImage_data;
+  jobs.m_width = width;
+  jobs.m_height = height;
+  jobs.m_req_comps = req_comps;
+  jobs.m_actual_comps = actual_comps;
+  jobs.m_use_jpgd = use_jpgd;
+  jobs.m_compare_threads = (num_threads == 1) ? 0 : 1;
+  jobs.m_pRows = pRows;
+  run_jobs(cNumExhaustiveConfigs, num_threads, exhaustive_job, &jobs);
 
   double max_err = 0;
   double lowest_psnr = 9e+9;
   double threshold_psnr = 9e+9;
   double threshold_max_err = 0.0f;
 
-  image_compare_results prev_results;
+  imgcmp::channel_results prev_results;
 
-  for (uint quality_factor = 1; quality_factor <= 100; quality_factor++)
+  for (int i = 0; i < cNumExhaustiveConfigs; i++)
   {
-    for (uint subsampling = 0; subsampling <= jpge::H2V2; subsampling++)
+    const report_row &row = pRows[i];
+    if (!row.m_succeeded)
     {
-      for (uint optimize_huffman_tables = 0; optimize_huffman_tables <= 1; optimize_huffman_tables++)
-      {
-        // Fill in the compression parameter structure.
-        jpge::params params;
-        params.m_quality = quality_factor;
-        params.m_subsampling = static_cast<jpge::subsampling_t>(subsampling);
-        params.m_two_pass_flag = (optimize_huffman_tables != 0);
-
-        int comp_size = orig_buf_size;
-        if (!jpge::compress_image_to_jpeg_file_in_memory(pBuf, comp_size, width, height, req_comps, pImage_data, params))
-        {
-          status = EXIT_FAILURE;
-          goto failure;
-        }
+      status = EXIT_FAILURE;
+      goto failure;
+    }
 
-        int uncomp_width = 0, uncomp_height = 0, uncomp_actual_comps = 0, uncomp_req_comps = 3;
-        free(pUncomp_image_data);
-        if (use_jpgd)
-          pUncomp_image_data = jpgd::decompress_jpeg_image_from_memory((const stbi_uc*)pBuf, comp_size, &uncomp_width, &uncomp_height, &uncomp_actual_comps, uncomp_req_comps);
-        else
-          pUncomp_image_data = stbi_load_from_memory((const stbi_uc*)pBuf, comp_size, &uncomp_width, &uncomp_height, &uncomp_actual_comps, uncomp_req_comps);
-        if (!pUncomp_image_data)
-        {
-          status = EXIT_FAILURE;
-          goto failure;
-        }
+    const imgcmp::channel_results &results = row.m_results.m_total;
+    log_printf("%3u, %u, %u, %7u, %3.3f, %3.3f, %5.3f, %3.3f, %3.3f, %1.4f\n", row.m_quality, row.m_subsampling, row.m_optimize_huffman_tables, row.m_comp_size, results.m_max_err, results.m_mean, results.m_mean_squared, results.m_root_mean_squared, results.m_peak_snr, results.m_ssim);
+    if (results.m_max_err > max_err) max_err = results.m_max_err;
+    if (results.m_peak_snr < lowest_psnr) lowest_psnr = results.m_peak_snr;
 
-        if ((uncomp_width != width) || (uncomp_height != height))
+    if (row.m_quality == 1)
+    {
+      if (results.m_peak_snr < threshold_psnr)
+        threshold_psnr = results.m_peak_snr;
+      if (results.m_max_err > threshold_max_err)
+        threshold_max_err = results.m_max_err;
+    }
+    else
+    {
+      // Couple empirically determined tests - worked OK on my test data set.
+      if ((results.m_peak_snr < (threshold_psnr - 3.0f)) || (results.m_peak_snr < 10.75f)) 
+      {
+        status = EXIT_FAILURE;
+        goto failure;
+      }
+      if (row.m_optimize_huffman_tables)
+      {
+        if ((prev_results.m_max_err != results.m_max_err) || (prev_results.m_peak_snr != results.m_peak_snr) || (prev_results.m_ssim != results.m_ssim))
         {
           status = EXIT_FAILURE;
           goto failure;
         }
-
-        image_compare_results results;
-        image_compare(results, width, height, pImage_data, req_comps, pUncomp_image_data, uncomp_req_comps, (params.m_subsampling == jpge::Y_ONLY) || (actual_comps == 1) || (uncomp_actual_comps == 1));
-        //log_printf("Q: %3u, S: %u, O: %u, CompSize: %7u, Error Max: %3.3f, Mean: %3.3f, Mean^2: %5.3f, RMSE: %3.3f, PSNR: %3.3f\n", quality_factor, subsampling, optimize_huffman_tables, comp_size, results.max_err, results.mean, results.mean_squared, results.root_mean_squared, results.peak_snr);
-        log_printf("%3u, %u, %u, %7u, %3.3f, %3.3f, %5.3f, %3.3f, %3.3f\n", quality_factor, subsampling, optimize_huffman_tables, comp_size, results.max_err, results.mean, results.mean_squared, results.root_mean_squared, results.peak_snr);
-        if (results.max_err > max_err) max_err = results.max_err;
-        if (results.peak_snr < lowest_psnr) lowest_psnr = results.peak_snr;
-
-        if (quality_factor == 1)
-        {
-          if (results.peak_snr < threshold_psnr)
-            threshold_psnr = results.peak_snr;
-          if (results.max_err > threshold_max_err)
-            threshold_max_err = results.max_err;
-        }
-        else
-        {
-          // Couple empirically determined tests - worked OK on my test data set.
-          if ((results.peak_snr < (threshold_psnr - 3.0f)) || (results.peak_snr < 6.0f)) 
-          {
-            status = EXIT_FAILURE;
-            goto failure;
-          }
-          if (optimize_huffman_tables)
-          {
-            if ((prev_results.max_err != results.max_err) || (prev_results.peak_snr != results.peak_snr))
-            {
-              status = EXIT_FAILURE;
-              goto failure;
-            }
-          }
-        }
-
-        prev_results = results;
       }
     }
+
+    prev_results = results;
   }
 
   log_printf("Max error: %f Lowest PSNR: %f\n", max_err, lowest_psnr);
 
 failure:
   free(pImage_data);
-  free(pBuf);
-  free(pUncomp_image_data);
 
   log_printf((status == EXIT_SUCCESS) ? "Success.\n" : "Exhaustive test failed!\n");
   return status;
 }
 
-// Test JPEG file decompression using jpgd.h
-static int test_jpgd(const char *pSrc_filename, const char *pDst_filename)
+// Batch mode: every source file is converted on its own job.
+struct convert_jobs
+{
+  const std::vector<std::string> *m_pSrc_filenames;
+  const std::vector<std::string> *m_pDst_filenames;
+  jpge::params m_params;
+  bool m_auto_subsampling;
+  bool m_use_jpgd;
+  int m_compare_threads;
+  report_row *m_pRows;
+};
+
+static void convert_job(int index, void *pData)
+{
+  const convert_jobs *pJobs = static_cast<const convert_jobs*>(pData);
+  report_row &row = pJobs->m_pRows[index];
+
+  const int req_comps = 3; // request RGB image
+  int width = 0, height = 0, actual_comps = 0;
+  uint8 *pImage_data = stbi_load((*pJobs->m_pSrc_filenames)[index].c_str(), &width, &height, &actual_comps, req_comps);
+  if (!pImage_data)
+    return;
+
+  jpge::params params(pJobs->m_params);
+  if (pJobs->m_auto_subsampling)
+    params.m_subsampling = (actual_comps == 1) ? jpge::Y_ONLY : jpge::H2V2;
+
+  round_trip(row, pImage_data, width, height, req_comps, actual_comps, params, pJobs->m_use_jpgd, (*pJobs->m_pDst_filenames)[index].c_str(), pJobs->m_compare_threads);
+  free(pImage_data);
+}
+
+static bool has_image_extension(const char *pFilename)
+{
+  static const char *s_extensions[] = { ".jpg", ".jpeg", ".png", ".tga", ".bmp", ".psd" };
+  const char *pExt = strrchr(pFilename, '.');
+  if (!pExt)
+    return false;
+  for (uint i = 0; i < sizeof(s_extensions) / sizeof(s_extensions[0]); i++)
+    if (strcasecmp(pExt, s_extensions[i]) == 0)
+      return true;
+  return false;
+}
+
+// Adds a source path to the list: a file, every image file in a directory, or the files matching a wildcard pattern.
+static void add_source_files(std::vector<std::string> &filenames, const char *pPath)
+{
+  const size_t first = filenames.size();
+#if defined(_MSC_VER)
+  const DWORD attribs = GetFileAttributesA(pPath);
+  const bool is_dir = (attribs != INVALID_FILE_ATTRIBUTES) && (attribs & FILE_ATTRIBUTE_DIRECTORY);
+  if ((!is_dir) && (!strpbrk(pPath, "*?")))
+    filenames.push_back(pPath);
+  else
+  {
+    std::string dir(pPath), pattern(pPath);
+    if (is_dir)
+      pattern = dir + "\\*";
+    else
+    {
+      const size_t slash = dir.find_last_of("\\/");
+      dir = (slash == std::string::npos) ? "." : dir.substr(0, slash);
+    }
+
+    WIN32_FIND_DATAA find_data;
+    HANDLE hFind = FindFirstFileA(pattern.c_str(), &find_data);
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+      do
+      {
+        if ((find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || ((is_dir) && (!has_image_extension(find_data.cFileName))))
+          continue;
+        filenames.push_back(dir + "\\" + find_data.cFileName);
+      } while (FindNextFileA(hFind, &find_data));
+      FindClose(hFind);
+    }
+  }
+#else
+  struct stat st;
+  if ((stat(pPath, &st) == 0) && (S_ISDIR(st.st_mode)))
+  {
+    if (DIR *pDir = opendir(pPath))
+    {
+      while (struct dirent *pEntry = readdir(pDir))
+      {
+        const std::string filename = std::string(pPath) + "/" + pEntry->d_name;
+        if ((has_image_extension(pEntry->d_name)) && (stat(filename.c_str(), &st) == 0) && (S_ISREG(st.st_mode)))
+          filenames.push_back(filename);
+      }
+      closedir(pDir);
+    }
+  }
+  else if (strpbrk(pPath, "*?["))
+  {
+    glob_t matches;
+    if (glob(pPath, 0, NULL, &matches) == 0)
+    {
+      for (size_t i = 0; i < matches.gl_pathc; i++)
+        if ((stat(matches.gl_pathv[i], &st) == 0) && (S_ISREG(st.st_mode)))
+          filenames.push_back(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+  }
+  else
+    filenames.push_back(pPath);
+#endif
+  std::sort(filenames.begin() + first, filenames.end());
+
+  // Drop files that an earlier path already added.
+  for (size_t i = filenames.size(); i-- > first; )
+    if (std::find(filenames.begin(), filenames.begin() + first, filenames[i]) != filenames.begin() + first)
+      filenames.erase(filenames.begin() + i);
+}
+
+// dst_dir/<source file name without extension>.jpg, or dst_dir/<source file name>.jpg with keep_ext.
+static std::string get_dst_filename(const char *pDst_dir, const std::string &src_filename, bool keep_ext)
+{
+  const size_t slash = src_filename.find_last_of("\\/");
+  std::string name = (slash == std::string::npos) ? src_filename : src_filename.substr(slash + 1);
+  const size_t dot = name.find_last_of('.');
+  if ((dot != std::string::npos) && (!keep_ext))
+    name.erase(dot);
+  return std::string(pDst_dir) + "/" + name + ".jpg";
+}
+
+static std::string lower_case(std::string str)
+{
+  for (size_t i = 0; i < str.size(); i++)
+    str[i] = static_cast<char>(tolower(static_cast<unsigned char>(str[i])));
+  return str;
+}
+
+// Sources sharing a name (x.tga, x.png) keep their extension in their output name. Returns false,
+// having logged them, if two sources would still write the same file (x.png in two directories).
+static bool get_dst_filenames(const char *pDst_dir, const std::vector<std::string> &src_filenames, std::vector<std::string> &dst_filenames)
+{
+  // Compared case insensitively, as file names are on Windows and macOS
+  std::vector<std::string> plain(src_filenames.size());
+  for (size_t i = 0; i < src_filenames.size(); i++)
+    plain[i] = lower_case(get_dst_filename(pDst_dir, src_filenames[i], false));
+
+  dst_filenames.resize(src_filenames.size());
+  for (size_t i = 0; i < src_filenames.size(); i++)
+  {
+    const bool shared = (std::count(plain.begin(), plain.end(), plain[i]) > 1);
+    dst_filenames[i] = get_dst_filename(pDst_dir, src_filenames[i], shared);
+  }
+
+  bool unique = true;
+  for (size_t i = 0; i < dst_filenames.size(); i++)
+  {
+    for (size_t j = i + 1; j < dst_filenames.size(); j++)
+    {
+      if (lower_case(dst_filenames[i]) == lower_case(dst_filenames[j]))
+      {
+        log_printf("%s and %s would both be written to %s\n", src_filenames[i].c_str(), src_filenames[j].c_str(), dst_filenames[i].c_str());
+        unique = false;
+      }
+    }
+  }
+  return unique;
+}
+
+// Writes the report as JSON if the filename ends in .json, as CSV otherwise.
+static bool write_report(const char *pFilename, const std::vector<report_row> &rows)
+{
+  const char *pExt = strrchr(pFilename, '.');
+  const bool json = (pExt) && (strcasecmp(pExt, ".json") == 0);
+
+  FILE *pFile = fopen(pFilename, "w");
+  if (!pFile)
+    return false;
+
+  if (json)
+    fprintf(pFile, "[\n");
+  else
+    fprintf(pFile, "file,quality,subsampling,optimized_huffman,width,height,size,bits_per_pixel,psnr,ssim,max_error,encode_mps,decode_mps,succeeded\n");
+
+  for (size_t i = 0; i < rows.size(); i++)
+  {
+    const report_row &row = rows[i];
+
+    // Quote the file name: JSON escapes '"' and '\' with a backslash, CSV doubles '"'.
+    std::string filename;
+    for (const char *p = row.m_pFilename; *p; p++)
+    {
+      if ((json) && ((*p == '"') || (*p == '\\')))
+        filename += '\\';
+      else if ((!json) && (*p == '"'))
+        filename += '"';
+      filename += *p;
+    }
+
+    const double bits_per_pixel = (row.m_width && row.m_height) ? ((row.m_comp_size * 8.0) / (static_cast<double>(row.m_width) * row.m_height)) : 0.0;
+    if (json)
+    {
+      fprintf(pFile, "  { \"file\": \"%s\", \"quality\": %i, \"subsampling\": %i, \"optimized_huffman\": %s, \"width\": %i, \"height\": %i, \"size\": %u, "
+        "\"bits_per_pixel\": %.4f, \"psnr\": %.4f, \"ssim\": %.5f, \"max_error\": %.0f, \"encode_mps\": %.3f, \"decode_mps\": %.3f, \"succeeded\": %s }%s\n",
+        filename.c_str(), row.m_quality, row.m_subsampling, row.m_optimize_huffman_tables ? "true" : "false", row.m_width, row.m_height, row.m_comp_size,
+        bits_per_pixel, row.m_results.m_total.m_peak_snr, row.m_results.m_total.m_ssim, row.m_results.m_total.m_max_err, row.m_encode_mps, row.m_decode_mps, row.m_succeeded ? "true" : "false", (i + 1 < rows.size()) ? "," : "");
+    }
+    else
+    {
+      fprintf(pFile, "\"%s\",%i,%i,%i,%i,%i,%u,%.4f,%.4f,%.5f,%.0f,%.3f,%.3f,%i\n",
+        filename.c_str(), row.m_quality, row.m_subsampling, row.m_optimize_huffman_tables, row.m_width, row.m_height, row.m_comp_size,
+        bits_per_pixel, row.m_results.m_total.m_peak_snr, row.m_results.m_total.m_ssim, row.m_results.m_total.m_max_err, row.m_encode_mps, row.m_decode_mps, row.m_succeeded);
+    }
+  }
+
+  if (json)
+    fprintf(pFile, "]\n");
+  return fclose(pFile) != EOF;
+}
+
+static void print_compare_results(const char *pPrefix, const imgcmp::results &results)
+{
+  const imgcmp::channel_results &total = results.m_total;
+  log_printf("%sError Max: %f, Mean: %f, Mean^2: %f, RMSE: %f, PSNR: %f, SSIM: %f\n", pPrefix, total.m_max_err, total.m_mean, total.m_mean_squared, total.m_root_mean_squared, total.m_peak_snr, total.m_ssim);
+  if (results.m_num_channels < 2)
+    return;
+  for (int c = 0; c < results.m_num_channels; c++)
+  {
+    const imgcmp::channel_results &channel = results.m_channels[c];
+    log_printf("%s  %c: Error Max: %f, Mean: %f, RMSE: %f, PSNR: %f, SSIM: %f\n", pPrefix, "RGBA"[c], channel.m_max_err, channel.m_mean, channel.m_root_mean_squared, channel.m_peak_snr, channel.m_ssim);
+  }
+}
+
+// Rounding differences (e.g. in the IDCT) stay well above this, real decoding errors don't.
+static const double cMinReferencePSNR = 50.0;
+
+// Compares a decoded image against a reference image: as a whole, and each half on its own, as the viewer uploads the halves
+// of an over/under panorama to the two eyes' textures. Fails if the sizes differ or any PSNR is below min_psnr.
+static bool check_against_reference(const uint8 *pImage_data, int width, int height, int comps, const char *pRef_filename, double min_psnr)
+{
+  int ref_width = 0, ref_height = 0, ref_actual_comps = 0;
+  uint8 *pRef_image_data = stbi_load(pRef_filename, &ref_width, &ref_height, &ref_actual_comps, comps);
+  if (!pRef_image_data)
+  {
+    log_printf("Failed loading reference image \"%s\"!\n", pRef_filename);
+    return false;
+  }
+
+  bool passed = (ref_width == width) && (ref_height == height);
+  if (!passed)
+    log_printf("Reference image \"%s\" is %ix%i, expected %ix%i!\n", pRef_filename, ref_width, ref_height, width, height);
+  else
+  {
+    const imgcmp::image image(pImage_data, width, height, comps), ref_image(pRef_image_data, width, height, comps);
+    const char *pPrefixes[3] = { "Reference: ", "Top half: ", "Bottom half: " };
+    for (int i = 0; i < 3; i++)
+    {
+      const int y = (i == 2) ? (height / 2) : 0, h = i ? (height / 2) : height;
+      if (!h)
+        continue;
+      imgcmp::results results;
+      imgcmp::compare_images(results, image.get_rect(0, y, width, h), ref_image.get_rect(0, y, width, h));
+      print_compare_results(pPrefixes[i], results);
+      if (results.m_total.m_peak_snr < min_psnr)
+        passed = false;
+    }
+  }
+
+  free(pRef_image_data);
+  return passed;
+}
+
+// Test JPEG file decompression using jpgd.h, optionally checking the result against a reference image.
+static int test_jpgd(const char *pSrc_filename, const char *pDst_filename, const char *pRef_filename)
 {
   // Load the source JPEG image.
   const int req_comps = 3; // request RGB image
@@ -298,6 +643,13 @@ static int test_jpgd(const char *pSrc_filename, const char *pDst_filename)
     return EXIT_FAILURE;
   }
   log_printf("Wrote decompressed image to TGA file \"%s\"\n", pDst_filename);
+
+  if ((pRef_filename[0]) && (!check_against_reference(pImage_data, width, height, req_comps, pRef_filename, cMinReferencePSNR)))
+  {
+    log_printf("Decompressed image doesn't match the reference image!\n");
+    free(pImage_data);
+    return EXIT_FAILURE;
+  }
   
   log_printf("Success.\n");
 
@@ -308,15 +660,28 @@ static int test_jpgd(const char *pSrc_filename, const char *pDst_filename)
 int main(int arg_c, char* ppArgs[])
 {
   printf("jpge/jpgd example app\n");
+  timer::init();
 
   // Parse command line.
   bool run_exhausive_test = false;
   bool test_memory_compression = false;
   bool optimize_huffman_tables = false;
+  bool single_feed = false;
+  bool progressive = false;
   int subsampling = -1;
+  int restart_interval = 0;
+  int num_threads = 1;
+  int target_size = 0;
   char output_filename[256] = "";
   bool use_jpgd = true;
   bool test_jpgd_decompression = false;
+  bool transcode = false;
+  int dst_width = 0, dst_height = 0;
+  char bottom_filename[256] = "";
+  bool batch = false;
+  int batch_threads = 1;
+  char report_filename[256] = "";
+  char reference_filename[256] = "";
 
   int arg_index = 1;
   while ((arg_index < arg_c) && (ppArgs[arg_index][0] == '-'))
@@ -332,12 +697,50 @@ int main(int arg_c, char* ppArgs[])
     case 'x':
       run_exhausive_test = true;
       break;
+    case 'c':
+      transcode = true;
+      break;
+    case 'j':
+      batch = true;
+      batch_threads = atoi(&ppArgs[arg_index][2]);
+      break;
+    case 'e':
+      strcpy_s(report_filename, sizeof(report_filename), &ppArgs[arg_index][2]);
+      break;
+    case 'v':
+      if (sscanf(&ppArgs[arg_index][2], "%dx%d", &dst_width, &dst_height) != 2)
+      {
+        log_printf("Invalid resample size: %s\n", ppArgs[arg_index]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'k':
+      strcpy_s(reference_filename, sizeof(reference_filename), &ppArgs[arg_index][2]);
+      break;
+    case 'u':
+      strcpy_s(bottom_filename, sizeof(bottom_filename), &ppArgs[arg_index][2]);
+      break;
     case 'm':
       test_memory_compression = true;
       break;
     case 'o':
       optimize_huffman_tables = true;
       break;
+    case 'f':
+      single_feed = true;
+      break;
+    case 'p':
+      progressive = true;
+      break;
+    case 'r':
+      restart_interval = atoi(&ppArgs[arg_index][2]);
+      break;
+    case 't':
+      num_threads = atoi(&ppArgs[arg_index][2]);
+      break;
+    case 'b':
+      target_size = atoi(&ppArgs[arg_index][2]);
+      break;
     case 'l':
       if (strcasecmp(&ppArgs[arg_index][1], "luma") == 0)
         subsampling = jpge::Y_ONLY;
@@ -385,8 +788,27 @@ int main(int arg_c, char* ppArgs[])
       return print_usage();
     }
 
-    const char* pSrc_filename = ppArgs[arg_index++];
-    return exhausive_compression_test(pSrc_filename, use_jpgd);
+    std::vector<std::string> src_filenames;
+    while (arg_index < arg_c)
+      add_source_files(src_filenames, ppArgs[arg_index++]);
+    if (src_filenames.empty())
+    {
+      log_printf("No source files found!\n");
+      return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    std::vector<report_row> report;
+    for (size_t i = 0; i < src_filenames.size(); i++)
+      if (exhausive_compression_test(src_filenames[i].c_str(), use_jpgd, batch_threads, report) != EXIT_SUCCESS)
+        status = EXIT_FAILURE;
+
+    if ((report_filename[0]) && (!write_report(report_filename, report)))
+    {
+      log_printf("Failed writing report file \"%s\"!\n", report_filename);
+      status = EXIT_FAILURE;
+    }
+    return status;
   }
   else if (test_jpgd_decompression)
   {
@@ -398,7 +820,91 @@ int main(int arg_c, char* ppArgs[])
 
     const char* pSrc_filename = ppArgs[arg_index++];
     const char* pDst_filename = ppArgs[arg_index++];
-    return test_jpgd(pSrc_filename, pDst_filename);
+    return test_jpgd(pSrc_filename, pDst_filename, reference_filename);
+  }
+  else if ((batch) && (!transcode))
+  {
+    if ((arg_c - arg_index) < 3)
+    {
+      log_printf("Not enough parameters (expected dest directory, quality factor and source files)\n");
+      return print_usage();
+    }
+
+    const char* pDst_dir = ppArgs[arg_index++];
+    int quality_factor = atoi(ppArgs[arg_index++]);
+    if ((quality_factor < 1) || (quality_factor > 100))
+    {
+      log_printf("Quality factor must range from 1-100!\n");
+      return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> src_filenames, dst_filenames;
+    while (arg_index < arg_c)
+      add_source_files(src_filenames, ppArgs[arg_index++]);
+    if (src_filenames.empty())
+    {
+      log_printf("No source files found!\n");
+      return EXIT_FAILURE;
+    }
+
+    if (!get_dst_filenames(pDst_dir, src_filenames, dst_filenames))
+    {
+      log_printf("Rename the sources so every output name is unique.\n");
+      return EXIT_FAILURE;
+    }
+
+    std::vector<report_row> report(src_filenames.size());
+    for (size_t i = 0; i < src_filenames.size(); i++)
+      report[i].m_pFilename = src_filenames[i].c_str();
+
+    convert_jobs jobs;
+    jobs.m_pSrc_filenames = &src_filenames;
+    jobs.m_pDst_filenames = &dst_filenames;
+    jobs.m_params.m_quality = quality_factor;
+    jobs.m_params.m_subsampling = (subsampling < 0) ? jpge::H2V2 : static_cast<jpge::subsampling_t>(subsampling);
+    jobs.m_params.m_two_pass_flag = optimize_huffman_tables;
+    jobs.m_params.m_single_feed_flag = single_feed;
+    jobs.m_params.m_progressive_flag = progressive;
+    jobs.m_params.m_restart_interval = restart_interval;
+    jobs.m_params.m_num_threads = num_threads;
+    jobs.m_params.m_target_size = target_size;
+    jobs.m_auto_subsampling = (subsampling < 0);
+    jobs.m_use_jpgd = use_jpgd;
+    jobs.m_compare_threads = (batch_threads == 1) ? 0 : 1;
+    jobs.m_pRows = &report[0];
+
+    make_dir(pDst_dir);
+
+    log_printf("Converting %u files to \"%s\"\n", static_cast<uint>(src_filenames.size()), pDst_dir);
+
+    timer tm;
+    tm.start();
+    run_jobs(static_cast<int>(src_filenames.size()), batch_threads, convert_job, &jobs);
+    tm.stop();
+
+    int status = EXIT_SUCCESS;
+    uint num_converted = 0;
+    for (size_t i = 0; i < report.size(); i++)
+    {
+      const report_row &row = report[i];
+      if (!row.m_succeeded)
+      {
+        log_printf("%s: Failed!\n", row.m_pFilename);
+        status = EXIT_FAILURE;
+        continue;
+      }
+      num_converted++;
+      log_printf("%s: %ix%i, %u bytes, bits/pixel: %3.3f, PSNR: %3.3f, SSIM: %1.4f, encode: %3.3f MP/s, decode: %3.3f MP/s\n", row.m_pFilename, row.m_width, row.m_height, row.m_comp_size,
+        (row.m_comp_size * 8.0f) / (static_cast<double>(row.m_width) * row.m_height), row.m_results.m_total.m_peak_snr, row.m_results.m_total.m_ssim, row.m_encode_mps, row.m_decode_mps);
+    }
+    log_printf("Converted %u of %u files in %3.3fms\n", num_converted, static_cast<uint>(report.size()), tm.get_elapsed_ms());
+
+    if ((report_filename[0]) && (!write_report(report_filename, report)))
+    {
+      log_printf("Failed writing report file \"%s\"!\n", report_filename);
+      status = EXIT_FAILURE;
+    }
+    return status;
   }
 
   // Test jpge
@@ -418,6 +924,34 @@ int main(int arg_c, char* ppArgs[])
     return EXIT_FAILURE;
   }
 
+  if (transcode)
+  {
+    jpgt::params trans_params;
+    trans_params.m_comp_params.m_quality = quality_factor;
+    trans_params.m_comp_params.m_subsampling = (subsampling < 0) ? jpge::H2V2 : static_cast<jpge::subsampling_t>(subsampling);
+    trans_params.m_comp_params.m_two_pass_flag = optimize_huffman_tables;
+    trans_params.m_comp_params.m_progressive_flag = progressive;
+    trans_params.m_comp_params.m_restart_interval = restart_interval;
+    trans_params.m_comp_params.m_target_size = target_size;
+    trans_params.m_dst_width = dst_width;
+    trans_params.m_dst_height = dst_height;
+    trans_params.m_split_over_under = (bottom_filename[0] != '\0');
+
+    log_printf("Transcoding \"%s\" to \"%s\"\n", pSrc_filename, pDst_filename);
+
+    timer tm;
+    tm.start();
+    if (!jpgt::transcode_file(pSrc_filename, pDst_filename, trans_params, bottom_filename))
+    {
+      log_printf("Failed transcoding file!\n");
+      return EXIT_FAILURE;
+    }
+    tm.stop();
+
+    log_printf("Transcoding time: %3.3fms, compressed file size: %u\n", tm.get_elapsed_ms(), get_file_size(pDst_filename));
+    return EXIT_SUCCESS;
+  }
+
   // Load the source image.
   const int req_comps = 3; // request RGB image
   int width = 0, height = 0, actual_comps = 0;
@@ -435,6 +969,11 @@ int main(int arg_c, char* ppArgs[])
   params.m_quality = quality_factor;
   params.m_subsampling = (subsampling < 0) ? ((actual_comps == 1) ? jpge::Y_ONLY : jpge::H2V2) : static_cast<jpge::subsampling_t>(subsampling);
   params.m_two_pass_flag = optimize_huffman_tables;
+  params.m_single_feed_flag = single_feed;
+  params.m_progressive_flag = progressive;
+  params.m_restart_interval = restart_interval;
+  params.m_num_threads = num_threads;
+  params.m_target_size = target_size;
 
   log_printf("Writing JPEG image to file: %s\n", pDst_filename);
 
@@ -443,18 +982,19 @@ int main(int arg_c, char* ppArgs[])
   // Now create the JPEG file.
   if (test_memory_compression)
   {
-    int buf_size = width * height * 3; // allocate a buffer that's hopefully big enough (this is way overkill for jpeg)
-    if (buf_size < 1024) buf_size = 1024;
-    void *pBuf = malloc(buf_size);
+    // Memory use tracks the compressed size, the chunks are written out in place.
+    jpge::chunked_output_stream comp_stream;
 
     tm.start();
-    if (!jpge::compress_image_to_jpeg_file_in_memory(pBuf, buf_size, width, height, req_comps, pImage_data, params))
+    if (!jpge::compress_image_to_jpeg_chunks(comp_stream, width, height, req_comps, pImage_data, params))
     {
        log_printf("Failed creating JPEG data!\n");
        return EXIT_FAILURE;
     }
     tm.stop();
 
+    log_printf("Compressed to %u bytes in %u memory chunks\n", comp_stream.get_size(), comp_stream.get_num_chunks());
+
     FILE *pFile = fopen(pDst_filename, "wb");
     if (!pFile)
     {
@@ -462,10 +1002,13 @@ int main(int arg_c, char* ppArgs[])
        return EXIT_FAILURE;
     }
 
-    if (fwrite(pBuf, buf_size, 1, pFile) != 1)
+    for (const jpge::chunked_output_stream::chunk *pChunk = comp_stream.get_first_chunk(); pChunk; pChunk = pChunk->m_pNext)
     {
-       log_printf("Failed writing to output file!\n");
-       return EXIT_FAILURE;
+       if (fwrite(pChunk->get_data(), pChunk->m_size, 1, pFile) != 1)
+       {
+          log_printf("Failed writing to output file!\n");
+          return EXIT_FAILURE;
+       }
     }
 
     if (fclose(pFile) == EOF)
@@ -523,9 +1066,11 @@ int main(int arg_c, char* ppArgs[])
   }
 
   // Diff the original and compressed images.
-  image_compare_results results;
-  image_compare(results, width, height, pImage_data, req_comps, pUncomp_image_data, uncomp_req_comps, (params.m_subsampling == jpge::Y_ONLY) || (actual_comps == 1) || (uncomp_actual_comps == 1));
-  log_printf("Error Max: %f, Mean: %f, Mean^2: %f, RMSE: %f, PSNR: %f\n", results.max_err, results.mean, results.mean_squared, results.root_mean_squared, results.peak_snr);
+  imgcmp::params comp_params;
+  comp_params.m_luma_only = (params.m_subsampling == jpge::Y_ONLY) || (actual_comps == 1) || (uncomp_actual_comps == 1);
+  imgcmp::results results;
+  imgcmp::compare_images(results, imgcmp::image(pImage_data, width, height, req_comps), imgcmp::image(pUncomp_image_data, uncomp_width, uncomp_height, uncomp_req_comps), comp_params);
+  print_compare_results("", results);
 
   log_printf("Success.\n");
 
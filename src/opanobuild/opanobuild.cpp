@@ -0,0 +1,652 @@
+// opanobuild.cpp
+// Converts stereo JPEG panoramas, over/under or left/right pairs, into .opano tile pyramids.
+// The source decodes a row at a time and each level keeps only the rows of its current
+// tile row, so memory depends on the image width alone. Tiles encode on all cores.
+
+#include "OpanoFormat.h"
+#include "jpgd.h"
+#include "jpge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    const int kMinPixelsPerThread = 64 * 1024; ///< Less downsampling than this is not worth a thread
+
+    ///@brief Command line options.
+    struct BuildParams
+    {
+        BuildParams()
+        : quality(90)
+        , tileSize(128)
+        , border(4)
+        , numThreads(0)
+        , projection()
+        {
+            projection.cylHeight = 5.0f;
+            projection.coverage = 1.0f;
+            projection.pairTweak = 0.016f;
+            projection.reserved = 0.0f;
+        }
+
+        int quality;
+        int tileSize;
+        int border;
+        int numThreads; ///< 0 = one per hardware thread
+        OpanoProjection projection;
+    };
+
+    int WrapIndex(int i, int n)
+    {
+        return ((i % n) + n) % n;
+    }
+
+    /// Level sizes down to the first that fits in a single tile, as VirtualTexture uses them.
+    ///@param firstTile Index of the first tile of level 0 in the file's tile table
+    std::vector<OpanoLevel> MakeLevels(int width, int height, int tileSize, uint64_t firstTile)
+    {
+        std::vector<OpanoLevel> levels;
+        for (;;)
+        {
+            OpanoLevel level;
+            level.width = width;
+            level.height = height;
+            level.tilesX = (width + tileSize - 1) / tileSize;
+            level.tilesY = (height + tileSize - 1) / tileSize;
+            level.firstTile = firstTile;
+            levels.push_back(level);
+            firstTile += (uint64_t)level.tilesX * level.tilesY;
+            if ((level.tilesX == 1) && (level.tilesY == 1))
+                break;
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+        return levels;
+    }
+
+    ///@brief The rows of a JPEG as 8-bit RGB, decoded one at a time.
+    class JpegRowReader
+    {
+    public:
+        JpegRowReader()
+        : m_stream()
+        , m_pDecoder()
+        , m_row()
+        {}
+
+        bool Open(const char* pFilename)
+        {
+            if (!m_stream.open(pFilename))
+                return false;
+            m_pDecoder.reset(new jpgd::jpeg_decoder(&m_stream));
+            if ((m_pDecoder->get_error_code() != jpgd::JPGD_SUCCESS) ||
+                (m_pDecoder->begin_decoding() != jpgd::JPGD_SUCCESS))
+            {
+                return false;
+            }
+            m_row.resize((size_t)Width() * 3);
+            return true;
+        }
+
+        int Width() const { return m_pDecoder->get_width(); }
+        int Height() const { return m_pDecoder->get_height(); }
+
+        ///@return NULL on a decoding error
+        const unsigned char* NextRow()
+        {
+            const void* pScan = NULL;
+            unsigned int scanLen = 0;
+            if (m_pDecoder->decode(&pScan, &scanLen) != jpgd::JPGD_SUCCESS)
+                return NULL;
+
+            /// jpgd gives 4 bytes per pixel for color images, 1 for greyscale
+            const unsigned char* pSrc = (const unsigned char*)pScan;
+            const int comps = (m_pDecoder->get_num_components() == 1) ? 1 : 4;
+            for (int x=0; x<Width(); ++x)
+            {
+                for (int c=0; c<3; ++c)
+                    m_row[x*3 + c] = pSrc[x*comps + ((comps == 1) ? 0 : c)];
+            }
+            return &m_row[0];
+        }
+
+    protected:
+        jpgd::jpeg_decoder_file_stream m_stream;
+        std::unique_ptr<jpgd::jpeg_decoder> m_pDecoder;
+        std::vector<unsigned char> m_row;
+
+    private: // Disallow copy ctor and assignment operator
+        JpegRowReader(const JpegRowReader&);
+        JpegRowReader& operator=(const JpegRowReader&);
+    };
+
+    ///@brief Appends tile payloads to the file as they finish, from any thread, then writes
+    /// the index in the space left for it at the front.
+    class OpanoWriter
+    {
+    public:
+        OpanoWriter()
+        : m_pFile(NULL)
+        , m_mutex()
+        , m_header()
+        , m_levels()
+        , m_tiles()
+        , m_offset(0)
+        , m_failed(false)
+        {}
+
+        ~OpanoWriter()
+        {
+            if (m_pFile != NULL)
+                fclose(m_pFile);
+        }
+
+        bool Open(const char* pFilename, const OpanoHeader& header, const std::vector<OpanoLevel>& levels, uint64_t numTiles)
+        {
+            m_pFile = fopen(pFilename, "wb");
+            if (m_pFile == NULL)
+                return false;
+
+            m_header = header;
+            m_levels = levels;
+            OpanoTile empty = { 0, 0, 0 };
+            m_tiles.assign((size_t)numTiles, empty);
+            m_header.indexBytes = sizeof(OpanoHeader) + m_levels.size() * sizeof(OpanoLevel) + m_tiles.size() * sizeof(OpanoTile);
+
+            /// Sequential writes only, so no seeking past 2GB
+            std::vector<char> zeros(64 * 1024, 0);
+            for (uint64_t left=m_header.indexBytes; left>0; )
+            {
+                const size_t n = (size_t)std::min<uint64_t>(left, zeros.size());
+                if (fwrite(&zeros[0], 1, n, m_pFile) != n)
+                    return false;
+                left -= n;
+            }
+            m_offset = m_header.indexBytes;
+            return true;
+        }
+
+        void WriteTile(uint64_t index, const unsigned char* pData, size_t size)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (fwrite(pData, 1, size, m_pFile) != size)
+            {
+                m_failed = true;
+                return;
+            }
+            m_tiles[(size_t)index].offset = m_offset;
+            m_tiles[(size_t)index].size = (uint32_t)size;
+            m_offset += size;
+        }
+
+        bool Close()
+        {
+            for (size_t i=0; i<m_tiles.size(); ++i)
+                m_failed = m_failed || (m_tiles[i].size == 0);
+
+            m_header.fileSize = m_offset;
+            const bool ok = !m_failed &&
+                (fseek(m_pFile, 0, SEEK_SET) == 0) &&
+                (fwrite(&m_header, sizeof(m_header), 1, m_pFile) == 1) &&
+                (fwrite(&m_levels[0], sizeof(OpanoLevel), m_levels.size(), m_pFile) == m_levels.size()) &&
+                (fwrite(&m_tiles[0], sizeof(OpanoTile), m_tiles.size(), m_pFile) == m_tiles.size());
+            const bool closed = (fclose(m_pFile) == 0);
+            m_pFile = NULL;
+            return ok && closed;
+        }
+
+        uint64_t Bytes() const { return m_offset; }
+
+    protected:
+        FILE* m_pFile;
+        std::mutex m_mutex;
+        OpanoHeader m_header;
+        std::vector<OpanoLevel> m_levels;
+        std::vector<OpanoTile> m_tiles;
+        uint64_t m_offset;
+        bool m_failed;
+
+    private: // Disallow copy ctor and assignment operator
+        OpanoWriter(const OpanoWriter&);
+        OpanoWriter& operator=(const OpanoWriter&);
+    };
+
+    ///@brief The rows of one level that a tile row and its borders cover.
+    struct Band
+    {
+        int width;
+        int firstRow;
+        int numRows;
+        std::vector<unsigned char> pixels;
+    };
+
+    struct TileJob
+    {
+        std::shared_ptr<const Band> pBand;
+        int tileX;
+        int tileY;
+        uint64_t index;
+    };
+
+    ///@brief Worker threads cutting tiles with their borders out of bands and encoding them.
+    class TileEncoder
+    {
+    public:
+        TileEncoder(const BuildParams& params, OpanoWriter& writer)
+        : m_params(params)
+        , m_writer(writer)
+        , m_mutex()
+        , m_ready()
+        , m_space()
+        , m_jobs()
+        , m_maxJobs(0)
+        , m_done(false)
+        , m_failed(false)
+        , m_threads()
+        {
+            int numThreads = params.numThreads;
+            if (numThreads <= 0)
+                numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+            m_maxJobs = 64 * numThreads;
+            for (int i=0; i<numThreads; ++i)
+                m_threads.push_back(std::thread(&TileEncoder::_Run, this));
+        }
+
+        ~TileEncoder()
+        {
+            Finish();
+        }
+
+        /// Queue every tile of a band, first waiting while the queue is full, which bounds
+        /// the memory held by bands waiting to be encoded.
+        void Push(const std::shared_ptr<const Band>& pBand, int tileY, int tilesX, uint64_t firstIndex)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_jobs.size() >= m_maxJobs)
+                m_space.wait(lock);
+            for (int tx=0; tx<tilesX; ++tx)
+            {
+                TileJob job;
+                job.pBand = pBand;
+                job.tileX = tx;
+                job.tileY = tileY;
+                job.index = firstIndex + tx;
+                m_jobs.push_back(job);
+            }
+            m_ready.notify_all();
+        }
+
+        ///@return false if any tile failed to encode
+        bool Finish()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_done = true;
+                m_ready.notify_all();
+            }
+            for (size_t i=0; i<m_threads.size(); ++i)
+                m_threads[i].join();
+            m_threads.clear();
+            return !m_failed;
+        }
+
+    protected:
+        void _Run()
+        {
+            const int size = m_params.tileSize + 2 * m_params.border;
+            std::vector<unsigned char> tile((size_t)size * size * 3);
+            std::vector<unsigned char> jpeg(2 * tile.size() + 1024);
+            for (;;)
+            {
+                TileJob job;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    while (m_jobs.empty() && !m_done)
+                        m_ready.wait(lock);
+                    if (m_jobs.empty())
+                        return;
+                    job = m_jobs.front();
+                    m_jobs.pop_front();
+                    m_space.notify_one();
+                }
+
+                _CutTile(job, size, &tile[0]);
+                jpge::params params;
+                params.m_quality = m_params.quality;
+                int jpegSize = (int)jpeg.size();
+                if (!jpge::compress_image_to_jpeg_file_in_memory(&jpeg[0], jpegSize, size, size, 3, &tile[0], params))
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_failed = true;
+                    continue;
+                }
+                m_writer.WriteTile(job.index, &jpeg[0], jpegSize);
+            }
+        }
+
+        /// Tile texels wrap around on x and clamp on y, as TileSource requires.
+        void _CutTile(const TileJob& job, int size, unsigned char* pDst) const
+        {
+            const Band& band = *job.pBand;
+            const int x0 = job.tileX * m_params.tileSize - m_params.border;
+            const int y0 = job.tileY * m_params.tileSize - m_params.border;
+            for (int y=0; y<size; ++y)
+            {
+                const int sy = std::min(band.firstRow + band.numRows - 1, std::max(band.firstRow, y0 + y));
+                const unsigned char* pRow = &band.pixels[(size_t)(sy - band.firstRow) * band.width * 3];
+                for (int x=0; x<size; ++x)
+                {
+                    const unsigned char* pSrc = pRow + WrapIndex(x0 + x, band.width) * 3;
+                    *pDst++ = pSrc[0];
+                    *pDst++ = pSrc[1];
+                    *pDst++ = pSrc[2];
+                }
+            }
+        }
+
+        const BuildParams& m_params;
+        OpanoWriter& m_writer;
+        std::mutex m_mutex;
+        std::condition_variable m_ready;
+        std::condition_variable m_space;
+        std::deque<TileJob> m_jobs;
+        size_t m_maxJobs;
+        bool m_done;
+        bool m_failed;
+        std::vector<std::thread> m_threads;
+
+    private: // Disallow default, copy ctor and assignment operator
+        TileEncoder();
+        TileEncoder(const TileEncoder&);
+        TileEncoder& operator=(const TileEncoder&);
+    };
+
+    /// 2x2 box filter rows [y0,y1) of the next level; odd last rows and columns drop out.
+    void DownsampleRows(const unsigned char* pSrc, int srcFirstRow, int srcWidth, int srcHeight,
+                        int dstWidth, int y0, int y1, unsigned char* pDst)
+    {
+        for (int y=y0; y<y1; ++y)
+        {
+            const unsigned char* pA = pSrc + (size_t)(std::min(2*y,     srcHeight - 1) - srcFirstRow) * srcWidth * 3;
+            const unsigned char* pB = pSrc + (size_t)(std::min(2*y + 1, srcHeight - 1) - srcFirstRow) * srcWidth * 3;
+            unsigned char* pOut = pDst + (size_t)(y - y0) * dstWidth * 3;
+            for (int x=0; x<dstWidth; ++x)
+            {
+                const int xa = std::min(2*x,     srcWidth - 1) * 3;
+                const int xb = std::min(2*x + 1, srcWidth - 1) * 3;
+                for (int c=0; c<3; ++c)
+                    pOut[x*3 + c] = (unsigned char)((pA[xa + c] + pA[xb + c] + pB[xa + c] + pB[xb + c] + 2) / 4);
+            }
+        }
+    }
+
+    ///@brief The tile pyramid of one eye, fed a row of level 0 at a time. Each level holds
+    /// the rows of its current tile row; once those and the border below are in, the
+    /// band goes to the encoder and its rows are filtered into the next level.
+    class EyePyramid
+    {
+    public:
+        EyePyramid(const std::vector<OpanoLevel>& levels, const BuildParams& params, TileEncoder& encoder)
+        : m_params(params)
+        , m_encoder(encoder)
+        , m_levels()
+        , m_next()
+        , m_numThreads(params.numThreads)
+        {
+            if (m_numThreads <= 0)
+                m_numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+
+            for (size_t i=0; i<levels.size(); ++i)
+            {
+                Level level;
+                level.info = levels[i];
+                level.firstRow = 0;
+                level.numRows = 0;
+                level.nextTileRow = 0;
+                m_levels.push_back(level);
+            }
+        }
+
+        void AddRow(const unsigned char* pRow)
+        {
+            _AddRows(0, pRow, 1);
+        }
+
+        bool IsComplete() const
+        {
+            for (size_t i=0; i<m_levels.size(); ++i)
+            {
+                if (m_levels[i].nextTileRow < m_levels[i].info.tilesY)
+                    return false;
+            }
+            return true;
+        }
+
+    protected:
+        struct Level
+        {
+            OpanoLevel info;
+            std::vector<unsigned char> rows;
+            int firstRow;    ///< Of the rows held
+            int numRows;
+            int nextTileRow;
+        };
+
+        void _AddRows(size_t level, const unsigned char* pRows, int count)
+        {
+            Level& L = m_levels[level];
+            L.rows.insert(L.rows.end(), pRows, pRows + (size_t)count * L.info.width * 3);
+            L.numRows += count;
+
+            const int T = m_params.tileSize;
+            while ((L.nextTileRow < L.info.tilesY) &&
+                   (L.firstRow + L.numRows >= std::min(L.info.height, (L.nextTileRow + 1) * T + m_params.border)))
+            {
+                _FinishTileRow(level);
+            }
+        }
+
+        void _FinishTileRow(size_t level)
+        {
+            Level& L = m_levels[level];
+            const int T = m_params.tileSize;
+            const int ty = L.nextTileRow;
+            const size_t rowBytes = (size_t)L.info.width * 3;
+
+            const std::shared_ptr<Band> pBand(new Band);
+            pBand->width = L.info.width;
+            pBand->firstRow = std::max(0, ty * T - m_params.border);
+            pBand->numRows = std::min(L.info.height, (ty + 1) * T + m_params.border) - pBand->firstRow;
+            const unsigned char* pFirst = &L.rows[(pBand->firstRow - L.firstRow) * rowBytes];
+            pBand->pixels.assign(pFirst, pFirst + pBand->numRows * rowBytes);
+            m_encoder.Push(pBand, ty, L.info.tilesX, L.info.firstTile + (uint64_t)ty * L.info.tilesX);
+
+            if (level + 1 < m_levels.size())
+            {
+                const OpanoLevel& next = m_levels[level + 1].info;
+                const int y0 = ty * T / 2;
+                const int y1 = std::min(next.height, (ty + 1) * T / 2);
+                _Downsample(level, y0, y1);
+                _AddRows(level + 1, &m_next[0], y1 - y0);
+            }
+
+            /// Keep what the border of the next tile row needs
+            ++L.nextTileRow;
+            const int keepFrom = std::max(L.firstRow, std::min(L.firstRow + L.numRows, L.nextTileRow * T - m_params.border));
+            L.rows.erase(L.rows.begin(), L.rows.begin() + (keepFrom - L.firstRow) * rowBytes);
+            L.numRows -= keepFrom - L.firstRow;
+            L.firstRow = keepFrom;
+        }
+
+        /// Filter rows [y0,y1) of the level below into m_next, split across threads.
+        void _Downsample(size_t level, int y0, int y1)
+        {
+            const Level& L = m_levels[level];
+            const OpanoLevel& next = m_levels[level + 1].info;
+            m_next.resize((size_t)(y1 - y0) * next.width * 3);
+
+            const int numThreads = std::max(1, std::min(m_numThreads, (y1 - y0) * next.width / kMinPixelsPerThread));
+            std::vector<std::thread> threads;
+            for (int i=1; i<numThreads; ++i)
+            {
+                const int a = y0 + (y1 - y0) * i / numThreads;
+                const int b = y0 + (y1 - y0) * (i + 1) / numThreads;
+                threads.push_back(std::thread(DownsampleRows, &L.rows[0], L.firstRow, L.info.width, L.info.height,
+                    next.width, a, b, &m_next[(size_t)(a - y0) * next.width * 3]));
+            }
+            DownsampleRows(&L.rows[0], L.firstRow, L.info.width, L.info.height,
+                next.width, y0, y0 + (y1 - y0) / numThreads, &m_next[0]);
+            for (size_t i=0; i<threads.size(); ++i)
+                threads[i].join();
+        }
+
+        const BuildParams& m_params;
+        TileEncoder& m_encoder;
+        std::vector<Level> m_levels;
+        std::vector<unsigned char> m_next; ///< Rows on their way to the next level
+        int m_numThreads;
+
+    private: // Disallow default, copy ctor and assignment operator
+        EyePyramid();
+        EyePyramid(const EyePyramid&);
+        EyePyramid& operator=(const EyePyramid&);
+    };
+
+    /// Feed rows of the reader to an eye's pyramid.
+    bool FeedRows(JpegRowReader& reader, int count, EyePyramid& eye)
+    {
+        for (int y=0; y<count; ++y)
+        {
+            const unsigned char* pRow = reader.NextRow();
+            if (pRow == NULL)
+                return false;
+            eye.AddRow(pRow);
+        }
+        return eye.IsComplete();
+    }
+
+    int PrintUsage()
+    {
+        printf("Usage: opanobuild [options] <output.opano> <overunder.jpg>\n"
+               "       opanobuild [options] <output.opano> <left.jpg> <right.jpg>\n"
+               "\n"
+               "Options:\n"
+               "  -q <quality>    JPEG quality of the tiles, 1-100 (90)\n"
+               "  -t <size>       Tile size in texels, a multiple of 4 (128)\n"
+               "  -b <border>     Border texels around each tile, a multiple of 4 (4)\n"
+               "  -j <threads>    Worker threads, 0 for one per core (0)\n"
+               "  -height <h>     Half height of the display cylinder (5)\n"
+               "  -coverage <c>   Fraction of the full circle the image spans (1)\n"
+               "  -pairtweak <p>  Texture coordinate offset of the right eye (0.016)\n");
+        return EXIT_FAILURE;
+    }
+} // namespace
+
+
+int main(int argc, char* argv[])
+{
+    BuildParams params;
+    int arg = 1;
+    for (; (arg + 1 < argc) && (argv[arg][0] == '-'); arg += 2)
+    {
+        const std::string opt(argv[arg]);
+        const char* pValue = argv[arg + 1];
+        if      (opt == "-q")          params.quality = atoi(pValue);
+        else if (opt == "-t")          params.tileSize = atoi(pValue);
+        else if (opt == "-b")          params.border = atoi(pValue);
+        else if (opt == "-j")          params.numThreads = atoi(pValue);
+        else if (opt == "-height")     params.projection.cylHeight = (float)atof(pValue);
+        else if (opt == "-coverage")   params.projection.coverage = (float)atof(pValue);
+        else if (opt == "-pairtweak")  params.projection.pairTweak = (float)atof(pValue);
+        else
+            return PrintUsage();
+    }
+    const int files = argc - arg;
+    if ((files < 2) || (files > 3) ||
+        (params.quality < 1) || (params.quality > 100) ||
+        (params.tileSize < 4) || (params.tileSize % 4 != 0) ||
+        (params.border < 0) || (params.border % 4 != 0) || (params.border > params.tileSize))
+    {
+        return PrintUsage();
+    }
+    const char* pOutput = argv[arg];
+    const bool overUnder = (files == 2);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    JpegRowReader readers[2];
+    for (int i=0; i<files-1; ++i)
+    {
+        if (!readers[i].Open(argv[arg + 1 + i]))
+        {
+            fprintf(stderr, "Could not read JPEG %s\n", argv[arg + 1 + i]);
+            return EXIT_FAILURE;
+        }
+    }
+    const int width = readers[0].Width();
+    const int height = overUnder ? readers[0].Height() / 2 : readers[0].Height();
+    if (!overUnder && ((readers[1].Width() != width) || (readers[1].Height() != height)))
+    {
+        fprintf(stderr, "Left and right images differ in size\n");
+        return EXIT_FAILURE;
+    }
+
+    const std::vector<OpanoLevel> levelsL = MakeLevels(width, height, params.tileSize, 0);
+    const uint64_t tilesPerEye = levelsL.back().firstTile + 1;
+    const std::vector<OpanoLevel> levelsR = MakeLevels(width, height, params.tileSize, tilesPerEye);
+    std::vector<OpanoLevel> levels(levelsL);
+    levels.insert(levels.end(), levelsR.begin(), levelsR.end());
+
+    OpanoHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kOpanoMagic, sizeof(header.magic));
+    header.version = kOpanoVersion;
+    header.numEyes = 2;
+    header.numLevels = (uint32_t)levelsL.size();
+    header.payload = OpanoJpeg;
+    header.tileSize = params.tileSize;
+    header.border = params.border;
+    header.bytesPerPixel = 3;
+    header.projection = params.projection;
+
+    OpanoWriter writer;
+    if (!writer.Open(pOutput, header, levels, 2 * tilesPerEye))
+    {
+        fprintf(stderr, "Could not write %s\n", pOutput);
+        return EXIT_FAILURE;
+    }
+    printf("%d x %d per eye, %d levels, %llu tiles per eye\n",
+        width, height, (int)levelsL.size(), (unsigned long long)tilesPerEye);
+
+    bool ok = true;
+    {
+        TileEncoder encoder(params, writer);
+        for (int e=0; (e<2) && ok; ++e)
+        {
+            EyePyramid eye((e == 0) ? levelsL : levelsR, params, encoder);
+            ok = FeedRows(readers[overUnder ? 0 : e], height, eye);
+        }
+        ok = encoder.Finish() && ok;
+    }
+    ok = writer.Close() && ok;
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to build %s\n", pOutput);
+        remove(pOutput);
+        return EXIT_FAILURE;
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Wrote %s: %.1f MB in %.1f s\n", pOutput, writer.Bytes() / 1048576.0, seconds);
+    return EXIT_SUCCESS;
+}
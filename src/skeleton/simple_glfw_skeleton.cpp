@@ -14,6 +14,8 @@
 #include <math.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <chrono>
 #include <sstream>
 #include <vector>
 
@@ -32,6 +34,11 @@
 
 #include "OVRkill/OVRkill.h"
 #include "PanoramaPatch.h"
+#include "PanoLoader.h"
+#include "PanoDiskCache.h"
+#include "OpanoFile.h"
+#include "PboUploadRing.h"
+#include "ImageDecoder.h"
 
 #include <iostream>
 
@@ -42,10 +49,30 @@ int running = 0;
 
 OVRkill g_ok;
 #ifdef USE_PATCH
-PanoramaPatch* g_pPano = NULL; ///< Initialize AFTER we have a GL context
+std::shared_ptr<PanoramaPatch> g_pPano; ///< Initialize AFTER we have a GL context
+std::shared_ptr<PanoramaPatch> g_pNextPano; ///< Still uploading, replaces g_pPano when done
 #else
-PanoramaCylinder* g_pPano = NULL; ///< Initialize AFTER we have a GL context
+std::shared_ptr<PanoramaCylinder> g_pPano; ///< Initialize AFTER we have a GL context
+std::shared_ptr<PanoramaCylinder> g_pNextPano; ///< Still uploading, replaces g_pPano when done
 #endif
+std::string g_nextPanoKey;      ///< Of the pano last asked for
+std::string g_uploadingPanoKey; ///< Of g_pNextPano, which may be an older pano than g_nextPanoKey
+double g_nextPanoUploadMs = 0.0;
+PanoCache g_panoCache;
+std::unique_ptr<PanoDiskCache> g_pDiskCache; ///< Under datadir, once it is found; outlives the loader
+PanoLoader g_panoLoader(g_panoCache);
+const size_t g_uploadBytesPerFrame = 4 * 1024 * 1024;
+const double g_uploadMsPerFrame = 2.0;  ///< Stop streaming a frame's upload chunks after this long
+const int g_uploadRingBuffers = 8;
+const size_t g_uploadChunkBytes = 1024 * 1024;
+std::unique_ptr<PboUploadRing> g_pUploadRing; ///< Upload chunks in flight, NULL to upload directly
+const int g_prefetchNext = 2; ///< Playlist entries after the current one to keep decoded
+const int g_prefetchPrev = 1; ///< ...and before it
+const size_t g_diskCacheBytes = (size_t)2 * 1024 * 1024 * 1024;
+const bool g_compressBc1 = true; ///< 4-8x less VRAM and upload bandwidth for RGB panos
+const BlockCompressQuality g_compressQuality = BlockCompressFast;
+const bool g_useVirtualTexture = false; ///< Stream tiles of panos at full size, past GL_MAX_TEXTURE_SIZE
+const int g_maxStrips = 4; ///< Else split panos wider than GL_MAX_TEXTURE_SIZE into up to this many textures
 
 ///
 /// VR view parameters
@@ -290,6 +317,28 @@ void GLFWCALL keyhandler(int key, int action)
         }
         break;
 
+    case 'O':
+        if (g_pPano != NULL)
+        {
+            g_pPano->m_exposureStops -= 0.25f;
+            printf("exposure: %f stops\n", g_pPano->m_exposureStops);
+        }
+        break;
+    case 'P':
+        if (g_pPano != NULL)
+        {
+            g_pPano->m_exposureStops += 0.25f;
+            printf("exposure: %f stops\n", g_pPano->m_exposureStops);
+        }
+        break;
+    case 'T':
+        if (g_pPano != NULL)
+        {
+            g_pPano->m_tonemap = !g_pPano->m_tonemap;
+            printf("tonemap: %d\n", g_pPano->m_tonemap);
+        }
+        break;
+
     case GLFW_KEY_SPACE:
         {
             InitPano(1,NULL);
@@ -395,6 +444,10 @@ void RenderForOneEye(const OVR::Matrix4f& mview, const OVR::Matrix4f& persp, boo
         
         const float vMove = sin(EyeRoll);
         const float vEyeYaw = -EyeYaw / (2.0f * (float)M_PI);
+        GLint vp[4];
+        glGetIntegerv(GL_VIEWPORT, vp);
+        const OVR::Matrix4f mvp = persp * mview;
+        g_pPano->UpdateView(&mvp.Transposed().M[0][0], vp[2], vp[3], isLeft, vEyeYaw);
         g_pPano->DrawPanoramaGeometry(isLeft, vMove, vEyeYaw);
     }
     glUseProgram(0);
@@ -486,7 +539,7 @@ void GLFWCALL reshape(int w, int h)
 }
 
 
-/// Scan a directory for jpg files to display and return the list of filenames.
+/// Scan a directory for image files any registered decoder can display and return the list of filenames.
 std::vector<std::string> GetFileList(const std::string& datadir)
 {
     std::vector<std::string> panoFiles;
@@ -501,20 +554,13 @@ std::vector<std::string> GetFileList(const std::string& datadir)
         {
             std::string filename(ent->d_name);
 
-            /// Check file suffixes
-            if (filename.length() > 4)
+            /// Check the file's magic bytes against the decoder registry
+            std::string fullname = datadir;
+            fullname.append(filename);
+            if (IsSupportedImageFile(fullname.c_str()) || OpanoFile::IsOpanoFile(fullname.c_str()))
             {
-                std::string suffix = filename.substr(filename.length()-4, 4);
-                if (
-                    !suffix.compare(".jpg") ||
-                    !suffix.compare(".JPG")
-                    )
-                {
-                    printf("%s\n", filename.c_str());
-                    std::string fullname = datadir;
-                    fullname.append(filename);
-                    panoFiles.push_back(fullname);
-                }
+                printf("%s\n", filename.c_str());
+                panoFiles.push_back(fullname);
             }
         }
         closedir(dir);
@@ -523,33 +569,167 @@ std::vector<std::string> GetFileList(const std::string& datadir)
     return panoFiles;
 }
 
+/// Open a tiled pyramid file and stream it as a virtual texture. Only the index is read up
+/// front, so this is quick enough for the render thread whatever the size of the image.
+std::shared_ptr<PanoramaPatch> OpenOpano(const std::string& filename)
+{
+    const std::shared_ptr<OpanoFile> pFile(new OpanoFile());
+    if (!pFile->Open(filename.c_str()))
+        return std::shared_ptr<PanoramaPatch>();
+
+    VirtualTextureParams params;
+    params.tileSize = pFile->Header().tileSize;
+    params.border = pFile->Header().border;
+    params.viewportWidth = g_ok.GetRenderBufferWidth() / 2;
+    params.viewportHeight = g_ok.GetRenderBufferHeight();
+    const std::shared_ptr<PanoramaPatch> pPano(new PanoramaPatch(
+        std::make_shared<OpanoTileSource>(pFile, 0), std::make_shared<OpanoTileSource>(pFile, 1), params));
+
+    const OpanoProjection& proj = pFile->Header().projection;
+    pPano->SetProjection(proj.cylHeight, proj.coverage, proj.pairTweak);
+    return pPano;
+}
+
 /// Load a panoramic pair from file, preferably over/under but we try to do pairs as well.
+/// The files load on a background thread while the current pano stays on display.
 void InitPano(int argc, char *argv[])
 {
     if (panoFiles.empty())
         return;
 
-    delete g_pPano, g_pPano = NULL;
-    display();
-
     std::string fullFilename(panoFiles[currentPano]);
     ++currentPano;
     currentPano %= panoFiles.size();
 
+    GLint maxTexSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
+    PanoLoadParams params;
+    params.maxTexSize = g_useVirtualTexture ? 0 : maxTexSize;
+    params.compressBc1 = g_compressBc1 && GLEW_EXT_texture_compression_s3tc;
+    params.compressQuality = g_compressQuality;
+    params.maxStrips = g_maxStrips;
+    g_panoLoader.SetParams(params);
+
+    std::string fileL = fullFilename;
+    std::string fileR;
+    if (argc == 2) ///< Specify over/under image on cmd line
+    {
+        fileL.assign(argv[1]);
+    }
+    else if (argc == 3) ///< Specify pair of images on cmd line
+    {
+        fileL.assign(argv[1]);
+        fileR.assign(argv[2]);
+    }
+    const char* pFileR = fileR.empty() ? NULL : fileR.c_str();
+
+    /// Textures still resident swap in on the next frame, anything else goes to the loader
+    g_nextPanoKey = MakePanoCacheKey(fileL.c_str(), pFileR);
+    std::shared_ptr<PanoramaPatch> pResident = g_panoCache.m_textures.Find(g_nextPanoKey);
+    if (pResident != NULL)
+    {
+        g_panoLoader.Cancel();
+        g_pNextPano = pResident;
+        g_uploadingPanoKey = g_nextPanoKey;
+    }
+    else if (OpanoFile::IsOpanoFile(fileL.c_str()))
+    {
+        g_panoLoader.Cancel();
+        g_pNextPano = OpenOpano(fileL);
+        g_uploadingPanoKey = g_nextPanoKey;
+        g_nextPanoUploadMs = 0.0;
+    }
+    else
+    {
+        /// A superseded upload is never swapped in
+        g_pNextPano.reset();
+        g_uploadingPanoKey.clear();
+        g_panoLoader.Request(fileL.c_str(), pFileR);
+    }
+
     if (argc == 1)
     {
-        g_pPano = new PanoramaPatch(fullFilename.c_str());
+        /// Neighbours in the playlist, nearest first; currentPano is already the next one
+        const int count = (int)panoFiles.size();
+        const int shown = (currentPano + count - 1) % count;
+        std::vector<std::string> prefetch;
+        for (int d=1; d<=std::max(g_prefetchNext, g_prefetchPrev); ++d)
+        {
+            /// Tiled files stream on demand instead
+            const std::string& next = panoFiles[(shown + d) % count];
+            const std::string& prev = panoFiles[((shown - d) % count + count) % count];
+            if ((d <= g_prefetchNext) && !OpanoFile::IsOpanoFile(next.c_str()))
+                prefetch.push_back(next);
+            if ((d <= g_prefetchPrev) && !OpanoFile::IsOpanoFile(prev.c_str()))
+                prefetch.push_back(prev);
+        }
+        g_panoLoader.SetPrefetchList(prefetch);
     }
-    else if (argc == 2) ///< Specify over/under image on cmd line
+}
+
+void PrintCacheTierStats(const char* pName, const CacheTierStats& stats)
+{
+    printf("  %-9s %u/%u hits(%.0f%%), %u evicted, %d entries in %.1f/%.1f MB\n",
+        pName, stats.hits, stats.hits + stats.misses, 100.0f * stats.HitRate(), stats.evictions,
+        (int)stats.entries, stats.bytes / 1048576.0, stats.budgetBytes / 1048576.0);
+    LOG_INFO("%s cache: %u/%u hits, %u evicted, %d entries in %u/%u bytes",
+        pName, stats.hits, stats.hits + stats.misses, stats.evictions,
+        (int)stats.entries, (unsigned int)stats.bytes, (unsigned int)stats.budgetBytes);
+}
+
+/// Once per frame: pick up a pano the loader has finished, upload the next slice of it
+/// and swap it in for the displayed one once all of it is on the GPU.
+void UpdatePano()
+{
+    const std::shared_ptr<PanoImageData> pImage = g_panoLoader.TakeResult();
+    if (pImage != NULL)
     {
-        fullFilename.assign(argv[1]);
-        g_pPano = new PanoramaPatch(fullFilename.c_str());
+        /// A newer pano supersedes one still uploading
+        if (g_useVirtualTexture)
+        {
+            VirtualTextureParams vtParams;
+            vtParams.viewportWidth = g_ok.GetRenderBufferWidth() / 2;
+            vtParams.viewportHeight = g_ok.GetRenderBufferHeight();
+            g_pNextPano.reset(new PanoramaPatch(pImage, &vtParams));
+        }
+        else
+        {
+            g_pNextPano.reset(new PanoramaPatch(pImage));
+        }
+        g_uploadingPanoKey = g_nextPanoKey;
+        g_nextPanoUploadMs = 0.0;
+        if (pImage->eyes[0].blockBytes != 0)
+        {
+            printf("BC1 textures %.1f MB, PSNR %.2f/%.2f dB\n", pImage->ByteSize() / 1048576.0,
+                pImage->eyes[0].psnr, pImage->eyes[1].psnr);
+        }
     }
-    else if (argc == 3) ///< Specify pair of images on cmd line
+
+    if (g_pNextPano == NULL)
+        return;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const bool uploaded = g_pNextPano->ContinueUpload(g_uploadBytesPerFrame, g_uploadMsPerFrame, g_pUploadRing.get());
+    g_nextPanoUploadMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (uploaded)
     {
-        std::string fileL(argv[1]);
-        std::string fileR(argv[2]);
-        g_pPano = new PanoramaPatch(fileL.c_str(), fileR.c_str());
+        g_pPano = g_pNextPano;
+        g_pNextPano.reset();
+
+        /// Keep the textures resident, never evicting the ones on display
+        if (!g_uploadingPanoKey.empty() && !g_panoCache.m_textures.Contains(g_uploadingPanoKey))
+        {
+            std::set<std::string> keep;
+            keep.insert(g_uploadingPanoKey);
+            g_panoCache.m_textures.Insert(g_uploadingPanoKey, g_pPano, g_pPano->m_textureBytes, g_nextPanoUploadMs, &keep);
+        }
+        g_uploadingPanoKey.clear();
+
+        printf("pano cache:\n");
+        PrintCacheTierStats("textures", g_panoCache.m_textures.GetStats());
+        PrintCacheTierStats("images", g_panoCache.m_images.GetStats());
+        PrintCacheTierStats("files", g_panoCache.m_fileBytes.GetStats());
+        if (g_pDiskCache != NULL)
+            PrintCacheTierStats("disk", g_pDiskCache->GetStats());
     }
 }
 
@@ -598,6 +778,10 @@ int main(int argc, char *argv[])
         exit(0);
     }
 
+    /// Finished mip chains persist next to the panoramas, so reloads skip decoding
+    g_pDiskCache.reset(new PanoDiskCache(datadir + ".panocache/", g_diskCacheBytes));
+    g_panoLoader.SetDiskCache(g_pDiskCache.get());
+
 
     bool fullScreen = false;
 
@@ -653,6 +837,10 @@ int main(int argc, char *argv[])
     }
 
     OpenGL_initialization();
+    if (PboUploadRing::IsSupported())
+    {
+        g_pUploadRing.reset(new PboUploadRing(g_uploadRingBuffers, g_uploadChunkBytes));
+    }
     LOG_INFO("Initializing shaders.");
     g_ok.CreateShaders();
     g_ok.CreateRenderBuffer(1.71f);
@@ -668,10 +856,16 @@ int main(int argc, char *argv[])
         float dt = (float)g_timer.seconds();
         timestep(dt);
         g_timer.reset();
+        UpdatePano();
         display();
         running = running && glfwGetWindowParam(GLFW_OPENED);
     }
 
+    /// Release the textures while there is still a context
+    g_pNextPano.reset();
+    g_pPano.reset();
+    g_panoCache.m_textures.Clear();
+    g_pUploadRing.reset();
     g_ok.DestroyOVR();
 
     glfwTerminate();